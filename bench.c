@@ -0,0 +1,744 @@
+#include "nn.h"
+#include "nnData.h"
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ *  Benchmarks for the matrix kernels, the dino array, whole networks and
+ * the data loader.
+ *  Every case gets timed in runs of enough calls to take at least a few
+ * milliseconds. The first runs (finding how many calls that is, plus one more)
+ * are warmup, then the median and the fastest of the timed runs get reported
+ * as ns per op, and as GFLOP/s and GB/s where that means something. A table
+ * goes to stdout as the cases finish.
+ *
+ *  bench [--csv FILE] [--json FILE] [--filter TEXT] [--quick] [--threads N]
+ *
+ *  --csv/--json  also write the results to FILE, tagged with BENCH_REV, the
+ *                precision, the ISA and the thread count
+ *  --filter      only run cases whose "group/case" name contains TEXT
+ *  --quick       fewer and shorter runs, for a smoke test
+ *  --threads     pool threads, the default is what threadpool.h picks
+ *
+ *  The MATRIX_ISA environment variable picks the SIMD kernels as usual.
+ * Built with NN_PROFILE (bin/bench-prof) every network's per layer profile
+ * gets printed after its cases, and the timings include the profiler.
+ */
+
+#ifndef BENCH_REV
+#define BENCH_REV "unknown"
+#endif // BENCH_REV
+
+typedef struct BenchOpts {
+    const char* filter;
+    long long minRunNs; // A timed run calls the op until it takes this long
+    int runs;
+} BenchOpts;
+
+typedef struct BenchResult {
+    char name[96];
+    double medianNs; // Per op
+    double minNs;
+    double flops; // Per op, 0 if it doesn't make sense
+    double bytes; // Moved per op, 0 if it doesn't make sense
+    long long calls; // Per timed run
+    int runs;
+} BenchResult;
+
+// Everything reported so far
+static BenchResult* results;
+static int resultCnt;
+
+static long long _bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long _bench_time(void (*op)(void* ctx), void* ctx,
+                             long long calls) {
+    long long start = _bench_now();
+    for (long long i = 0; i < calls; i++) {
+        op(ctx);
+    }
+    return _bench_now() - start;
+}
+
+static int _bench_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Times one case and records it
+ * @param name "group/case", what --filter matches against
+ * @param op Runs `opsPerCall` ops
+ * @param opsPerCall What a call to op counts as, so ns/op isn't per call
+ * @param flops Floating point operations per op, 0 for none
+ * @param bytes Bytes read plus written per op, 0 for none
+ */
+static void _bench_run(const BenchOpts* opts, const char* name,
+                       void (*op)(void* ctx), void* ctx, long long opsPerCall,
+                       double flops, double bytes) {
+    if (opts->filter && !strstr(name, opts->filter)) {
+        return;
+    }
+    // Warmup: double the calls until a run is long enough, then one more
+    long long calls = 1;
+    while (_bench_time(op, ctx, calls) < opts->minRunNs) {
+        calls *= 2;
+    }
+    _bench_time(op, ctx, calls);
+
+    double* perOp = malloc(sizeof(double) * opts->runs);
+    for (int r = 0; r < opts->runs; r++) {
+        perOp[r] = (double)_bench_time(op, ctx, calls) / (calls * opsPerCall);
+    }
+    qsort(perOp, opts->runs, sizeof(double), _bench_cmp);
+
+    results = realloc(results, sizeof(BenchResult) * (resultCnt + 1));
+    BenchResult* res = &results[resultCnt++];
+    *res = (BenchResult){.medianNs = perOp[opts->runs / 2],
+                         .minNs = perOp[0],
+                         .flops = flops,
+                         .bytes = bytes,
+                         .calls = calls,
+                         .runs = opts->runs};
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    free(perOp);
+
+    printf("%-50s %12.1f %12.1f", res->name, res->medianNs, res->minNs);
+    if (flops) {
+        printf(" %10.2f", flops / res->medianNs);
+    } else {
+        printf(" %10s", "-");
+    }
+    if (bytes) {
+        printf(" %10.2f", bytes / res->medianNs);
+    } else {
+        printf(" %10s", "-");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+//====================== GEMM ======================
+
+typedef struct {
+    Matrix* dest;
+    Matrix* a;
+    Matrix* b;
+} _BenchGemm;
+
+static void _bench_gemm_op(void* ctx) {
+    _BenchGemm* g = ctx;
+    matrixMulti(g->dest, g->a, g->b);
+}
+
+// dest (m x n) = a (m x k) * b (k x n)
+static void _bench_gemm(const BenchOpts* opts, const char* group, int m,
+                        int k, int n) {
+    _BenchGemm g = {matrixCreate(m, n), matrixCreate(m, k),
+                    matrixCreate(k, n)};
+    matrixRand(g.a, -1, 1);
+    matrixRand(g.b, -1, 1);
+    char name[96];
+    snprintf(name, sizeof(name), "%s/%dx%dx%d", group, m, k, n);
+    double flops = 2.0 * m * k * n;
+    double bytes = sizeof(mfloat) * ((double)m * k + (double)k * n +
+                                     (double)m * n);
+    _bench_run(opts, name, _bench_gemm_op, &g, 1, flops, bytes);
+    matrixFree(g.dest);
+    matrixFree(g.a);
+    matrixFree(g.b);
+}
+
+typedef struct {
+    Matrix* dest;
+    Matrix* a;
+    MatrixInt8 b;
+} _BenchGemmInt8;
+
+static void _bench_gemm_int8_op(void* ctx) {
+    _BenchGemmInt8* g = ctx;
+    matrixGemmInt8(g->dest, g->a, (mfloat)1 / 127, &g->b, NULL,
+                   MATRIX_ACT_NONE);
+}
+
+// The same, with b quantized ahead of time like nnQuantize does it
+static void _bench_gemm_int8(const BenchOpts* opts, int m, int k, int n) {
+    Matrix* b = matrixCreate(k, n);
+    matrixRand(b, -1, 1);
+    long long bytes = (matrixInt8Bytes(k, n) + 63) / 64 * 64;
+    void* mem = aligned_alloc(64, bytes);
+    _BenchGemmInt8 g = {matrixCreate(m, n), matrixCreate(m, k),
+                        matrixQuantize(mem, b)};
+    matrixRand(g.a, -1, 1);
+    char name[96];
+    snprintf(name, sizeof(name), "gemm_int8/%dx%dx%d", m, k, n);
+    // a in and dest out as mfloats, b as int8s
+    double moved = sizeof(mfloat) * ((double)m * k + (double)m * n) +
+                   (double)k * n;
+    _bench_run(opts, name, _bench_gemm_int8_op, &g, 1, 2.0 * m * k * n,
+               moved);
+    free(mem);
+    matrixFree(b);
+    matrixFree(g.dest);
+    matrixFree(g.a);
+}
+
+static void _bench_gemms(const BenchOpts* opts) {
+    int square[] = {64, 128, 256, 512, 1024};
+    for (int i = 0; i < 5; i++) {
+        _bench_gemm(opts, "gemm_square", square[i], square[i], square[i]);
+    }
+    // Shapes dense layers actually see: a single sample or a small batch
+    // against a weight matrix, and tall data against few outputs
+    int skinny[][3] = {{1, 1024, 1024},  {16, 1024, 1024}, {64, 784, 128},
+                       {1024, 1024, 16}, {4096, 64, 64},   {64, 4096, 64}};
+    for (int i = 0; i < 6; i++) {
+        _bench_gemm(opts, "gemm_skinny", skinny[i][0], skinny[i][1],
+                    skinny[i][2]);
+    }
+    for (int i = 0; i < 3; i++) {
+        _bench_gemm_int8(opts, skinny[i][0], skinny[i][1], skinny[i][2]);
+    }
+}
+
+//====================== Element-wise ======================
+
+typedef struct {
+    Matrix* dest;
+    Matrix* a;
+    Matrix* b;
+    MATRIX_ACT act;
+} _BenchEw;
+
+static void _bench_add_op(void* ctx) {
+    _BenchEw* e = ctx;
+    matrixAdd(e->dest, e->a, e->b);
+}
+
+static void _bench_sub_op(void* ctx) {
+    _BenchEw* e = ctx;
+    matrixSub(e->dest, e->a, e->b);
+}
+
+static void _bench_scalar_op(void* ctx) {
+    _BenchEw* e = ctx;
+    matrixScalar(e->dest, -1);
+}
+
+static void _bench_act_op(void* ctx) {
+    _BenchEw* e = ctx;
+    matrixCopy(e->dest, e->a);
+    matrixAct(e->dest, e->act, NULL);
+}
+
+static void _bench_rand_op(void* ctx) {
+    _BenchEw* e = ctx;
+    matrixRand(e->dest, -1, 1);
+}
+
+static void _bench_copy_op(void* ctx) {
+    _BenchEw* e = ctx;
+    matrixCopy(e->dest, e->a);
+}
+
+static void _bench_transpose_op(void* ctx) {
+    _BenchEw* e = ctx;
+    matrixTranspose(e->dest, e->a);
+}
+
+static void _bench_elementwise(const BenchOpts* opts) {
+    // One that fits in L2 and one that has to stream from memory
+    int sizes[][2] = {{256, 256}, {2048, 2048}};
+    const char* acts[] = {"relu",       "sigmoid", "tanh",
+                          "gelu",       "leaky_relu", "softmax"};
+    MATRIX_ACT actKinds[] = {MATRIX_ACT_RELU,       MATRIX_ACT_SIGMOID,
+                             MATRIX_ACT_TANH,       MATRIX_ACT_GELU,
+                             MATRIX_ACT_LEAKY_RELU, MATRIX_ACT_SOFTMAX};
+    for (int s = 0; s < 2; s++) {
+        int rows = sizes[s][0];
+        int cols = sizes[s][1];
+        double n = (double)rows * cols;
+        _BenchEw e = {matrixCreate(rows, cols), matrixCreate(rows, cols),
+                      matrixCreate(rows, cols)};
+        matrixRand(e.a, -1, 1);
+        matrixRand(e.b, -1, 1);
+        matrixFill(e.dest, 1);
+        char name[96];
+
+        snprintf(name, sizeof(name), "ew/add/%dx%d", rows, cols);
+        _bench_run(opts, name, _bench_add_op, &e, 1, n,
+                   3 * n * sizeof(mfloat));
+        snprintf(name, sizeof(name), "ew/sub/%dx%d", rows, cols);
+        _bench_run(opts, name, _bench_sub_op, &e, 1, n,
+                   3 * n * sizeof(mfloat));
+        snprintf(name, sizeof(name), "ew/scalar/%dx%d", rows, cols);
+        _bench_run(opts, name, _bench_scalar_op, &e, 1, n,
+                   2 * n * sizeof(mfloat));
+        snprintf(name, sizeof(name), "ew/rand/%dx%d", rows, cols);
+        _bench_run(opts, name, _bench_rand_op, &e, 1, 0,
+                   n * sizeof(mfloat));
+        snprintf(name, sizeof(name), "ew/copy/%dx%d", rows, cols);
+        _bench_run(opts, name, _bench_copy_op, &e, 1, 0,
+                   2 * n * sizeof(mfloat));
+        for (int a = 0; a < 6; a++) {
+            e.act = actKinds[a];
+            // Copy then activate in place, so twice the traffic of a copy
+            snprintf(name, sizeof(name), "ew/%s/%dx%d", acts[a], rows, cols);
+            _bench_run(opts, name, _bench_act_op, &e, 1, 0,
+                       4 * n * sizeof(mfloat));
+        }
+        matrixFree(e.dest);
+        matrixFree(e.a);
+        matrixFree(e.b);
+    }
+}
+
+typedef struct {
+    MatrixOptimizer opt;
+    mfloat* p;
+    mfloat* g;
+    mfloat* m;
+    mfloat* v;
+    long long n;
+} _BenchOpt;
+
+// The step zeroes the gradients, so they get filled again first. Otherwise the
+// state decays into denormals and that's all that gets measured.
+static void _bench_opt_op(void* ctx) {
+    _BenchOpt* b = ctx;
+    Matrix g = matView(b->g, 1, (int)b->n);
+    matrixFill(&g, 1e-3);
+    matrixOptimizerStep(&b->opt, 1e-3, b->p, b->g, b->m, b->v, b->n);
+}
+
+static void _bench_optimizers(const BenchOpts* opts) {
+    const char* names[] = {"sgd", "momentum", "adam", "adamw"};
+    // One that fits in L2 and one that has to stream from memory
+    long long sizes[] = {1 << 14, 1 << 22};
+    for (int s = 0; s < 2; s++) {
+        long long n = sizes[s];
+        Matrix* bufs = matrixCreate(4, (int)n);
+        matrixRand(bufs, -1, 1);
+        for (int k = 0; k < 4; k++) {
+            _BenchOpt b = {matrixOptimizerCreate((MATRIX_OPTIMIZER)k),
+                           bufs->data, bufs->data + n, bufs->data + 2 * n,
+                           bufs->data + 3 * n, n};
+            // Params, grads and every array of state get read and written,
+            // plus refilling the grads
+            int arrays = 2 + matrixOptimizerStates(b.opt.kind);
+            char name[96];
+            snprintf(name, sizeof(name), "opt/%s/%lld", names[k], n);
+            _bench_run(opts, name, _bench_opt_op, &b, 1, 0,
+                       (2.0 * arrays + 1) * n * sizeof(mfloat));
+        }
+        matrixFree(bufs);
+    }
+}
+
+static void _bench_transposes(const BenchOpts* opts) {
+    int sizes[][2] = {{256, 256}, {1024, 1024}, {2048, 2048}, {4096, 64}};
+    for (int s = 0; s < 4; s++) {
+        int rows = sizes[s][0];
+        int cols = sizes[s][1];
+        _BenchEw e = {matrixCreate(cols, rows), matrixCreate(rows, cols)};
+        matrixRand(e.a, -1, 1);
+        char name[96];
+        snprintf(name, sizeof(name), "transpose/%dx%d", rows, cols);
+        _bench_run(opts, name, _bench_transpose_op, &e, 1, 0,
+                   2.0 * rows * cols * sizeof(mfloat));
+        matrixFree(e.dest);
+        matrixFree(e.a);
+    }
+}
+
+//====================== Dino array ======================
+
+typedef struct {
+    int len;
+    int stride; // Bytes per element
+} _BenchDino;
+
+// An element of any size, so the copies are as big as the stride says
+typedef struct {
+    unsigned char bytes[64];
+} _BenchDinoElem;
+
+static void _bench_dino_push_op(void* ctx) {
+    _BenchDino* d = ctx;
+    _BenchDinoElem v = {{1}};
+    void* arr = _dino_create(DINO_DEFAULT_SIZE, d->stride);
+    for (int i = 0; i < d->len; i++) {
+        arr = _dino_push(arr, &v);
+    }
+    _dino_destroy(arr);
+}
+
+// Whole chunks at a time, like gathering a batch of samples
+static void _bench_dino_append_op(void* ctx) {
+    _BenchDino* d = ctx;
+    _BenchDinoElem chunk[64] = {{{1}}};
+    void* arr = _dino_create(DINO_DEFAULT_SIZE, d->stride);
+    for (int i = 0; i < d->len; i += 64) {
+        arr = _dino_append_n(arr, chunk, 64);
+    }
+    _dino_destroy(arr);
+}
+
+static void _bench_dino_insert_op(void* ctx) {
+    _BenchDino* d = ctx;
+    _BenchDinoElem v = {{1}};
+    void* arr = _dino_create(DINO_DEFAULT_SIZE, d->stride);
+    arr = _dino_push(arr, &v);
+    for (int i = 1; i < d->len; i++) {
+        arr = _dino_insert_at(arr, 0, &v);
+    }
+    _dino_destroy(arr);
+}
+
+static void _bench_dino(const BenchOpts* opts) {
+    int lens[] = {1024, 65536};
+    int strides[] = {4, 64};
+    char name[96];
+    for (int s = 0; s < 2; s++) {
+        for (int l = 0; l < 2; l++) {
+            _BenchDino d = {lens[l], strides[s]};
+            snprintf(name, sizeof(name), "dino/push/%d/stride%d", d.len,
+                     d.stride);
+            _bench_run(opts, name, _bench_dino_push_op, &d, d.len, 0, 0);
+            snprintf(name, sizeof(name), "dino/append64/%d/stride%d", d.len,
+                     d.stride);
+            _bench_run(opts, name, _bench_dino_append_op, &d, d.len, 0, 0);
+        }
+        // Inserting at the front moves everything, so keep it short
+        _BenchDino d = {4096, strides[s]};
+        snprintf(name, sizeof(name), "dino/insert_front/%d/stride%d", d.len,
+                 d.stride);
+        _bench_run(opts, name, _bench_dino_insert_op, &d, d.len, 0, 0);
+    }
+}
+
+//====================== Networks ======================
+
+typedef struct {
+    NN* nn;
+    Matrix* ti;
+    Matrix* to;
+    NN_Layer* layer;
+} _BenchNet;
+
+static void _bench_forward_op(void* ctx) {
+    _BenchNet* b = ctx;
+    nnForward(b->nn);
+}
+
+static void _bench_backprop_op(void* ctx) {
+    _BenchNet* b = ctx;
+    nnBackprop(b->nn, b->ti, b->to);
+}
+
+static void _bench_layer_forward_op(void* ctx) {
+    _BenchNet* b = ctx;
+    layerForward(b->layer);
+}
+
+static void _bench_layer_backward_op(void* ctx) {
+    _BenchNet* b = ctx;
+    layerBackward(b->layer);
+}
+
+// Multiply-adds of a layer's forward pass for one sample, times 2
+static double _bench_layer_flops(const NN_Layer* l) {
+    if (l->kind == LAYER_KIND_CONV) {
+        double k = l->conv.kernelSize;
+        return 2.0 * l->width * l->height * l->depth * k * k * l->prev->depth;
+    }
+    if (l->wss.vals) {
+        return 2.0 * l->wss.blocks * l->wss.blockCols;
+    }
+    return 2.0 * l->prev->nodeCnt * l->nodeCnt;
+}
+
+/**
+ * Times the whole network forward, forward + backward, and every layer on its
+ * own
+ * @param config Names the network in the results
+ */
+static void _bench_net(const BenchOpts* opts, const char* config, NN* nn,
+                       int batch) {
+    nnBatchSet(nn, batch);
+    NN_Layer* out = &nn->layers[nn->layerCnt - 1];
+    _BenchNet b = {nn, matrixCreate(batch, nn->layers[0].nodeCnt),
+                   matrixCreate(batch, out->nodeCnt)};
+    matrixRand(b.ti, 0, 1);
+    matrixRand(b.to, 0, 1);
+    matrixCopy(NN_INPUT(nn), b.ti);
+
+    double flops = 0;
+    for (int i = 1; i < nn->layerCnt; i++) {
+        flops += _bench_layer_flops(&nn->layers[i]) * batch;
+    }
+#ifdef NN_PROFILE
+    nnProfileReset(nn);
+    int ran = resultCnt;
+#endif
+    char name[96];
+    snprintf(name, sizeof(name), "net/%s/b%d/forward", config, batch);
+    _bench_run(opts, name, _bench_forward_op, &b, 1, flops, 0);
+    // Backward is about two forwards worth of multiply-adds
+    snprintf(name, sizeof(name), "net/%s/b%d/forward+backward", config,
+             batch);
+    _bench_run(opts, name, _bench_backprop_op, &b, 1, 3 * flops, 0);
+
+    nnForward(nn);
+    for (int i = 1; i < nn->layerCnt; i++) {
+        b.layer = &nn->layers[i];
+        const char* kind = b.layer->kind == LAYER_KIND_CONV ? "conv" : "full";
+        double lf = _bench_layer_flops(b.layer) * batch;
+        snprintf(name, sizeof(name), "net/%s/b%d/l%d_%s/forward", config,
+                 batch, i, kind);
+        _bench_run(opts, name, _bench_layer_forward_op, &b, 1, lf, 0);
+        snprintf(name, sizeof(name), "net/%s/b%d/l%d_%s/backward", config,
+                 batch, i, kind);
+        _bench_run(opts, name, _bench_layer_backward_op, &b, 1, 2 * lf, 0);
+    }
+#ifdef NN_PROFILE
+    // Only if --filter let any of it run
+    if (resultCnt > ran) {
+        NN_ProfileReport report = nnProfileReport(nn);
+        printf("\nprofile of net/%s/b%d\n", config, batch);
+        nnProfilePrint(&report, stdout);
+        printf("\n");
+        nnProfileReportFree(&report);
+    }
+#endif
+    nnZeroGrads(nn);
+    matrixFree(b.ti);
+    matrixFree(b.to);
+}
+
+static void _bench_nets(const BenchOpts* opts) {
+    int batches[] = {1, 64};
+    for (int i = 0; i < 2; i++) {
+        NN nn = nnCreate();
+        layerCreateInput(&nn, 784, 1, 1);
+        layerCreateFull(&nn, 128, MATRIX_ACT_RELU, 1);
+        layerCreateFull(&nn, 10, MATRIX_ACT_SIGMOID, 1);
+        _bench_net(opts, "mlp784-128-10", &nn, batches[i]);
+        nnFree(&nn);
+
+        nn = nnCreate();
+        layerCreateInput(&nn, 1024, 1, 1);
+        layerCreateFull(&nn, 1024, MATRIX_ACT_RELU, 1);
+        layerCreateFull(&nn, 1024, MATRIX_ACT_RELU, 1);
+        layerCreateFull(&nn, 16, MATRIX_ACT_SIGMOID, 1);
+        _bench_net(opts, "mlp1024x2-16", &nn, batches[i]);
+        // The same one with 90% of its weights gone, in blocks of 8
+        nnPrune(&nn, 0.9, 8);
+        _bench_net(opts, "mlp1024x2-16/pruned90b8", &nn, batches[i]);
+        nnFree(&nn);
+
+        // Small enough that dispatching the layers costs about what the
+        // math does
+        nn = nnCreate();
+        layerCreateInput(&nn, 16, 1, 1);
+        layerCreateFull(&nn, 32, MATRIX_ACT_RELU, 1);
+        layerCreateFull(&nn, 32, MATRIX_ACT_RELU, 1);
+        layerCreateFull(&nn, 4, MATRIX_ACT_SIGMOID, 1);
+        _bench_net(opts, "mlp16-32x2-4", &nn, batches[i]);
+        nnFree(&nn);
+    }
+
+    int convBatches[] = {1, 32};
+    NN_LAYOUT layouts[] = {NN_LAYOUT_NCHW, NN_LAYOUT_NHWC};
+    for (int i = 0; i < 2; i++) {
+        for (int l = 0; l < 2; l++) {
+            NN nn = nnCreate();
+            nn.layout = layouts[l];
+            layerCreateInput(&nn, 28, 28, 1);
+            layerCreateConv(&nn, 8, 3, 1, 1, MATRIX_ACT_RELU, 1);
+            layerCreateConv(&nn, 16, 3, 2, 1, MATRIX_ACT_RELU, 1);
+            layerCreateFull(&nn, 10, MATRIX_ACT_SIGMOID, 1);
+            _bench_net(opts,
+                       l == 0 ? "cnn28-c8-c16s2-10/nchw"
+                              : "cnn28-c8-c16s2-10/nhwc",
+                       &nn, convBatches[i]);
+            nnFree(&nn);
+        }
+    }
+}
+
+//====================== Data ======================
+
+typedef struct {
+    NN_Dataset* ds;
+    int batch;
+} _BenchData;
+
+static void _bench_data_epoch_op(void* ctx) {
+    _BenchData* d = ctx;
+    Matrix ti;
+    Matrix to;
+    nnDataEpochStart(d->ds, d->batch);
+    while (nnDataNext(d->ds, &ti, &to) > 0) {
+    }
+}
+
+// Gathering whole epochs of mini-batches out of a shard, which is in the page
+// cache after the warmup, fully shuffled and through a window
+static void _bench_data(const BenchOpts* opts) {
+    int rows = 16384;
+    int inCols = 784;
+    int outCols = 10;
+    long long windows[] = {0, 1024};
+    char names[2][96];
+    int any = 0;
+    for (int w = 0; w < 2; w++) {
+        snprintf(names[w], sizeof(names[w]), "data/epoch%d/window%lld/b64",
+                 rows, windows[w]);
+        any |= !opts->filter || strstr(names[w], opts->filter);
+    }
+    // Don't bother writing the shard then
+    if (!any) {
+        return;
+    }
+    const char* tmp = getenv("TMPDIR");
+    char path[512];
+    snprintf(path, sizeof(path), "%s/nn-bench-data.nnd", tmp ? tmp : "/tmp");
+    Matrix* ti = matrixCreate(rows, inCols);
+    Matrix* to = matrixCreate(rows, outCols);
+    matrixRand(ti, 0, 1);
+    matrixRand(to, 0, 1);
+    int ok = nnDataShardWrite(path, ti, to) == 0;
+    matrixFree(ti);
+    matrixFree(to);
+    if (!ok) {
+        fprintf(stderr, "bench: can't write %s, skipping data/\n", path);
+        return;
+    }
+
+    const char* paths[] = {path};
+    for (int w = 0; w < 2; w++) {
+        NN_Dataset ds;
+        if (nnDataOpen(&ds, paths, 1, windows[w]) != 0) {
+            continue;
+        }
+        // Every sample gets read out of the shard and written to the batch
+        _BenchData d = {&ds, 64};
+        double bytes = 2.0 * (inCols + outCols) * sizeof(mfloat);
+        _bench_run(opts, names[w], _bench_data_epoch_op, &d, rows, 0, bytes);
+        nnDataClose(&ds);
+    }
+    remove(path);
+}
+
+//====================== Output ======================
+
+static const char* _bench_precision(void) {
+    return sizeof(mfloat) == 4 ? "float" : "double";
+}
+
+// Writes the results as CSV, 0 if the file couldn't be written
+static int _bench_write_csv(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        return 0;
+    }
+    fprintf(f, "name,median_ns,min_ns,gflops,gbps,calls,runs,rev,precision,"
+               "isa,threads\n");
+    for (int i = 0; i < resultCnt; i++) {
+        BenchResult* r = &results[i];
+        fprintf(f, "%s,%.3f,%.3f,%.4f,%.4f,%lld,%d,%s,%s,%s,%d\n", r->name,
+                r->medianNs, r->minNs, r->flops / r->medianNs,
+                r->bytes / r->medianNs, r->calls, r->runs, BENCH_REV,
+                _bench_precision(), matrixIsaName(matrixIsaGet()),
+                tpoolThreadsGet());
+    }
+    return fclose(f) == 0;
+}
+
+// Writes the results as JSON, 0 if the file couldn't be written
+static int _bench_write_json(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        return 0;
+    }
+    fprintf(f,
+            "{\n  \"rev\": \"%s\",\n  \"precision\": \"%s\",\n"
+            "  \"isa\": \"%s\",\n  \"threads\": %d,\n  \"results\": [\n",
+            BENCH_REV, _bench_precision(), matrixIsaName(matrixIsaGet()),
+            tpoolThreadsGet());
+    for (int i = 0; i < resultCnt; i++) {
+        BenchResult* r = &results[i];
+        fprintf(f,
+                "    {\"name\": \"%s\", \"median_ns\": %.3f, "
+                "\"min_ns\": %.3f, \"gflops\": %.4f, \"gbps\": %.4f, "
+                "\"calls\": %lld, \"runs\": %d}%s\n",
+                r->name, r->medianNs, r->minNs, r->flops / r->medianNs,
+                r->bytes / r->medianNs, r->calls, r->runs,
+                i + 1 < resultCnt ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+int main(int argc, char** argv) {
+    BenchOpts opts = {.minRunNs = 20000000, .runs = 7};
+    const char* csvPath = NULL;
+    const char* jsonPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--csv") == 0 && val) {
+            csvPath = argv[++i];
+        } else if (strcmp(arg, "--json") == 0 && val) {
+            jsonPath = argv[++i];
+        } else if (strcmp(arg, "--filter") == 0 && val) {
+            opts.filter = argv[++i];
+        } else if (strcmp(arg, "--quick") == 0) {
+            opts.minRunNs = 2000000;
+            opts.runs = 3;
+        } else if (strcmp(arg, "--threads") == 0 && val) {
+            tpoolThreadsSet(atoi(argv[++i]));
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--csv FILE] [--json FILE] [--filter TEXT] "
+                    "[--quick] [--threads N]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    matrixRngSeed(1);
+    printf("rev %s, %s, isa %s, %d threads\n", BENCH_REV, _bench_precision(),
+           matrixIsaName(matrixIsaGet()), tpoolThreadsGet());
+    printf("%-50s %12s %12s %10s %10s\n", "name", "median ns", "min ns",
+           "GFLOP/s", "GB/s");
+    _bench_gemms(&opts);
+    _bench_elementwise(&opts);
+    _bench_optimizers(&opts);
+    _bench_transposes(&opts);
+    _bench_dino(&opts);
+    _bench_nets(&opts);
+    _bench_data(&opts);
+
+    int ok = 1;
+    if (csvPath && !_bench_write_csv(csvPath)) {
+        fprintf(stderr, "bench: can't write %s\n", csvPath);
+        ok = 0;
+    }
+    if (jsonPath && !_bench_write_json(jsonPath)) {
+        fprintf(stderr, "bench: can't write %s\n", jsonPath);
+        ok = 0;
+    }
+    free(results);
+    tpoolShutdown();
+    return ok ? 0 : 1;
+}
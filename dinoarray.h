@@ -10,15 +10,22 @@ enum {
     DINOARRAY_MAX_SIZE,
     DINOARRAY_LENGTH,
     DINOARRAY_STRIDE,
+    DINOARRAY_ALIGN, // Of the elements in bytes, 0 for whatever DINO_MALLOC gives
+    DINOARRAY_PAD,   // Bytes between the allocation and the header
     DINOARRAY_FIELD_LENGTH
 };
 
 //"Private Functions" will wrap with define functions
 
 void* _dino_create(unsigned long long length, unsigned long long stride);
+void* _dino_create_aligned(unsigned long long length, unsigned long long stride,
+                           unsigned long long align);
 void _dino_destroy(void* array);
-void* _dino_resize(void* array);
+void* _dino_reserve(void* array, unsigned long long length);
+void* _dino_resize(void* array, unsigned long long length);
 void* _dino_shrink(void* array);
+void* _dino_append_n(void* array, const void* values,
+                     unsigned long long count);
 
 unsigned long long _dino_field_get(void* array, unsigned long long field);
 void _dino_field_set(void* array, unsigned long long field,
@@ -32,6 +39,8 @@ void* _dino_insert_at(void* array, unsigned long long idx, void* valuePtr);
 
 #define DINO_DEFAULT_SIZE 1
 #define DINO_DEFAULT_RESIZE_FACTOR 2
+// A cache line, for dinoCreateAligned
+#define DINO_CACHE_LINE 64
 
 //====================== Define function wrappers ======================
 
@@ -48,6 +57,15 @@ void* _dino_insert_at(void* array, unsigned long long idx, void* valuePtr);
  */
 #define dinoCreateReserve(length, type) _dino_create(length, sizeof(type));
 
+/**
+ *  Create a Dino array whose elements start on an `align` byte boundary, e.g.
+ * DINO_CACHE_LINE so the first element doesn't share a cache line with the
+ * header or anything else. Stays aligned through every resize.
+ *  align has to be a power of 2.
+ */
+#define dinoCreateAligned(length, type, align)                                 \
+    _dino_create_aligned(length, sizeof(type), align)
+
 /**
  *  Frees the Dino array
  */
@@ -57,7 +75,19 @@ void* _dino_insert_at(void* array, unsigned long long idx, void* valuePtr);
  *  Shrinks the Dino array to it's length so no memory is being wasted.
  *  This does perform a reallocate.
  */
-#define dinoShrink(array) _dino_shrink(array);
+#define dinoShrink(array) array = _dino_shrink(array)
+
+/**
+ *  Makes room for at least `length` elements without changing the length, so
+ * the pushes up to it don't reallocate. Never shrinks.
+ */
+#define dinoReserve(array, length) array = _dino_reserve(array, length)
+
+/**
+ *  Sets the length of the Dino array, reallocating if it doesn't fit. New
+ * elements are zeroed.
+ */
+#define dinoResize(array, length) array = _dino_resize(array, length)
 
 /**
  *  Push an element value to the Dino array. Will automatically resize
@@ -68,6 +98,13 @@ void* _dino_insert_at(void* array, unsigned long long idx, void* valuePtr);
         array = _dino_push(array, &t);                                         \
     }
 
+/**
+ *  Push `count` elements from the `values` pointer at once, reallocating at
+ * most once
+ */
+#define dinoAppendN(array, values, count)                                      \
+    array = _dino_append_n(array, values, count)
+
 /**
  *  Pop the last element value from the Dino array.
  */
@@ -125,53 +162,152 @@ void* _dino_insert_at(void* array, unsigned long long idx, void* valuePtr);
 #include <stdio.h>
 #include <string.h>
 
+// A custom DINO_MALLOC/DINO_FREE without a DINO_REALLOC to go with it can't
+// be handed to libc's realloc, so growing copies instead
+#ifndef DINO_REALLOC
+#if defined(DINO_MALLOC) || defined(DINO_FREE)
+#define _DINO_NO_REALLOC
+#else
+#include <stdlib.h>
+#define DINO_REALLOC realloc
+#endif
+#endif
+
 #ifndef DINO_MALLOC
 #include <stdlib.h>
 #define DINO_MALLOC malloc
 #endif
 
+#ifndef DINO_FREE
+#include <stdlib.h>
+#define DINO_FREE free
+#endif
 
-void* _dino_create(unsigned long long length, unsigned long long stride) {
+#define _DINO_HEADER (DINOARRAY_FIELD_LENGTH * sizeof(unsigned long long))
+
+// Where the allocation of an array starts
+static unsigned char* _dino_base(void* array) {
+    return (unsigned char*)array - _DINO_HEADER -
+           _dino_field_get(array, DINOARRAY_PAD);
+}
+
+// Bytes to allocate for `length` elements. Aligned arrays get enough slack to
+// put the elements on the boundary wherever the allocation lands
+static unsigned long long _dino_bytes(unsigned long long length,
+                                      unsigned long long stride,
+                                      unsigned long long align) {
+    return _DINO_HEADER + length * stride + (align ? align - 1 : 0);
+}
+
+// Padding that puts the elements of an allocation at `base` on the boundary
+static unsigned long long _dino_pad(unsigned char* base,
+                                    unsigned long long align) {
+    if (!align) {
+        return 0;
+    }
+    unsigned long long data = (unsigned long long)base + _DINO_HEADER;
+    return (align - data % align) % align;
+}
+
+void* _dino_create_aligned(unsigned long long length, unsigned long long stride,
+                           unsigned long long align) {
+    if (align & (align - 1)) {
+        fprintf(stderr, "DINO ERROR: Alignment has to be a power of 2");
+        align = 0;
+    }
+    if (length == 0) {
+        length = 1;
+    }
+    unsigned char* base = DINO_MALLOC(_dino_bytes(length, stride, align));
+    unsigned long long pad = _dino_pad(base, align);
     // Like an html network header
     // Stores info
-    unsigned long long header =
-        DINOARRAY_FIELD_LENGTH * sizeof(unsigned long long);
-    unsigned long long mix = (length * stride) + header;
-    void* newArr = DINO_MALLOC(mix);
-    // Set header info
-    ((unsigned long long*)newArr)[DINOARRAY_MAX_SIZE] = length;
-    ((unsigned long long*)newArr)[DINOARRAY_LENGTH] =
-        0; // Length of current elements
-    ((unsigned long long*)newArr)[DINOARRAY_STRIDE] = stride;
+    unsigned long long* header = (unsigned long long*)(base + pad);
+    header[DINOARRAY_MAX_SIZE] = length;
+    header[DINOARRAY_LENGTH] = 0; // Length of current elements
+    header[DINOARRAY_STRIDE] = stride;
+    header[DINOARRAY_ALIGN] = align;
+    header[DINOARRAY_PAD] = pad;
     // Move the array up so the user can access their elements immediately
-    return ((void*)(((unsigned long long*)newArr) + DINOARRAY_FIELD_LENGTH));
+    return header + DINOARRAY_FIELD_LENGTH;
+}
+
+void* _dino_create(unsigned long long length, unsigned long long stride) {
+    return _dino_create_aligned(length, stride, 0);
 }
 
 void _dino_destroy(void* array) {
-    unsigned long long* header =
-        (unsigned long long*)array - DINOARRAY_FIELD_LENGTH;
-    free(header);
+    DINO_FREE(_dino_base(array));
 }
 
-void* _dino_resize(void* array) {
+// Gives the array room for exactly `max` elements. realloc gets to grow it in
+// place when there's space behind it, an aligned array that lands with a
+// different padding gets its elements shifted over afterwards.
+static void* _dino_realloc(void* array, unsigned long long max) {
     unsigned long long length = dinoLength(array);
     unsigned long long stride = dinoStride(array);
-    void* temp =
-        _dino_create(dinoMaxSize(array) * DINO_DEFAULT_RESIZE_FACTOR, stride);
-    memcpy(temp, array, length * stride);
-    _dino_destroy(array);
-    dinoLengthSet(temp, length);
-    return temp;
+    unsigned long long align = _dino_field_get(array, DINOARRAY_ALIGN);
+    unsigned long long pad = _dino_field_get(array, DINOARRAY_PAD);
+    if (length > max) {
+        length = max;
+    }
+    unsigned long long used = _DINO_HEADER + length * stride;
+#ifdef _DINO_NO_REALLOC
+    unsigned char* base = DINO_MALLOC(_dino_bytes(max, stride, align));
+    unsigned long long newPad = _dino_pad(base, align);
+    memcpy(base + newPad, _dino_base(array) + pad, used);
+    DINO_FREE(_dino_base(array));
+#else
+    unsigned char* base =
+        DINO_REALLOC(_dino_base(array), _dino_bytes(max, stride, align));
+    unsigned long long newPad = _dino_pad(base, align);
+    if (newPad != pad) {
+        memmove(base + newPad, base + pad, used);
+    }
+#endif
+    unsigned long long* header = (unsigned long long*)(base + newPad);
+    header[DINOARRAY_MAX_SIZE] = max;
+    header[DINOARRAY_LENGTH] = length;
+    header[DINOARRAY_PAD] = newPad;
+    return header + DINOARRAY_FIELD_LENGTH;
+}
+
+void* _dino_reserve(void* array, unsigned long long length) {
+    unsigned long long max = dinoMaxSize(array);
+    if (length <= max) {
+        return array;
+    }
+    // Growing by a factor keeps pushing amortized O(1) even when every call
+    // only asks for one more
+    max *= DINO_DEFAULT_RESIZE_FACTOR;
+    return _dino_realloc(array, length > max ? length : max);
+}
+
+void* _dino_resize(void* array, unsigned long long length) {
+    unsigned long long old = dinoLength(array);
+    array = _dino_reserve(array, length);
+    if (length > old) {
+        unsigned long long stride = dinoStride(array);
+        memset((unsigned char*)array + old * stride, 0,
+               (length - old) * stride);
+    }
+    dinoLengthSet(array, length);
+    return array;
 }
 
 void* _dino_shrink(void* array) {
     unsigned long long length = dinoLength(array);
+    return _dino_realloc(array, length ? length : 1);
+}
+
+void* _dino_append_n(void* array, const void* values,
+                     unsigned long long count) {
+    unsigned long long length = dinoLength(array);
     unsigned long long stride = dinoStride(array);
-    void* temp = _dino_create(length + 1, stride);
-    memcpy(temp, array, length * stride);
-    _dino_destroy(array);
-    dinoLengthSet(temp, length);
-    return temp;
+    array = _dino_reserve(array, length + count);
+    memcpy((unsigned char*)array + length * stride, values, count * stride);
+    dinoLengthSet(array, length + count);
+    return array;
 }
 
 unsigned long long _dino_field_get(void* array, unsigned long long field) {
@@ -190,10 +326,8 @@ void _dino_field_set(void* array, unsigned long long field,
 void* _dino_push(void* array, const void* valuePtr) {
     unsigned long long length = dinoLength(array);
     unsigned long long stride = dinoStride(array);
-    // printf("Length: %llu, MaxSize: %llu\n", length, dinoMaxSize(array));
     if (length >= dinoMaxSize(array)) {
-        // printf("Resizing Array\n");
-        array = _dino_resize(array);
+        array = _dino_reserve(array, length + 1);
     }
     unsigned long long idx = (unsigned long long)array;
     // Since length is One-based and array is Zero-based we don't have to add
@@ -212,17 +346,15 @@ void* _dino_insert_at(void* array, unsigned long long idx, void* valuePtr) {
         return array;
     }
     if (length >= dinoMaxSize(array)) {
-        array = _dino_resize(array);
+        array = _dino_reserve(array, length + 1);
     }
     unsigned long long memIdx = (unsigned long long)array;
 
-    // If idx isn't at the end move elements after it down one
+    // Move the elements from idx on down one, the ranges overlap
     // Element after the index to move the afterbit to
     unsigned long long elementAfter = memIdx + ((idx + 1) * stride);
     unsigned long long afterbit = memIdx + (idx * stride);
-    if (idx != length - 1) {
-        memcpy((void*)elementAfter, (void*)afterbit, stride * (length - idx));
-    }
+    memmove((void*)elementAfter, (void*)afterbit, stride * (length - idx));
     // Actually copy the idx value into the array
     memcpy((void*)(memIdx + (idx * stride)), valuePtr, stride);
     dinoLengthSet(array, length + 1);
@@ -250,13 +382,12 @@ void* _dino_pop_at(void* array, unsigned long long idx, void* dest) {
     // Copy the element to the dest
     memcpy(dest, (void*)(memIdx + eleIdx), stride);
 
-    // If idx isn't at the end move elements after it down one
+    // Move the elements after idx up one, the ranges overlap
     // Element after the index to move the afterbit to
     unsigned long long elementAfter = memIdx + ((idx + 1) * stride);
     unsigned long long afterbit = memIdx + (idx * stride);
-    if (idx != length - 1) {
-        memcpy((void*)afterbit, (void*)elementAfter, stride * (length - idx));
-    }
+    memmove((void*)afterbit, (void*)elementAfter,
+            stride * (length - idx - 1));
     dinoLengthSet(array, length - 1);
     return array;
 }
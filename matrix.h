@@ -1,16 +1,42 @@
 #pragma once
 
+#ifdef MATRIX_IMPLEMENTATION
+#define TPOOL_IMPLEMENTATION
+#endif
+#include "threadpool.h"
+
+/**
+ * The element type of every matrix. Doubles by default, define MATRIX_FLOAT
+ * before including to store and compute in single precision instead. That
+ * halves the memory and doubles the SIMD width of every kernel.
+ * For mixed precision training keep a master copy of the weights in doubles,
+ * step that with matrixOptimizerStepMaster and do the rest of the math in
+ * floats.
+ */
+#ifdef MATRIX_FLOAT
+typedef float mfloat;
+#else
+typedef double mfloat;
+#endif
+
 typedef struct {
-    double* data;
+    mfloat* data;
     int rows;
     int cols;
+    int stride; // Elements between the starts of two rows in memory
+    // The memory holds a cols x rows matrix and this is its transpose, so
+    // element (r, c) is at data[c * stride + r]
+    char transposed;
 } Matrix;
 
 
 /**
- * QoL function to get access to an element without having to do math
+ * QoL function to get access to an element without having to do math.
+ * Works for every kind of view.
  */
-#define MAT_AT(mat, r, c) (mat)->data[(r) * (mat)->cols + c]
+#define MAT_AT(mat, r, c)                                                      \
+    (mat)->data[(mat)->transposed ? (long long)(c) * (mat)->stride + (r)       \
+                                  : (long long)(r) * (mat)->stride + (c)]
 
 /**
  * QoL function to print a matrix just by giving the matrix
@@ -18,7 +44,37 @@ typedef struct {
 #define matPrint(m) matrixPrint(m, #m, 0);
 
 /**
- * Create and Return a matrix.
+ * Instruction sets the matrix kernels can run on. Ordered from narrowest to
+ * widest so they can be compared.
+ */
+typedef enum MATRIX_ISA {
+    MATRIX_ISA_SCALAR,
+    MATRIX_ISA_SSE2,
+    MATRIX_ISA_AVX2,
+    MATRIX_ISA_AVX512,
+} MATRIX_ISA;
+
+/**
+ * Picks which kernels the matrix functions use.
+ * The widest one the CPU supports is picked at startup. The `MATRIX_ISA`
+ * environment variable (scalar, sse2, avx2 or avx512) can lower that.
+ * @param isa The wanted instruction set. Gets lowered if the CPU can't run it
+ * @return The instruction set actually in use
+ */
+MATRIX_ISA matrixIsaSelect(MATRIX_ISA isa);
+
+/**
+ * @return The instruction set the matrix kernels are currently using
+ */
+MATRIX_ISA matrixIsaGet(void);
+
+/**
+ * @return A printable name for `isa`
+ */
+const char* matrixIsaName(MATRIX_ISA isa);
+
+/**
+ * Create and Return a matrix. The header and the data are one allocation.
  * Calls Malloc MUST be freed (look at matrixFree)
  * @param rows amount of rows the matrix needs
  * @param cols amount of cols the matrix needs
@@ -32,13 +88,49 @@ Matrix* matrixCreate(int rows, int cols);
  */
 void matrixFree(Matrix* m);
 
+//====================== Views ======================
+// Views don't own or copy anything, they're O(1) and the matrix functions
+// take them like any other matrix. They stay valid as long as the memory
+// they point into does.
+
+/**
+ * Wraps a plain row-major buffer as a matrix
+ * @param data The buffer, needs rows * cols elements
+ */
+Matrix matView(mfloat* data, int rows, int cols);
+
+/**
+ * A rows x cols window of `m` starting at (row, col)
+ */
+Matrix matSlice(const Matrix* m, int row, int col, int rows, int cols);
+
+/**
+ * `count` rows of `m` starting at `row`. e.g. a mini-batch out of a data set
+ */
+Matrix matRows(const Matrix* m, int row, int count);
+
+/**
+ * `count` columns of `m` starting at `col`
+ */
+Matrix matCols(const Matrix* m, int col, int count);
+
+/**
+ * A single row of `m`
+ */
+Matrix matRow(const Matrix* m, int row);
+
+/**
+ * The transpose of `m`, without moving anything
+ */
+Matrix matT(const Matrix* m);
+
 
 /**
  * Fills a matrix with `val`
  * @param m The matrix to be filled
  * @param val The value to fill the matrix with
  */
-void matrixFill(Matrix* m, double val);
+void matrixFill(Matrix* m, mfloat val);
 
 /**
  * Prints the matrix in a pretty way. Might want to look at matPrint for some QoL
@@ -61,13 +153,84 @@ void matrixIdentity(Matrix* m);
  */
 char matrixIsIdentity(Matrix* m);
 
+//====================== Random ======================
+// Counter based (Philox4x32-10), draw n of a generator is a pure function of
+// its seed, stream and n. Filling a matrix hands every thread its own range
+// of counters, so the values are the same whatever the thread count.
+
+/**
+ * A random generator. Copying one copies where it is in its sequence.
+ */
+typedef struct MatrixRng {
+    unsigned long long seed;
+    unsigned long long stream;  // Streams of the same seed never overlap
+    unsigned long long counter; // Draws taken so far
+} MatrixRng;
+
+/**
+ * @param seed Same seed and stream, same sequence
+ * @param stream Picks one of 2^64 independent sequences of the seed
+ */
+MatrixRng matrixRngCreate(unsigned long long seed, unsigned long long stream);
+
+/**
+ * Reseeds the shared generator matrixRand and matrixShuffleRows draw from,
+ * and starts handing out streams from matrixRngStream over. The seed is 0
+ * until this gets called.
+ */
+void matrixRngSeed(unsigned long long seed);
+
+/**
+ * A generator on a stream of the shared seed nothing else got yet. Every
+ * network takes one when it's created.
+ */
+MatrixRng matrixRngStream(void);
+
+/**
+ * @return 64 random bits
+ */
+unsigned long long matrixRngNext(MatrixRng* rng);
+
+/**
+ * @return Uniform in [0, 1)
+ */
+mfloat matrixRngUniform(MatrixRng* rng);
+
+/**
+ * @return Uniform in [0, n)
+ */
+long long matrixRngBelow(MatrixRng* rng, long long n);
+
+/**
+ * The swaps of a Fisher-Yates shuffle of n items, drawn in parallel. Swapping
+ * item i with item j[i] for i from n - 1 down to 1 shuffles them.
+ * @param j Gets j[i] uniform in [0, i]
+ */
+void matrixRngSwaps(MatrixRng* rng, long long* j, long long n);
+
+/**
+ * Fills a matrix with uniform values in [low, high), row by row
+ * @param rng What to draw from, moves on by rows * cols draws
+ */
+void matrixRandRng(Matrix* m, MatrixRng* rng, mfloat low, mfloat high);
+
 /**
- * Fills a matrix with random decimal values
+ * Fills a matrix with uniform values from the shared generator. Safe to call
+ * from several threads, each call gets its own draws.
  * @param m The matrix to use
  * @param low The low of the random values
- * @param high The high of the random values
+ * @param high The high of the random values, never hit
+ */
+void matrixRand(Matrix* m, mfloat low, mfloat high);
+
+/**
+ * Inverted dropout, zeroes every element with probability `rate` and scales
+ * the rest by 1 / (1 - rate) so the expected value stays the same. Draws the
+ * same mask as matrixRandRng would draw values.
+ * @param rate In [0, 1)
  */
-void matrixRand(Matrix* m, double low, double high);
+void matrixDropout(Matrix* m, MatrixRng* rng, mfloat rate);
+
 
 /**
  * Adds two matrices together
@@ -90,10 +253,11 @@ void matrixSub(Matrix* dest, const Matrix* a, const Matrix* b);
  * @param a The matrix to use
  * @param val The value to use
  */
-void matrixScalar(Matrix* a, double val);
+void matrixScalar(Matrix* a, mfloat val);
 
 /**
- * Multiples two matrices together
+ * Multiples two matrices together. `dest` is overwritten, to accumulate into it
+ * use matrixGemm with a beta of 1
  * @param dest The matrix where the result is stored
  * @param a The first matrix to use
  * @param b The second matrix to use
@@ -101,7 +265,332 @@ void matrixScalar(Matrix* a, double val);
 void matrixMulti(Matrix* dest, const Matrix* a, const Matrix* b);
 
 /**
- * Transposes a matrix
+ * General matrix multiply: dest = alpha * (a * b) + beta * dest
+ * Cache blocked and packed so it stays fast for big matrices, and split over
+ * the thread pool once it's big enough.
+ * When beta is 0 dest is never read, so it doesn't need to be initialized.
+ * @param dest The matrix where the result is stored. Can't be `a` or `b`
+ * @param a The first matrix to use
+ * @param b The second matrix to use
+ * @param alpha What the product gets scaled by
+ * @param beta What the old contents of dest get scaled by (0 overwrites, 1 accumulates)
+ */
+void matrixGemm(Matrix* dest, const Matrix* a, const Matrix* b, mfloat alpha,
+                mfloat beta);
+
+/**
+ * Activation functions the fused kernels know about. They run as SIMD kernels
+ * on the selected instruction set.
+ *  exp and tanh are polynomial approximations rather than libm calls: e^x is
+ * 2^n * e^r with |r| <= ln2 / 2 and e^r from its Taylor series, and tanh is
+ * built from e^x - 1 so it stays accurate near 0. Sigmoid and tanh come out
+ * within 3 ulp of the exact result in doubles and floats, and so does GELU
+ * for x >= -1. Further out GELU is nearly 0 and the rounding of its cubic
+ * argument takes over, but the error stays far below an ulp of x. Inputs
+ * beyond what exp can represent saturate.
+ */
+typedef enum MATRIX_ACT {
+    MATRIX_ACT_NONE,
+    MATRIX_ACT_SIGMOID,
+    MATRIX_ACT_TANH,
+    MATRIX_ACT_RELU,
+    MATRIX_ACT_GELU,
+    MATRIX_ACT_LEAKY_RELU, // x, or MATRIX_LEAKY_SLOPE * x below 0
+    // e^x / sum(e^x) over each row, with the row's max taken off first so it
+    // can't overflow. Only makes sense when a whole row is one sample
+    MATRIX_ACT_SOFTMAX,
+} MATRIX_ACT;
+
+#ifndef MATRIX_LEAKY_SLOPE
+#define MATRIX_LEAKY_SLOPE 0.01
+#endif // MATRIX_LEAKY_SLOPE
+
+/**
+ * Loss functions for matrixLoss and matrixLossGrad
+ *  MSE: the summed squared error of every row
+ *  CROSS_ENTROPY: -sum(t * log(y)) of every row, for outputs that are
+ * probabilities (softmax). y gets clamped to MATRIX_LOSS_EPS so log(0) never
+ * comes up
+ */
+typedef enum MATRIX_LOSS {
+    MATRIX_LOSS_MSE,
+    MATRIX_LOSS_CROSS_ENTROPY,
+} MATRIX_LOSS;
+
+#ifndef MATRIX_LOSS_EPS
+#define MATRIX_LOSS_EPS 1e-12
+#endif // MATRIX_LOSS_EPS
+
+/**
+ * A dense layer's forward pass in one go: dest = act(a * b + bias)
+ * The bias and activation are applied to each tile of dest right after the
+ * GEMM computes it, so dest is only written once. Softmax needs whole rows, so
+ * it gets its own pass over dest afterwards.
+ * @param dest The matrix where the result is stored. Can't be `a` or `b`
+ * @param a The inputs, one sample per row
+ * @param b The weights
+ * @param bias A 1 x dest->cols row added to every row, or NULL
+ * @param act The activation to apply
+ * @param preact If not NULL gets a * b + bias (before the activation). GELU's
+ * derivative needs it
+ */
+void matrixGemmFused(Matrix* dest, const Matrix* a, const Matrix* b,
+                     const Matrix* bias, MATRIX_ACT act, Matrix* preact);
+
+/**
+ * A matrix already packed into the panels the GEMM reads its right hand side
+ * from, so multiplying by it skips the packing. Meant for weights that stop
+ * changing. The layout depends on the kernels in use, so pack after picking
+ * the instruction set.
+ */
+typedef struct {
+    mfloat* data;
+    int rows;
+    int cols;
+    int nr; // Panel width of the kernels it was packed for
+} MatrixPacked;
+
+/**
+ * @return How many mfloats matrixPack needs for a rows x cols matrix
+ */
+long long matrixPackedLen(int rows, int cols);
+
+/**
+ * Packs `b` for matrixGemmPacked
+ * @param dst matrixPackedLen(b->rows, b->cols) mfloats, 64 byte aligned
+ * @param b The matrix to pack, any kind of view
+ * @return The packed matrix, its data is `dst`
+ */
+MatrixPacked matrixPack(mfloat* dst, const Matrix* b);
+
+/**
+ * matrixGemmFused with `b` packed ahead of time
+ */
+void matrixGemmPacked(Matrix* dest, const Matrix* a, const MatrixPacked* b,
+                      const Matrix* bias, MATRIX_ACT act, Matrix* preact);
+
+/**
+ * A matrix quantized to int8 for matrixGemmInt8, one scale per column:
+ * element (r, c) is about q(r, c) * scales[c]. The values are stored packed,
+ * in panels of 16 columns where the 4 values of a column for k, k+1, k+2 and
+ * k+3 sit next to each other. The layout doesn't depend on the kernels.
+ */
+typedef struct {
+    signed char* data;
+    int rows;
+    int cols;
+    mfloat* scales;
+    int* colSums; // Sum of the int8 values of every column
+} MatrixInt8;
+
+/**
+ * @return How many bytes matrixQuantize needs for a rows x cols matrix
+ */
+long long matrixInt8Bytes(int rows, int cols);
+
+/**
+ * Quantizes `b` symmetrically per column, the biggest magnitude of a column
+ * maps to 127
+ * @param dst matrixInt8Bytes(b->rows, b->cols) bytes, 64 byte aligned
+ * @param b The matrix to quantize, any kind of view
+ * @return The quantized matrix, everything in it lives in `dst`
+ */
+MatrixInt8 matrixQuantize(void* dst, const Matrix* b);
+
+/**
+ * dest = act(a * b + bias) with `a` rounded to int8 steps of aScale on the
+ * way in. The products are summed exactly in int32, then scaled back to
+ * mfloats before the bias and activation.
+ * @param dest Any kind of view, a transposed one gets the product transposed
+ * @param a Any kind of view. Values beyond 127 * aScale get clamped
+ * @param aScale The step `a` gets quantized with
+ * @param b The quantized right hand side
+ * @param bias A 1 x dest->cols row added to every row, or NULL
+ * @param act The activation to apply
+ */
+void matrixGemmInt8(Matrix* dest, const Matrix* a, mfloat aScale,
+                    const MatrixInt8* b, const Matrix* bias, MATRIX_ACT act);
+
+/**
+ * A matrix with only its nonzero blocks stored, block sparse row. A block is
+ * blockCols elements of a row starting on a multiple of blockCols, so with
+ * blockCols 1 it's plain CSR. Wider blocks are what the SIMD kernels like,
+ * pruning whole blocks keeps them.
+ */
+typedef struct {
+    int rows;
+    int cols;
+    int blockCols;
+    long long blocks;
+    // rows + 1 of them, row r's blocks are [rowStart[r], rowStart[r + 1])
+    int* rowStart;
+    int* blockCol; // The first column of every block
+    // blockCols values per block, past the matrix's last column they're 0
+    mfloat* vals;
+} MatrixSparse;
+
+/**
+ * @return How many blocks of `b` have a nonzero in them
+ */
+long long matrixSparseBlocks(const Matrix* b, int blockCols);
+
+/**
+ * @return How many bytes matrixSparsify needs for a matrix with `rows` rows
+ * and `blocks` nonzero blocks
+ */
+long long matrixSparseBytes(int rows, long long blocks, int blockCols);
+
+/**
+ * Keeps the blocks of `b` that have a nonzero in them
+ * @param dst matrixSparseBytes bytes, 64 byte aligned
+ * @param b The matrix, any kind of view
+ * @return The sparse matrix, everything in it lives in `dst`
+ */
+MatrixSparse matrixSparsify(void* dst, const Matrix* b, int blockCols);
+
+/**
+ * Copies the values at the blocks `s` keeps back in from `b`, after `b` got
+ * changed e.g. by a learning step. What's outside the blocks is ignored.
+ */
+void matrixSparseUpdate(MatrixSparse* s, const Matrix* b);
+
+/**
+ * dest = act(a * b + bias) with b sparse, the same as matrixGemmFused. Rows
+ * of `a` are walked once and zeros in them skipped, so a ReLU before helps.
+ * @param dest Row major, can't be `a`
+ * @param a Row major
+ * @param bias A 1 x dest->cols row added to every row, or NULL
+ * @param preact If not NULL gets dest from before the activation
+ */
+void matrixGemmSparse(Matrix* dest, const Matrix* a, const MatrixSparse* b,
+                      const Matrix* bias, MATRIX_ACT act, Matrix* preact);
+
+/**
+ * dest = a * b^T with b sparse, the gradient w.r.t. the input of a layer
+ * that ran matrixGemmSparse. All row major.
+ */
+void matrixGemmSparseT(Matrix* dest, const Matrix* a, const MatrixSparse* b);
+
+/**
+ * dest += a^T * b, but only where `pattern` has a block, the gradient w.r.t.
+ * the weights of a layer that ran matrixGemmSparse. Everywhere else dest is
+ * left alone, so weights pruned to 0 stay 0.
+ * @param dest As big as pattern, row major
+ * @param a The inputs, one sample per row, row major
+ * @param b The gradients w.r.t. the outputs, one sample per row, row major
+ */
+void matrixGemmSparseGrad(Matrix* dest, const Matrix* a, const Matrix* b,
+                          const MatrixSparse* pattern);
+
+/**
+ * Applies an activation in place, for when the product wasn't made by
+ * matrixGemmFused
+ * @param m The matrix to activate
+ * @param act The activation to apply
+ * @param preact If not NULL gets `m` from before the activation
+ */
+void matrixAct(Matrix* m, MATRIX_ACT act, Matrix* preact);
+
+/**
+ * The matching backward pass of matrixGemmFused's bias and activation.
+ * Turns the gradient w.r.t. the outputs into the gradient w.r.t. the
+ * pre-activation, and sums it into the bias gradient, in a single sweep.
+ * @param gs The gradients, multiplied by the activation's derivative in place
+ * @param out What matrixGemmFused wrote to dest
+ * @param preact What matrixGemmFused wrote to preact. Only needed for GELU
+ * @param act The activation that was applied
+ * @param bsu A 1 x gs->cols row the column sums get added to, or NULL
+ */
+void matrixActBackward(Matrix* gs, const Matrix* out, const Matrix* preact,
+                       MATRIX_ACT act, Matrix* bsu);
+
+/**
+ * The loss of every row of `out` against the same row of `to`, summed
+ * @param out The outputs, one sample per row
+ * @param to The expected outputs
+ * @param loss Which loss
+ */
+double matrixLoss(const Matrix* out, const Matrix* to, MATRIX_LOSS loss);
+
+/**
+ * The gradient of matrixLoss w.r.t. `out`, times `scale`. For cross-entropy
+ * after a softmax it gives the gradient w.r.t. the pre-activation instead,
+ * which is just y - t, so the softmax's derivative never has to be applied.
+ * @param gs Where the gradient goes, can be `out`
+ * @param out The outputs
+ * @param to The expected outputs
+ * @param loss Which loss
+ * @param act The activation that made `out`
+ * @param scale What the gradient gets multiplied by, e.g. 1 / batch size
+ * @return The activation matrixActBackward still has to go through: `act`,
+ * or MATRIX_ACT_NONE if it got folded in
+ */
+MATRIX_ACT matrixLossGrad(Matrix* gs, const Matrix* out, const Matrix* to,
+                          MATRIX_LOSS loss, MATRIX_ACT act, mfloat scale);
+
+/**
+ * Update rules for matrixOptimizerStep. g is the gradient plus the L2 weight
+ * decay, weightDecay * p, for all but AdamW
+ *  SGD: p -= rate * g
+ *  MOMENTUM: m = beta1 * m + g, p -= rate * m
+ *  ADAM: m = beta1 * m + (1 - beta1) * g, v = beta2 * v + (1 - beta2) * g^2,
+ * p -= rate * m / (sqrt(v) + eps) with m and v corrected for starting at 0
+ *  ADAMW: Adam on the plain gradient, and the decay shrinks p on its own by
+ * rate * weightDecay * p
+ */
+typedef enum MATRIX_OPTIMIZER {
+    MATRIX_OPTIMIZER_SGD,
+    MATRIX_OPTIMIZER_MOMENTUM,
+    MATRIX_OPTIMIZER_ADAM,
+    MATRIX_OPTIMIZER_ADAMW,
+} MATRIX_OPTIMIZER;
+
+typedef struct MatrixOptimizer {
+    MATRIX_OPTIMIZER kind;
+    mfloat beta1; // The momentum, or how fast Adam's m decays
+    mfloat beta2; // How fast Adam's v decays
+    mfloat eps;
+    mfloat weightDecay;
+    long long step; // Steps taken so far, for Adam's bias correction
+} MatrixOptimizer;
+
+/**
+ * An optimizer with the usual settings: beta1 0.9, beta2 0.999, eps 1e-8 and
+ * a weightDecay of 0.01 for AdamW, 0 for the rest
+ */
+MatrixOptimizer matrixOptimizerCreate(MATRIX_OPTIMIZER kind);
+
+/**
+ * How many arrays of state an optimizer keeps, each as long as the params.
+ * 0 for SGD, m for momentum, m and v for Adam and AdamW
+ */
+int matrixOptimizerStates(MATRIX_OPTIMIZER kind);
+
+/**
+ * Takes one step over `n` params as a single fused pass. Each param,
+ * gradient and state element gets read and written once, SIMD and on the
+ * pool when there are enough of them. The gradients get zeroed for the next
+ * step and opt->step goes up by 1.
+ * @param rate The learning rate
+ * @param m The first array of state, NULL if there isn't one. Start it at 0
+ * @param v The second one, same as m
+ */
+void matrixOptimizerStep(MatrixOptimizer* opt, mfloat rate, mfloat* p,
+                         mfloat* g, mfloat* m, mfloat* v, long long n);
+
+/**
+ * matrixOptimizerStep for mixed precision training: the step is taken in
+ * doubles on `master`, the master copy of `p`, and `p` gets the result
+ * rounded. Steps too small to move an mfloat still add up in `master`. Scalar
+ * but on the pool, it's memory bound anyway.
+ * @param master n doubles, p's values to start with
+ */
+void matrixOptimizerStepMaster(MatrixOptimizer* opt, mfloat rate,
+                               double* master, mfloat* p, mfloat* g, mfloat* m,
+                               mfloat* v, long long n);
+
+/**
+ * Transposes a matrix into new memory. If you don't need a copy look at matT
  * @param dest The matrix where the result is stored
  * @param a The matrix to use
  */
@@ -115,13 +604,30 @@ void matrixTranspose(Matrix* dest, const Matrix* a);
 void matrixCopy(Matrix* dest, const Matrix* a);
 
 /**
- * Shuffles the rows in a matrix.
+ * Widens a matrix into a plain double array. Used to keep double precision
+ * master weights next to a float matrix.
+ * @param dest Where to write, needs rows * cols doubles
+ * @param a The matrix to read
+ */
+void matrixToDouble(double* dest, const Matrix* a);
+
+/**
+ * Rounds a plain double array into a matrix. The other half of matrixToDouble.
+ * @param dest The matrix where the result is stored
+ * @param src What to read, needs rows * cols doubles
+ */
+void matrixFromDouble(Matrix* dest, const double* src);
+
+/**
+ * Shuffles the rows in a matrix, every order equally likely. Draws from the
+ * shared generator. This moves every row, to train in a random order shuffle
+ * an index array instead.
  * @param a The matrix to shuffle
  */
 void matrixShuffleRows(Matrix* m);
 
 void matrixRowSwap(Matrix* m1, int row1, Matrix* m2, int row2);
-void matrixRowScalar(Matrix* m, int row, double val);
+void matrixRowScalar(Matrix* m, int row, mfloat val);
 void matrixRowAdd(Matrix* m1, int row1, const Matrix* m2, int row2);
 Matrix* matrixRowAddDestCreate(const Matrix* m1, int row1, const Matrix* m2, int row2);
 Matrix* matrixSubmatrixCreate(const Matrix* m, int* rowArrIdxs, int rowArrLen, int* colArrIdxs, int colArrLen);
@@ -143,116 +649,2376 @@ Matrix* matrixSubmatrixCreate(const Matrix* m, int* rowArrIdxs, int rowArrLen, i
 #define MATRIX_ASSERT assert
 #endif
 
-Matrix* matrixCreate(int rows, int cols) {
-    Matrix* m = MATRIX_MALLOC(sizeof(Matrix));
-    m->rows = rows;
-    m->cols = cols;
-    m->data = MATRIX_MALLOC(sizeof(double) * rows * cols);
-    return m;
-}
+#include <string.h>
 
-void matrixFill(Matrix* m, double val) {
-    for (int i = 0; i < m->rows; i++) {
-        for (int j = 0; j < m->cols; j++) {
-            printf("%d:%d\n", i, j);
-            MAT_AT(m, i, j) = val;
-        }
+//====================== Activations ======================
+
+#include <math.h>
+
+// Adding then taking off 1.5 * 2^mantissa bits rounds to the nearest integer
+#ifdef MATRIX_FLOAT
+#define _MATRIX_ROUND_MAGIC 12582912.0f
+#else
+#define _MATRIX_ROUND_MAGIC 6755399441055744.0
+#endif
+
+// The bits of an mfloat as an unsigned integer of the same size, and what the
+// exp approximation needs to know about the format. LO and HI are as far as x
+// can go before 2^n stops being a normal number, ln2 is split in two so n ln2
+// can be taken off x without losing r.
+#ifdef MATRIX_FLOAT
+typedef unsigned int _MatrixBits;
+#define _MATRIX_MANT_BITS 23
+#define _MATRIX_EXP_BIAS 127u
+#define _MATRIX_EXP_LO -87.0f
+#define _MATRIX_EXP_HI 88.0f
+#define _MATRIX_LN2_HI 0.693359375f
+#define _MATRIX_LN2_LO -2.12194440e-4f
+#define _MATRIX_EXP_DEG 7
+#else
+typedef unsigned long long _MatrixBits;
+#define _MATRIX_MANT_BITS 52
+#define _MATRIX_EXP_BIAS 1023ull
+#define _MATRIX_EXP_LO -708.0
+#define _MATRIX_EXP_HI 709.0
+#define _MATRIX_LN2_HI 6.93147180369123816490e-01
+#define _MATRIX_LN2_LO 1.90821492927058770002e-10
+#define _MATRIX_EXP_DEG 13
+#endif
+#define _MATRIX_LOG2E ((mfloat)1.4426950408889634)
+#define _MATRIX_SIGN_BIT ((_MatrixBits)1 << (sizeof(mfloat) * 8 - 1))
+
+// 1 / k! from k = _MATRIX_EXP_DEG down to 1, the Taylor series of e^r - 1.
+// With |r| <= ln2 / 2 the first term left out is below half an ulp.
+static const mfloat _matrixExpPoly[] = {
+#ifndef MATRIX_FLOAT
+    (mfloat)(1.0 / 6227020800.0), (mfloat)(1.0 / 479001600.0),
+    (mfloat)(1.0 / 39916800.0),   (mfloat)(1.0 / 3628800.0),
+    (mfloat)(1.0 / 362880.0),     (mfloat)(1.0 / 40320.0),
+#endif
+    (mfloat)(1.0 / 5040.0),       (mfloat)(1.0 / 720.0),
+    (mfloat)(1.0 / 120.0),        (mfloat)(1.0 / 24.0),
+    (mfloat)(1.0 / 6.0),          (mfloat)(1.0 / 2.0),
+    (mfloat)1,
+};
+
+// e^x split as s * (1 + q): puts 2^n in *s and returns q = e^r - 1, where
+// x = n ln2 + r. 2^n gets written straight into the exponent bits. Keeping q
+// apart is what lets tanh get e^x - 1 without any cancellation.
+static inline mfloat _matrix_expq(mfloat x, mfloat* s) {
+    x = x < _MATRIX_EXP_LO ? _MATRIX_EXP_LO : x;
+    x = x > _MATRIX_EXP_HI ? _MATRIX_EXP_HI : x;
+    mfloat t = x * _MATRIX_LOG2E + _MATRIX_ROUND_MAGIC;
+    mfloat n = t - _MATRIX_ROUND_MAGIC;
+    mfloat r = x - n * _MATRIX_LN2_HI - n * _MATRIX_LN2_LO;
+    mfloat q = _matrixExpPoly[0];
+    for (int k = 1; k < _MATRIX_EXP_DEG; k++) {
+        q = q * r + _matrixExpPoly[k];
     }
+    // n sits in the low bits of t
+    mfloat magic = _MATRIX_ROUND_MAGIC;
+    _MatrixBits bits;
+    _MatrixBits magicBits;
+    memcpy(&bits, &t, sizeof(bits));
+    memcpy(&magicBits, &magic, sizeof(magicBits));
+    bits = (bits - magicBits + _MATRIX_EXP_BIAS) << _MATRIX_MANT_BITS;
+    memcpy(s, &bits, sizeof(bits));
+    return q * r;
 }
 
-void matrixIdentity(Matrix* m) {
-    assert(m->cols != m->rows);
-    for (int i = 0; i < m->rows; i++) {
-        for (int j = 0; j < m->cols; j++) {
-            MAT_AT(m, i, j) = (i == j) ? 1 : 0;
-        }
-    }
+static inline mfloat _matrix_exp(mfloat x) {
+    mfloat s;
+    mfloat q = _matrix_expq(x, &s);
+    return s + s * q;
 }
 
-char matrixIsIdentity(Matrix* m) {
-    if (m->cols != m->rows) {
-        return 0;
-    }
-    for (int i = 0; i < m->rows; i++) {
-        for (int j = 0; j < m->cols; j++) {
-            if (i == j) {
-                if (MAT_AT(m, i, j) != 1) {
-                    return 0;
-                }
-            } else {
-                if (MAT_AT(m, i, j) != 0) {
-                    return 0;
-                }
-            }
-        }
-    }
-    return 1;
+// With m = e^(-2|x|) - 1, tanh |x| = -m / (m + 2). Small |x| only ever
+// touches the polynomial, so the result stays accurate down to 0.
+static inline mfloat _matrix_tanh(mfloat x) {
+    mfloat ax = x < 0 ? -x : x;
+    mfloat s;
+    mfloat q = _matrix_expq(-2 * ax, &s);
+    mfloat m = s * q + (s - 1);
+    mfloat th = (0 - m) / (m + 2);
+    return x < 0 ? -th : th;
 }
 
-void matrixFree(Matrix* m) {
-    if (m->data) {
-        MATRIX_FREE(m->data);
+// sqrt(2 / pi), for the tanh approximation of GELU. Rather than as
+// 0.5 x (1 + tanh(u)) it gets computed as x * sigmoid(2u), which is the same
+// but doesn't cancel down to nothing for negative x.
+#define _MATRIX_GELU_C ((mfloat)0.7978845608028654)
+#define _MATRIX_GELU_K ((mfloat)0.044715)
+
+static inline mfloat _matrix_gelu(mfloat v) {
+    mfloat u = _MATRIX_GELU_C * (v + _MATRIX_GELU_K * v * v * v);
+    return v / (1 + _matrix_exp(-2 * u));
+}
+
+static inline mfloat _matrix_gelu_grad(mfloat v) {
+    mfloat u = _MATRIX_GELU_C * (v + _MATRIX_GELU_K * v * v * v);
+    mfloat e = _matrix_exp(-2 * u);
+    mfloat sig = 1 / (1 + e);
+    mfloat du = _MATRIX_GELU_C * (1 + 3 * _MATRIX_GELU_K * v * v);
+    // 1 - sig is e * sig, without the cancellation
+    return sig + 2 * v * sig * (e * sig) * du;
+}
+
+static void _matrix_softmax_scalar(mfloat* x, int n) {
+    mfloat max = n > 0 ? x[0] : 0;
+    for (int j = 1; j < n; j++) {
+        max = x[j] > max ? x[j] : max;
+    }
+    mfloat sum = 0;
+    for (int j = 0; j < n; j++) {
+        x[j] = _matrix_exp(x[j] - max);
+        sum += x[j];
+    }
+    mfloat inv = 1 / sum;
+    for (int j = 0; j < n; j++) {
+        x[j] *= inv;
     }
-    MATRIX_FREE(m);
 }
 
-void matrixPrint(Matrix* m, const char* name, int p) {
-    printf("%*s%s = [\n", (int)p, "", name);
-    for (int i = 0; i < m->rows; i++) {
-        printf("%*s    ", (int)p, "");
-        for (int j = 0; j < m->cols; j++) {
-            printf("%f ", MAT_AT(m, i, j));
+static void _matrix_act_scalar(mfloat* x, int n, MATRIX_ACT act) {
+    switch (act) {
+    case MATRIX_ACT_NONE:
+        break;
+    case MATRIX_ACT_SIGMOID:
+        for (int j = 0; j < n; j++) {
+            x[j] = 1 / (1 + _matrix_exp(-x[j]));
         }
-        printf("\n");
+        break;
+    case MATRIX_ACT_TANH:
+        for (int j = 0; j < n; j++) {
+            x[j] = _matrix_tanh(x[j]);
+        }
+        break;
+    case MATRIX_ACT_RELU:
+        for (int j = 0; j < n; j++) {
+            x[j] = x[j] > 0 ? x[j] : 0;
+        }
+        break;
+    case MATRIX_ACT_GELU:
+        for (int j = 0; j < n; j++) {
+            x[j] = _matrix_gelu(x[j]);
+        }
+        break;
+    case MATRIX_ACT_LEAKY_RELU:
+        for (int j = 0; j < n; j++) {
+            x[j] = x[j] > 0 ? x[j] : (mfloat)MATRIX_LEAKY_SLOPE * x[j];
+        }
+        break;
+    case MATRIX_ACT_SOFTMAX:
+        _matrix_softmax_scalar(x, n);
+        break;
     }
-    printf("%*s]\n", (int)p, "");
 }
 
-void matrixRand(Matrix* m, double low, double high) {
-    for (int i = 0; i < m->rows; i++) {
-        for (int j = 0; j < m->cols; j++) {
-            MAT_AT(m, i, j) =
-                ((float)rand() / (float)RAND_MAX) * (high - low) + low;
+// g *= the activation's derivative, from its output y or, for GELU, from its
+// input z. Softmax needs g and y to be whole rows.
+static void _matrix_act_back_scalar(mfloat* g, const mfloat* y,
+                                    const mfloat* z, int n, MATRIX_ACT act) {
+    switch (act) {
+    case MATRIX_ACT_NONE:
+        break;
+    case MATRIX_ACT_SIGMOID:
+        for (int j = 0; j < n; j++) {
+            g[j] *= y[j] * (1 - y[j]);
         }
+        break;
+    case MATRIX_ACT_TANH:
+        for (int j = 0; j < n; j++) {
+            g[j] *= 1 - y[j] * y[j];
+        }
+        break;
+    case MATRIX_ACT_RELU:
+        for (int j = 0; j < n; j++) {
+            g[j] = y[j] > 0 ? g[j] : 0;
+        }
+        break;
+    case MATRIX_ACT_GELU:
+        for (int j = 0; j < n; j++) {
+            g[j] *= _matrix_gelu_grad(z[j]);
+        }
+        break;
+    case MATRIX_ACT_LEAKY_RELU:
+        for (int j = 0; j < n; j++) {
+            g[j] *= y[j] > 0 ? 1 : (mfloat)MATRIX_LEAKY_SLOPE;
+        }
+        break;
+    case MATRIX_ACT_SOFTMAX: {
+        // dL/dx_j = y_j * (g_j - sum_i g_i y_i)
+        mfloat dot = 0;
+        for (int j = 0; j < n; j++) {
+            dot += g[j] * y[j];
+        }
+        for (int j = 0; j < n; j++) {
+            g[j] = y[j] * (g[j] - dot);
+        }
+        break;
+    }
     }
 }
 
-void matrixAdd(Matrix* dest, const Matrix* a, const Matrix* b) {
-    assert(a->rows == b->rows && dest->rows == a->rows);
-    assert(a->cols == b->cols && dest->cols == a->cols);
-    for (int i = 0; i < a->rows; i++) {
-        for (int j = 0; j < a->cols; j++) {
-            MAT_AT(dest, i, j) = MAT_AT(a, i, j) + MAT_AT(b, i, j);
+// Goes through the kernel table, which is further down
+static void _matrix_act_row(mfloat* x, int n, MATRIX_ACT act);
+
+// What a GEMM does to a finished tile of dest, offset to the tile's corner
+typedef struct {
+    const mfloat* bias; // Indexed by column, or NULL
+    mfloat* preact;     // Gets the value before the activation, or NULL
+    int ldp;            // Row stride of preact
+    MATRIX_ACT act;
+} _MatrixEpilogue;
+
+// Finishes row i of a tile whose gemm result is already in `row`
+static void _matrix_epilogue_row(const _MatrixEpilogue* ep, mfloat* row, int i,
+                                 int n) {
+    if (ep->bias) {
+        for (int j = 0; j < n; j++) {
+            row[j] += ep->bias[j];
         }
     }
+    if (ep->preact) {
+        memcpy(ep->preact + (long long)i * ep->ldp, row, sizeof(mfloat) * n);
+    }
+    _matrix_act_row(row, n, ep->act);
+}
+
+//====================== Kernels ======================
+// Every element-wise op and the GEMM microkernel go through this table. It
+// starts out on the portable scalar kernels and gets upgraded once at startup
+// to the widest instruction set the CPU has.
+
+// An optimizer step boiled down to what every element needs
+typedef struct {
+    MATRIX_OPTIMIZER kind;
+    mfloat rate;
+    mfloat beta1;
+    mfloat beta2;
+    mfloat eps;
+    mfloat decay;  // What of p gets added to the gradient, 0 for AdamW
+    mfloat shrink; // p gets multiplied by it before the step, 1 but for AdamW
+    mfloat mScale; // rate over Adam's bias correction of m
+    mfloat vScale; // 1 over Adam's bias correction of v
+} _MatrixOptStep;
+
+typedef struct {
+    MATRIX_ISA isa;
+    int mr; // GEMM microkernel tile rows
+    int nr; // GEMM microkernel tile cols
+    void (*add)(mfloat* d, const mfloat* a, const mfloat* b, long long n);
+    void (*sub)(mfloat* d, const mfloat* a, const mfloat* b, long long n);
+    void (*scale)(mfloat* d, const mfloat* a, mfloat val, long long n);
+    void (*fill)(mfloat* d, mfloat val, long long n);
+    void (*act)(mfloat* x, int n, MATRIX_ACT act);
+    void (*actBack)(mfloat* g, const mfloat* y, const mfloat* z, int n,
+                    MATRIX_ACT act);
+    void (*gemmMicro)(int kc, const mfloat* ap, const mfloat* bp, mfloat* c,
+                      int ldc, int mr, int nr, mfloat alpha, mfloat beta,
+                      const _MatrixEpilogue* ep);
+    void (*gemmRow)(int n, int k, const mfloat* a, long long aStep,
+                    const mfloat* b, int ldb, mfloat* c, mfloat alpha,
+                    mfloat beta);
+    void (*optStep)(const _MatrixOptStep* s, mfloat* p, mfloat* g, mfloat* m,
+                    mfloat* v, long long n);
+    // The sparse ones take up to _MATRIX_SPARSE_ROWS rows of a at a time
+    void (*sparseRow)(const MatrixSparse* s, const mfloat* a, int lda,
+                      mfloat* c, int ldc, int rows);
+    void (*sparseRowT)(const MatrixSparse* s, const mfloat* a, int lda,
+                       mfloat* c, int ldc, int rows);
+    void (*sparseGrad)(const MatrixSparse* s, int k0, int k1, const mfloat* a,
+                       int lda, const mfloat* g, int ldg, int rows, mfloat* w,
+                       int ldw);
+    void (*quantize)(signed char* d, const mfloat* a, mfloat inv, long long n);
+    void (*gemmI8)(int kp, const signed char* a, int lda, int mr,
+                   const signed char* bp, const int* colSums, int* c);
+    void (*philox)(const MatrixRng* rng, unsigned long long group,
+                   unsigned long long* out);
+} _MatrixKernels;
+
+static void _matrix_add_scalar(mfloat* d, const mfloat* a, const mfloat* b,
+                               long long n) {
+    for (long long i = 0; i < n; i++) {
+        d[i] = a[i] + b[i];
+    }
+}
+
+static void _matrix_sub_scalar(mfloat* d, const mfloat* a, const mfloat* b,
+                               long long n) {
+    for (long long i = 0; i < n; i++) {
+        d[i] = a[i] - b[i];
+    }
+}
+
+static void _matrix_scale_scalar(mfloat* d, const mfloat* a, mfloat val,
+                                 long long n) {
+    for (long long i = 0; i < n; i++) {
+        d[i] = a[i] * val;
+    }
+}
+
+static void _matrix_fill_scalar(mfloat* d, mfloat val, long long n) {
+    for (long long i = 0; i < n; i++) {
+        d[i] = val;
+    }
+}
+
+enum { _MATRIX_MR_scalar = 4, _MATRIX_NR_scalar = 4 };
+
+// c[0..mr, 0..nr] = alpha * (ap * bp) + beta * c, then the epilogue if any.
+// Always computes the full tile, only the valid part gets stored.
+static void _matrix_gemm_micro_scalar(int kc, const mfloat* restrict ap,
+                                      const mfloat* restrict bp, mfloat* c,
+                                      int ldc, int mr, int nr, mfloat alpha,
+                                      mfloat beta, const _MatrixEpilogue* ep) {
+    mfloat acc[_MATRIX_MR_scalar][_MATRIX_NR_scalar] = {{0}};
+    for (int k = 0; k < kc; k++) {
+        for (int i = 0; i < _MATRIX_MR_scalar; i++) {
+            mfloat av = ap[i];
+            for (int j = 0; j < _MATRIX_NR_scalar; j++) {
+                acc[i][j] += av * bp[j];
+            }
+        }
+        ap += _MATRIX_MR_scalar;
+        bp += _MATRIX_NR_scalar;
+    }
+    for (int i = 0; i < mr; i++) {
+        mfloat* crow = c + (long long)i * ldc;
+        for (int j = 0; j < nr; j++) {
+            // beta of 0 must not read c, it might be uninitialized
+            crow[j] = alpha * acc[i][j] + (beta == 0 ? 0 : beta * crow[j]);
+        }
+        if (ep) {
+            _matrix_epilogue_row(ep, crow, i, nr);
+        }
+    }
+}
+
+// c = alpha * a * b + beta * c for one row of a small GEMM, b row major and
+// the row of a read every aStep
+static void _matrix_gemm_row_scalar(int n, int k, const mfloat* a,
+                                    long long aStep, const mfloat* b, int ldb,
+                                    mfloat* c, mfloat alpha, mfloat beta) {
+    for (int j = 0; j < n; j++) {
+        c[j] = (beta == 0) ? 0 : beta * c[j];
+    }
+    for (int p = 0; p < k; p++) {
+        mfloat av = alpha * a[p * aStep];
+        const mfloat* brow = b + (long long)p * ldb;
+        for (int j = 0; j < n; j++) {
+            c[j] += av * brow[j];
+        }
+    }
+}
+
+// The SIMD kernels finish their ragged ends with this too
+static void _matrix_opt_step_scalar(const _MatrixOptStep* s, mfloat* p,
+                                    mfloat* g, mfloat* m, mfloat* v,
+                                    long long n) {
+    for (long long i = 0; i < n; i++) {
+        mfloat gi = g[i] + s->decay * p[i];
+        g[i] = 0;
+        switch (s->kind) {
+        case MATRIX_OPTIMIZER_SGD:
+            p[i] -= s->rate * gi;
+            break;
+        case MATRIX_OPTIMIZER_MOMENTUM:
+            m[i] = s->beta1 * m[i] + gi;
+            p[i] -= s->rate * m[i];
+            break;
+        default:
+            m[i] = s->beta1 * m[i] + (1 - s->beta1) * gi;
+            v[i] = s->beta2 * v[i] + (1 - s->beta2) * gi * gi;
+            p[i] = p[i] * s->shrink -
+                   s->mScale * m[i] / ((mfloat)sqrt(v[i] * s->vScale) + s->eps);
+            break;
+        }
+    }
+}
+
+// How much of the block at `col` is inside the matrix, the last one of a row
+// can stick out
+static inline int _matrix_sparse_width(const MatrixSparse* s, int col) {
+    int left = s->cols - col;
+    return left < s->blockCols ? left : s->blockCols;
+}
+
+// Rows of the dense operand the sparse kernels go through together. Every
+// block gets loaded once for all of them instead of once per row, which is
+// what keeps a batch from streaming the whole sparse matrix per sample.
+#define _MATRIX_SPARSE_ROWS 4
+
+// c += a * s for `rows` rows of the left hand side
+static void _matrix_sparse_row_scalar(const MatrixSparse* s, const mfloat* a,
+                                      int lda, mfloat* c, int ldc, int rows) {
+    int bw = s->blockCols;
+    for (int r = 0; r < rows; r++) {
+        const mfloat* ar = a + (long long)r * lda;
+        mfloat* cr = c + (long long)r * ldc;
+        for (int k = 0; k < s->rows; k++) {
+            mfloat av = ar[k];
+            if (av == 0) {
+                continue;
+            }
+            for (int b = s->rowStart[k]; b < s->rowStart[k + 1]; b++) {
+                const mfloat* vals = s->vals + (long long)b * bw;
+                int col = s->blockCol[b];
+                int n = _matrix_sparse_width(s, col);
+                for (int j = 0; j < n; j++) {
+                    cr[col + j] += av * vals[j];
+                }
+            }
+        }
+    }
+}
+
+// c = a * s^T for `rows` rows of a, c[k] is a dot with row k of s
+static void _matrix_sparse_row_t_scalar(const MatrixSparse* s,
+                                        const mfloat* a, int lda, mfloat* c,
+                                        int ldc, int rows) {
+    int bw = s->blockCols;
+    for (int r = 0; r < rows; r++) {
+        const mfloat* ar = a + (long long)r * lda;
+        for (int k = 0; k < s->rows; k++) {
+            mfloat acc = 0;
+            for (int b = s->rowStart[k]; b < s->rowStart[k + 1]; b++) {
+                const mfloat* vals = s->vals + (long long)b * bw;
+                int col = s->blockCol[b];
+                int n = _matrix_sparse_width(s, col);
+                for (int j = 0; j < n; j++) {
+                    acc += ar[col + j] * vals[j];
+                }
+            }
+            c[(long long)r * ldc + k] = acc;
+        }
+    }
+}
+
+// w[k] += a[k] * g at the blocks of rows [k0, k1) of s, summed over `rows`
+// samples' inputs a and output gradients g
+static void _matrix_sparse_grad_scalar(const MatrixSparse* s, int k0, int k1,
+                                       const mfloat* a, int lda,
+                                       const mfloat* g, int ldg, int rows,
+                                       mfloat* w, int ldw) {
+    for (int r = 0; r < rows; r++) {
+        const mfloat* ar = a + (long long)r * lda;
+        const mfloat* gr = g + (long long)r * ldg;
+        for (int k = k0; k < k1; k++) {
+            mfloat av = ar[k];
+            if (av == 0) {
+                continue;
+            }
+            mfloat* wrow = w + (long long)k * ldw;
+            for (int b = s->rowStart[k]; b < s->rowStart[k + 1]; b++) {
+                int col = s->blockCol[b];
+                int n = _matrix_sparse_width(s, col);
+                for (int j = 0; j < n; j++) {
+                    wrow[col + j] += av * gr[col + j];
+                }
+            }
+        }
+    }
+}
+
+// Rounds x * inv to the nearest int8, clamped symmetric to [-127, 127].
+// Branch free, the signs of activations are as good as random
+static signed char _matrix_quantize(mfloat x, mfloat inv) {
+    mfloat q = x * inv;
+    q = q < -127 ? -127 : q;
+    q = q > 127 ? 127 : q;
+    return (signed char)((q + _MATRIX_ROUND_MAGIC) - _MATRIX_ROUND_MAGIC);
+}
+
+static void _matrix_quantize_scalar(signed char* d, const mfloat* a,
+                                    mfloat inv, long long n) {
+    for (long long i = 0; i < n; i++) {
+        d[i] = _matrix_quantize(a[i], inv);
+    }
+}
+
+// Philox4x32-10 works on 128 bit blocks, the counter being the block index
+// and the stream, the key being the seed. The generators hand them out in
+// groups of _MATRIX_RNG_BLOCKS so the SIMD kernels have independent blocks to
+// work on side by side: draw k of a group is the low half of block k, draw
+// k + _MATRIX_RNG_BLOCKS its high half.
+#define _MATRIX_RNG_BLOCKS 32
+#define _MATRIX_RNG_DRAWS (2 * _MATRIX_RNG_BLOCKS)
+#define _MATRIX_PHILOX_M0 0xD2511F53u
+#define _MATRIX_PHILOX_M1 0xCD9E8D57u
+#define _MATRIX_PHILOX_W0 0x9E3779B9u
+#define _MATRIX_PHILOX_W1 0xBB67AE85u
+
+static inline void _matrix_philox_block(const MatrixRng* rng,
+                                        unsigned long long blk,
+                                        unsigned long long* lo,
+                                        unsigned long long* hi) {
+    unsigned int c0 = (unsigned int)blk;
+    unsigned int c1 = (unsigned int)(blk >> 32);
+    unsigned int c2 = (unsigned int)rng->stream;
+    unsigned int c3 = (unsigned int)(rng->stream >> 32);
+    unsigned int k0 = (unsigned int)rng->seed;
+    unsigned int k1 = (unsigned int)(rng->seed >> 32);
+    for (int r = 0; r < 10; r++) {
+        unsigned long long p0 = (unsigned long long)_MATRIX_PHILOX_M0 * c0;
+        unsigned long long p1 = (unsigned long long)_MATRIX_PHILOX_M1 * c2;
+        c0 = (unsigned int)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (unsigned int)p1;
+        c2 = (unsigned int)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (unsigned int)p0;
+        k0 += _MATRIX_PHILOX_W0;
+        k1 += _MATRIX_PHILOX_W1;
+    }
+    *lo = (unsigned long long)c1 << 32 | c0;
+    *hi = (unsigned long long)c3 << 32 | c2;
+}
+
+// The _MATRIX_RNG_DRAWS draws of group `group` of rng's sequence. Blocks go
+// through the rounds 8 at a time, one alone would wait on every multiply.
+static void _matrix_philox_scalar(const MatrixRng* rng,
+                                  unsigned long long group,
+                                  unsigned long long* out) {
+    for (int b = 0; b < _MATRIX_RNG_BLOCKS; b += 8) {
+        unsigned int c0[8], c1[8], c2[8], c3[8];
+        for (int l = 0; l < 8; l++) {
+            unsigned long long blk = group * _MATRIX_RNG_BLOCKS + b + l;
+            c0[l] = (unsigned int)blk;
+            c1[l] = (unsigned int)(blk >> 32);
+            c2[l] = (unsigned int)rng->stream;
+            c3[l] = (unsigned int)(rng->stream >> 32);
+        }
+        unsigned int k0 = (unsigned int)rng->seed;
+        unsigned int k1 = (unsigned int)(rng->seed >> 32);
+        for (int r = 0; r < 10; r++) {
+            for (int l = 0; l < 8; l++) {
+                unsigned long long p0 =
+                    (unsigned long long)_MATRIX_PHILOX_M0 * c0[l];
+                unsigned long long p1 =
+                    (unsigned long long)_MATRIX_PHILOX_M1 * c2[l];
+                c0[l] = (unsigned int)(p1 >> 32) ^ c1[l] ^ k0;
+                c1[l] = (unsigned int)p1;
+                c2[l] = (unsigned int)(p0 >> 32) ^ c3[l] ^ k1;
+                c3[l] = (unsigned int)p0;
+            }
+            k0 += _MATRIX_PHILOX_W0;
+            k1 += _MATRIX_PHILOX_W1;
+        }
+        for (int l = 0; l < 8; l++) {
+            out[b + l] = (unsigned long long)c1[l] << 32 | c0[l];
+            out[b + l + _MATRIX_RNG_BLOCKS] =
+                (unsigned long long)c3[l] << 32 | c2[l];
+        }
+    }
+}
+
+// The int8 GEMM works on a whole panel of B at a time, in tiles of up to
+// _MATRIX_I8_MR rows of A. k gets padded to a multiple of 4 with zeros.
+#define _MATRIX_I8_MR 8
+#define _MATRIX_I8_NR 16
+
+// c[0..mr, 0..16] = a * bp summed in int32. `a` holds mr rows of kp int8s,
+// lda apart, `bp` one packed panel of B. colSums are the panel's column sums,
+// for kernels that have to offset `a` to make it unsigned.
+static void _matrix_gemm_i8_scalar(int kp, const signed char* a, int lda,
+                                   int mr, const signed char* bp,
+                                   const int* colSums, int* c) {
+    (void)colSums;
+    for (int i = 0; i < mr; i++) {
+        int* crow = c + i * _MATRIX_I8_NR;
+        for (int j = 0; j < _MATRIX_I8_NR; j++) {
+            crow[j] = 0;
+        }
+        const signed char* arow = a + (long long)i * lda;
+        for (int k = 0; k < kp; k += 4) {
+            const signed char* b = bp + (long long)k * _MATRIX_I8_NR;
+            for (int j = 0; j < _MATRIX_I8_NR; j++) {
+                crow[j] += arow[k] * b[4 * j] + arow[k + 1] * b[4 * j + 1] +
+                           arow[k + 2] * b[4 * j + 2] +
+                           arow[k + 3] * b[4 * j + 3];
+            }
+        }
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define _MATRIX_HAS_X86_KERNELS
+#include <immintrin.h>
+
+#define MK_ISA sse2
+#define MK_TARGET "sse2"
+#define MK_BYTES 16
+#define MK_MR 4
+#define MK_NRV 2
+#include "matrixkernels.h"
+
+#define MK_ISA avx2
+#define MK_TARGET "avx2,fma"
+#define MK_BYTES 32
+#define MK_MR 6
+#define MK_NRV 2
+#include "matrixkernels.h"
+
+#define MK_ISA avx512
+#define MK_TARGET "avx512f"
+#define MK_BYTES 64
+#define MK_MR 8
+#define MK_NRV 2
+#include "matrixkernels.h"
+
+// _matrix_quantize a vector at a time. The conversions round to nearest even
+// like _MATRIX_ROUND_MAGIC does, then the int32s get narrowed with
+// saturation, which can't kick in after the clamp.
+__attribute__((target("avx2"))) static void
+_matrix_quantize_avx2(signed char* d, const mfloat* a, mfloat inv,
+                      long long n) {
+    long long i = 0;
+#ifdef MATRIX_FLOAT
+    __m256 s = _mm256_set1_ps(inv);
+    __m256 lo = _mm256_set1_ps(-127);
+    __m256 hi = _mm256_set1_ps(127);
+    for (; i + 8 <= n; i += 8) {
+        __m256 q = _mm256_mul_ps(_mm256_loadu_ps(a + i), s);
+        __m256i x = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(q, lo), hi));
+        __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(x),
+                                    _mm256_extracti128_si256(x, 1));
+        _mm_storel_epi64((__m128i*)(d + i), _mm_packs_epi16(w, w));
+    }
+#else
+    __m256d s = _mm256_set1_pd(inv);
+    __m256d lo = _mm256_set1_pd(-127);
+    __m256d hi = _mm256_set1_pd(127);
+    for (; i + 4 <= n; i += 4) {
+        __m256d q = _mm256_mul_pd(_mm256_loadu_pd(a + i), s);
+        __m128i x = _mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(q, lo), hi));
+        x = _mm_packs_epi32(x, x);
+        int b = _mm_cvtsi128_si32(_mm_packs_epi16(x, x));
+        memcpy(d + i, &b, 4);
+    }
+#endif
+    for (; i < n; i++) {
+        d[i] = _matrix_quantize(a[i], inv);
+    }
+}
+
+__attribute__((target("avx512f"))) static void
+_matrix_quantize_avx512(signed char* d, const mfloat* a, mfloat inv,
+                        long long n) {
+    long long i = 0;
+#ifdef MATRIX_FLOAT
+    __m512 s = _mm512_set1_ps(inv);
+    __m512 lo = _mm512_set1_ps(-127);
+    __m512 hi = _mm512_set1_ps(127);
+    for (; i + 16 <= n; i += 16) {
+        __m512 q = _mm512_mul_ps(_mm512_loadu_ps(a + i), s);
+        __m512i x = _mm512_cvtps_epi32(_mm512_min_ps(_mm512_max_ps(q, lo), hi));
+        _mm_storeu_si128((__m128i*)(d + i), _mm512_cvtsepi32_epi8(x));
+    }
+#else
+    __m512d s = _mm512_set1_pd(inv);
+    __m512d lo = _mm512_set1_pd(-127);
+    __m512d hi = _mm512_set1_pd(127);
+    for (; i + 8 <= n; i += 8) {
+        __m512d q = _mm512_mul_pd(_mm512_loadu_pd(a + i), s);
+        __m256i x = _mm512_cvtpd_epi32(_mm512_min_pd(_mm512_max_pd(q, lo), hi));
+        // Widened back so AVX-512F alone can narrow it to bytes
+        _mm_storel_epi64((__m128i*)(d + i),
+                         _mm512_cvtsepi64_epi8(_mm512_cvtepi32_epi64(x)));
+    }
+#endif
+    for (; i < n; i++) {
+        d[i] = _matrix_quantize(a[i], inv);
+    }
+}
+
+// Without VNNI there is no int8 dot product that can't saturate (pmaddubsw
+// clips its pairs to int16), so the int8s get widened to int16 and multiplied
+// with pmaddwd. Every register ends up holding two partial sums per column of
+// 4 columns. Two rows of `a` at a time to stay within 16 registers.
+__attribute__((target("avx2"))) static void
+_matrix_gemm_i8_avx2(int kp, const signed char* a, int lda, int mr,
+                     const signed char* bp, const int* colSums, int* c) {
+    (void)colSums;
+    for (int i = 0; i < mr; i += 2) {
+        const signed char* a0 = a + (long long)i * lda;
+        // A lone last row gets computed twice rather than read out of bounds
+        const signed char* a1 = i + 1 < mr ? a0 + lda : a0;
+        __m256i acc[2][4];
+        for (int q = 0; q < 4; q++) {
+            acc[0][q] = _mm256_setzero_si256();
+            acc[1][q] = _mm256_setzero_si256();
+        }
+        for (int k = 0; k < kp; k += 4) {
+            const signed char* b = bp + (long long)k * _MATRIX_I8_NR;
+            int w0, w1;
+            memcpy(&w0, a0 + k, 4);
+            memcpy(&w1, a1 + k, 4);
+            __m256i x0 = _mm256_broadcastq_epi64(
+                _mm_cvtepi8_epi16(_mm_cvtsi32_si128(w0)));
+            __m256i x1 = _mm256_broadcastq_epi64(
+                _mm_cvtepi8_epi16(_mm_cvtsi32_si128(w1)));
+            for (int q = 0; q < 4; q++) {
+                __m256i y = _mm256_cvtepi8_epi16(
+                    _mm_loadu_si128((const __m128i*)(b + 16 * q)));
+                acc[0][q] =
+                    _mm256_add_epi32(acc[0][q], _mm256_madd_epi16(x0, y));
+                acc[1][q] =
+                    _mm256_add_epi32(acc[1][q], _mm256_madd_epi16(x1, y));
+            }
+        }
+        for (int r = 0; r < 2 && i + r < mr; r++) {
+            int* crow = c + (i + r) * _MATRIX_I8_NR;
+            for (int q = 0; q < 4; q++) {
+                int part[8];
+                _mm256_storeu_si256((__m256i*)part, acc[r][q]);
+                for (int j = 0; j < 4; j++) {
+                    crow[4 * q + j] = part[2 * j] + part[2 * j + 1];
+                }
+            }
+        }
+    }
+}
+
+// vpdpbusd multiplies unsigned by signed bytes, so `a` gets 128 added on the
+// way in (flipping the sign bit) and 128 * colSums taken off at the end.
+__attribute__((target("avx512f,avx512vnni"))) static void
+_matrix_gemm_i8_vnni(int kp, const signed char* a, int lda, int mr,
+                     const signed char* bp, const int* colSums, int* c) {
+    __m512i acc[_MATRIX_I8_MR];
+    const signed char* rows[_MATRIX_I8_MR];
+    for (int i = 0; i < _MATRIX_I8_MR; i++) {
+        acc[i] = _mm512_setzero_si512();
+        // Rows past mr repeat the last one rather than read out of bounds
+        rows[i] = a + (long long)(i < mr ? i : mr - 1) * lda;
+    }
+    for (int k = 0; k < kp; k += 4) {
+        __m512i b = _mm512_loadu_si512(bp + (long long)k * _MATRIX_I8_NR);
+        for (int i = 0; i < _MATRIX_I8_MR; i++) {
+            int w;
+            memcpy(&w, rows[i] + k, 4);
+            acc[i] = _mm512_dpbusd_epi32(
+                acc[i], _mm512_set1_epi32(w ^ (int)0x80808080), b);
+        }
+    }
+    __m512i comp = _mm512_slli_epi32(_mm512_loadu_si512(colSums), 7);
+    for (int i = 0; i < mr; i++) {
+        _mm512_storeu_si512(c + i * _MATRIX_I8_NR,
+                            _mm512_sub_epi32(acc[i], comp));
+    }
+}
+
+// Every 32 bit Philox word sits in a 64 bit lane, that's what the widening
+// multiply wants. The high halves collect junk along the way, nothing reads
+// them but the final pack. Each round waits on a multiply, so 4 vectors of
+// blocks go through it at once.
+__attribute__((target("avx2"))) static void
+_matrix_philox_avx2(const MatrixRng* rng, unsigned long long group,
+                    unsigned long long* out) {
+    const __m256i m0 = _mm256_set1_epi64x(_MATRIX_PHILOX_M0);
+    const __m256i m1 = _mm256_set1_epi64x(_MATRIX_PHILOX_M1);
+    const __m256i low = _mm256_set1_epi64x(0xFFFFFFFFll);
+    const __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+    for (int b = 0; b < _MATRIX_RNG_BLOCKS; b += 16) {
+        __m256i c0[4], c1[4], c2[4], c3[4];
+#pragma GCC unroll 4
+        for (int v = 0; v < 4; v++) {
+            __m256i blk = _mm256_add_epi64(
+                _mm256_set1_epi64x(
+                    (long long)(group * _MATRIX_RNG_BLOCKS + b + 4 * v)),
+                lanes);
+            c0[v] = blk;
+            c1[v] = _mm256_srli_epi64(blk, 32);
+            c2[v] = _mm256_set1_epi64x((long long)(rng->stream & 0xFFFFFFFF));
+            c3[v] = _mm256_set1_epi64x((long long)(rng->stream >> 32));
+        }
+        unsigned int k0 = (unsigned int)rng->seed;
+        unsigned int k1 = (unsigned int)(rng->seed >> 32);
+        for (int r = 0; r < 10; r++) {
+            __m256i kv0 = _mm256_set1_epi64x(k0);
+            __m256i kv1 = _mm256_set1_epi64x(k1);
+#pragma GCC unroll 4
+            for (int v = 0; v < 4; v++) {
+                __m256i p0 = _mm256_mul_epu32(c0[v], m0);
+                __m256i p1 = _mm256_mul_epu32(c2[v], m1);
+                c0[v] = _mm256_xor_si256(
+                    _mm256_xor_si256(_mm256_srli_epi64(p1, 32), c1[v]), kv0);
+                c1[v] = p1;
+                c2[v] = _mm256_xor_si256(
+                    _mm256_xor_si256(_mm256_srli_epi64(p0, 32), c3[v]), kv1);
+                c3[v] = p0;
+            }
+            k0 += _MATRIX_PHILOX_W0;
+            k1 += _MATRIX_PHILOX_W1;
+        }
+#pragma GCC unroll 4
+        for (int v = 0; v < 4; v++) {
+            unsigned long long* o = out + b + 4 * v;
+            _mm256_storeu_si256(
+                (__m256i*)o, _mm256_or_si256(_mm256_slli_epi64(c1[v], 32),
+                                             _mm256_and_si256(c0[v], low)));
+            _mm256_storeu_si256(
+                (__m256i*)(o + _MATRIX_RNG_BLOCKS),
+                _mm256_or_si256(_mm256_slli_epi64(c3[v], 32),
+                                _mm256_and_si256(c2[v], low)));
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) static void
+_matrix_philox_avx512(const MatrixRng* rng, unsigned long long group,
+                      unsigned long long* out) {
+    const __m512i m0 = _mm512_set1_epi64(_MATRIX_PHILOX_M0);
+    const __m512i m1 = _mm512_set1_epi64(_MATRIX_PHILOX_M1);
+    const __m512i low = _mm512_set1_epi64(0xFFFFFFFFll);
+    const __m512i lanes = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+    __m512i c0[4], c1[4], c2[4], c3[4];
+#pragma GCC unroll 4
+    for (int v = 0; v < 4; v++) {
+        __m512i blk = _mm512_add_epi64(
+            _mm512_set1_epi64((long long)(group * _MATRIX_RNG_BLOCKS + 8 * v)),
+            lanes);
+        c0[v] = blk;
+        c1[v] = _mm512_srli_epi64(blk, 32);
+        c2[v] = _mm512_set1_epi64((long long)(rng->stream & 0xFFFFFFFF));
+        c3[v] = _mm512_set1_epi64((long long)(rng->stream >> 32));
+    }
+    unsigned int k0 = (unsigned int)rng->seed;
+    unsigned int k1 = (unsigned int)(rng->seed >> 32);
+    for (int r = 0; r < 10; r++) {
+        __m512i kv0 = _mm512_set1_epi64(k0);
+        __m512i kv1 = _mm512_set1_epi64(k1);
+#pragma GCC unroll 4
+        for (int v = 0; v < 4; v++) {
+            __m512i p0 = _mm512_mul_epu32(c0[v], m0);
+            __m512i p1 = _mm512_mul_epu32(c2[v], m1);
+            c0[v] = _mm512_ternarylogic_epi64(_mm512_srli_epi64(p1, 32), c1[v],
+                                              kv0, 0x96);
+            c1[v] = p1;
+            c2[v] = _mm512_ternarylogic_epi64(_mm512_srli_epi64(p0, 32), c3[v],
+                                              kv1, 0x96);
+            c3[v] = p0;
+        }
+        k0 += _MATRIX_PHILOX_W0;
+        k1 += _MATRIX_PHILOX_W1;
+    }
+#pragma GCC unroll 4
+    for (int v = 0; v < 4; v++) {
+        unsigned long long* o = out + 8 * v;
+        _mm512_storeu_si512(o, _mm512_or_si512(_mm512_slli_epi64(c1[v], 32),
+                                               _mm512_and_si512(c0[v], low)));
+        _mm512_storeu_si512(o + _MATRIX_RNG_BLOCKS,
+                            _mm512_or_si512(_mm512_slli_epi64(c3[v], 32),
+                                            _mm512_and_si512(c2[v], low)));
+    }
+}
+#endif
+
+#define _MATRIX_KERNELS(isa, name)                                             \
+    {                                                                          \
+        isa, _MATRIX_MR_##name, _MATRIX_NR_##name, _matrix_add_##name,         \
+            _matrix_sub_##name,                                                \
+            _matrix_scale_##name, _matrix_fill_##name, _matrix_act_##name,     \
+            _matrix_act_back_##name, _matrix_gemm_micro_##name,                \
+            _matrix_gemm_row_##name, _matrix_opt_step_##name,                  \
+            _matrix_sparse_row_##name, _matrix_sparse_row_t_##name,            \
+            _matrix_sparse_grad_##name, _matrix_quantize_scalar,               \
+            _matrix_gemm_i8_scalar, _matrix_philox_scalar                      \
+    }
+
+static _MatrixKernels _matrixKernels =
+    _MATRIX_KERNELS(MATRIX_ISA_SCALAR, scalar);
+
+static MATRIX_ISA _matrix_isa_detect(void) {
+#ifdef _MATRIX_HAS_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return MATRIX_ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return MATRIX_ISA_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return MATRIX_ISA_SSE2;
+    }
+#endif
+    return MATRIX_ISA_SCALAR;
+}
+
+MATRIX_ISA matrixIsaSelect(MATRIX_ISA isa) {
+    MATRIX_ISA best = _matrix_isa_detect();
+    if (isa > best) {
+        isa = best;
+    }
+    switch (isa) {
+#ifdef _MATRIX_HAS_X86_KERNELS
+    case MATRIX_ISA_AVX512:
+        _matrixKernels =
+            (_MatrixKernels)_MATRIX_KERNELS(MATRIX_ISA_AVX512, avx512);
+        break;
+    case MATRIX_ISA_AVX2:
+        _matrixKernels = (_MatrixKernels)_MATRIX_KERNELS(MATRIX_ISA_AVX2, avx2);
+        break;
+    case MATRIX_ISA_SSE2:
+        _matrixKernels = (_MatrixKernels)_MATRIX_KERNELS(MATRIX_ISA_SSE2, sse2);
+        break;
+#endif
+    default:
+        isa = MATRIX_ISA_SCALAR;
+        _matrixKernels =
+            (_MatrixKernels)_MATRIX_KERNELS(MATRIX_ISA_SCALAR, scalar);
+        break;
+    }
+#ifdef _MATRIX_HAS_X86_KERNELS
+    // VNNI is an extension on top of AVX-512 that not every CPU with it has
+    if (isa == MATRIX_ISA_AVX512 && __builtin_cpu_supports("avx512vnni")) {
+        _matrixKernels.gemmI8 = _matrix_gemm_i8_vnni;
+    } else if (isa >= MATRIX_ISA_AVX2) {
+        _matrixKernels.gemmI8 = _matrix_gemm_i8_avx2;
+    }
+    if (isa == MATRIX_ISA_AVX512) {
+        _matrixKernels.quantize = _matrix_quantize_avx512;
+    } else if (isa == MATRIX_ISA_AVX2) {
+        _matrixKernels.quantize = _matrix_quantize_avx2;
+    }
+    if (isa == MATRIX_ISA_AVX512) {
+        _matrixKernels.philox = _matrix_philox_avx512;
+    } else if (isa == MATRIX_ISA_AVX2) {
+        _matrixKernels.philox = _matrix_philox_avx2;
+    }
+#endif
+    return isa;
+}
+
+static void _matrix_act_row(mfloat* x, int n, MATRIX_ACT act) {
+    if (act != MATRIX_ACT_NONE) {
+        _matrixKernels.act(x, n, act);
+    }
+}
+
+MATRIX_ISA matrixIsaGet(void) {
+    return _matrixKernels.isa;
+}
+
+const char* matrixIsaName(MATRIX_ISA isa) {
+    switch (isa) {
+    case MATRIX_ISA_SCALAR:
+        return "scalar";
+    case MATRIX_ISA_SSE2:
+        return "sse2";
+    case MATRIX_ISA_AVX2:
+        return "avx2";
+    case MATRIX_ISA_AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void _matrix_kernels_init(void) {
+    MATRIX_ISA isa = MATRIX_ISA_AVX512;
+    const char* env = getenv("MATRIX_ISA");
+    if (env) {
+        for (int i = MATRIX_ISA_SCALAR; i <= MATRIX_ISA_AVX512; i++) {
+            if (strcmp(env, matrixIsaName((MATRIX_ISA)i)) == 0) {
+                isa = (MATRIX_ISA)i;
+            }
+        }
+    }
+    matrixIsaSelect(isa);
+}
+
+// Element count of a matrix
+#define _MATRIX_LEN(m) ((long long)(m)->rows * (m)->cols)
+// True when the rows * cols elements are one flat run in row-major order
+#define _MATRIX_FLAT(m)                                                        \
+    (!(m)->transposed && ((m)->stride == (m)->cols || (m)->rows <= 1))
+#define _MATRIX_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define _MATRIX_ROUND_UP(x, to) ((((x) + (to)-1) / (to)) * (to))
+// Rounds a pointer up to the next cache line
+#define _MATRIX_ALIGN64(p) ((mfloat*)(((unsigned long long)(p) + 63) & ~63ULL))
+
+//====================== Threading ======================
+// Anything smaller than these runs on the calling thread, below that waking
+// the pool costs more than it saves.
+
+// Elements, for the memory bound element-wise ops
+#ifndef MATRIX_PARALLEL_MIN
+#define MATRIX_PARALLEL_MIN (1 << 16)
+#endif
+// Elements each thread gets at least
+#ifndef MATRIX_PARALLEL_GRAIN
+#define MATRIX_PARALLEL_GRAIN (1 << 13)
+#endif
+// Multiply-adds, for GEMM
+#ifndef MATRIX_GEMM_PARALLEL_MIN
+#define MATRIX_GEMM_PARALLEL_MIN (1 << 21)
+#endif
+
+typedef enum {
+    _MATRIX_EW_ADD,
+    _MATRIX_EW_SUB,
+    _MATRIX_EW_SCALE,
+    _MATRIX_EW_FILL,
+    _MATRIX_EW_COPY,
+} _MATRIX_EW_OP;
+
+typedef struct {
+    _MATRIX_EW_OP op;
+    mfloat* d;
+    const mfloat* a;
+    const mfloat* b;
+    mfloat val;
+} _MatrixEwTask;
+
+static void _matrix_ew_range(void* ctx, long long begin, long long end) {
+    _MatrixEwTask* t = ctx;
+    long long n = end - begin;
+    switch (t->op) {
+    case _MATRIX_EW_ADD:
+        _matrixKernels.add(t->d + begin, t->a + begin, t->b + begin, n);
+        break;
+    case _MATRIX_EW_SUB:
+        _matrixKernels.sub(t->d + begin, t->a + begin, t->b + begin, n);
+        break;
+    case _MATRIX_EW_SCALE:
+        _matrixKernels.scale(t->d + begin, t->a + begin, t->val, n);
+        break;
+    case _MATRIX_EW_FILL:
+        _matrixKernels.fill(t->d + begin, t->val, n);
+        break;
+    case _MATRIX_EW_COPY:
+        // libc already ships a tuned copy for every instruction set
+        memmove(t->d + begin, t->a + begin, sizeof(mfloat) * n);
+        break;
+    }
+}
+
+// Runs an element-wise op over n elements, on the pool if it's worth it
+static void _matrix_ew(_MATRIX_EW_OP op, mfloat* d, const mfloat* a,
+                       const mfloat* b, mfloat val, long long n) {
+    _MatrixEwTask t = {op, d, a, b, val};
+    if (n < MATRIX_PARALLEL_MIN) {
+        _matrix_ew_range(&t, 0, n);
+        return;
+    }
+    tpoolParallelFor(n, MATRIX_PARALLEL_GRAIN, _matrix_ew_range, &t);
+}
+
+typedef struct {
+    _MATRIX_EW_OP op;
+    Matrix* d;
+    const Matrix* a;
+    const Matrix* b;
+    mfloat val;
+} _MatrixEwRowsTask;
+
+// Row by row for strided views, each row is still a flat run
+static void _matrix_ew_rows(void* ctx, long long begin, long long end) {
+    _MatrixEwRowsTask* t = ctx;
+    for (long long i = begin; i < end; i++) {
+        _MatrixEwTask row = {t->op, &MAT_AT(t->d, i, 0),
+                             t->a ? &MAT_AT(t->a, i, 0) : NULL,
+                             t->b ? &MAT_AT(t->b, i, 0) : NULL, t->val};
+        _matrix_ew_range(&row, 0, t->d->cols);
+    }
+}
+
+// Runs an element-wise op over whole matrices of any kind of view. `a` and
+// `b` are NULL when the op doesn't read them.
+static void _matrix_ew_mat(_MATRIX_EW_OP op, Matrix* d, const Matrix* a,
+                           const Matrix* b, mfloat val) {
+    if (_MATRIX_FLAT(d) && (!a || _MATRIX_FLAT(a)) && (!b || _MATRIX_FLAT(b))) {
+        _matrix_ew(op, d->data, a ? a->data : NULL, b ? b->data : NULL, val,
+                   _MATRIX_LEN(d));
+        return;
+    }
+    if (!d->transposed && (!a || !a->transposed) && (!b || !b->transposed)) {
+        _MatrixEwRowsTask t = {op, d, a, b, val};
+        if (_MATRIX_LEN(d) < MATRIX_PARALLEL_MIN) {
+            _matrix_ew_rows(&t, 0, d->rows);
+            return;
+        }
+        long long grain = MATRIX_PARALLEL_GRAIN / (d->cols ? d->cols : 1);
+        tpoolParallelFor(d->rows, grain, _matrix_ew_rows, &t);
+        return;
+    }
+    // Transposed views don't have flat rows, go element by element
+    for (int i = 0; i < d->rows; i++) {
+        for (int j = 0; j < d->cols; j++) {
+            mfloat x = a ? MAT_AT(a, i, j) : 0;
+            switch (op) {
+            case _MATRIX_EW_ADD:
+                x += MAT_AT(b, i, j);
+                break;
+            case _MATRIX_EW_SUB:
+                x -= MAT_AT(b, i, j);
+                break;
+            case _MATRIX_EW_SCALE:
+                x *= val;
+                break;
+            case _MATRIX_EW_FILL:
+                x = val;
+                break;
+            case _MATRIX_EW_COPY:
+                break;
+            }
+            MAT_AT(d, i, j) = x;
+        }
+    }
+}
+
+Matrix* matrixCreate(int rows, int cols) {
+    // Header and data share one allocation, data starts on a cache line
+    Matrix* m =
+        MATRIX_MALLOC(sizeof(Matrix) + 64 + sizeof(mfloat) * rows * cols);
+    *m = matView(_MATRIX_ALIGN64(m + 1), rows, cols);
+    return m;
+}
+
+void matrixFill(Matrix* m, mfloat val) {
+    _matrix_ew_mat(_MATRIX_EW_FILL, m, NULL, NULL, val);
+}
+
+void matrixIdentity(Matrix* m) {
+    assert(m->cols != m->rows);
+    for (int i = 0; i < m->rows; i++) {
+        for (int j = 0; j < m->cols; j++) {
+            MAT_AT(m, i, j) = (i == j) ? 1 : 0;
+        }
+    }
+}
+
+char matrixIsIdentity(Matrix* m) {
+    if (m->cols != m->rows) {
+        return 0;
+    }
+    for (int i = 0; i < m->rows; i++) {
+        for (int j = 0; j < m->cols; j++) {
+            if (i == j) {
+                if (MAT_AT(m, i, j) != 1) {
+                    return 0;
+                }
+            } else {
+                if (MAT_AT(m, i, j) != 0) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+void matrixFree(Matrix* m) {
+    MATRIX_FREE(m);
+}
+
+void matrixPrint(Matrix* m, const char* name, int p) {
+    printf("%*s%s = [\n", (int)p, "", name);
+    for (int i = 0; i < m->rows; i++) {
+        printf("%*s    ", (int)p, "");
+        for (int j = 0; j < m->cols; j++) {
+            printf("%f ", MAT_AT(m, i, j));
+        }
+        printf("\n");
+    }
+    printf("%*s]\n", (int)p, "");
+}
+
+void matrixAdd(Matrix* dest, const Matrix* a, const Matrix* b) {
+    assert(a->rows == b->rows && dest->rows == a->rows);
+    assert(a->cols == b->cols && dest->cols == a->cols);
+    _matrix_ew_mat(_MATRIX_EW_ADD, dest, a, b, 0);
 }
 
 void matrixSub(Matrix* dest, const Matrix* a, const Matrix* b) {
     assert(a->rows == b->rows && dest->rows == a->rows);
     assert(a->cols == b->cols && dest->cols == a->cols);
-    for (int i = 0; i < a->rows; i++) {
-        for (int j = 0; j < a->cols; j++) {
-            MAT_AT(dest, i, j) = MAT_AT(a, i, j) + (-1 * MAT_AT(b, i, j));
+    _matrix_ew_mat(_MATRIX_EW_SUB, dest, a, b, 0);
+}
+
+void matrixScalar(Matrix* a, mfloat val) {
+    _matrix_ew_mat(_MATRIX_EW_SCALE, a, a, NULL, val);
+}
+
+//====================== Random ======================
+
+// The shared generator and the next stream matrixRngStream hands out
+static MatrixRng _matrixRng = {0, 0, 0};
+static unsigned long long _matrixRngStreams = 1;
+
+// Draw `n` of rng's sequence
+static inline unsigned long long _matrix_rng_at(const MatrixRng* rng,
+                                                unsigned long long n) {
+    unsigned long long k = n % _MATRIX_RNG_DRAWS;
+    unsigned long long lo, hi;
+    _matrix_philox_block(
+        rng, n / _MATRIX_RNG_DRAWS * _MATRIX_RNG_BLOCKS + k % _MATRIX_RNG_BLOCKS,
+        &lo, &hi);
+    return k < _MATRIX_RNG_BLOCKS ? lo : hi;
+}
+
+// Takes `n` draws off rng, returns the first. The shared one can be drawn
+// from by several threads at once.
+static inline unsigned long long _matrix_rng_take(MatrixRng* rng,
+                                                  unsigned long long n) {
+    if (rng == &_matrixRng) {
+        return __atomic_fetch_add(&rng->counter, n, __ATOMIC_RELAXED);
+    }
+    unsigned long long first = rng->counter;
+    rng->counter += n;
+    return first;
+}
+
+// The top bits of a draw as a float in [0, 1)
+static inline mfloat _matrix_rng_unit(unsigned long long bits) {
+    // Through a signed type, converting those is a single instruction
+#ifdef MATRIX_FLOAT
+    return (mfloat)(int)(bits >> 40) * 0x1p-24f;
+#else
+    return (mfloat)(long long)(bits >> 11) * 0x1p-53;
+#endif
+}
+
+// Uniform in [0, n) out of a draw, by multiplying instead of taking a modulo.
+// The bias is at most n / 2^64.
+static inline long long _matrix_rng_scale(unsigned long long bits,
+                                          long long n) {
+    return (long long)(((unsigned __int128)bits * (unsigned long long)n) >> 64);
+}
+
+MatrixRng matrixRngCreate(unsigned long long seed, unsigned long long stream) {
+    return (MatrixRng){seed, stream, 0};
+}
+
+void matrixRngSeed(unsigned long long seed) {
+    _matrixRng = matrixRngCreate(seed, 0);
+    _matrixRngStreams = 1;
+}
+
+MatrixRng matrixRngStream(void) {
+    return matrixRngCreate(
+        _matrixRng.seed,
+        __atomic_fetch_add(&_matrixRngStreams, 1, __ATOMIC_RELAXED));
+}
+
+unsigned long long matrixRngNext(MatrixRng* rng) {
+    return _matrix_rng_at(rng, _matrix_rng_take(rng, 1));
+}
+
+mfloat matrixRngUniform(MatrixRng* rng) {
+    return _matrix_rng_unit(matrixRngNext(rng));
+}
+
+long long matrixRngBelow(MatrixRng* rng, long long n) {
+    MATRIX_ASSERT(n > 0);
+    return _matrix_rng_scale(matrixRngNext(rng), n);
+}
+
+typedef struct {
+    MatrixRng rng;
+    unsigned long long first; // Counter of element 0
+    Matrix* m;                // Filled, or dropped out when `j` is NULL
+    long long* j;             // Fisher-Yates swaps instead
+    mfloat low;
+    mfloat high;
+    char dropout;
+} _MatrixRandTask;
+
+// Element i gets draw first + i, so which thread draws it doesn't matter
+static void _matrix_rand_range(void* ctx, long long begin, long long end) {
+    _MatrixRandTask* t = ctx;
+    unsigned long long draws[_MATRIX_RNG_DRAWS];
+    int cols = t->m ? t->m->cols : 1;
+    int r = (int)(begin / cols);
+    int c = (int)(begin % cols);
+    mfloat range = t->high - t->low;
+    long long i = begin;
+    while (i < end) {
+        // The whole group draw first + i is in
+        unsigned long long n = t->first + i;
+        _matrixKernels.philox(&t->rng, n / _MATRIX_RNG_DRAWS, draws);
+        int k = (int)(n % _MATRIX_RNG_DRAWS);
+        int cnt = (int)_MATRIX_MIN(_MATRIX_RNG_DRAWS - k, end - i);
+        if (t->j) {
+            for (int d = k; d < k + cnt; d++, i++) {
+                t->j[i] = _matrix_rng_scale(draws[d], i + 1);
+            }
+            continue;
+        }
+        for (int d = k; d < k + cnt;) {
+            // The part of row r these draws cover
+            int run = _MATRIX_MIN(cols - c, k + cnt - d);
+            mfloat* x = &MAT_AT(t->m, r, c);
+            long long step = t->m->transposed ? t->m->stride : 1;
+            if (t->dropout) {
+                // low is the rate, high the scale of what's kept
+                for (int q = 0; q < run; q++) {
+                    mfloat u = _matrix_rng_unit(draws[d + q]);
+                    x[q * step] = u < t->low ? 0 : x[q * step] * t->high;
+                }
+            } else {
+                for (int q = 0; q < run; q++) {
+                    x[q * step] = t->low + _matrix_rng_unit(draws[d + q]) * range;
+                }
+            }
+            d += run;
+            i += run;
+            c += run;
+            if (c == cols) {
+                c = 0;
+                r++;
+            }
+        }
+    }
+}
+
+static void _matrix_rand_run(_MatrixRandTask* t, MatrixRng* rng,
+                             long long len) {
+    t->first = _matrix_rng_take(rng, len);
+    t->rng = *rng;
+    if (len == 0) {
+        return;
+    }
+    if (len < MATRIX_PARALLEL_MIN) {
+        _matrix_rand_range(t, 0, len);
+        return;
+    }
+    tpoolParallelFor(len, MATRIX_PARALLEL_GRAIN, _matrix_rand_range, t);
+}
+
+void matrixRngSwaps(MatrixRng* rng, long long* j, long long n) {
+    _MatrixRandTask t = {.j = j};
+    _matrix_rand_run(&t, rng, n);
+}
+
+void matrixRandRng(Matrix* m, MatrixRng* rng, mfloat low, mfloat high) {
+    _MatrixRandTask t = {.m = m, .low = low, .high = high};
+    _matrix_rand_run(&t, rng, _MATRIX_LEN(m));
+}
+
+void matrixRand(Matrix* m, mfloat low, mfloat high) {
+    matrixRandRng(m, &_matrixRng, low, high);
+}
+
+void matrixDropout(Matrix* m, MatrixRng* rng, mfloat rate) {
+    MATRIX_ASSERT(rate >= 0 && rate < 1);
+    _MatrixRandTask t = {
+        .m = m, .low = rate, .high = 1 / (1 - rate), .dropout = 1};
+    _matrix_rand_run(&t, rng, _MATRIX_LEN(m));
+}
+
+//====================== GEMM ======================
+// Goto/BLIS style: B gets packed into KC x NC panels that sit in L3/L2, A into
+// MC x KC blocks that sit in L2, and the microkernel computes an MR x NR tile
+// of dest in registers while streaming both packed panels from L1.
+// MR and NR come from the kernel table since they depend on the vector width.
+
+#ifndef MATRIX_GEMM_MC
+#define MATRIX_GEMM_MC 96
+#endif
+#ifndef MATRIX_GEMM_KC
+#define MATRIX_GEMM_KC 256
+#endif
+#ifndef MATRIX_GEMM_NC
+#define MATRIX_GEMM_NC 4096
+#endif
+// Below this many multiply-adds packing costs more than it saves
+#ifndef MATRIX_GEMM_SMALL
+#define MATRIX_GEMM_SMALL (32 * 32 * 32)
+#endif
+
+// Packs a mc x kc block of `a` into MR row slivers. Each sliver is stored k
+// major so the microkernel reads MR values per k step. Ragged rows get zeros.
+static void _matrix_pack_a(mfloat* dst, const Matrix* a, int i0, int k0,
+                           int mc, int kc, int MR) {
+    long long ld = a->stride;
+    for (int ip = 0; ip < mc; ip += MR) {
+        int mr = _MATRIX_MIN(MR, mc - ip);
+        if (a->transposed) {
+            // The MR values for a k are next to each other in memory
+            for (int k = 0; k < kc; k++) {
+                const mfloat* src = a->data + (k0 + k) * ld + i0 + ip;
+                int i = 0;
+                for (; i < mr; i++) {
+                    dst[(long long)k * MR + i] = src[i];
+                }
+                for (; i < MR; i++) {
+                    dst[(long long)k * MR + i] = 0;
+                }
+            }
+        } else {
+            // Read each row of the sliver straight through
+            for (int i = 0; i < MR; i++) {
+                const mfloat* src = a->data + (i0 + ip + i) * ld + k0;
+                for (int k = 0; k < kc; k++) {
+                    dst[(long long)k * MR + i] = (i < mr) ? src[k] : 0;
+                }
+            }
         }
+        dst += (long long)kc * MR;
     }
 }
 
-void matrixScalar(Matrix* a, double val) {
-    for (int i = 0; i < a->rows; i++) {
-        for (int j = 0; j < a->cols; j++) {
-            MAT_AT(a, i, j) *= val;
+// Packs a kc x nc block of `b` into NR column slivers, k major as well.
+static void _matrix_pack_b(mfloat* dst, const Matrix* b, int k0, int j0,
+                           int kc, int nc, int NR) {
+    long long ld = b->stride;
+    for (int jp = 0; jp < nc; jp += NR) {
+        int nr = _MATRIX_MIN(NR, nc - jp);
+        if (b->transposed) {
+            // Each column of the sliver is a row in memory
+            for (int j = 0; j < NR; j++) {
+                const mfloat* src = b->data + (j0 + jp + j) * ld + k0;
+                for (int k = 0; k < kc; k++) {
+                    dst[(long long)k * NR + j] = (j < nr) ? src[k] : 0;
+                }
+            }
+        } else {
+            for (int k = 0; k < kc; k++) {
+                const mfloat* src = b->data + (k0 + k) * ld + j0 + jp;
+                int j = 0;
+                for (; j < nr; j++) {
+                    dst[(long long)k * NR + j] = src[j];
+                }
+                for (; j < NR; j++) {
+                    dst[(long long)k * NR + j] = 0;
+                }
+            }
         }
+        dst += (long long)kc * NR;
     }
 }
 
-void matrixMulti(Matrix* dest, const Matrix* a, const Matrix* b) {
-    assert(a->cols == b->rows && dest->rows == a->rows &&
-           dest->cols == b->cols);
-    int n = a->cols;
+// `ep` is for all of dest and only given on the last k block
+static void _matrix_gemm_macro(const _MatrixKernels* kern, Matrix* dest,
+                               const mfloat* ap, const mfloat* bp, int i0,
+                               int j0, int mc, int nc, int kc, mfloat alpha,
+                               mfloat beta, const _MatrixEpilogue* ep) {
+    for (int jp = 0; jp < nc; jp += kern->nr) {
+        int nr = _MATRIX_MIN(kern->nr, nc - jp);
+        for (int ip = 0; ip < mc; ip += kern->mr) {
+            int mr = _MATRIX_MIN(kern->mr, mc - ip);
+            int i = i0 + ip;
+            int j = j0 + jp;
+            _MatrixEpilogue tileEp;
+            if (ep) {
+                tileEp = *ep;
+                tileEp.bias = ep->bias ? ep->bias + j : NULL;
+                tileEp.preact = ep->preact
+                                    ? ep->preact + (long long)i * ep->ldp + j
+                                    : NULL;
+            }
+            kern->gemmMicro(kc, ap + (long long)ip * kc,
+                            bp + (long long)jp * kc, &MAT_AT(dest, i, j),
+                            dest->stride, mr, nr, alpha, beta,
+                            ep ? &tileEp : NULL);
+        }
+    }
+}
+
+// Runs the epilogue over rows [i0, i1) of dest that are already computed
+static void _matrix_epilogue_rows(const _MatrixEpilogue* ep, Matrix* dest,
+                                  int i0, int i1) {
+    for (int i = i0; i < i1; i++) {
+        _MatrixEpilogue rowEp = *ep;
+        rowEp.preact =
+            ep->preact ? ep->preact + (long long)i * ep->ldp : NULL;
+        _matrix_epilogue_row(&rowEp, &MAT_AT(dest, i, 0), 0, dest->cols);
+    }
+}
+
+// Straight i-k-j loops for problems too small to be worth packing. A row
+// major b goes a row of dest at a time through the SIMD kernel.
+static void _matrix_gemm_small(Matrix* dest, const Matrix* a, const Matrix* b,
+                               mfloat alpha, mfloat beta,
+                               const _MatrixEpilogue* ep) {
+    const _MatrixKernels* kern = &_matrixKernels;
+    long long aStep = a->transposed ? a->stride : 1;
     for (int i = 0; i < dest->rows; i++) {
-        for (int j = 0; j < dest->cols; j++) {
-            for (int k = 0; k < n; k++) {
-                MAT_AT(dest, i, j) += MAT_AT(a, i, k) * MAT_AT(b, k, j);
+        mfloat* crow = &MAT_AT(dest, i, 0);
+        if (!b->transposed) {
+            kern->gemmRow(dest->cols, a->cols, &MAT_AT(a, i, 0), aStep,
+                          b->data, b->stride, crow, alpha, beta);
+        } else {
+            for (int j = 0; j < dest->cols; j++) {
+                crow[j] = (beta == 0) ? 0 : beta * crow[j];
+            }
+            for (int k = 0; k < a->cols; k++) {
+                mfloat aik = alpha * MAT_AT(a, i, k);
+                for (int j = 0; j < dest->cols; j++) {
+                    crow[j] += aik * MAT_AT(b, k, j);
+                }
+            }
+        }
+        if (ep) {
+            _matrix_epilogue_rows(ep, dest, i, i + 1);
+        }
+    }
+}
+
+// Where the panels for rows [k0, k0 + kc) and cols from j0 on start in a
+// packed matrix. Every KC rows are packed like one block of _matrix_pack_b
+// over all the columns.
+static const mfloat* _matrix_packed_at(const MatrixPacked* b, int k0, int j0,
+                                       int kc) {
+    long long colsPadded = _MATRIX_ROUND_UP(b->cols, b->nr);
+    return b->data + (long long)k0 * colsPadded + (long long)j0 * kc;
+}
+
+// Every thread keeps the packing space of its last GEMM and only grows it,
+// so training steps don't malloc (and fault in fresh pages) on every product.
+// The key frees it when a pool thread exits.
+static _Thread_local void* _matrixPackMem;
+static _Thread_local long long _matrixPackCap;
+static pthread_key_t _matrixPackKey;
+static pthread_once_t _matrixPackOnce = PTHREAD_ONCE_INIT;
+
+static void _matrix_pack_free(void* mem) {
+    MATRIX_FREE(mem);
+}
+
+static void _matrix_pack_key_create(void) {
+    pthread_key_create(&_matrixPackKey, _matrix_pack_free);
+}
+
+static void* _matrix_pack_mem(long long bytes) {
+    if (bytes > _matrixPackCap) {
+        pthread_once(&_matrixPackOnce, _matrix_pack_key_create);
+        if (_matrixPackMem) {
+            MATRIX_FREE(_matrixPackMem);
+        }
+        // A bit extra so slightly bigger blocks don't grow it again
+        _matrixPackCap = bytes + bytes / 4;
+        _matrixPackMem = MATRIX_MALLOC(_matrixPackCap);
+        pthread_setspecific(_matrixPackKey, _matrixPackMem);
+    }
+    return _matrixPackMem;
+}
+
+// The packed algorithm for the block dest[i0:i0+m, j0:j0+n]. If `packed` is
+// given it's b already packed and b isn't read.
+static void _matrix_gemm_block(const _MatrixKernels* kern, Matrix* dest,
+                               const Matrix* a, const Matrix* b,
+                               const MatrixPacked* packed, mfloat alpha,
+                               mfloat beta, const _MatrixEpilogue* ep, int i0,
+                               int m, int j0, int n) {
+    int k = a->cols;
+    // Only allocate as much packing space as the problem can use
+    int mcMax = _MATRIX_MIN(MATRIX_GEMM_MC, _MATRIX_ROUND_UP(m, kern->mr));
+    int kcMax = _MATRIX_MIN(MATRIX_GEMM_KC, k);
+    int ncMax = _MATRIX_MIN(_MATRIX_ROUND_UP(MATRIX_GEMM_NC, kern->nr),
+                            _MATRIX_ROUND_UP(n, kern->nr));
+    long long apLen = (long long)_MATRIX_ROUND_UP(mcMax, kern->mr) * kcMax;
+    long long bpLen = packed ? 0 : (long long)ncMax * kcMax;
+    void* packMem = _matrix_pack_mem(sizeof(mfloat) * (apLen + bpLen) + 128);
+    mfloat* ap = _MATRIX_ALIGN64(packMem);
+    mfloat* bp = _MATRIX_ALIGN64(ap + apLen);
+
+    for (int jc = 0; jc < n; jc += ncMax) {
+        int nc = _MATRIX_MIN(ncMax, n - jc);
+        for (int pc = 0; pc < k; pc += MATRIX_GEMM_KC) {
+            int kc = _MATRIX_MIN(MATRIX_GEMM_KC, k - pc);
+            // Beta only applies once, every later k block accumulates, and
+            // the epilogue runs once the last k block finished the tile
+            mfloat blockBeta = (pc == 0) ? beta : 1;
+            const _MatrixEpilogue* blockEp = (pc + kc == k) ? ep : NULL;
+            const mfloat* bBlock = bp;
+            if (packed) {
+                bBlock = _matrix_packed_at(packed, pc, j0 + jc, kc);
+            } else {
+                _matrix_pack_b(bp, b, pc, j0 + jc, kc, nc, kern->nr);
+            }
+            for (int ic = 0; ic < m; ic += MATRIX_GEMM_MC) {
+                int mc = _MATRIX_MIN(MATRIX_GEMM_MC, m - ic);
+                _matrix_pack_a(ap, a, i0 + ic, pc, mc, kc, kern->mr);
+                _matrix_gemm_macro(kern, dest, ap, bBlock, i0 + ic, j0 + jc,
+                                   mc, nc, kc, alpha, blockBeta, blockEp);
+            }
+        }
+    }
+}
+
+typedef struct {
+    const _MatrixKernels* kern;
+    Matrix* dest;
+    const Matrix* a;
+    const Matrix* b;
+    const MatrixPacked* packed;
+    mfloat alpha;
+    mfloat beta;
+    const _MatrixEpilogue* ep;
+    char splitRows; // Split over the rows of dest, otherwise over its cols
+    int unit;       // Rows/cols per index handed out by the pool
+} _MatrixGemmTask;
+
+static void _matrix_gemm_range(void* ctx, long long begin, long long end) {
+    _MatrixGemmTask* t = ctx;
+    int lim = t->splitRows ? t->dest->rows : t->dest->cols;
+    int from = (int)(begin * t->unit);
+    int to = _MATRIX_MIN((int)(end * t->unit), lim);
+    if (t->splitRows) {
+        _matrix_gemm_block(t->kern, t->dest, t->a, t->b, t->packed, t->alpha,
+                           t->beta, t->ep, from, to - from, 0, t->dest->cols);
+    } else {
+        _matrix_gemm_block(t->kern, t->dest, t->a, t->b, t->packed, t->alpha,
+                           t->beta, t->ep, 0, t->dest->rows, from, to - from);
+    }
+}
+
+// Either `b` or `packed` is given
+static void _matrix_gemm(Matrix* dest, const Matrix* a, const Matrix* b,
+                         const MatrixPacked* packed, mfloat alpha, mfloat beta,
+                         const _MatrixEpilogue* ep) {
+    int bRows = packed ? packed->rows : b->rows;
+    int bCols = packed ? packed->cols : b->cols;
+    const mfloat* bData = packed ? packed->data : b->data;
+    MATRIX_ASSERT(a->cols == bRows && dest->rows == a->rows &&
+                  dest->cols == bCols);
+    MATRIX_ASSERT(dest->data != a->data && dest->data != bData);
+    MATRIX_ASSERT(!dest->transposed);
+    MATRIX_ASSERT(!packed || packed->nr == _matrixKernels.nr);
+    if (ep && ep->act == MATRIX_ACT_SOFTMAX) {
+        // A tile only has part of a row, so softmax goes over the rows once
+        // the product is done
+        _MatrixEpilogue linear = *ep;
+        linear.act = MATRIX_ACT_NONE;
+        _matrix_gemm(dest, a, b, packed, alpha, beta, &linear);
+        matrixAct(dest, MATRIX_ACT_SOFTMAX, NULL);
+        return;
+    }
+    int m = dest->rows;
+    int n = dest->cols;
+    int k = a->cols;
+    if (m == 0 || n == 0) {
+        return;
+    }
+    if (k == 0 || alpha == 0) {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                MAT_AT(dest, i, j) = (beta == 0) ? 0 : beta * MAT_AT(dest, i, j);
+            }
+        }
+        if (ep) {
+            _matrix_epilogue_rows(ep, dest, 0, m);
+        }
+        return;
+    }
+    long long work = (long long)m * n * k;
+    if (work <= MATRIX_GEMM_SMALL && !packed) {
+        _matrix_gemm_small(dest, a, b, alpha, beta, ep);
+        return;
+    }
+
+    const _MatrixKernels* kern = &_matrixKernels;
+    if (work < MATRIX_GEMM_PARALLEL_MIN) {
+        _matrix_gemm_block(kern, dest, a, b, packed, alpha, beta, ep, 0, m, 0,
+                           n);
+        return;
+    }
+
+    // Split the bigger side of dest. Every thread packs its own slice of that
+    // side and all of the other one, so this keeps the repeated packing small.
+    _MatrixGemmTask t = {kern, dest, a, b, packed, alpha, beta, ep, m > n, 0};
+    t.unit = t.splitRows ? kern->mr : kern->nr;
+    long long units = ((t.splitRows ? m : n) + t.unit - 1) / t.unit;
+    // Rows get handed out a whole A block at a time so packing stays efficient
+    long long grain = t.splitRows ? MATRIX_GEMM_MC / kern->mr : 1;
+    tpoolParallelFor(units, grain, _matrix_gemm_range, &t);
+}
+
+void matrixGemm(Matrix* dest, const Matrix* a, const Matrix* b, mfloat alpha,
+                mfloat beta) {
+    _matrix_gemm(dest, a, b, NULL, alpha, beta, NULL);
+}
+
+void matrixGemmFused(Matrix* dest, const Matrix* a, const Matrix* b,
+                     const Matrix* bias, MATRIX_ACT act, Matrix* preact) {
+    MATRIX_ASSERT(!bias || (bias->rows == 1 && bias->cols == dest->cols));
+    MATRIX_ASSERT(!preact ||
+                  (preact->rows == dest->rows && preact->cols == dest->cols));
+    MATRIX_ASSERT(!preact || !preact->transposed);
+    MATRIX_ASSERT(!bias || !bias->transposed);
+    _MatrixEpilogue ep = {bias ? bias->data : NULL,
+                          preact ? preact->data : NULL,
+                          preact ? preact->stride : 0, act};
+    _matrix_gemm(dest, a, b, NULL, 1, 0, &ep);
+}
+
+long long matrixPackedLen(int rows, int cols) {
+    return (long long)rows * _MATRIX_ROUND_UP(cols, _matrixKernels.nr);
+}
+
+MatrixPacked matrixPack(mfloat* dst, const Matrix* b) {
+    MatrixPacked p = {dst, b->rows, b->cols, _matrixKernels.nr};
+    for (int pc = 0; pc < b->rows; pc += MATRIX_GEMM_KC) {
+        int kc = _MATRIX_MIN(MATRIX_GEMM_KC, b->rows - pc);
+        _matrix_pack_b((mfloat*)_matrix_packed_at(&p, pc, 0, kc), b, pc, 0, kc,
+                       b->cols, p.nr);
+    }
+    return p;
+}
+
+void matrixGemmPacked(Matrix* dest, const Matrix* a, const MatrixPacked* b,
+                      const Matrix* bias, MATRIX_ACT act, Matrix* preact) {
+    MATRIX_ASSERT(!bias || (bias->rows == 1 && bias->cols == dest->cols));
+    MATRIX_ASSERT(!preact ||
+                  (preact->rows == dest->rows && preact->cols == dest->cols));
+    MATRIX_ASSERT(!preact || !preact->transposed);
+    MATRIX_ASSERT(!bias || !bias->transposed);
+    _MatrixEpilogue ep = {bias ? bias->data : NULL,
+                          preact ? preact->data : NULL,
+                          preact ? preact->stride : 0, act};
+    _matrix_gemm(dest, a, NULL, b, 1, 0, &ep);
+}
+
+//====================== Int8 ======================
+
+// Rows of A a task of the int8 GEMM takes, they stay in cache while every
+// panel of B goes by
+#define _MATRIX_I8_MC 64
+// k padded for the kernels, and the cols of B padded to whole panels
+#define _MATRIX_I8_KP(rows) _MATRIX_ROUND_UP(rows, 4)
+#define _MATRIX_I8_COLS(cols) _MATRIX_ROUND_UP(cols, _MATRIX_I8_NR)
+#define _MATRIX_BYTES64(n) _MATRIX_ROUND_UP((long long)(n), 64)
+
+long long matrixInt8Bytes(int rows, int cols) {
+    long long colsPad = _MATRIX_I8_COLS(cols);
+    return _MATRIX_BYTES64(sizeof(mfloat) * colsPad) +
+           _MATRIX_BYTES64(sizeof(int) * colsPad) +
+           _MATRIX_I8_KP(rows) * colsPad;
+}
+
+MatrixInt8 matrixQuantize(void* dst, const Matrix* b) {
+    int colsPad = _MATRIX_I8_COLS(b->cols);
+    int kp = _MATRIX_I8_KP(b->rows);
+    char* p = dst;
+    MatrixInt8 q = {NULL, b->rows, b->cols, (mfloat*)p, NULL};
+    p += _MATRIX_BYTES64(sizeof(mfloat) * colsPad);
+    q.colSums = (int*)p;
+    p += _MATRIX_BYTES64(sizeof(int) * colsPad);
+    q.data = (signed char*)p;
+    memset(q.data, 0, (size_t)kp * colsPad);
+    for (int j = 0; j < colsPad; j++) {
+        int valid = j < b->cols;
+        mfloat max = 0;
+        for (int k = 0; valid && k < b->rows; k++) {
+            mfloat v = MAT_AT(b, k, j);
+            v = v < 0 ? -v : v;
+            max = v > max ? v : max;
+        }
+        q.scales[j] = max > 0 ? max / 127 : 1;
+        mfloat inv = 1 / q.scales[j];
+        long long panelLen = (long long)kp * _MATRIX_I8_NR;
+        signed char* panel = q.data + j / _MATRIX_I8_NR * panelLen +
+                             4 * (j % _MATRIX_I8_NR);
+        int sum = 0;
+        for (int k = 0; valid && k < b->rows; k++) {
+            signed char v = _matrix_quantize(MAT_AT(b, k, j), inv);
+            panel[(long long)(k / 4) * 4 * _MATRIX_I8_NR + k % 4] = v;
+            sum += v;
+        }
+        q.colSums[j] = sum;
+    }
+    return q;
+}
+
+typedef struct {
+    const _MatrixKernels* kern;
+    Matrix* dest;
+    const signed char* aq; // a quantized, dest->rows rows of kp
+    int kp;
+    mfloat aScale;
+    const MatrixInt8* b;
+    const mfloat* bias;
+    MATRIX_ACT act;
+    long long panels;
+} _MatrixGemmI8Task;
+
+// Index u is rows [u / panels * _MATRIX_I8_MC, +_MATRIX_I8_MC) against panel
+// u % panels, so consecutive indexes share their rows of A
+static void _matrix_gemm_i8_range(void* ctx, long long begin, long long end) {
+    _MatrixGemmI8Task* t = ctx;
+    int c[_MATRIX_I8_MR * _MATRIX_I8_NR];
+    mfloat row[_MATRIX_I8_NR];
+    mfloat scale[_MATRIX_I8_NR];
+    for (long long u = begin; u < end; u++) {
+        int p = (int)(u % t->panels);
+        int i1 = (int)(u / t->panels) * _MATRIX_I8_MC;
+        int i2 = _MATRIX_MIN(i1 + _MATRIX_I8_MC, t->dest->rows);
+        int j0 = p * _MATRIX_I8_NR;
+        int nr = _MATRIX_MIN(_MATRIX_I8_NR, t->dest->cols - j0);
+        const signed char* bp =
+            t->b->data + (long long)p * t->kp * _MATRIX_I8_NR;
+        for (int j = 0; j < nr; j++) {
+            scale[j] = t->aScale * t->b->scales[j0 + j];
+        }
+        for (int i0 = i1; i0 < i2; i0 += _MATRIX_I8_MR) {
+            int mr = _MATRIX_MIN(_MATRIX_I8_MR, i2 - i0);
+            t->kern->gemmI8(t->kp, t->aq + (long long)i0 * t->kp, t->kp, mr,
+                            bp, t->b->colSums + j0, c);
+            // Back to mfloats, then the bias and activation
+            for (int i = 0; i < mr; i++) {
+                for (int j = 0; j < nr; j++) {
+                    row[j] = c[i * _MATRIX_I8_NR + j] * scale[j] +
+                             (t->bias ? t->bias[j0 + j] : 0);
+                }
+                _matrix_act_row(row, nr, t->act);
+                for (int j = 0; j < nr; j++) {
+                    MAT_AT(t->dest, i0 + i, j0 + j) = row[j];
+                }
+            }
+        }
+    }
+}
+
+void matrixGemmInt8(Matrix* dest, const Matrix* a, mfloat aScale,
+                    const MatrixInt8* b, const Matrix* bias, MATRIX_ACT act) {
+    MATRIX_ASSERT(a->cols == b->rows && dest->rows == a->rows &&
+                  dest->cols == b->cols);
+    MATRIX_ASSERT(!bias || (bias->rows == 1 && bias->cols == dest->cols));
+    MATRIX_ASSERT(!bias || !bias->transposed);
+    MATRIX_ASSERT(aScale > 0);
+    if (act == MATRIX_ACT_SOFTMAX) {
+        // Same as _matrix_gemm, the panels only have part of a row
+        matrixGemmInt8(dest, a, aScale, b, bias, MATRIX_ACT_NONE);
+        matrixAct(dest, MATRIX_ACT_SOFTMAX, NULL);
+        return;
+    }
+    int m = dest->rows;
+    if (m == 0 || dest->cols == 0) {
+        return;
+    }
+    int k = a->cols;
+    int kp = _MATRIX_I8_KP(k);
+    signed char* aq = MATRIX_MALLOC((size_t)m * kp + 1);
+    memset(aq, 0, (size_t)m * kp);
+    mfloat inv = 1 / aScale;
+    if (a->transposed) {
+        // Quantize the runs that are contiguous in memory, the columns, then
+        // transpose the bytes a cache friendly tile at a time
+        signed char* cols = MATRIX_MALLOC((size_t)k * m);
+        for (int kk = 0; kk < k; kk++) {
+            _matrixKernels.quantize(cols + (long long)kk * m,
+                                    a->data + (long long)kk * a->stride, inv,
+                                    m);
+        }
+        for (int i0 = 0; i0 < m; i0 += 32) {
+            for (int k0 = 0; k0 < k; k0 += 32) {
+                int i1 = _MATRIX_MIN(i0 + 32, m);
+                int k1 = _MATRIX_MIN(k0 + 32, k);
+                for (int i = i0; i < i1; i++) {
+                    for (int kk = k0; kk < k1; kk++) {
+                        aq[(long long)i * kp + kk] =
+                            cols[(long long)kk * m + i];
+                    }
+                }
+            }
+        }
+        MATRIX_FREE(cols);
+    } else {
+        for (int i = 0; i < m; i++) {
+            _matrixKernels.quantize(aq + (long long)i * kp,
+                                    a->data + (long long)i * a->stride, inv, k);
+        }
+    }
+
+    long long panels = _MATRIX_I8_COLS(dest->cols) / _MATRIX_I8_NR;
+    _MatrixGemmI8Task t = {&_matrixKernels, dest, aq, kp, aScale, b,
+                           bias ? bias->data : NULL, act, panels};
+    long long units = (m + _MATRIX_I8_MC - 1) / _MATRIX_I8_MC * panels;
+    if ((long long)m * dest->cols * kp < MATRIX_GEMM_PARALLEL_MIN) {
+        _matrix_gemm_i8_range(&t, 0, units);
+    } else {
+        tpoolParallelFor(units, 1, _matrix_gemm_i8_range, &t);
+    }
+    MATRIX_FREE(aq);
+}
+
+typedef struct {
+    Matrix* m;
+    _MatrixEpilogue ep;
+} _MatrixActTask;
+
+static void _matrix_act_range(void* ctx, long long begin, long long end) {
+    _MatrixActTask* t = ctx;
+    for (long long i = begin; i < end; i++) {
+        _matrix_epilogue_row(&t->ep, &MAT_AT(t->m, i, 0), (int)i, t->m->cols);
+    }
+}
+
+void matrixAct(Matrix* m, MATRIX_ACT act, Matrix* preact) {
+    MATRIX_ASSERT(!m->transposed && (!preact || !preact->transposed));
+    MATRIX_ASSERT(!preact ||
+                  (preact->rows == m->rows && preact->cols == m->cols));
+    if (act == MATRIX_ACT_NONE && !preact) {
+        return;
+    }
+    _MatrixActTask t = {m, {NULL, preact ? preact->data : NULL,
+                            preact ? preact->stride : 0, act}};
+    if (_MATRIX_LEN(m) < MATRIX_PARALLEL_MIN) {
+        _matrix_act_range(&t, 0, m->rows);
+        return;
+    }
+    long long grain = MATRIX_PARALLEL_GRAIN / 4 / (m->cols ? m->cols : 1);
+    tpoolParallelFor(m->rows, grain, _matrix_act_range, &t);
+}
+
+typedef struct {
+    Matrix* gs;
+    const Matrix* out;
+    const Matrix* preact;
+    MATRIX_ACT act;
+    Matrix* bsu;
+} _MatrixActBackTask;
+
+// Handles cols [begin, end) for every row, so threads never share a bsu entry
+static void _matrix_act_back_range(void* ctx, long long begin, long long end) {
+    _MatrixActBackTask* t = ctx;
+    int j0 = (int)begin;
+    int n = (int)(end - begin);
+    for (int i = 0; i < t->gs->rows; i++) {
+        mfloat* g = &MAT_AT(t->gs, i, j0);
+        if (t->act != MATRIX_ACT_NONE) {
+            _matrixKernels.actBack(
+                g, &MAT_AT(t->out, i, j0),
+                t->preact ? &MAT_AT(t->preact, i, j0) : NULL, n, t->act);
+        }
+        if (t->bsu) {
+            mfloat* b = &MAT_AT(t->bsu, 0, j0);
+            for (int j = 0; j < n; j++) {
+                b[j] += g[j];
+            }
+        }
+    }
+}
+
+// Whole rows [begin, end), for softmax where every element of a row depends on
+// all of it
+static void _matrix_act_back_rows(void* ctx, long long begin, long long end) {
+    _MatrixActBackTask* t = ctx;
+    for (long long i = begin; i < end; i++) {
+        _matrixKernels.actBack(&MAT_AT(t->gs, i, 0), &MAT_AT(t->out, i, 0),
+                               NULL, t->gs->cols, t->act);
+    }
+}
+
+void matrixActBackward(Matrix* gs, const Matrix* out, const Matrix* preact,
+                       MATRIX_ACT act, Matrix* bsu) {
+    MATRIX_ASSERT(gs->rows == out->rows && gs->cols == out->cols);
+    MATRIX_ASSERT(act != MATRIX_ACT_GELU || preact);
+    MATRIX_ASSERT(!bsu || (bsu->rows == 1 && bsu->cols == gs->cols));
+    MATRIX_ASSERT(!gs->transposed && !out->transposed);
+    MATRIX_ASSERT(!preact || !preact->transposed);
+    MATRIX_ASSERT(!bsu || !bsu->transposed);
+    _MatrixActBackTask t = {gs, out, preact, act, bsu};
+    char small = _MATRIX_LEN(gs) < MATRIX_PARALLEL_MIN;
+    if (act == MATRIX_ACT_SOFTMAX) {
+        if (small) {
+            _matrix_act_back_rows(&t, 0, gs->rows);
+        } else {
+            long long grain = MATRIX_PARALLEL_GRAIN / (gs->cols ? gs->cols : 1);
+            tpoolParallelFor(gs->rows, grain, _matrix_act_back_rows, &t);
+        }
+        // Only the bias gradient is left
+        if (!bsu) {
+            return;
+        }
+        t.act = MATRIX_ACT_NONE;
+    }
+    if (small) {
+        _matrix_act_back_range(&t, 0, gs->cols);
+        return;
+    }
+    tpoolParallelFor(gs->cols, 64, _matrix_act_back_range, &t);
+}
+
+//====================== Sparse ======================
+
+// Whether any of the n elements of row r from col on is nonzero
+static char _matrix_block_nonzero(const Matrix* b, int r, int col, int n) {
+    for (int j = 0; j < n; j++) {
+        if (MAT_AT(b, r, col + j) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+long long matrixSparseBlocks(const Matrix* b, int blockCols) {
+    MATRIX_ASSERT(blockCols > 0);
+    long long blocks = 0;
+    for (int r = 0; r < b->rows; r++) {
+        for (int col = 0; col < b->cols; col += blockCols) {
+            int n = _MATRIX_MIN(blockCols, b->cols - col);
+            blocks += _matrix_block_nonzero(b, r, col, n);
+        }
+    }
+    return blocks;
+}
+
+long long matrixSparseBytes(int rows, long long blocks, int blockCols) {
+    return _MATRIX_BYTES64(sizeof(mfloat) * blocks * blockCols) +
+           _MATRIX_BYTES64(sizeof(int) * (rows + 1LL)) +
+           _MATRIX_BYTES64(sizeof(int) * blocks);
+}
+
+MatrixSparse matrixSparsify(void* dst, const Matrix* b, int blockCols) {
+    long long blocks = matrixSparseBlocks(b, blockCols);
+    MATRIX_ASSERT(blocks <= 0x7fffffff);
+    MatrixSparse s = {.rows = b->rows,
+                      .cols = b->cols,
+                      .blockCols = blockCols,
+                      .blocks = blocks};
+    char* p = dst;
+    s.vals = (mfloat*)p;
+    p += _MATRIX_BYTES64(sizeof(mfloat) * blocks * blockCols);
+    s.rowStart = (int*)p;
+    p += _MATRIX_BYTES64(sizeof(int) * (b->rows + 1LL));
+    s.blockCol = (int*)p;
+
+    int at = 0;
+    for (int r = 0; r < b->rows; r++) {
+        s.rowStart[r] = at;
+        for (int col = 0; col < b->cols; col += blockCols) {
+            int n = _MATRIX_MIN(blockCols, b->cols - col);
+            if (!_matrix_block_nonzero(b, r, col, n)) {
+                continue;
+            }
+            mfloat* vals = s.vals + (long long)at * blockCols;
+            for (int j = 0; j < blockCols; j++) {
+                vals[j] = j < n ? MAT_AT(b, r, col + j) : 0;
+            }
+            s.blockCol[at++] = col;
+        }
+    }
+    s.rowStart[b->rows] = at;
+    return s;
+}
+
+void matrixSparseUpdate(MatrixSparse* s, const Matrix* b) {
+    MATRIX_ASSERT(b->rows == s->rows && b->cols == s->cols);
+    for (int r = 0; r < s->rows; r++) {
+        for (int blk = s->rowStart[r]; blk < s->rowStart[r + 1]; blk++) {
+            mfloat* vals = s->vals + (long long)blk * s->blockCols;
+            int col = s->blockCol[blk];
+            int n = _matrix_sparse_width(s, col);
+            for (int j = 0; j < n; j++) {
+                vals[j] = MAT_AT(b, r, col + j);
+            }
+        }
+    }
+}
+
+typedef struct {
+    Matrix* dest;
+    const Matrix* a;
+    const Matrix* b;
+    const MatrixSparse* s;
+    const _MatrixEpilogue* ep;
+} _MatrixSparseTask;
+
+static void _matrix_sparse_range(void* ctx, long long begin, long long end) {
+    _MatrixSparseTask* t = ctx;
+    for (long long i = begin; i < end; i += _MATRIX_SPARSE_ROWS) {
+        int rows = (int)_MATRIX_MIN(_MATRIX_SPARSE_ROWS, end - i);
+        for (int r = 0; r < rows; r++) {
+            memset(&MAT_AT(t->dest, i + r, 0), 0,
+                   sizeof(mfloat) * t->dest->cols);
+        }
+        _matrixKernels.sparseRow(t->s, &MAT_AT(t->a, i, 0), t->a->stride,
+                                 &MAT_AT(t->dest, i, 0), t->dest->stride,
+                                 rows);
+        // The rows are whole, so even softmax can go in the epilogue
+        _matrix_epilogue_rows(t->ep, t->dest, (int)i, (int)i + rows);
+    }
+}
+
+static void _matrix_sparse_t_range(void* ctx, long long begin, long long end) {
+    _MatrixSparseTask* t = ctx;
+    for (long long i = begin; i < end; i += _MATRIX_SPARSE_ROWS) {
+        int rows = (int)_MATRIX_MIN(_MATRIX_SPARSE_ROWS, end - i);
+        _matrixKernels.sparseRowT(t->s, &MAT_AT(t->a, i, 0), t->a->stride,
+                                  &MAT_AT(t->dest, i, 0), t->dest->stride,
+                                  rows);
+    }
+}
+
+// Rows of the pattern the gradient goes through every sample for before
+// moving on, so their part of dest stays in cache
+#define _MATRIX_SPARSE_GRAD_TILE 32
+
+// Every index is a row of the pattern, so every thread has its own rows of
+// dest and goes through all of the samples
+static void _matrix_sparse_grad_range(void* ctx, long long begin,
+                                      long long end) {
+    _MatrixSparseTask* t = ctx;
+    for (long long k = begin; k < end; k += _MATRIX_SPARSE_GRAD_TILE) {
+        int k1 = (int)_MATRIX_MIN(k + _MATRIX_SPARSE_GRAD_TILE, end);
+        for (int i = 0; i < t->a->rows; i += _MATRIX_SPARSE_ROWS) {
+            int rows = _MATRIX_MIN(_MATRIX_SPARSE_ROWS, t->a->rows - i);
+            _matrixKernels.sparseGrad(t->s, (int)k, k1, &MAT_AT(t->a, i, 0),
+                                      t->a->stride, &MAT_AT(t->b, i, 0),
+                                      t->b->stride, rows, t->dest->data,
+                                      t->dest->stride);
+        }
+    }
+}
+
+// Runs `fn` over `count` indices that each cost `work` multiply-adds, on the
+// pool if it's worth it
+static void _matrix_sparse_run(void (*fn)(void*, long long, long long),
+                               _MatrixSparseTask* t, long long count,
+                               long long work) {
+    if (count * work < MATRIX_GEMM_PARALLEL_MIN) {
+        fn(t, 0, count);
+        return;
+    }
+    tpoolParallelFor(count, 1 + MATRIX_PARALLEL_GRAIN / (work + 1), fn, t);
+}
+
+void matrixGemmSparse(Matrix* dest, const Matrix* a, const MatrixSparse* b,
+                      const Matrix* bias, MATRIX_ACT act, Matrix* preact) {
+    MATRIX_ASSERT(a->cols == b->rows && dest->rows == a->rows &&
+                  dest->cols == b->cols);
+    MATRIX_ASSERT(!dest->transposed && !a->transposed);
+    MATRIX_ASSERT(dest->data != a->data);
+    MATRIX_ASSERT(!bias || (bias->rows == 1 && bias->cols == dest->cols));
+    MATRIX_ASSERT(!preact ||
+                  (preact->rows == dest->rows && preact->cols == dest->cols));
+    MATRIX_ASSERT(!preact || !preact->transposed);
+    _MatrixEpilogue ep = {bias ? bias->data : NULL,
+                          preact ? preact->data : NULL,
+                          preact ? preact->stride : 0, act};
+    _MatrixSparseTask t = {dest, a, NULL, b, &ep};
+    _matrix_sparse_run(_matrix_sparse_range, &t, dest->rows,
+                       b->blocks * b->blockCols);
+}
+
+void matrixGemmSparseT(Matrix* dest, const Matrix* a, const MatrixSparse* b) {
+    MATRIX_ASSERT(a->cols == b->cols && dest->rows == a->rows &&
+                  dest->cols == b->rows);
+    MATRIX_ASSERT(!dest->transposed && !a->transposed);
+    MATRIX_ASSERT(dest->data != a->data);
+    _MatrixSparseTask t = {dest, a, NULL, b, NULL};
+    _matrix_sparse_run(_matrix_sparse_t_range, &t, dest->rows,
+                       b->blocks * b->blockCols);
+}
+
+void matrixGemmSparseGrad(Matrix* dest, const Matrix* a, const Matrix* b,
+                          const MatrixSparse* pattern) {
+    MATRIX_ASSERT(dest->rows == pattern->rows && dest->cols == pattern->cols);
+    MATRIX_ASSERT(a->rows == b->rows && a->cols == pattern->rows &&
+                  b->cols == pattern->cols);
+    MATRIX_ASSERT(!dest->transposed && !a->transposed && !b->transposed);
+    _MatrixSparseTask t = {dest, a, b, pattern, NULL};
+    long long perRow = pattern->blocks * pattern->blockCols /
+                       (pattern->rows ? pattern->rows : 1);
+    _matrix_sparse_run(_matrix_sparse_grad_range, &t, pattern->rows,
+                       perRow * a->rows);
+}
+
+//====================== Losses ======================
+
+double matrixLoss(const Matrix* out, const Matrix* to, MATRIX_LOSS loss) {
+    MATRIX_ASSERT(out->rows == to->rows && out->cols == to->cols);
+    // Summed in doubles either way, there can be a lot of rows
+    double sum = 0;
+    for (int i = 0; i < out->rows; i++) {
+        for (int j = 0; j < out->cols; j++) {
+            double y = MAT_AT(out, i, j);
+            double t = MAT_AT(to, i, j);
+            if (loss == MATRIX_LOSS_MSE) {
+                sum += (y - t) * (y - t);
+            } else if (t != 0) {
+                sum -= t * log(y > MATRIX_LOSS_EPS ? y : MATRIX_LOSS_EPS);
+            }
+        }
+    }
+    return sum;
+}
+
+MATRIX_ACT matrixLossGrad(Matrix* gs, const Matrix* out, const Matrix* to,
+                          MATRIX_LOSS loss, MATRIX_ACT act, mfloat scale) {
+    MATRIX_ASSERT(out->rows == to->rows && out->cols == to->cols);
+    MATRIX_ASSERT(gs->rows == out->rows && gs->cols == out->cols);
+    if (loss == MATRIX_LOSS_MSE || act == MATRIX_ACT_SOFTMAX) {
+        // (y - t) is the whole gradient of cross-entropy through softmax, and
+        // half of MSE's
+        matrixSub(gs, out, to);
+        matrixScalar(gs, loss == MATRIX_LOSS_MSE ? 2 * scale : scale);
+        return loss == MATRIX_LOSS_MSE ? act : MATRIX_ACT_NONE;
+    }
+    for (int i = 0; i < out->rows; i++) {
+        for (int j = 0; j < out->cols; j++) {
+            mfloat y = MAT_AT(out, i, j);
+            y = y > (mfloat)MATRIX_LOSS_EPS ? y : (mfloat)MATRIX_LOSS_EPS;
+            MAT_AT(gs, i, j) = -scale * MAT_AT(to, i, j) / y;
+        }
+    }
+    return act;
+}
+
+//====================== Optimizers ======================
+
+MatrixOptimizer matrixOptimizerCreate(MATRIX_OPTIMIZER kind) {
+    MatrixOptimizer opt = {kind, 0.9, 0.999, 1e-8, 0, 0};
+    if (kind == MATRIX_OPTIMIZER_ADAMW) {
+        opt.weightDecay = 0.01;
+    }
+    return opt;
+}
+
+int matrixOptimizerStates(MATRIX_OPTIMIZER kind) {
+    switch (kind) {
+    case MATRIX_OPTIMIZER_SGD:
+        return 0;
+    case MATRIX_OPTIMIZER_MOMENTUM:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+typedef struct {
+    const _MatrixOptStep* s;
+    mfloat* p;
+    mfloat* g;
+    mfloat* m;
+    mfloat* v;
+} _MatrixOptTask;
+
+static void _matrix_opt_range(void* ctx, long long begin, long long end) {
+    _MatrixOptTask* t = ctx;
+    _matrixKernels.optStep(t->s, t->p + begin, t->g + begin,
+                           t->m ? t->m + begin : NULL,
+                           t->v ? t->v + begin : NULL, end - begin);
+}
+
+void matrixOptimizerStep(MatrixOptimizer* opt, mfloat rate, mfloat* p,
+                         mfloat* g, mfloat* m, mfloat* v, long long n) {
+    int states = matrixOptimizerStates(opt->kind);
+    MATRIX_ASSERT(states < 1 || m);
+    MATRIX_ASSERT(states < 2 || v);
+    opt->step++;
+    char adamW = opt->kind == MATRIX_OPTIMIZER_ADAMW;
+    _MatrixOptStep s = {opt->kind, rate, opt->beta1, opt->beta2, opt->eps,
+                        adamW ? 0 : opt->weightDecay,
+                        adamW ? 1 - rate * opt->weightDecay : 1, 0, 0};
+    if (states == 2) {
+        // In doubles, beta2^step creeps toward 1 slowly
+        s.mScale = (mfloat)(rate / (1 - pow(opt->beta1, (double)opt->step)));
+        s.vScale = (mfloat)(1 / (1 - pow(opt->beta2, (double)opt->step)));
+    }
+    _MatrixOptTask t = {&s, p, g, m, v};
+    if (n < MATRIX_PARALLEL_MIN) {
+        _matrix_opt_range(&t, 0, n);
+        return;
+    }
+    tpoolParallelFor(n, MATRIX_PARALLEL_GRAIN, _matrix_opt_range, &t);
+}
+
+typedef struct {
+    const MatrixOptimizer* opt;
+    double rate;
+    double decay;
+    double shrink;
+    double mScale;
+    double vScale;
+    double* master;
+    mfloat* p;
+    mfloat* g;
+    mfloat* m;
+    mfloat* v;
+} _MatrixOptMasterTask;
+
+// _matrix_opt_step_scalar in doubles on the master weights
+static void _matrix_opt_master_range(void* ctx, long long begin,
+                                     long long end) {
+    _MatrixOptMasterTask* t = ctx;
+    const MatrixOptimizer* o = t->opt;
+    double* w = t->master;
+    for (long long i = begin; i < end; i++) {
+        double gi = t->g[i] + t->decay * w[i];
+        t->g[i] = 0;
+        switch (o->kind) {
+        case MATRIX_OPTIMIZER_SGD:
+            w[i] -= t->rate * gi;
+            break;
+        case MATRIX_OPTIMIZER_MOMENTUM: {
+            double m = o->beta1 * (double)t->m[i] + gi;
+            t->m[i] = (mfloat)m;
+            w[i] -= t->rate * m;
+            break;
+        }
+        default: {
+            double m = o->beta1 * (double)t->m[i] + (1 - o->beta1) * gi;
+            double v = o->beta2 * (double)t->v[i] + (1 - o->beta2) * gi * gi;
+            t->m[i] = (mfloat)m;
+            t->v[i] = (mfloat)v;
+            w[i] = w[i] * t->shrink -
+                   t->mScale * m / (sqrt(v * t->vScale) + o->eps);
+            break;
+        }
+        }
+        t->p[i] = (mfloat)w[i];
+    }
+}
+
+void matrixOptimizerStepMaster(MatrixOptimizer* opt, mfloat rate,
+                               double* master, mfloat* p, mfloat* g, mfloat* m,
+                               mfloat* v, long long n) {
+    int states = matrixOptimizerStates(opt->kind);
+    MATRIX_ASSERT(states < 1 || m);
+    MATRIX_ASSERT(states < 2 || v);
+    opt->step++;
+    char adamW = opt->kind == MATRIX_OPTIMIZER_ADAMW;
+    _MatrixOptMasterTask t = {
+        .opt = opt,
+        .rate = rate,
+        .decay = adamW ? 0 : opt->weightDecay,
+        .shrink = adamW ? 1 - (double)rate * opt->weightDecay : 1,
+        .master = master,
+        .p = p,
+        .g = g,
+        .m = m,
+        .v = v,
+    };
+    if (states == 2) {
+        t.mScale = rate / (1 - pow(opt->beta1, (double)opt->step));
+        t.vScale = 1 / (1 - pow(opt->beta2, (double)opt->step));
+    }
+    if (n < MATRIX_PARALLEL_MIN) {
+        _matrix_opt_master_range(&t, 0, n);
+        return;
+    }
+    tpoolParallelFor(n, MATRIX_PARALLEL_GRAIN, _matrix_opt_master_range, &t);
+}
+
+void matrixMulti(Matrix* dest, const Matrix* a, const Matrix* b) {
+    matrixGemm(dest, a, b, 1, 0);
+}
+
+// Square tiles so both the reads and the writes stay inside a few cache lines
+#define _MATRIX_TRANSPOSE_TILE 32
+
+typedef struct {
+    Matrix* dest;
+    const Matrix* a;
+} _MatrixTransposeTask;
+
+// Handles dest rows [begin, end) tile by tile
+static void _matrix_transpose_range(void* ctx, long long begin,
+                                    long long end) {
+    _MatrixTransposeTask* t = ctx;
+    for (int i0 = (int)begin; i0 < end; i0 += _MATRIX_TRANSPOSE_TILE) {
+        int i1 = _MATRIX_MIN(i0 + _MATRIX_TRANSPOSE_TILE, (int)end);
+        for (int j0 = 0; j0 < t->dest->cols; j0 += _MATRIX_TRANSPOSE_TILE) {
+            int j1 = _MATRIX_MIN(j0 + _MATRIX_TRANSPOSE_TILE, t->dest->cols);
+            for (int i = i0; i < i1; i++) {
+                for (int j = j0; j < j1; j++) {
+                    MAT_AT(t->dest, i, j) = MAT_AT(t->a, j, i);
+                }
             }
         }
     }
@@ -260,71 +3026,113 @@ void matrixMulti(Matrix* dest, const Matrix* a, const Matrix* b) {
 
 void matrixTranspose(Matrix* dest, const Matrix* a) {
     assert(dest->cols == a->rows && dest->rows == a->cols);
-    for (int i = 0; i < dest->rows; i++) {
-        for (int j = 0; j < dest->cols; j++) {
-            MAT_AT(dest, i, j) = MAT_AT(a, j, i);
-        }
+    _MatrixTransposeTask t = {dest, a};
+    if (_MATRIX_LEN(a) < MATRIX_PARALLEL_MIN) {
+        _matrix_transpose_range(&t, 0, dest->rows);
+        return;
     }
+    tpoolParallelFor(dest->rows, _MATRIX_TRANSPOSE_TILE,
+                     _matrix_transpose_range, &t);
 }
 
 void matrixCopy(Matrix* dest, const Matrix* a) {
     assert(dest->cols == a->cols && dest->rows == a->rows);
+    _matrix_ew_mat(_MATRIX_EW_COPY, dest, a, NULL, 0);
+}
+
+void matrixToDouble(double* dest, const Matrix* a) {
     for (int i = 0; i < a->rows; i++) {
         for (int j = 0; j < a->cols; j++) {
-            MAT_AT(dest, i, j) = MAT_AT(a, i, j);
+            *dest++ = MAT_AT(a, i, j);
         }
     }
 }
 
-Matrix matRow(Matrix* m, int row) {
-    return (Matrix){.rows = 1, .cols = m->cols, .data = &MAT_AT(m, row, 0)};
-}
-
-void matFunc(Matrix* m, double (*callbackFunc)(double d)) {
-    for (int i = 0; i < m->rows; i++) {
-        for (int j = 0; j < m->cols; j++) {
-            MAT_AT(m, i, j) = callbackFunc(MAT_AT(m, i, j));
+void matrixFromDouble(Matrix* dest, const double* src) {
+    for (int i = 0; i < dest->rows; i++) {
+        for (int j = 0; j < dest->cols; j++) {
+            MAT_AT(dest, i, j) = (mfloat)*src++;
         }
     }
 }
 
+Matrix matView(mfloat* data, int rows, int cols) {
+    return (Matrix){.data = data, .rows = rows, .cols = cols, .stride = cols};
+}
+
+Matrix matSlice(const Matrix* m, int row, int col, int rows, int cols) {
+    MATRIX_ASSERT(row >= 0 && col >= 0 && row + rows <= m->rows &&
+                  col + cols <= m->cols);
+    Matrix v = *m;
+    v.data = &MAT_AT(m, row, col);
+    v.rows = rows;
+    v.cols = cols;
+    return v;
+}
+
+Matrix matRows(const Matrix* m, int row, int count) {
+    return matSlice(m, row, 0, count, m->cols);
+}
+
+Matrix matCols(const Matrix* m, int col, int count) {
+    return matSlice(m, 0, col, m->rows, count);
+}
+
+Matrix matRow(const Matrix* m, int row) {
+    return matSlice(m, row, 0, 1, m->cols);
+}
+
+Matrix matT(const Matrix* m) {
+    Matrix v = *m;
+    v.rows = m->cols;
+    v.cols = m->rows;
+    v.transposed = !m->transposed;
+    return v;
+}
+
 void matrixShuffleRows(Matrix* m) {
-    for (int i = 0; i < m->rows; i++) {
-        int randRow = (i + rand()) & (m->rows - i);
+    if (m->rows < 2) {
+        return;
+    }
+    long long* swaps = MATRIX_MALLOC(sizeof(long long) * m->rows);
+    matrixRngSwaps(&_matrixRng, swaps, m->rows);
+    for (int i = m->rows - 1; i > 0; i--) {
+        int randRow = (int)swaps[i];
         for (int j = 0; j < m->cols; j++) {
-            double save = MAT_AT(m, i, j);
+            mfloat save = MAT_AT(m, i, j);
             MAT_AT(m, i, j) = MAT_AT(m, randRow, j);
             MAT_AT(m, randRow, j) = save;
         }
     }
+    MATRIX_FREE(swaps);
 }
 
 void matrixRowSwap(Matrix* m1, int row1, Matrix* m2, int row2) {
-    double save = MAT_AT(m1, row1, row2);
+    mfloat save = MAT_AT(m1, row1, row2);
     MAT_AT(m1, row1, row2) = MAT_AT(m2, row2, row1);
     MAT_AT(m2, row2, row1) = save;
 }
 
-void matrixRowScalar(Matrix* m, int row, double val) {
-    for (int j = 0; j < m->cols; j++) {
-        MAT_AT(m, row, j) *= val;
-    }
+void matrixRowScalar(Matrix* m, int row, mfloat val) {
+    MATRIX_ASSERT(!m->transposed);
+    mfloat* r = &MAT_AT(m, row, 0);
+    _matrixKernels.scale(r, r, val, m->cols);
 }
 
 void matrixRowAdd(Matrix* m1, int row1, const Matrix* m2, int row2) {
     assert(m1->rows == m2->rows && m1->cols == m2->cols);
-    for (int j = 0; j < m1->cols; j++) {
-        MAT_AT(m1, row1, j) += MAT_AT(m2, row2, j);
-    }
+    MATRIX_ASSERT(!m1->transposed && !m2->transposed);
+    mfloat* r = &MAT_AT(m1, row1, 0);
+    _matrixKernels.add(r, r, &MAT_AT(m2, row2, 0), m1->cols);
 }
 
 Matrix* matrixRowAddDestCreate(const Matrix* m1, int row1, const Matrix* m2,
                                int row2) {
     assert(m1->rows == m2->rows && m1->cols == m2->cols);
+    MATRIX_ASSERT(!m1->transposed && !m2->transposed);
     Matrix* dest = matrixCreate(1, m1->cols);
-    for (int j = 0; j < m1->cols; j++) {
-        MAT_AT(dest, 0, j) = MAT_AT(m1, row1, j) + MAT_AT(m2, row2, j);
-    }
+    _matrixKernels.add(dest->data, &MAT_AT(m1, row1, 0), &MAT_AT(m2, row2, 0),
+                       m1->cols);
     return dest;
 }
 
@@ -0,0 +1,632 @@
+// No pragma once on purpose. matrix.h includes this once per instruction set
+// to stamp out the SIMD kernels, don't include it yourself.
+//
+// Expects these to be defined before including:
+//     MK_ISA    Suffix for the function names (sse2, avx2, ...)
+//     MK_TARGET The gcc/clang target string (e.g. "avx2,fma")
+//     MK_BYTES  Vector register width in bytes
+//     MK_MR     GEMM microkernel rows
+//     MK_NRV    GEMM microkernel cols, in vectors
+
+#define _MK_CAT2(a, b) a##_##b
+#define _MK_CAT(a, b) _MK_CAT2(a, b)
+#define _MK(name) _MK_CAT(name, MK_ISA)
+
+// aligned(sizeof(mfloat)) makes every load/store through this type unaligned
+// and may_alias lets it point at plain mfloat buffers
+typedef mfloat _MK(_matrix_vec)
+    __attribute__((vector_size(MK_BYTES), aligned(sizeof(mfloat)), may_alias));
+
+#define _MK_V _MK(_matrix_vec)
+#define _MK_VL (MK_BYTES / (int)sizeof(mfloat))
+#define _MK_NR (MK_NRV * _MK_VL)
+#define _MK_ATTR __attribute__((target(MK_TARGET)))
+#define _MK_LD(p) (*(const _MK_V*)(p))
+#define _MK_ST(p) (*(_MK_V*)(p))
+
+// Tile size the GEMM driver packs for
+enum { _MK(_MATRIX_MR) = MK_MR, _MK(_MATRIX_NR) = _MK_NR };
+
+// Four vectors per trip so there are enough independent loads in flight to
+// saturate the memory bus, then one vector at a time, then scalar for the tail
+#define _MK_BINARY(name, op)                                                   \
+    _MK_ATTR static void _MK(name)(mfloat* d, const mfloat* a,                 \
+                                   const mfloat* b, long long n) {             \
+        long long i = 0;                                                       \
+        for (; i + 4 * _MK_VL <= n; i += 4 * _MK_VL) {                         \
+            _MK_V a0 = _MK_LD(a + i);                                          \
+            _MK_V a1 = _MK_LD(a + i + _MK_VL);                                 \
+            _MK_V a2 = _MK_LD(a + i + 2 * _MK_VL);                             \
+            _MK_V a3 = _MK_LD(a + i + 3 * _MK_VL);                             \
+            _MK_V b0 = _MK_LD(b + i);                                          \
+            _MK_V b1 = _MK_LD(b + i + _MK_VL);                                 \
+            _MK_V b2 = _MK_LD(b + i + 2 * _MK_VL);                             \
+            _MK_V b3 = _MK_LD(b + i + 3 * _MK_VL);                             \
+            _MK_ST(d + i) = a0 op b0;                                          \
+            _MK_ST(d + i + _MK_VL) = a1 op b1;                                 \
+            _MK_ST(d + i + 2 * _MK_VL) = a2 op b2;                             \
+            _MK_ST(d + i + 3 * _MK_VL) = a3 op b3;                             \
+        }                                                                      \
+        for (; i + _MK_VL <= n; i += _MK_VL) {                                 \
+            _MK_ST(d + i) = _MK_LD(a + i) op _MK_LD(b + i);                    \
+        }                                                                      \
+        for (; i < n; i++) {                                                   \
+            d[i] = a[i] op b[i];                                               \
+        }                                                                      \
+    }
+
+_MK_BINARY(_matrix_add, +)
+_MK_BINARY(_matrix_sub, -)
+
+_MK_ATTR static void _MK(_matrix_scale)(mfloat* d, const mfloat* a, mfloat val,
+                                        long long n) {
+    long long i = 0;
+    for (; i + 4 * _MK_VL <= n; i += 4 * _MK_VL) {
+        _MK_V a0 = _MK_LD(a + i);
+        _MK_V a1 = _MK_LD(a + i + _MK_VL);
+        _MK_V a2 = _MK_LD(a + i + 2 * _MK_VL);
+        _MK_V a3 = _MK_LD(a + i + 3 * _MK_VL);
+        _MK_ST(d + i) = a0 * val;
+        _MK_ST(d + i + _MK_VL) = a1 * val;
+        _MK_ST(d + i + 2 * _MK_VL) = a2 * val;
+        _MK_ST(d + i + 3 * _MK_VL) = a3 * val;
+    }
+    for (; i + _MK_VL <= n; i += _MK_VL) {
+        _MK_ST(d + i) = _MK_LD(a + i) * val;
+    }
+    for (; i < n; i++) {
+        d[i] = a[i] * val;
+    }
+}
+
+_MK_ATTR static void _MK(_matrix_fill)(mfloat* d, mfloat val, long long n) {
+    _MK_V v = (_MK_V){0} + val;
+    long long i = 0;
+    for (; i + 4 * _MK_VL <= n; i += 4 * _MK_VL) {
+        _MK_ST(d + i) = v;
+        _MK_ST(d + i + _MK_VL) = v;
+        _MK_ST(d + i + 2 * _MK_VL) = v;
+        _MK_ST(d + i + 3 * _MK_VL) = v;
+    }
+    for (; i + _MK_VL <= n; i += _MK_VL) {
+        _MK_ST(d + i) = v;
+    }
+    for (; i < n; i++) {
+        d[i] = val;
+    }
+}
+
+// MK_MR x MK_NRV accumulators stay in registers for the whole k loop. Each k
+// step is MK_NRV loads of B, MK_MR broadcasts of A and MK_MR * MK_NRV FMAs.
+_MK_ATTR static void _MK(_matrix_gemm_micro)(int kc, const mfloat* restrict ap,
+                                             const mfloat* restrict bp,
+                                             mfloat* c, int ldc, int mr,
+                                             int nr, mfloat alpha,
+                                             mfloat beta,
+                                             const _MatrixEpilogue* ep) {
+    _MK_V acc[MK_MR][MK_NRV];
+#pragma GCC unroll 16
+    for (int i = 0; i < MK_MR; i++) {
+#pragma GCC unroll 4
+        for (int j = 0; j < MK_NRV; j++) {
+            acc[i][j] = (_MK_V){0};
+        }
+    }
+    for (int k = 0; k < kc; k++) {
+        _MK_V bv[MK_NRV];
+#pragma GCC unroll 4
+        for (int j = 0; j < MK_NRV; j++) {
+            bv[j] = _MK_LD(bp + j * _MK_VL);
+        }
+#pragma GCC unroll 16
+        for (int i = 0; i < MK_MR; i++) {
+            mfloat av = ap[i];
+#pragma GCC unroll 4
+            for (int j = 0; j < MK_NRV; j++) {
+                acc[i][j] += bv[j] * av;
+            }
+        }
+        ap += MK_MR;
+        bp += _MK_NR;
+    }
+
+    if (!ep && mr == MK_MR && nr == _MK_NR) {
+#pragma GCC unroll 16
+        for (int i = 0; i < MK_MR; i++) {
+            mfloat* crow = c + (long long)i * ldc;
+#pragma GCC unroll 4
+            for (int j = 0; j < MK_NRV; j++) {
+                // beta of 0 must not read c, it might be uninitialized
+                if (beta == 0) {
+                    _MK_ST(crow + j * _MK_VL) = acc[i][j] * alpha;
+                } else {
+                    _MK_ST(crow + j * _MK_VL) =
+                        acc[i][j] * alpha + _MK_LD(crow + j * _MK_VL) * beta;
+                }
+            }
+        }
+        return;
+    }
+
+    // Ragged edge tile or an epilogue to run, spill and store only the valid
+    // part. The tile is still in L1 when the epilogue gets to it.
+    mfloat tmp[MK_MR][_MK_NR];
+    for (int i = 0; i < MK_MR; i++) {
+        for (int j = 0; j < MK_NRV; j++) {
+            _MK_ST(&tmp[i][j * _MK_VL]) = acc[i][j];
+        }
+    }
+    for (int i = 0; i < mr; i++) {
+        mfloat* crow = c + (long long)i * ldc;
+        for (int j = 0; j < nr; j++) {
+            crow[j] = alpha * tmp[i][j] + (beta == 0 ? 0 : beta * crow[j]);
+        }
+        if (ep) {
+            _matrix_epilogue_row(ep, crow, i, nr);
+        }
+    }
+}
+
+// One row of a GEMM too small to pack, c = alpha * a * b + beta * c with b row
+// major and the row of a read every aStep. Four vectors of c stay in
+// registers for the whole k loop, then one at a time, then scalar.
+_MK_ATTR static void _MK(_matrix_gemm_row)(int n, int k, const mfloat* a,
+                                           long long aStep, const mfloat* b,
+                                           int ldb, mfloat* c, mfloat alpha,
+                                           mfloat beta) {
+    int j = 0;
+    for (; j + 4 * _MK_VL <= n; j += 4 * _MK_VL) {
+        _MK_V acc[4] = {{0}};
+        const mfloat* bp = b + j;
+        for (int p = 0; p < k; p++) {
+            mfloat av = a[p * aStep];
+#pragma GCC unroll 4
+            for (int v = 0; v < 4; v++) {
+                acc[v] += _MK_LD(bp + v * _MK_VL) * av;
+            }
+            bp += ldb;
+        }
+#pragma GCC unroll 4
+        for (int v = 0; v < 4; v++) {
+            // beta of 0 must not read c, it might be uninitialized
+            mfloat* cp = c + j + v * _MK_VL;
+            _MK_ST(cp) = (beta == 0) ? acc[v] * alpha
+                                     : acc[v] * alpha + _MK_LD(cp) * beta;
+        }
+    }
+    for (; j + _MK_VL <= n; j += _MK_VL) {
+        _MK_V acc = {0};
+        for (int p = 0; p < k; p++) {
+            acc += _MK_LD(b + (long long)p * ldb + j) * a[p * aStep];
+        }
+        _MK_ST(c + j) = (beta == 0) ? acc * alpha
+                                    : acc * alpha + _MK_LD(c + j) * beta;
+    }
+    for (; j < n; j++) {
+        mfloat acc = 0;
+        for (int p = 0; p < k; p++) {
+            acc += b[(long long)p * ldb + j] * a[p * aStep];
+        }
+        c[j] = alpha * acc + (beta == 0 ? 0 : beta * c[j]);
+    }
+}
+
+// The vector extensions have no square root
+_MK_ATTR static inline _MK_V _MK(_matrix_vsqrt)(_MK_V x) {
+#if MK_BYTES == 64 && defined(MATRIX_FLOAT)
+    return (_MK_V)_mm512_sqrt_ps((__m512)x);
+#elif MK_BYTES == 64
+    return (_MK_V)_mm512_sqrt_pd((__m512d)x);
+#elif MK_BYTES == 32 && defined(MATRIX_FLOAT)
+    return (_MK_V)_mm256_sqrt_ps((__m256)x);
+#elif MK_BYTES == 32
+    return (_MK_V)_mm256_sqrt_pd((__m256d)x);
+#elif defined(MATRIX_FLOAT)
+    return (_MK_V)_mm_sqrt_ps((__m128)x);
+#else
+    return (_MK_V)_mm_sqrt_pd((__m128d)x);
+#endif
+}
+
+// The whole optimizer step for a vector at a time, params, gradients and
+// state each go through the core once
+_MK_ATTR static void _MK(_matrix_opt_step)(const _MatrixOptStep* s, mfloat* p,
+                                           mfloat* g, mfloat* m, mfloat* v,
+                                           long long n) {
+    long long i = 0;
+    switch (s->kind) {
+    case MATRIX_OPTIMIZER_SGD:
+        for (; i + _MK_VL <= n; i += _MK_VL) {
+            _MK_V gv = _MK_LD(g + i) + _MK_LD(p + i) * s->decay;
+            _MK_ST(p + i) = _MK_LD(p + i) - gv * s->rate;
+            _MK_ST(g + i) = (_MK_V){0};
+        }
+        break;
+    case MATRIX_OPTIMIZER_MOMENTUM:
+        for (; i + _MK_VL <= n; i += _MK_VL) {
+            _MK_V gv = _MK_LD(g + i) + _MK_LD(p + i) * s->decay;
+            _MK_V mv = _MK_LD(m + i) * s->beta1 + gv;
+            _MK_ST(m + i) = mv;
+            _MK_ST(p + i) = _MK_LD(p + i) - mv * s->rate;
+            _MK_ST(g + i) = (_MK_V){0};
+        }
+        break;
+    default:
+        for (; i + _MK_VL <= n; i += _MK_VL) {
+            _MK_V pv = _MK_LD(p + i);
+            _MK_V gv = _MK_LD(g + i) + pv * s->decay;
+            _MK_V mv = _MK_LD(m + i) * s->beta1 + gv * (1 - s->beta1);
+            _MK_V vv = _MK_LD(v + i) * s->beta2 + gv * gv * (1 - s->beta2);
+            _MK_ST(m + i) = mv;
+            _MK_ST(v + i) = vv;
+            _MK_ST(p + i) =
+                pv * s->shrink -
+                mv * s->mScale / (_MK(_matrix_vsqrt)(vv * s->vScale) + s->eps);
+            _MK_ST(g + i) = (_MK_V){0};
+        }
+        break;
+    }
+    _matrix_opt_step_scalar(s, p + i, g + i, m ? m + i : NULL,
+                            v ? v + i : NULL, n - i);
+}
+
+// The sparse kernels, the same loops as the scalar ones with every block done
+// a vector at a time for _MATRIX_SPARSE_ROWS rows at once. Fewer rows than
+// that go through the scalar kernels, it's only ever the end of a batch.
+// Plain CSR (blocks of 1) gains little from these.
+_MK_ATTR static void _MK(_matrix_sparse_row)(const MatrixSparse* s,
+                                             const mfloat* a, int lda,
+                                             mfloat* c, int ldc, int rows) {
+    if (rows < _MATRIX_SPARSE_ROWS) {
+        _matrix_sparse_row_scalar(s, a, lda, c, ldc, rows);
+        return;
+    }
+    int bw = s->blockCols;
+    mfloat* c0 = c;
+    mfloat* c1 = c0 + ldc;
+    mfloat* c2 = c1 + ldc;
+    mfloat* c3 = c2 + ldc;
+    for (int k = 0; k < s->rows; k++) {
+        if (s->rowStart[k] == s->rowStart[k + 1]) {
+            continue;
+        }
+        mfloat a0 = a[k], a1 = a[lda + k];
+        mfloat a2 = a[2LL * lda + k], a3 = a[3LL * lda + k];
+        if (a0 == 0 && a1 == 0 && a2 == 0 && a3 == 0) {
+            continue;
+        }
+        for (int b = s->rowStart[k]; b < s->rowStart[k + 1]; b++) {
+            const mfloat* vals = s->vals + (long long)b * bw;
+            int col = s->blockCol[b];
+            int n = _matrix_sparse_width(s, col);
+            int j = 0;
+            for (; j + _MK_VL <= n; j += _MK_VL) {
+                _MK_V v = _MK_LD(vals + j);
+                _MK_ST(c0 + col + j) = _MK_LD(c0 + col + j) + v * a0;
+                _MK_ST(c1 + col + j) = _MK_LD(c1 + col + j) + v * a1;
+                _MK_ST(c2 + col + j) = _MK_LD(c2 + col + j) + v * a2;
+                _MK_ST(c3 + col + j) = _MK_LD(c3 + col + j) + v * a3;
+            }
+            for (; j < n; j++) {
+                c0[col + j] += vals[j] * a0;
+                c1[col + j] += vals[j] * a1;
+                c2[col + j] += vals[j] * a2;
+                c3[col + j] += vals[j] * a3;
+            }
+        }
+    }
+}
+
+_MK_ATTR static inline mfloat _MK(_matrix_hsum)(_MK_V v) {
+    mfloat sum = 0;
+    for (int l = 0; l < _MK_VL; l++) {
+        sum += v[l];
+    }
+    return sum;
+}
+
+_MK_ATTR static void _MK(_matrix_sparse_row_t)(const MatrixSparse* s,
+                                               const mfloat* a, int lda,
+                                               mfloat* c, int ldc, int rows) {
+    if (rows < _MATRIX_SPARSE_ROWS) {
+        _matrix_sparse_row_t_scalar(s, a, lda, c, ldc, rows);
+        return;
+    }
+    int bw = s->blockCols;
+    for (int k = 0; k < s->rows; k++) {
+        if (s->rowStart[k] == s->rowStart[k + 1]) {
+            c[k] = c[ldc + k] = c[2LL * ldc + k] = c[3LL * ldc + k] = 0;
+            continue;
+        }
+        _MK_V acc0 = {0}, acc1 = {0}, acc2 = {0}, acc3 = {0};
+        mfloat t0 = 0, t1 = 0, t2 = 0, t3 = 0;
+        for (int b = s->rowStart[k]; b < s->rowStart[k + 1]; b++) {
+            const mfloat* vals = s->vals + (long long)b * bw;
+            const mfloat* ap = a + s->blockCol[b];
+            int n = _matrix_sparse_width(s, s->blockCol[b]);
+            int j = 0;
+            for (; j + _MK_VL <= n; j += _MK_VL) {
+                _MK_V v = _MK_LD(vals + j);
+                acc0 += _MK_LD(ap + j) * v;
+                acc1 += _MK_LD(ap + lda + j) * v;
+                acc2 += _MK_LD(ap + 2LL * lda + j) * v;
+                acc3 += _MK_LD(ap + 3LL * lda + j) * v;
+            }
+            for (; j < n; j++) {
+                t0 += ap[j] * vals[j];
+                t1 += ap[lda + j] * vals[j];
+                t2 += ap[2LL * lda + j] * vals[j];
+                t3 += ap[3LL * lda + j] * vals[j];
+            }
+        }
+        c[k] = t0 + _MK(_matrix_hsum)(acc0);
+        c[ldc + k] = t1 + _MK(_matrix_hsum)(acc1);
+        c[2LL * ldc + k] = t2 + _MK(_matrix_hsum)(acc2);
+        c[3LL * ldc + k] = t3 + _MK(_matrix_hsum)(acc3);
+    }
+}
+
+// Sums the samples' products before touching w, so it gets loaded and stored
+// once for all of them
+_MK_ATTR static void _MK(_matrix_sparse_grad)(const MatrixSparse* s, int k0,
+                                              int k1, const mfloat* a,
+                                              int lda, const mfloat* g,
+                                              int ldg, int rows, mfloat* w,
+                                              int ldw) {
+    if (rows < _MATRIX_SPARSE_ROWS) {
+        _matrix_sparse_grad_scalar(s, k0, k1, a, lda, g, ldg, rows, w, ldw);
+        return;
+    }
+    const mfloat* g0 = g;
+    const mfloat* g1 = g0 + ldg;
+    const mfloat* g2 = g1 + ldg;
+    const mfloat* g3 = g2 + ldg;
+    for (int k = k0; k < k1; k++) {
+        if (s->rowStart[k] == s->rowStart[k + 1]) {
+            continue;
+        }
+        mfloat a0 = a[k], a1 = a[lda + k];
+        mfloat a2 = a[2LL * lda + k], a3 = a[3LL * lda + k];
+        if (a0 == 0 && a1 == 0 && a2 == 0 && a3 == 0) {
+            continue;
+        }
+        mfloat* wrow = w + (long long)k * ldw;
+        for (int b = s->rowStart[k]; b < s->rowStart[k + 1]; b++) {
+            int col = s->blockCol[b];
+            int n = _matrix_sparse_width(s, col);
+            int j = col;
+            for (; j + _MK_VL <= col + n; j += _MK_VL) {
+                _MK_ST(wrow + j) = _MK_LD(wrow + j) + _MK_LD(g0 + j) * a0 +
+                                   _MK_LD(g1 + j) * a1 + _MK_LD(g2 + j) * a2 +
+                                   _MK_LD(g3 + j) * a3;
+            }
+            for (; j < col + n; j++) {
+                wrow[j] += g0[j] * a0 + g1[j] * a1 + g2[j] * a2 + g3[j] * a3;
+            }
+        }
+    }
+}
+
+//====================== Activations ======================
+// The same approximations as _matrix_expq and _matrix_tanh, a vector at a
+// time. Ragged ends get padded out to a whole vector rather than finished in
+// scalar, so every element goes through the same math wherever it sits.
+
+typedef _MatrixBits _MK(_matrix_vbits)
+    __attribute__((vector_size(MK_BYTES), aligned(sizeof(mfloat)), may_alias));
+
+#define _MK_VB _MK(_matrix_vbits)
+#define _MK_SPLAT(x) ((_MK_V){0} + (mfloat)(x))
+// The lanes of a where mask is set, of b elsewhere
+#define _MK_SEL(mask, a, b)                                                    \
+    ((_MK_V)(((_MK_VB)(mask) & (_MK_VB)(a)) | (~(_MK_VB)(mask) & (_MK_VB)(b))))
+
+// The first n lanes from p, the rest 0
+_MK_ATTR static inline _MK_V _MK(_matrix_vload)(const mfloat* p, int n) {
+    if (n >= _MK_VL) {
+        return _MK_LD(p);
+    }
+    _MK_V v = {0};
+    memcpy(&v, p, sizeof(mfloat) * n);
+    return v;
+}
+
+_MK_ATTR static inline void _MK(_matrix_vstore)(mfloat* p, _MK_V v, int n) {
+    if (n >= _MK_VL) {
+        _MK_ST(p) = v;
+        return;
+    }
+    memcpy(p, &v, sizeof(mfloat) * n);
+}
+
+_MK_ATTR static inline _MK_V _MK(_matrix_vexpq)(_MK_V x, _MK_V* s) {
+    _MK_V lo = _MK_SPLAT(_MATRIX_EXP_LO);
+    _MK_V hi = _MK_SPLAT(_MATRIX_EXP_HI);
+    x = _MK_SEL(x < lo, lo, x);
+    x = _MK_SEL(x > hi, hi, x);
+    _MK_V t = x * _MATRIX_LOG2E + _MATRIX_ROUND_MAGIC;
+    _MK_V n = t - _MATRIX_ROUND_MAGIC;
+    _MK_V r = x - n * _MATRIX_LN2_HI - n * _MATRIX_LN2_LO;
+    _MK_V q = _MK_SPLAT(_matrixExpPoly[0]);
+#pragma GCC unroll 16
+    for (int k = 1; k < _MATRIX_EXP_DEG; k++) {
+        q = q * r + _matrixExpPoly[k];
+    }
+    mfloat magic = _MATRIX_ROUND_MAGIC;
+    _MatrixBits magicBits;
+    memcpy(&magicBits, &magic, sizeof(magicBits));
+    *s = (_MK_V)(((_MK_VB)t - magicBits + _MATRIX_EXP_BIAS)
+                 << _MATRIX_MANT_BITS);
+    return q * r;
+}
+
+_MK_ATTR static inline _MK_V _MK(_matrix_vexp)(_MK_V x) {
+    _MK_V s;
+    _MK_V q = _MK(_matrix_vexpq)(x, &s);
+    return s + s * q;
+}
+
+_MK_ATTR static inline _MK_V _MK(_matrix_vtanh)(_MK_V x) {
+    _MK_VB sign = (_MK_VB)x & _MATRIX_SIGN_BIT;
+    _MK_V ax = (_MK_V)((_MK_VB)x & ~_MATRIX_SIGN_BIT);
+    _MK_V s;
+    _MK_V q = _MK(_matrix_vexpq)(ax * -2, &s);
+    _MK_V m = s * q + (s - 1);
+    _MK_V th = (0 - m) / (m + 2);
+    return (_MK_V)((_MK_VB)th | sign);
+}
+
+_MK_ATTR static inline _MK_V _MK(_matrix_vgelu)(_MK_V v) {
+    _MK_V u = (v + v * v * v * _MATRIX_GELU_K) * _MATRIX_GELU_C;
+    return v / (1 + _MK(_matrix_vexp)(u * -2));
+}
+
+_MK_ATTR static inline _MK_V _MK(_matrix_vgelu_grad)(_MK_V v) {
+    _MK_V u = (v + v * v * v * _MATRIX_GELU_K) * _MATRIX_GELU_C;
+    _MK_V e = _MK(_matrix_vexp)(u * -2);
+    _MK_V sig = 1 / (1 + e);
+    _MK_V du = (1 + v * v * (3 * _MATRIX_GELU_K)) * _MATRIX_GELU_C;
+    return sig + v * sig * (e * sig) * du * 2;
+}
+
+// A row at a time: its max, then e^(x - max) and their sum, then the scaling
+_MK_ATTR static void _MK(_matrix_softmax)(mfloat* x, int n) {
+    if (n <= 0) {
+        return;
+    }
+    _MK_V vmax = _MK_SPLAT(x[0]);
+    for (int i = 0; i < n; i += _MK_VL) {
+        // Padding with x[0] can't change the max
+        int len = n - i;
+        _MK_V v = _MK_SPLAT(x[0]);
+        memcpy(&v, x + i, sizeof(mfloat) * (len < _MK_VL ? len : _MK_VL));
+        vmax = _MK_SEL(v > vmax, v, vmax);
+    }
+    mfloat max = vmax[0];
+    for (int j = 1; j < _MK_VL; j++) {
+        max = vmax[j] > max ? vmax[j] : max;
+    }
+
+    _MK_V vsum = {0};
+    for (int i = 0; i < n; i += _MK_VL) {
+        int len = n - i;
+        _MK_V e = _MK(_matrix_vexp)(_MK(_matrix_vload)(x + i, len) - max);
+        if (len < _MK_VL) {
+            // The padding lanes don't count
+            for (int j = len; j < _MK_VL; j++) {
+                e[j] = 0;
+            }
+        }
+        vsum += e;
+        _MK(_matrix_vstore)(x + i, e, len);
+    }
+    mfloat sum = 0;
+    for (int j = 0; j < _MK_VL; j++) {
+        sum += vsum[j];
+    }
+    mfloat inv = 1 / sum;
+    for (int i = 0; i < n; i += _MK_VL) {
+        _MK(_matrix_vstore)(x + i, _MK(_matrix_vload)(x + i, n - i) * inv,
+                            n - i);
+    }
+}
+
+_MK_ATTR static void _MK(_matrix_act)(mfloat* x, int n, MATRIX_ACT act) {
+    if (act == MATRIX_ACT_SOFTMAX) {
+        _MK(_matrix_softmax)(x, n);
+        return;
+    }
+    for (int i = 0; i < n; i += _MK_VL) {
+        _MK_V v = _MK(_matrix_vload)(x + i, n - i);
+        switch (act) {
+        case MATRIX_ACT_NONE:
+        case MATRIX_ACT_SOFTMAX:
+            break;
+        case MATRIX_ACT_SIGMOID:
+            v = 1 / (1 + _MK(_matrix_vexp)(-v));
+            break;
+        case MATRIX_ACT_TANH:
+            v = _MK(_matrix_vtanh)(v);
+            break;
+        case MATRIX_ACT_RELU:
+            v = _MK_SEL(v > 0, v, _MK_SPLAT(0));
+            break;
+        case MATRIX_ACT_GELU:
+            v = _MK(_matrix_vgelu)(v);
+            break;
+        case MATRIX_ACT_LEAKY_RELU:
+            v = _MK_SEL(v > 0, v, v * (mfloat)MATRIX_LEAKY_SLOPE);
+            break;
+        }
+        _MK(_matrix_vstore)(x + i, v, n - i);
+    }
+}
+
+_MK_ATTR static void _MK(_matrix_act_back)(mfloat* g, const mfloat* y,
+                                           const mfloat* z, int n,
+                                           MATRIX_ACT act) {
+    if (act == MATRIX_ACT_SOFTMAX) {
+        // dL/dx_j = y_j * (g_j - sum_i g_i y_i), the padding is 0 in both
+        _MK_V vdot = {0};
+        for (int i = 0; i < n; i += _MK_VL) {
+            vdot += _MK(_matrix_vload)(g + i, n - i) *
+                    _MK(_matrix_vload)(y + i, n - i);
+        }
+        mfloat dot = 0;
+        for (int j = 0; j < _MK_VL; j++) {
+            dot += vdot[j];
+        }
+        for (int i = 0; i < n; i += _MK_VL) {
+            _MK_V gv = _MK(_matrix_vload)(g + i, n - i);
+            _MK_V yv = _MK(_matrix_vload)(y + i, n - i);
+            _MK(_matrix_vstore)(g + i, yv * (gv - dot), n - i);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i += _MK_VL) {
+        _MK_V gv = _MK(_matrix_vload)(g + i, n - i);
+        _MK_V yv = _MK(_matrix_vload)(y + i, n - i);
+        switch (act) {
+        case MATRIX_ACT_NONE:
+        case MATRIX_ACT_SOFTMAX:
+            break;
+        case MATRIX_ACT_SIGMOID:
+            gv *= yv * (1 - yv);
+            break;
+        case MATRIX_ACT_TANH:
+            gv *= 1 - yv * yv;
+            break;
+        case MATRIX_ACT_RELU:
+            gv = _MK_SEL(yv > 0, gv, _MK_SPLAT(0));
+            break;
+        case MATRIX_ACT_GELU:
+            gv *= _MK(_matrix_vgelu_grad)(_MK(_matrix_vload)(z + i, n - i));
+            break;
+        case MATRIX_ACT_LEAKY_RELU:
+            gv *= _MK_SEL(yv > 0, _MK_SPLAT(1),
+                          _MK_SPLAT(MATRIX_LEAKY_SLOPE));
+            break;
+        }
+        _MK(_matrix_vstore)(g + i, gv, n - i);
+    }
+}
+
+#undef _MK_SEL
+#undef _MK_SPLAT
+#undef _MK_VB
+
+#undef _MK_BINARY
+#undef _MK_ST
+#undef _MK_LD
+#undef _MK_ATTR
+#undef _MK_NR
+#undef _MK_VL
+#undef _MK_V
+#undef _MK
+#undef _MK_CAT
+#undef _MK_CAT2
+#undef MK_ISA
+#undef MK_TARGET
+#undef MK_BYTES
+#undef MK_MR
+#undef MK_NRV
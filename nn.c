@@ -1,25 +1,1824 @@
+#define NN_IMPLEMENTATION
 #include "nn.h"
 #include "dinoarray.h"
 #include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+
+//====================== Arenas ======================
+
+// Every view starts on a cache line
+#define _NN_ARENA_ALIGN (64 / (long long)sizeof(mfloat))
+
+enum {
+    _NN_VIEW_OUTPUT,
+    _NN_VIEW_PREACT,
+    _NN_VIEW_GS,
+    _NN_VIEW_WS,
+    _NN_VIEW_BS,
+    _NN_VIEW_WSU,
+    _NN_VIEW_BSU,
+    _NN_VIEW_COL,
+    _NN_VIEW_COUNT
+};
+
+static Matrix** _nn_layer_view(NN_Layer* l, int view) {
+    switch (view) {
+    case _NN_VIEW_OUTPUT:
+        return &l->output;
+    case _NN_VIEW_PREACT:
+        return &l->preact;
+    case _NN_VIEW_GS:
+        return &l->gs;
+    case _NN_VIEW_WS:
+        return &l->ws;
+    case _NN_VIEW_BS:
+        return &l->bs;
+    case _NN_VIEW_WSU:
+        return &l->wsu;
+    case _NN_VIEW_COL:
+        return &l->col;
+    default:
+        return &l->bsu;
+    }
+}
+
+static NN_Arena* _nn_view_arena(NN* nn, int view) {
+    switch (view) {
+    case _NN_VIEW_WS:
+    case _NN_VIEW_BS:
+        return &nn->params;
+    case _NN_VIEW_WSU:
+    case _NN_VIEW_BSU:
+        return &nn->grads;
+    default:
+        return &nn->acts;
+    }
+}
+
+// Grows an arena to hold at least `cap` mfloats. The new part is zeroed and
+// every view already in the arena gets pointed at the new memory.
+static void _nn_arena_grow(NN* nn, NN_Arena* a, long long cap) {
+    NN_ASSERT(!a->mapLen);
+    nn->compiled = 0;
+    void* mem = NN_MALLOC(sizeof(mfloat) * cap + 64);
+    mfloat* data = _MATRIX_ALIGN64(mem);
+    if (a->len > 0) {
+        memcpy(data, a->data, sizeof(mfloat) * a->len);
+    }
+    memset(data + a->len, 0, sizeof(mfloat) * (cap - a->len));
+
+    for (int i = 0; i < nn->layerCnt; i++) {
+        for (int v = 0; v < _NN_VIEW_COUNT; v++) {
+            Matrix* m = *_nn_layer_view(&nn->layers[i], v);
+            if (m && m->data && _nn_view_arena(nn, v) == a) {
+                m->data = data + (m->data - a->data);
+            }
+        }
+    }
+
+    if (a->mem) {
+        NN_FREE(a->mem);
+    }
+    a->mem = mem;
+    a->data = data;
+    a->cap = cap;
+}
+
+// Hands out `count` mfloats and returns where they start
+static long long _nn_arena_take(NN* nn, NN_Arena* a, long long count) {
+    long long off = a->len;
+    long long len = off + _MATRIX_ROUND_UP(count, _NN_ARENA_ALIGN);
+    if (len > a->cap) {
+        long long cap = a->cap ? a->cap : 1024;
+        while (cap < len) {
+            cap *= 2;
+        }
+        _nn_arena_grow(nn, a, cap);
+    }
+    a->len = len;
+    return off;
+}
+
+// Points one of the layer's view headers at fresh space in its arena. The
+// layer has to already be in nn->layers so it gets rebased if the arena moves.
+static Matrix* _nn_view_create(NN* nn, NN_Layer* l, int view, int rows,
+                               int cols) {
+    NN_Arena* a = _nn_view_arena(nn, view);
+    nn->compiled = 0;
+    long long off = _nn_arena_take(nn, a, (long long)rows * cols);
+    Matrix* m = &l->views[view];
+    *m = matView(a->data + off, rows, cols);
+    *_nn_layer_view(l, view) = m;
+    return m;
+}
+
+static void _nn_arena_free(NN_Arena* a) {
+    if (a->mapLen) {
+        munmap(a->mem, a->mapLen);
+    } else if (a->mem) {
+        NN_FREE(a->mem);
+    }
+    *a = (NN_Arena){0};
+}
+
+static NN _nn_create(MatrixRng rng) {
+    NN nn = {0};
+    nn.layers = dinoCreate(NN_Layer);
+    nn.batch = 1;
+    nn.rng = rng;
+    return nn;
+}
+
+NN nnCreate(void) {
+    return _nn_create(matrixRngStream());
+}
+
+static void _nn_replicas_free(NN* nn);
+
+void nnFree(NN* nn) {
+    _nn_replicas_free(nn);
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_FREE(nn->layers[i].views);
+    }
+    dinoDestroy(nn->layers);
+    _nn_arena_free(&nn->params);
+    _nn_arena_free(&nn->grads);
+    _nn_arena_free(&nn->acts);
+    _nn_arena_free(&nn->state);
+    _nn_arena_free(&nn->sparse);
+    if (nn->master) {
+        NN_FREE(nn->master);
+    }
+    nn->master = NULL;
+    if (nn->ops) {
+        NN_FREE(nn->ops);
+    }
+    nn->ops = NULL;
+    nn->compiled = 0;
+    nn->layers = NULL;
+    nn->layerCnt = 0;
+}
+
+void nnZeroGrads(NN* nn) {
+    if (nn->grads.len > 0) {
+        memset(nn->grads.data, 0, sizeof(mfloat) * nn->grads.len);
+    }
+}
+
+Matrix nnParamsView(NN* nn) {
+    return matView(nn->params.data, 1, (int)nn->params.len);
+}
+
+Matrix nnGradsView(NN* nn) {
+    return matView(nn->grads.data, 1, (int)nn->grads.len);
+}
+
+//====================== Layers ======================
+
+// The layers live in a dino array that moves when it grows, so the prev/next
+// links get rebuilt every time a layer is added
+static void _nn_link_layers(NN* nn) {
+    for (int i = 0; i < nn->layerCnt; i++) {
+        nn->layers[i].prev = (i > 0) ? &nn->layers[i - 1] : NULL;
+        nn->layers[i].next =
+            (i < nn->layerCnt - 1) ? &nn->layers[i + 1] : NULL;
+    }
+}
+
+// Pushes a layer and hands back where it ended up
+static NN_Layer* _nn_layer_push(NN* nn, NN_Layer l) {
+    l.views = NN_MALLOC(sizeof(Matrix) * _NN_VIEW_COUNT);
+    dinoPush(nn->layers, l);
+    nn->layerCnt++;
+    nn->compiled = 0;
+    _nn_link_layers(nn);
+    return &nn->layers[nn->layerCnt - 1];
+}
 
 void layerCreateInput(NN* nn, int width, int height, int depth){
     NN_ASSERT(nn->layerCnt <= 0);
-    NN_Layer* l = (NN_Layer*)NN_MALLOC(sizeof(NN_Layer));
+    NN_Layer l = {0};
+    l.layerType = LAYER_TYPE_INPUT;
+
+    l.width = width;
+    l.height = height;
+    l.depth = depth;
+
+    l.nodeCnt = width * height * depth;
+
+    NN_Layer* in = _nn_layer_push(nn, l);
+    _nn_view_create(nn, in, _NN_VIEW_OUTPUT, nn->batch, in->nodeCnt);
+}
+
+// Gets the current last layer ready to have another layer added after it
+static void _nn_layer_append(NN* nn) {
+    NN_ASSERT(nn->layerCnt > 0 && !nn->frozen);
+    NN_Layer* prev = &nn->layers[nn->layerCnt - 1];
+    if (prev->layerType == LAYER_TYPE_OUTPUT) {
+        prev->layerType = LAYER_TYPE_HIDDEN;
+    }
+}
+
+// The views every layer with weights has. `l` has to be pushed already.
+static void _nn_layer_views(NN* nn, NN_Layer* l, int wsRows, int bsCols,
+                            char fillWithRand) {
+    _nn_view_create(nn, l, _NN_VIEW_OUTPUT, nn->batch, l->nodeCnt);
+    _nn_view_create(nn, l, _NN_VIEW_GS, nn->batch, l->nodeCnt);
+    // Only GELU can't get its derivative back from the output
+    if (l->act == MATRIX_ACT_GELU) {
+        _nn_view_create(nn, l, _NN_VIEW_PREACT, nn->batch, l->nodeCnt);
+    }
+    // The layer before now needs somewhere to put its gradients
+    if (l->prev->layerType != LAYER_TYPE_INPUT && !l->prev->gs) {
+        _nn_view_create(nn, l->prev, _NN_VIEW_GS, nn->batch,
+                        l->prev->nodeCnt);
+    }
+
+    // Taken in lockstep so every update sits at the same offset as its param.
+    // Fresh arena space is already zeroed.
+    _nn_view_create(nn, l, _NN_VIEW_WS, wsRows, bsCols);
+    _nn_view_create(nn, l, _NN_VIEW_WSU, wsRows, bsCols);
+    _nn_view_create(nn, l, _NN_VIEW_BS, 1, bsCols);
+    _nn_view_create(nn, l, _NN_VIEW_BSU, 1, bsCols);
+    NN_ASSERT(l->ws->data - nn->params.data == l->wsu->data - nn->grads.data);
+    if (fillWithRand) {
+        // Uniform with the variance of He/Glorot, keeps the activations from
+        // growing or shrinking layer after layer
+        int fanIn = wsRows;
+        int fanOut = bsCols;
+        if (l->kind == LAYER_KIND_CONV) {
+            fanOut *= l->conv.kernelSize * l->conv.kernelSize;
+        }
+        char relu = l->act == MATRIX_ACT_RELU ||
+                    l->act == MATRIX_ACT_LEAKY_RELU ||
+                    l->act == MATRIX_ACT_GELU;
+        mfloat limit = relu ? sqrt(6.0 / fanIn) : sqrt(6.0 / (fanIn + fanOut));
+        matrixRandRng(l->ws, &nn->rng, -limit, limit);
+    }
+}
+
+void layerCreateFull(NN* nn, int nodeCnt, MATRIX_ACT act, char fillWithRand){
+    _nn_layer_append(nn);
+
+    NN_Layer l = {0};
+    l.layerType = LAYER_TYPE_OUTPUT;
+    l.kind = LAYER_KIND_FULL;
+    l.width = nodeCnt;
+    l.height = 1;
+    l.depth = 1;
+    l.nodeCnt = nodeCnt;
+    l.act = act;
+
+    NN_Layer* full = _nn_layer_push(nn, l);
+    _nn_layer_views(nn, full, full->prev->nodeCnt, nodeCnt, fillWithRand);
+}
+
+void layerCreateConv(NN* nn, int filters, int kernelSize, int stride,
+                     int paddingSize, MATRIX_ACT act, char fillWithRand) {
+    _nn_layer_append(nn);
+    NN_Layer* prev = &nn->layers[nn->layerCnt - 1];
+    NN_ASSERT(kernelSize > 0 && stride > 0 && paddingSize >= 0);
+    // A sample's row mixes channels and pixels, there's nothing to normalize
+    NN_ASSERT(act != MATRIX_ACT_SOFTMAX);
+    NN_ASSERT(prev->width + 2 * paddingSize >= kernelSize &&
+              prev->height + 2 * paddingSize >= kernelSize);
+
+    NN_Layer l = {0};
+    l.layerType = LAYER_TYPE_OUTPUT;
+    l.kind = LAYER_KIND_CONV;
+    l.width = (prev->width + 2 * paddingSize - kernelSize) / stride + 1;
+    l.height = (prev->height + 2 * paddingSize - kernelSize) / stride + 1;
+    l.depth = filters;
+    l.nodeCnt = l.width * l.height * l.depth;
+    l.act = act;
+    l.conv.kernelSize = kernelSize;
+    l.conv.paddingSize = paddingSize;
+    l.conv.stride = stride;
+    l.conv.layout = nn->layout;
+    l.conv.direct = nn->layout == NN_LAYOUT_NCHW && kernelSize == 3 &&
+                    stride == 1 && prev->depth * filters <= NN_CONV_DIRECT_MAX;
 
-    l->width = width;
-    l->height = height;
-    l->depth = depth;
+    int colLen = kernelSize * kernelSize * prev->depth;
+    NN_Layer* conv = _nn_layer_push(nn, l);
+    _nn_layer_views(nn, conv, colLen, filters, fillWithRand);
+    // One row per output pixel for NHWC, one row per filter tap for NCHW
+    if (nn->layout == NN_LAYOUT_NHWC) {
+        _nn_view_create(nn, conv, _NN_VIEW_COL, conv->width * conv->height,
+                        colLen);
+    } else {
+        _nn_view_create(nn, conv, _NN_VIEW_COL, colLen,
+                        conv->width * conv->height);
+    }
+}
+
+static void _nn_full_forward(NN_Layer* l) {
+    if (l->wsq.data) {
+        matrixGemmInt8(l->output, l->prev->output, l->inScale, &l->wsq, l->bs,
+                       l->act);
+        return;
+    }
+    if (l->wss.vals) {
+        matrixGemmSparse(l->output, l->prev->output, &l->wss, l->bs, l->act,
+                         l->preact);
+        return;
+    }
+    if (l->wsp.data) {
+        matrixGemmPacked(l->output, l->prev->output, &l->wsp, l->bs, l->act,
+                         l->preact);
+        return;
+    }
+    matrixGemmFused(l->output, l->prev->output, l->ws, l->bs, l->act,
+                    l->preact);
+}
+
+// `act` is the activation whose derivative gs still needs, l->act or NONE if
+// the loss gradient already went through it
+static void _nn_full_backward(NN_Layer* l, MATRIX_ACT act) {
+    // gs becomes the gradient w.r.t. the pre-activation, bsu gets it too
+    matrixActBackward(l->gs, l->output, l->preact, act, l->bsu);
+
+    if (l->wss.vals) {
+        matrixGemmSparseGrad(l->wsu, l->prev->output, l->gs, &l->wss);
+        if (l->prev->gs) {
+            matrixGemmSparseT(l->prev->gs, l->gs, &l->wss);
+        }
+        return;
+    }
+
+    // The transposes are views, nothing gets copied
+    Matrix inT = matT(l->prev->output);
+    matrixGemm(l->wsu, &inT, l->gs, 1, 1);
+
+    if (l->prev->gs) {
+        Matrix wsT = matT(l->ws);
+        matrixGemm(l->prev->gs, l->gs, &wsT, 1, 0);
+    }
+}
+
+//====================== Conv ======================
+
+// The shape of a conv layer, input and output
+typedef struct {
+    int c, h, w; // Input channels, height, width
+    int f, oh, ow; // Output channels, height, width
+    int k, s, p; // Kernel size, stride, padding
+    NN_LAYOUT layout;
+} _NN_ConvShape;
+
+static _NN_ConvShape _nn_conv_shape(const NN_Layer* l) {
+    return (_NN_ConvShape){
+        .c = l->prev->depth,
+        .h = l->prev->height,
+        .w = l->prev->width,
+        .f = l->depth,
+        .oh = l->height,
+        .ow = l->width,
+        .k = l->conv.kernelSize,
+        .s = l->conv.stride,
+        .p = l->conv.paddingSize,
+        .layout = l->conv.layout,
+    };
+}
+
+// One sample of an image matrix as its pixels x channels (NHWC) or channels x
+// pixels (NCHW) matrix
+static Matrix _nn_conv_sample(const Matrix* m, int sample, int pixels,
+                              int channels, NN_LAYOUT layout) {
+    mfloat* row = &MAT_AT(m, sample, 0);
+    return layout == NN_LAYOUT_NHWC ? matView(row, pixels, channels)
+                                    : matView(row, channels, pixels);
+}
+
+// Lays every receptive field of one sample out as a row (NHWC) or column
+// (NCHW) of col, so the convolution becomes a single GEMM. With `add` it
+// runs the other way (col2im) and sums col back into the image instead.
+static void _nn_im2col(const _NN_ConvShape* cs, mfloat* img, Matrix* col,
+                       char add) {
+    if (cs->layout == NN_LAYOUT_NHWC) {
+        for (int oy = 0; oy < cs->oh; oy++) {
+            for (int ox = 0; ox < cs->ow; ox++) {
+                mfloat* dst = &MAT_AT(col, oy * cs->ow + ox, 0);
+                for (int ky = 0; ky < cs->k; ky++) {
+                    int iy = oy * cs->s - cs->p + ky;
+                    for (int kx = 0; kx < cs->k; kx++, dst += cs->c) {
+                        int ix = ox * cs->s - cs->p + kx;
+                        char in =
+                            iy >= 0 && iy < cs->h && ix >= 0 && ix < cs->w;
+                        mfloat* src =
+                            img + ((long long)iy * cs->w + ix) * cs->c;
+                        if (add) {
+                            for (int c = 0; in && c < cs->c; c++) {
+                                src[c] += dst[c];
+                            }
+                        } else if (in) {
+                            memcpy(dst, src, sizeof(mfloat) * cs->c);
+                        } else {
+                            memset(dst, 0, sizeof(mfloat) * cs->c);
+                        }
+                    }
+                }
+            }
+        }
+        return;
+    }
+
+    for (int c = 0; c < cs->c; c++) {
+        mfloat* plane = img + (long long)c * cs->h * cs->w;
+        for (int ky = 0; ky < cs->k; ky++) {
+            for (int kx = 0; kx < cs->k; kx++) {
+                mfloat* dst = &MAT_AT(col, (c * cs->k + ky) * cs->k + kx, 0);
+                for (int oy = 0; oy < cs->oh; oy++, dst += cs->ow) {
+                    int iy = oy * cs->s - cs->p + ky;
+                    if (iy < 0 || iy >= cs->h) {
+                        if (!add) {
+                            memset(dst, 0, sizeof(mfloat) * cs->ow);
+                        }
+                        continue;
+                    }
+                    mfloat* src = plane + (long long)iy * cs->w;
+                    for (int ox = 0; ox < cs->ow; ox++) {
+                        int ix = ox * cs->s - cs->p + kx;
+                        char in = ix >= 0 && ix < cs->w;
+                        if (add) {
+                            if (in) {
+                                src[ix] += dst[ox];
+                            }
+                        } else {
+                            dst[ox] = in ? src[ix] : 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    const _NN_ConvShape* cs;
+    const mfloat* in;
+    mfloat* out;
+    const Matrix* ws;
+    const Matrix* bs;
+} _NN_ConvDirectTask;
+
+// Filters the NCHW direct kernel does per pass over the input
+#define _NN_CONV_FB 4
+
+// Direct 3x3 stride 1 NCHW, every index is a block of _NN_CONV_FB output
+// channels. Their output rows stay in L1 while every input row under them gets
+// loaded once and added into all of them, and there's no im2col buffer.
+static void _nn_conv_direct_nchw(void* ctx, long long begin, long long end) {
+    _NN_ConvDirectTask* t = ctx;
+    const _NN_ConvShape* cs = t->cs;
+    // Output columns where all three taps of a row land inside the input
+    int xa = _MATRIX_MIN(cs->p, cs->ow);
+    int xb = _MATRIX_MIN(cs->ow, cs->w + cs->p - 2);
+    xb = xb < xa ? xa : xb;
+    for (long long blk = begin; blk < end; blk++) {
+        int f0 = (int)blk * _NN_CONV_FB;
+        int fn = _MATRIX_MIN(_NN_CONV_FB, cs->f - f0);
+        for (int oy = 0; oy < cs->oh; oy++) {
+            mfloat* o[_NN_CONV_FB];
+            for (int fi = 0; fi < _NN_CONV_FB; fi++) {
+                // Short blocks just repeat their last filter
+                int f = f0 + _MATRIX_MIN(fi, fn - 1);
+                o[fi] = t->out + ((long long)f * cs->oh + oy) * cs->ow;
+                for (int ox = 0; ox < cs->ow; ox++) {
+                    o[fi][ox] = MAT_AT(t->bs, 0, f);
+                }
+            }
+            for (int c = 0; c < cs->c; c++) {
+                for (int ky = 0; ky < 3; ky++) {
+                    int iy = oy - cs->p + ky;
+                    if (iy < 0 || iy >= cs->h) {
+                        continue;
+                    }
+                    // r[ox + kx] is the input under tap kx of output ox
+                    const mfloat* r =
+                        t->in + ((long long)c * cs->h + iy) * cs->w - cs->p;
+                    const mfloat* wrow = &MAT_AT(t->ws, c * 9 + ky * 3, f0);
+                    long long ld = t->ws->stride;
+                    for (int fi = 0; fi < fn; fi++) {
+                        mfloat w0 = wrow[fi];
+                        mfloat w1 = wrow[ld + fi];
+                        mfloat w2 = wrow[2 * ld + fi];
+                        mfloat* restrict of = o[fi];
+                        for (int ox = xa; ox < xb; ox++) {
+                            of[ox] += w0 * r[ox] + w1 * r[ox + 1] +
+                                      w2 * r[ox + 2];
+                        }
+                        // The padded edges, one tap at a time
+                        for (int ox = 0; ox < cs->ow; ox++) {
+                            if (ox == xa && (ox = xb) >= cs->ow) {
+                                break;
+                            }
+                            for (int kx = 0; kx < 3; kx++) {
+                                int ix = ox - cs->p + kx;
+                                if (ix >= 0 && ix < cs->w) {
+                                    of[ox] += wrow[kx * ld + fi] * r[ox + kx];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void _nn_conv_forward(NN_Layer* l) {
+    _NN_ConvShape cs = _nn_conv_shape(l);
+    int pixels = cs.oh * cs.ow;
+    for (int n = 0; n < l->output->rows; n++) {
+        mfloat* in = &MAT_AT(l->prev->output, n, 0);
+        Matrix out = _nn_conv_sample(l->output, n, pixels, cs.f, cs.layout);
+        Matrix pre;
+        if (l->preact) {
+            pre = _nn_conv_sample(l->preact, n, pixels, cs.f, cs.layout);
+        }
+
+        if (l->conv.direct) {
+            _NN_ConvDirectTask t = {&cs, in, out.data, l->ws, l->bs};
+            long long blocks = (cs.f + _NN_CONV_FB - 1) / _NN_CONV_FB;
+            if ((long long)l->ws->rows * l->nodeCnt < MATRIX_PARALLEL_MIN) {
+                _nn_conv_direct_nchw(&t, 0, blocks);
+            } else {
+                tpoolParallelFor(blocks, 1, _nn_conv_direct_nchw, &t);
+            }
+            matrixAct(&out, l->act, l->preact ? &pre : NULL);
+            continue;
+        }
+
+        _nn_im2col(&cs, in, l->col, 0);
+        if (l->wsq.data) {
+            // pixels x taps times taps x filters for either layout, NCHW
+            // just reads col and writes out transposed
+            Matrix a = *l->col;
+            Matrix dest = out;
+            if (cs.layout == NN_LAYOUT_NCHW) {
+                a = matT(l->col);
+                dest = matT(&out);
+            }
+            matrixGemmInt8(&dest, &a, l->inScale, &l->wsq, l->bs, l->act);
+        } else if (cs.layout == NN_LAYOUT_NHWC) {
+            // pixels x taps times taps x filters, bias and act fused
+            if (l->wsp.data) {
+                matrixGemmPacked(&out, l->col, &l->wsp, l->bs, l->act,
+                                 l->preact ? &pre : NULL);
+            } else {
+                matrixGemmFused(&out, l->col, l->ws, l->bs, l->act,
+                                l->preact ? &pre : NULL);
+            }
+        } else {
+            // filters x taps times taps x pixels, the bias is per row here so
+            // it goes in first and the GEMM adds onto it
+            for (int f = 0; f < cs.f; f++) {
+                Matrix row = matRow(&out, f);
+                matrixFill(&row, MAT_AT(l->bs, 0, f));
+            }
+            Matrix wsT = matT(l->ws);
+            matrixGemm(&out, &wsT, l->col, 1, 1);
+            matrixAct(&out, l->act, l->preact ? &pre : NULL);
+        }
+    }
+}
 
-    l->nodeCnt = width * height * depth;
+static void _nn_conv_backward(NN_Layer* l, MATRIX_ACT act) {
+    _NN_ConvShape cs = _nn_conv_shape(l);
+    int pixels = cs.oh * cs.ow;
+    for (int n = 0; n < l->output->rows; n++) {
+        mfloat* in = &MAT_AT(l->prev->output, n, 0);
+        Matrix gs = _nn_conv_sample(l->gs, n, pixels, cs.f, cs.layout);
+        Matrix out = _nn_conv_sample(l->output, n, pixels, cs.f, cs.layout);
+        Matrix pre;
+        if (l->preact) {
+            pre = _nn_conv_sample(l->preact, n, pixels, cs.f, cs.layout);
+        }
 
+        // col still holds whatever sample ran last, so lower this one again
+        _nn_im2col(&cs, in, l->col, 0);
+        if (cs.layout == NN_LAYOUT_NHWC) {
+            matrixActBackward(&gs, &out, l->preact ? &pre : NULL, act,
+                              l->bsu);
+            Matrix colT = matT(l->col);
+            matrixGemm(l->wsu, &colT, &gs, 1, 1);
+            if (l->prev->gs) {
+                Matrix wsT = matT(l->ws);
+                matrixGemm(l->col, &gs, &wsT, 1, 0);
+            }
+        } else {
+            matrixActBackward(&gs, &out, l->preact ? &pre : NULL, act,
+                              NULL);
+            for (int f = 0; f < cs.f; f++) {
+                mfloat sum = 0;
+                for (int i = 0; i < pixels; i++) {
+                    sum += MAT_AT(&gs, f, i);
+                }
+                MAT_AT(l->bsu, 0, f) += sum;
+            }
+            Matrix gsT = matT(&gs);
+            matrixGemm(l->wsu, l->col, &gsT, 1, 1);
+            if (l->prev->gs) {
+                matrixGemm(l->col, l->ws, &gs, 1, 0);
+            }
+        }
+
+        if (l->prev->gs) {
+            // Overlapping receptive fields add up, so start from zero
+            Matrix prevGs = matRow(l->prev->gs, n);
+            matrixFill(&prevGs, 0);
+            _nn_im2col(&cs, prevGs.data, l->col, 1);
+        }
+    }
+}
+
+//====================== Running ======================
+
+void layerForward(NN_Layer* l) {
+    NN_ASSERT(l->prev);
+#ifdef NN_PROFILE
+    long long start = _nn_profile_now();
+#endif
+    switch (l->kind) {
+    case LAYER_KIND_FULL:
+        _nn_full_forward(l);
+        break;
+    case LAYER_KIND_CONV:
+        _nn_conv_forward(l);
+        break;
+    }
+#ifdef NN_PROFILE
+    _nn_profile_layer(l, 0, start);
+#endif
 }
 
-void layerCreateFull(NN* nn, int nodeCnt, char fillWithRand){
+void layerBackward(NN_Layer* l) {
+    NN_ASSERT(l->prev);
+#ifdef NN_PROFILE
+    long long start = _nn_profile_now();
+#endif
+    switch (l->kind) {
+    case LAYER_KIND_FULL:
+        _nn_full_backward(l, l->act);
+        break;
+    case LAYER_KIND_CONV:
+        _nn_conv_backward(l, l->act);
+        break;
+    }
+#ifdef NN_PROFILE
+    _nn_profile_layer(l, 1, start);
+#endif
+}
+
+//====================== Compiling ======================
+
+// One step of a compiled pass, dest = a * b + beta * dest and the epilogue
+// for the GEMMs. Everything got resolved and checked by nnCompile, all that's
+// left when it runs is how many rows the batch has.
+typedef struct _NN_Op {
+    void (*run)(struct _NN_Op* op, int rows);
+    NN_Layer* layer;
+    // What the backward ops still have to take the derivative of. The output
+    // layer's gets set by every backprop, the loss might have folded it in
+    MATRIX_ACT act;
+    Matrix dest;
+    Matrix a;
+    Matrix b;
+    const MatrixPacked* packed; // Used instead of b if set
+    mfloat beta;
+    _MatrixEpilogue ep;
+    char hasEp;
+    Matrix preact; // For the activation backward, data is NULL if there's none
+    char batchInner; // The batch is k of the product instead of its rows
+    // Whether it starts/ends its layer's part of the pass, for the profiler
+    char first;
+    char last;
+} _NN_Op;
+
+static void _nn_op_rows(_NN_Op* op, int rows) {
+    if (op->batchInner) {
+        op->a.cols = rows;
+        op->b.rows = rows;
+    } else {
+        op->a.rows = rows;
+        op->dest.rows = rows;
+    }
+}
+
+static void _nn_op_gemm_small(_NN_Op* op, int rows) {
+    _nn_op_rows(op, rows);
+    _matrix_gemm_small(&op->dest, &op->a, &op->b, 1, op->beta,
+                       op->hasEp ? &op->ep : NULL);
+}
+
+static void _nn_op_gemm(_NN_Op* op, int rows) {
+    _nn_op_rows(op, rows);
+    _matrix_gemm(&op->dest, &op->a, op->packed ? NULL : &op->b, op->packed, 1,
+                 op->beta, op->hasEp ? &op->ep : NULL);
+}
+
+// b is the bias here, the weights are the layer's wsq
+static void _nn_op_gemm_int8(_NN_Op* op, int rows) {
+    _nn_op_rows(op, rows);
+    matrixGemmInt8(&op->dest, &op->a, op->layer->inScale, &op->layer->wsq,
+                   &op->b, op->act);
+}
+
+// b is the bias and the weights are the layer's wss, preact works like in
+// _nn_op_act_back
+static void _nn_op_gemm_sparse(_NN_Op* op, int rows) {
+    _nn_op_rows(op, rows);
+    op->preact.rows = rows;
+    matrixGemmSparse(&op->dest, &op->a, &op->layer->wss, &op->b, op->act,
+                     op->preact.data ? &op->preact : NULL);
+}
+
+// dest is wsu, a the input and b gs, both with a row per sample
+static void _nn_op_sparse_grad(_NN_Op* op, int rows) {
+    op->a.rows = rows;
+    op->b.rows = rows;
+    matrixGemmSparseGrad(&op->dest, &op->a, &op->b, &op->layer->wss);
+}
+
+// dest is the previous layer's gs and a this one's
+static void _nn_op_sparse_t(_NN_Op* op, int rows) {
+    _nn_op_rows(op, rows);
+    matrixGemmSparseT(&op->dest, &op->a, &op->layer->wss);
+}
+
+// dest is gs, a the output and b the bsu
+static void _nn_op_act_back(_NN_Op* op, int rows) {
+    _nn_op_rows(op, rows);
+    op->preact.rows = rows;
+    matrixActBackward(&op->dest, &op->a, op->preact.data ? &op->preact : NULL,
+                      op->act, &op->b);
+}
+
+// Conv layers loop over the samples themselves and read the batch off their
+// views, which are already the right length
+static void _nn_op_conv_forward(_NN_Op* op, int rows) {
+    (void)rows;
+    _nn_conv_forward(op->layer);
+}
 
+static void _nn_op_conv_backward(_NN_Op* op, int rows) {
+    (void)rows;
+    _nn_conv_backward(op->layer, op->act);
 }
 
-// Temp
-int main(void){
-    NN nn;
-    nn.layers = dinoCreateReserve(3, NN_Layer);
+static _NN_Op _nn_op_create(NN_Layer* l, void (*run)(_NN_Op*, int)) {
+    _NN_Op op = {0};
+    op.run = run;
+    op.layer = l;
+    op.act = l->act;
+    op.first = 1;
+    op.last = 1;
+    return op;
+}
+
+// Checks the shapes once and picks the kernel by how big a full batch is.
+// The straight loops if it's under MATRIX_GEMM_SMALL anyway, softmax needs
+// the whole row so it always goes through _matrix_gemm.
+static _NN_Op _nn_op_gemm_create(NN_Layer* l, Matrix dest, Matrix a, Matrix b,
+                                 mfloat beta, char batchInner) {
+    NN_ASSERT(a.cols == b.rows && dest.rows == a.rows &&
+              dest.cols == b.cols);
+    NN_ASSERT(dest.data != a.data && dest.data != b.data && !dest.transposed);
+    _NN_Op op = _nn_op_create(l, _nn_op_gemm);
+    op.dest = dest;
+    op.a = a;
+    op.b = b;
+    op.beta = beta;
+    op.batchInner = batchInner;
+    long long work = (long long)dest.rows * dest.cols * a.cols;
+    if (work <= MATRIX_GEMM_SMALL) {
+        op.run = _nn_op_gemm_small;
+    }
+    return op;
+}
+
+static void _nn_op_epilogue(_NN_Op* op, const NN_Layer* l) {
+    NN_ASSERT(l->bs->rows == 1 && l->bs->cols == l->nodeCnt);
+    NN_ASSERT(!l->preact || !l->preact->transposed);
+    op->ep = (_MatrixEpilogue){l->bs->data,
+                               l->preact ? l->preact->data : NULL,
+                               l->preact ? l->preact->stride : 0, l->act};
+    op->hasEp = 1;
+    if (l->act == MATRIX_ACT_SOFTMAX) {
+        op->run = _nn_op_gemm;
+    }
+}
+
+static int _nn_compile_forward(NN_Layer* l, _NN_Op* ops) {
+    if (l->kind == LAYER_KIND_CONV) {
+        ops[0] = _nn_op_create(l, _nn_op_conv_forward);
+        return 1;
+    }
+    Matrix out = *l->output;
+    Matrix in = *l->prev->output;
+    if (l->wsq.data) {
+        NN_ASSERT(in.cols == l->wsq.rows && out.cols == l->wsq.cols);
+        ops[0] = _nn_op_create(l, _nn_op_gemm_int8);
+        ops[0].dest = out;
+        ops[0].a = in;
+        ops[0].b = *l->bs;
+        return 1;
+    }
+    if (l->wss.vals) {
+        NN_ASSERT(in.cols == l->wss.rows && out.cols == l->wss.cols);
+        ops[0] = _nn_op_create(l, _nn_op_gemm_sparse);
+        ops[0].dest = out;
+        ops[0].a = in;
+        ops[0].b = *l->bs;
+        if (l->preact) {
+            ops[0].preact = *l->preact;
+        }
+        return 1;
+    }
+    if (l->wsp.data) {
+        NN_ASSERT(in.cols == l->wsp.rows && out.cols == l->wsp.cols);
+        NN_ASSERT(l->wsp.nr == _matrixKernels.nr);
+        ops[0] = _nn_op_create(l, _nn_op_gemm);
+        ops[0].dest = out;
+        ops[0].a = in;
+        ops[0].packed = &l->wsp;
+    } else {
+        ops[0] = _nn_op_gemm_create(l, out, in, *l->ws, 0, 0);
+    }
+    _nn_op_epilogue(&ops[0], l);
+    return 1;
+}
+
+// Same steps as _nn_full_backward
+static int _nn_compile_backward(NN_Layer* l, _NN_Op* ops) {
+    if (l->kind == LAYER_KIND_CONV) {
+        ops[0] = _nn_op_create(l, _nn_op_conv_backward);
+        return 1;
+    }
+    NN_ASSERT(l->gs && l->bsu && l->wsu);
+    int cnt = 0;
+    _NN_Op back = _nn_op_create(l, _nn_op_act_back);
+    back.dest = *l->gs;
+    back.a = *l->output;
+    back.b = *l->bsu;
+    if (l->preact) {
+        back.preact = *l->preact;
+    }
+    ops[cnt++] = back;
+
+    if (l->wss.vals) {
+        _NN_Op grad = _nn_op_create(l, _nn_op_sparse_grad);
+        grad.dest = *l->wsu;
+        grad.a = *l->prev->output;
+        grad.b = *l->gs;
+        ops[cnt++] = grad;
+        if (l->prev->gs) {
+            _NN_Op t = _nn_op_create(l, _nn_op_sparse_t);
+            t.dest = *l->prev->gs;
+            t.a = *l->gs;
+            ops[cnt++] = t;
+        }
+    } else {
+        ops[cnt++] = _nn_op_gemm_create(l, *l->wsu, matT(l->prev->output),
+                                        *l->gs, 1, 1);
+        if (l->prev->gs) {
+            ops[cnt++] = _nn_op_gemm_create(l, *l->prev->gs, *l->gs,
+                                            matT(l->ws), 0, 0);
+        }
+    }
+    for (int i = 0; i < cnt; i++) {
+        ops[i].first = (i == 0);
+        ops[i].last = (i == cnt - 1);
+    }
+    return cnt;
+}
+
+// With checkpointing, the forward ops of the segment of layers right before
+// kept layer `i` run again before its backward. The last segment is still
+// there from the forward pass. Every layer has exactly one forward op, so
+// layer j's is ops[j - 1].
+static int _nn_compile_recompute(NN* nn, int i, _NN_Op* ops) {
+    if (i == nn->layerCnt - 1 || nn->layers[i].recompute) {
+        return 0;
+    }
+    int first = i;
+    while (nn->layers[first - 1].recompute) {
+        first--;
+    }
+    for (int j = first; j < i; j++) {
+        _NN_Op* op = &ops[j - first];
+        *op = nn->ops[j - 1];
+        // Timed as part of layer i's backward
+        op->first = (j == first);
+        op->last = 0;
+    }
+    return i - first;
+}
+
+void nnCompile(NN* nn) {
+    if (nn->ops) {
+        NN_FREE(nn->ops);
+    }
+    // A dense layer's backward is the most any layer takes, 3 ops, and
+    // checkpointing can run every forward op again
+    nn->ops = NN_MALLOC(sizeof(_NN_Op) * (5 * nn->layerCnt + 1));
+    int cnt = 0;
+    for (int i = 1; i < nn->layerCnt; i++) {
+        cnt += _nn_compile_forward(&nn->layers[i], nn->ops + cnt);
+    }
+    NN_ASSERT(nn->layerCnt <= 1 || cnt == nn->layerCnt - 1);
+    nn->forwardCnt = cnt;
+    // Frozen and mapped networks only ever run forward
+    if (!nn->frozen && nn->grads.data) {
+        for (int i = nn->layerCnt - 1; i > 0; i--) {
+            int again = _nn_compile_recompute(nn, i, nn->ops + cnt);
+            cnt += again;
+            int back = _nn_compile_backward(&nn->layers[i], nn->ops + cnt);
+            if (again > 0) {
+                nn->ops[cnt].first = 0;
+            }
+            cnt += back;
+        }
+    }
+    nn->opCnt = cnt;
+    nn->compiled = 1;
+}
+
+static void _nn_ops_run(NN* nn, int begin, int end, int rows) {
+#ifdef NN_PROFILE
+    long long start = 0;
+#endif
+    for (int i = begin; i < end; i++) {
+        _NN_Op* op = &nn->ops[i];
+#ifdef NN_PROFILE
+        if (op->first) {
+            start = _nn_profile_now();
+        }
+#endif
+        op->run(op, rows);
+#ifdef NN_PROFILE
+        if (op->last) {
+            _nn_profile_layer(op->layer, i >= nn->forwardCnt, start);
+        }
+#endif
+    }
+}
+
+void nnForward(NN* nn) {
+    if (!nn->compiled) {
+        nnCompile(nn);
+    }
+    _nn_ops_run(nn, 0, nn->forwardCnt, NN_INPUT(nn)->rows);
+}
+
+//====================== Training ======================
+
+static void _nn_acts_plan(NN* nn);
+static long long _nn_acts_checkpoint(NN* nn, int every, char apply);
+
+void nnBatchSet(NN* nn, int batch) {
+    NN_ASSERT(batch > 0);
+    nn->batch = batch;
+    if (nn->replicaCnt > 1) {
+        nnReplicasSet(nn, nn->replicaCnt);
+    }
+    if (nn->frozen) {
+        _nn_acts_plan(nn);
+        return;
+    }
+    if (nn->checkpointEvery > 0) {
+        _nn_acts_checkpoint(nn, nn->checkpointEvery, 1);
+        return;
+    }
+    // Lay the activations out again from the start of the acts arena, it only
+    // grows if the new batch needs more room
+    nn->acts.len = 0;
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        l->recompute = 0;
+        for (int v = 0; v < _NN_VIEW_COUNT; v++) {
+            Matrix* m = *_nn_layer_view(l, v);
+            if (!m || _nn_view_arena(nn, v) != &nn->acts) {
+                continue;
+            }
+            // col holds a single sample whatever the batch is
+            int rows = (v == _NN_VIEW_COL) ? m->rows : batch;
+            _nn_view_create(nn, l, v, rows, m->cols);
+        }
+    }
+}
+
+// Makes every activation view `rows` long, for a batch that isn't full
+static void _nn_rows_set(NN* nn, int rows) {
+    NN_ASSERT(rows > 0 && rows <= nn->batch);
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        Matrix* ms[] = {l->output, l->preact, l->gs};
+        for (int j = 0; j < 3; j++) {
+            if (ms[j]) {
+                ms[j]->rows = rows;
+            }
+        }
+    }
+}
+
+void nnForwardRows(NN* nn, int rows) {
+    _nn_rows_set(nn, rows);
+    nnForward(nn);
+    _nn_rows_set(nn, nn->batch);
+}
+
+// Backprop on one thread for what's in NN_INPUT, `to` has a row per sample.
+// `total` is how many samples the whole batch has.
+static void _nn_backprop_local(NN* nn, const Matrix* to, int total) {
+    nnForward(nn);
+    NN_Layer* out = &nn->layers[nn->layerCnt - 1];
+    NN_ASSERT(to->rows == out->output->rows && to->cols == out->nodeCnt);
+    // d/dout of the mean loss over the batch
+    MATRIX_ACT act = matrixLossGrad(out->gs, out->output, to, nn->loss,
+                                    out->act, (mfloat)1 / total);
+    // The output layer's ops come first going backward
+    NN_ASSERT(nn->opCnt > nn->forwardCnt);
+    nn->ops[nn->forwardCnt].act = act;
+    _nn_ops_run(nn, nn->forwardCnt, nn->opCnt, to->rows);
+}
+
+//====================== Data parallel ======================
+
+// Grads handed to a thread at a time by the reduction. Small enough that the
+// slice of every replica stays in L2 while it gets summed.
+#define _NN_REDUCE_CHUNK 4096
+
+static void _nn_replicas_free(NN* nn) {
+    for (int r = 0; r < nn->replicaCnt; r++) {
+#ifdef NN_PROFILE
+        // Keep what the replica measured
+        for (int i = 0; i < nn->layerCnt; i++) {
+            _nn_profile_add(&nn->layers[i].prof,
+                            &nn->replicas[r].layers[i].prof);
+        }
+#endif
+        nnFree(&nn->replicas[r]);
+    }
+    if (nn->replicas) {
+        NN_FREE(nn->replicas);
+    }
+    nn->replicas = NULL;
+    nn->replicaCnt = 0;
+}
+
+// A copy of the network that shares nn's ws/bs but has its own activations
+// and gradients
+static NN _nn_replica_create(NN* nn, int batch) {
+    // Doesn't take a stream, or how many there are would change the next
+    // network's weights
+    NN r = _nn_create(nn->rng);
+    r.layout = nn->layout;
+    r.checkpointEvery = nn->checkpointEvery;
+    // Borrowed, mem stays NULL so nnFree leaves it alone
+    r.params.data = nn->params.data;
+    r.params.len = r.params.cap = nn->params.len;
+    _nn_arena_grow(&r, &r.grads, nn->grads.len);
+    r.grads.len = nn->grads.len;
+
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = _nn_layer_push(&r, nn->layers[i]);
+#ifdef NN_PROFILE
+        l->prof = (NN_LayerProfile){0};
+#endif
+        for (int v = 0; v < _NN_VIEW_COUNT; v++) {
+            Matrix* m = *_nn_layer_view(&nn->layers[i], v);
+            if (!m) {
+                continue;
+            }
+            l->views[v] = *m;
+            *_nn_layer_view(l, v) = &l->views[v];
+            if (_nn_view_arena(nn, v) == &nn->grads) {
+                l->views[v].data = r.grads.data + (m->data - nn->grads.data);
+            } else if (_nn_view_arena(nn, v) == &nn->acts) {
+                // Gets real space from nnBatchSet below
+                l->views[v].data = NULL;
+            }
+        }
+    }
+    nnBatchSet(&r, batch);
+    // Now rather than on the pool thread that first runs it
+    nnCompile(&r);
+    return r;
+}
+
+void nnReplicasSet(NN* nn, int replicas) {
+    NN_ASSERT(!nn->frozen);
+    _nn_replicas_free(nn);
+    if (replicas <= 0) {
+        replicas = tpoolThreadsGet();
+    }
+    if (replicas <= 1) {
+        return;
+    }
+    nn->replicas = NN_MALLOC(sizeof(NN) * replicas);
+    int batch = (nn->batch + replicas - 1) / replicas;
+    for (int r = 0; r < replicas; r++) {
+        nn->replicas[r] = _nn_replica_create(nn, batch);
+    }
+    nn->replicaCnt = replicas;
+}
+
+typedef struct {
+    NN* nn;
+    const Matrix* to;
+} _NN_BackpropTask;
+
+// Every index is a replica, which runs its share of the batch's rows
+static void _nn_backprop_replica(void* ctx, long long begin, long long end) {
+    _NN_BackpropTask* t = ctx;
+    int total = t->to->rows;
+    for (long long r = begin; r < end; r++) {
+        NN* rep = &t->nn->replicas[r];
+        int row = (int)(total * r / t->nn->replicaCnt);
+        int rows = (int)(total * (r + 1) / t->nn->replicaCnt) - row;
+        if (rows == 0) {
+            continue;
+        }
+        _nn_rows_set(rep, rows);
+        rep->loss = t->nn->loss;
+        Matrix in = matRows(NN_INPUT(t->nn), row, rows);
+        matrixCopy(NN_INPUT(rep), &in);
+        Matrix to = matRows(t->to, row, rows);
+        _nn_backprop_local(rep, &to, total);
+    }
+}
+
+// Every index is a chunk of the grads. The replicas get summed pairwise
+// (0 += 1, 2 += 3, ... then 0 += 2, ...) so the chain of dependent adds is
+// only log2(replicas) long, then replica 0 goes into nn and they're zeroed.
+static void _nn_reduce_range(void* ctx, long long begin, long long end) {
+    NN* nn = ctx;
+    for (long long c = begin; c < end; c++) {
+        long long off = c * _NN_REDUCE_CHUNK;
+        int len = (int)_MATRIX_MIN(_NN_REDUCE_CHUNK, nn->grads.len - off);
+        Matrix acc;
+        for (int step = 1; step < nn->replicaCnt; step *= 2) {
+            for (int r = 0; r + step < nn->replicaCnt; r += 2 * step) {
+                acc = matView(nn->replicas[r].grads.data + off, 1, len);
+                Matrix add =
+                    matView(nn->replicas[r + step].grads.data + off, 1, len);
+                matrixAdd(&acc, &acc, &add);
+            }
+        }
+        Matrix dest = matView(nn->grads.data + off, 1, len);
+        acc = matView(nn->replicas[0].grads.data + off, 1, len);
+        matrixAdd(&dest, &dest, &acc);
+        for (int r = 0; r < nn->replicaCnt; r++) {
+            memset(nn->replicas[r].grads.data + off, 0, sizeof(mfloat) * len);
+        }
+    }
+}
+
+// Backprop for a batch that's already in NN_INPUT, `to` has a row per sample
+static void _nn_backprop(NN* nn, const Matrix* to) {
+    if (nn->replicaCnt <= 1) {
+        _nn_backprop_local(nn, to, to->rows);
+        return;
+    }
+    _NN_BackpropTask t = {nn, to};
+    tpoolParallelFor(nn->replicaCnt, 1, _nn_backprop_replica, &t);
+    long long chunks =
+        (nn->grads.len + _NN_REDUCE_CHUNK - 1) / _NN_REDUCE_CHUNK;
+    tpoolParallelFor(chunks, 1, _nn_reduce_range, nn);
+}
+
+void nnBackprop(NN* nn, const Matrix* ti, const Matrix* to) {
+    NN_ASSERT(!nn->frozen);
+    NN_ASSERT(ti->rows == to->rows && ti->cols == nn->layers[0].nodeCnt);
+    _nn_rows_set(nn, ti->rows);
+    matrixCopy(NN_INPUT(nn), ti);
+    _nn_backprop(nn, to);
+    _nn_rows_set(nn, nn->batch);
+}
+
+mfloat nnCost(NN* nn, const Matrix* ti, const Matrix* to) {
+    NN_ASSERT(ti->rows == to->rows && ti->cols == nn->layers[0].nodeCnt);
+    double cost = 0;
+    for (int r = 0; r < ti->rows; r += nn->batch) {
+        int rows = _MATRIX_MIN(nn->batch, ti->rows - r);
+        Matrix in = matRows(ti, r, rows);
+        _nn_rows_set(nn, rows);
+        matrixCopy(NN_INPUT(nn), &in);
+        nnForward(nn);
+        Matrix expected = matRows(to, r, rows);
+        cost += matrixLoss(NN_OUTPUT(nn), &expected, nn->loss);
+    }
+    _nn_rows_set(nn, nn->batch);
+    return (mfloat)(cost / ti->rows);
+}
+
+void nnOptimizerSet(NN* nn, MatrixOptimizer opt) {
+    nn->opt = opt;
+    _nn_arena_free(&nn->state);
+}
+
+void nnMasterWeightsSet(NN* nn, char on) {
+    NN_ASSERT(!nn->frozen);
+    if (nn->master) {
+        NN_FREE(nn->master);
+    }
+    nn->master = NULL;
+    nn->masterLen = 0;
+    if (on) {
+        long long len = nn->params.len;
+        nn->master = NN_MALLOC(sizeof(double) * (len ? len : 1));
+        for (long long i = 0; i < len; i++) {
+            nn->master[i] = nn->params.data[i];
+        }
+        nn->masterLen = len;
+    }
+}
+
+void nnLearn(NN* nn, mfloat rate) {
+    NN_ASSERT(!nn->frozen);
+    long long len = nn->params.len;
+    long long stateLen = matrixOptimizerStates(nn->opt.kind) * len;
+    // New state if there's none yet or the params changed size since, it
+    // starts at 0 like every optimizer wants
+    if (nn->state.len != stateLen) {
+        _nn_arena_free(&nn->state);
+        if (stateLen > 0) {
+            _nn_arena_grow(nn, &nn->state, stateLen);
+        }
+        nn->state.len = stateLen;
+    }
+    mfloat* m = stateLen > 0 ? nn->state.data : NULL;
+    mfloat* v = stateLen > len ? nn->state.data + len : NULL;
+    if (nn->master) {
+        // Layers got added since, the new ones start from their params
+        if (nn->masterLen != len) {
+            nnMasterWeightsSet(nn, 1);
+        }
+        matrixOptimizerStepMaster(&nn->opt, rate, nn->master, nn->params.data,
+                                  nn->grads.data, m, v, len);
+    } else {
+        matrixOptimizerStep(&nn->opt, rate, nn->params.data, nn->grads.data,
+                            m, v, len);
+    }
+    // Forward reads the sparse copies
+    for (int i = 1; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        if (l->wss.vals) {
+            matrixSparseUpdate(&l->wss, l->ws);
+        }
+    }
+}
+
+void nnTrainEpoch(NN* nn, const Matrix* ti, const Matrix* to, mfloat rate) {
+    NN_ASSERT(!nn->frozen);
+    NN_ASSERT(ti->rows == to->rows && ti->cols == nn->layers[0].nodeCnt);
+    int n = ti->rows;
+    // Shuffling indices instead of rows leaves the training data untouched
+    int* perm = NN_MALLOC(sizeof(int) * n);
+    long long* swaps = NN_MALLOC(sizeof(long long) * n);
+    matrixRngSwaps(&nn->rng, swaps, n);
+    for (int i = 0; i < n; i++) {
+        perm[i] = i;
+    }
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int)swaps[i];
+        int save = perm[i];
+        perm[i] = perm[j];
+        perm[j] = save;
+    }
+    NN_FREE(swaps);
+
+    Matrix* batchTo = matrixCreate(nn->batch, to->cols);
+    for (int r = 0; r < n; r += nn->batch) {
+        int rows = _MATRIX_MIN(nn->batch, n - r);
+        _nn_rows_set(nn, rows);
+        batchTo->rows = rows;
+        for (int i = 0; i < rows; i++) {
+            Matrix src = matRow(ti, perm[r + i]);
+            Matrix dst = matRow(NN_INPUT(nn), i);
+            matrixCopy(&dst, &src);
+            src = matRow(to, perm[r + i]);
+            dst = matRow(batchTo, i);
+            matrixCopy(&dst, &src);
+        }
+        _nn_backprop(nn, batchTo);
+        nnLearn(nn, rate);
+    }
+    _nn_rows_set(nn, nn->batch);
+    matrixFree(batchTo);
+    NN_FREE(perm);
+}
+
+//====================== Checkpointing ======================
+
+static char _nn_checkpoint_kept(const NN* nn, int every, int i) {
+    return i == 0 || i == nn->layerCnt - 1 || nn->layers[i].checkpoint ||
+           i % every == 0;
+}
+
+// mfloats a `rows` long version of the view takes in the arena
+static long long _nn_acts_len(const Matrix* m, int rows) {
+    return _MATRIX_ROUND_UP((long long)rows * m->cols, _NN_ARENA_ALIGN);
+}
+
+// Lays out the acts arena for checkpointing every `every`-th layer. Kept
+// layers' outputs (and preacts) each get their own space. The layers of a
+// segment between two kept ones get laid out one after another in a region
+// every segment shares, only one segment is ever live: forward is done with
+// it once the next kept output is out, and backprop computes it again right
+// before it goes through it. A gs is only live from the backward of the layer
+// after to its own, so they alternate between two buffers, and there's one
+// im2col buffer since only the op running uses it.
+// Returns how many mfloats that takes, and only lays it out if `apply` is set
+static long long _nn_acts_checkpoint(NN* nn, int every, char apply) {
+    int batch = nn->batch;
+    long long kept = 0;
+    long long seg = 0;
+    long long segMax = 0;
+    long long gs = 0;
+    long long col = 0;
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        long long len = _nn_acts_len(l->output, batch) +
+                        (l->preact ? _nn_acts_len(l->preact, batch) : 0);
+        if (_nn_checkpoint_kept(nn, every, i)) {
+            kept += len;
+            seg = 0;
+        } else {
+            seg += len;
+            segMax = seg > segMax ? seg : segMax;
+        }
+        if (l->gs && _nn_acts_len(l->gs, batch) > gs) {
+            gs = _nn_acts_len(l->gs, batch);
+        }
+        if (l->col && _nn_acts_len(l->col, l->col->rows) > col) {
+            col = _nn_acts_len(l->col, l->col->rows);
+        }
+    }
+    long long total = kept + segMax + 2 * gs + col;
+    if (!apply) {
+        return total;
+    }
+
+    // Shrinks as well, less memory is the point. Nothing in the arena is worth
+    // keeping, so nothing gets rebased
+    if (total != nn->acts.cap) {
+        for (int i = 0; i < nn->layerCnt; i++) {
+            for (int v = 0; v < _NN_VIEW_COUNT; v++) {
+                Matrix* m = *_nn_layer_view(&nn->layers[i], v);
+                if (m && _nn_view_arena(nn, v) == &nn->acts) {
+                    m->data = NULL;
+                }
+            }
+        }
+        _nn_arena_free(&nn->acts);
+        _nn_arena_grow(nn, &nn->acts, total);
+    }
+    nn->acts.len = total;
+    nn->compiled = 0;
+    mfloat* data = nn->acts.data;
+    long long keptOff = 0;
+    long long segOff = kept;
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        l->recompute = !_nn_checkpoint_kept(nn, every, i);
+        long long* off = l->recompute ? &segOff : &keptOff;
+        if (!l->recompute) {
+            segOff = kept;
+        }
+        *l->output = matView(data + *off, batch, l->output->cols);
+        *off += _nn_acts_len(l->output, batch);
+        if (l->preact) {
+            *l->preact = matView(data + *off, batch, l->preact->cols);
+            *off += _nn_acts_len(l->preact, batch);
+        }
+        if (l->gs) {
+            *l->gs = matView(data + kept + segMax + (i % 2) * gs, batch,
+                             l->gs->cols);
+        }
+        if (l->col) {
+            *l->col = matView(data + kept + segMax + 2 * gs, l->col->rows,
+                              l->col->cols);
+        }
+    }
+    return total;
+}
+
+void nnCheckpointSet(NN* nn, int every) {
+    NN_ASSERT(!nn->frozen && every >= 0);
+    nn->checkpointEvery = every;
+    nnBatchSet(nn, nn->batch);
+}
+
+int nnCheckpointBudget(NN* nn, int batch, long long bytes) {
+    NN_ASSERT(!nn->frozen && batch > 0);
+    // Only sized for now, nnCheckpointSet lays it out
+    nn->batch = batch;
+    int least = 1;
+    long long leastLen = 0;
+    // Memory goes down and then up again as `every` grows, and the layers
+    // recomputed only go up
+    for (int every = 1; every <= nn->layerCnt; every++) {
+        long long len = _nn_acts_checkpoint(nn, every, 0);
+        if (len * (long long)sizeof(mfloat) <= bytes) {
+            nnCheckpointSet(nn, every);
+            return every;
+        }
+        if (every == 1 || len < leastLen) {
+            least = every;
+            leastLen = len;
+        }
+    }
+    nnCheckpointSet(nn, least);
+    return 0;
+}
+
+//====================== Pruning ======================
+
+static int _nn_norm_cmp(const void* a, const void* b) {
+    mfloat x = *(const mfloat*)a;
+    mfloat y = *(const mfloat*)b;
+    return (x > y) - (x < y);
+}
+
+// Zeroes the `drop` blocks of ws with the smallest L2 norms, and their wsu
+// so a gradient from before doesn't step them off 0 again. The ones that are
+// zero already go first, so pruning to the same sparsity again does nothing.
+static void _nn_prune_layer(NN_Layer* l, long long drop, int blockCols) {
+    Matrix* ws = l->ws;
+    int perRow = (ws->cols + blockCols - 1) / blockCols;
+    long long cnt = (long long)ws->rows * perRow;
+    mfloat* norms = NN_MALLOC(sizeof(mfloat) * cnt);
+    mfloat* sorted = NN_MALLOC(sizeof(mfloat) * cnt);
+    for (int r = 0; r < ws->rows; r++) {
+        for (int b = 0; b < perRow; b++) {
+            int end = _MATRIX_MIN((b + 1) * blockCols, ws->cols);
+            mfloat sum = 0;
+            for (int c = b * blockCols; c < end; c++) {
+                sum += MAT_AT(ws, r, c) * MAT_AT(ws, r, c);
+            }
+            norms[(long long)r * perRow + b] = sum;
+        }
+    }
+    memcpy(sorted, norms, sizeof(mfloat) * cnt);
+    qsort(sorted, cnt, sizeof(mfloat), _nn_norm_cmp);
+    mfloat cut = sorted[drop - 1];
+    // Everything under the cut goes, then as many blocks right at it as it
+    // takes to drop exactly `drop`
+    long long ties = drop;
+    for (long long i = 0; i < cnt; i++) {
+        ties -= norms[i] < cut;
+    }
+    for (long long i = 0; i < cnt; i++) {
+        if (norms[i] > cut || (norms[i] == cut && ties-- <= 0)) {
+            continue;
+        }
+        int r = (int)(i / perRow);
+        int col = (int)(i % perRow) * blockCols;
+        int end = _MATRIX_MIN(col + blockCols, ws->cols);
+        for (int c = col; c < end; c++) {
+            MAT_AT(ws, r, c) = 0;
+            if (l->wsu) {
+                MAT_AT(l->wsu, r, c) = 0;
+            }
+        }
+    }
+    NN_FREE(sorted);
+    NN_FREE(norms);
+}
+
+// mfloats of the sparse arena a MatrixSparse takes
+static long long _nn_sparse_len(const Matrix* ws, long long blocks,
+                                int blockCols) {
+    return (matrixSparseBytes(ws->rows, blocks, blockCols) + sizeof(mfloat) -
+            1) / sizeof(mfloat);
+}
+
+void nnPrune(NN* nn, mfloat sparsity, int blockCols) {
+    NN_ASSERT(!nn->frozen);
+    NN_ASSERT(sparsity >= 0 && sparsity < 1 && blockCols > 0);
+    NN_ASSERT(sparsity == 0 || !nn->params.mapLen);
+    // How many blocks every layer that goes sparse keeps, -1 for the ones
+    // that stay dense. The arena gets sized up front so it never moves
+    long long* kept = NN_MALLOC(sizeof(long long) * nn->layerCnt);
+    long long len = 0;
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        kept[i] = -1;
+        l->wss = (MatrixSparse){0};
+        if (l->kind != LAYER_KIND_FULL || !l->ws) {
+            continue;
+        }
+        int perRow = (l->ws->cols + blockCols - 1) / blockCols;
+        long long total = (long long)l->ws->rows * perRow;
+        long long drop = (long long)(sparsity * total);
+        if (drop > 0) {
+            _nn_prune_layer(l, drop, blockCols);
+        }
+        long long blocks = matrixSparseBlocks(l->ws, blockCols);
+        if (blocks <= (1 - NN_SPARSE_MIN) * total) {
+            kept[i] = blocks;
+            len += _MATRIX_ROUND_UP(_nn_sparse_len(l->ws, blocks, blockCols),
+                                    _NN_ARENA_ALIGN);
+        }
+    }
+    _nn_arena_free(&nn->sparse);
+    if (len > 0) {
+        _nn_arena_grow(nn, &nn->sparse, len);
+    }
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        if (kept[i] < 0) {
+            continue;
+        }
+        long long off = _nn_arena_take(
+            nn, &nn->sparse, _nn_sparse_len(l->ws, kept[i], blockCols));
+        l->wss = matrixSparsify(nn->sparse.data + off, l->ws, blockCols);
+    }
+    NN_FREE(kept);
+    nn->compiled = 0;
+    // The pruned weights go to 0 in the master copy too, the kept ones keep
+    // what the params can't hold
+    for (long long i = 0; i < nn->masterLen; i++) {
+        if (nn->params.data[i] == 0) {
+            nn->master[i] = 0;
+        }
+    }
+
+    // Momentum built up before would move the pruned weights off 0 again
+    MatrixOptimizer opt = nn->opt;
+    opt.step = 0;
+    nnOptimizerSet(nn, opt);
+    if (nn->replicaCnt > 1) {
+        nnReplicasSet(nn, nn->replicaCnt);
+    }
+}
+
+//====================== Inference ======================
+
+// An activation buffer the planner places, live from the forward pass of
+// layer `first` to the end of the one of layer `last`
+typedef struct {
+    Matrix* m;
+    int rows;
+    long long len; // Rounded up to the arena alignment
+    int first;
+    int last;
+    long long off;
+} _NN_PlanBuf;
+
+static int _nn_plan_cmp(const void* a, const void* b) {
+    const _NN_PlanBuf* x = a;
+    const _NN_PlanBuf* y = b;
+    if (x->len != y->len) {
+        return x->len < y->len ? 1 : -1;
+    }
+    return x->first - y->first;
+}
+
+// Lays out the acts arena of a frozen network by buffer lifetime instead of
+// giving every buffer its own space. An output is only live from its own
+// layer to the next one, and an im2col buffer only during its layer, so
+// buffers that are never live at once share memory. With a plain chain of
+// layers that ends up ping-ponging between two outputs.
+//  Biggest buffers first, each goes at the lowest offset that doesn't overlap
+// anything placed already that's live at the same time.
+static void _nn_acts_plan(NN* nn) {
+    nn->compiled = 0;
+    _NN_PlanBuf* bufs = NN_MALLOC(sizeof(_NN_PlanBuf) * 2 * nn->layerCnt);
+    int cnt = 0;
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        // The input is filled before layer 1 runs, the output is read after
+        // the last one
+        int last = (i == nn->layerCnt - 1) ? nn->layerCnt : i + 1;
+        bufs[cnt++] = (_NN_PlanBuf){l->output, nn->batch, 0, i, last, 0};
+        if (l->col) {
+            bufs[cnt++] = (_NN_PlanBuf){l->col, l->col->rows, 0, i, i, 0};
+        }
+    }
+    for (int b = 0; b < cnt; b++) {
+        long long len = (long long)bufs[b].rows * bufs[b].m->cols;
+        bufs[b].len = _MATRIX_ROUND_UP(len, _NN_ARENA_ALIGN);
+    }
+    qsort(bufs, cnt, sizeof(_NN_PlanBuf), _nn_plan_cmp);
+
+    long long total = 0;
+    for (int b = 0; b < cnt; b++) {
+        _NN_PlanBuf* buf = &bufs[b];
+        // Bump past every conflict until there are none, the offset only
+        // goes up so this ends
+        char moved = 1;
+        while (moved) {
+            moved = 0;
+            for (int p = 0; p < b; p++) {
+                _NN_PlanBuf* other = &bufs[p];
+                char liveTogether =
+                    buf->first <= other->last && other->first <= buf->last;
+                char overlap = buf->off < other->off + other->len &&
+                               other->off < buf->off + buf->len;
+                if (liveTogether && overlap) {
+                    buf->off = other->off + other->len;
+                    moved = 1;
+                }
+            }
+        }
+        if (buf->off + buf->len > total) {
+            total = buf->off + buf->len;
+        }
+    }
+
+    if (total > nn->acts.cap) {
+        // Nothing in the arena is worth keeping, so nothing gets rebased
+        for (int b = 0; b < cnt; b++) {
+            bufs[b].m->data = NULL;
+        }
+        _nn_arena_free(&nn->acts);
+        _nn_arena_grow(nn, &nn->acts, total);
+    }
+    nn->acts.len = total;
+    for (int b = 0; b < cnt; b++) {
+        *bufs[b].m =
+            matView(nn->acts.data + bufs[b].off, bufs[b].rows, bufs[b].m->cols);
+    }
+    NN_FREE(bufs);
+}
+
+// How the weights of a layer get stored once frozen
+typedef enum {
+    _NN_FROZEN_COPY,      // As they are, the direct conv kernel reads them so
+    _NN_FROZEN_PACK,      // Packed, they are B of the forward GEMM
+    _NN_FROZEN_TRANSPOSE, // ws^T row major, they are A of the forward GEMM
+    _NN_FROZEN_INT8,      // Quantized, they are B of the int8 GEMM
+    _NN_FROZEN_SPARSE,    // Only wss is kept, it's in its own arena already
+} _NN_FROZEN_WS;
+
+static _NN_FROZEN_WS _nn_frozen_ws(const NN_Layer* l) {
+    if (l->wss.vals) {
+        return _NN_FROZEN_SPARSE;
+    }
+    if (l->kind == LAYER_KIND_CONV && l->conv.direct) {
+        return _NN_FROZEN_COPY;
+    }
+    if (l->inScale > 0) {
+        return _NN_FROZEN_INT8;
+    }
+    if (l->kind == LAYER_KIND_CONV && l->conv.layout == NN_LAYOUT_NCHW) {
+        return _NN_FROZEN_TRANSPOSE;
+    }
+    return _NN_FROZEN_PACK;
+}
+
+// mfloats of the params arena a MatrixInt8 of ws takes
+static long long _nn_int8_len(const Matrix* ws) {
+    return (matrixInt8Bytes(ws->rows, ws->cols) + sizeof(mfloat) - 1) /
+           sizeof(mfloat);
+}
+
+void nnFreeze(NN* nn) {
+    NN_ASSERT(!nn->frozen);
+    _nn_replicas_free(nn);
+    nnMasterWeightsSet(nn, 0);
+
+    // Size the new params arena up front so it never grows (and never has to
+    // rebase) while it's being filled
+    long long len = 0;
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        if (!l->ws) {
+            continue;
+        }
+        long long wsLen = (long long)l->ws->rows * l->ws->cols;
+        if (_nn_frozen_ws(l) == _NN_FROZEN_PACK) {
+            wsLen = matrixPackedLen(l->ws->rows, l->ws->cols);
+        } else if (_nn_frozen_ws(l) == _NN_FROZEN_INT8) {
+            wsLen = _nn_int8_len(l->ws);
+        } else if (_nn_frozen_ws(l) == _NN_FROZEN_SPARSE) {
+            wsLen = 0;
+        }
+        len += _MATRIX_ROUND_UP(wsLen, _NN_ARENA_ALIGN) +
+               _MATRIX_ROUND_UP(l->bs->cols, _NN_ARENA_ALIGN);
+    }
+    NN_Arena params = {0};
+    _nn_arena_grow(nn, &params, len ? len : 1);
+
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        l->wsu = NULL;
+        l->bsu = NULL;
+        l->gs = NULL;
+        l->preact = NULL;
+        if (!l->ws) {
+            continue;
+        }
+        int rows = l->ws->rows;
+        int cols = l->ws->cols;
+        mfloat* ws;
+        switch (_nn_frozen_ws(l)) {
+        case _NN_FROZEN_PACK:
+            ws = params.data +
+                 _nn_arena_take(nn, &params, matrixPackedLen(rows, cols));
+            l->wsp = matrixPack(ws, l->ws);
+            l->ws = NULL;
+            break;
+        case _NN_FROZEN_INT8:
+            ws = params.data +
+                 _nn_arena_take(nn, &params, _nn_int8_len(l->ws));
+            l->wsq = matrixQuantize(ws, l->ws);
+            l->ws = NULL;
+            break;
+        case _NN_FROZEN_SPARSE:
+            l->ws = NULL;
+            break;
+        case _NN_FROZEN_TRANSPOSE:
+            // Stays a rows x cols view, just transposed in memory, so
+            // matT(ws) in the forward pass is plain row major
+            ws = params.data + _nn_arena_take(nn, &params,
+                                              (long long)rows * cols);
+            Matrix wsT = matView(ws, cols, rows);
+            matrixTranspose(&wsT, l->ws);
+            l->views[_NN_VIEW_WS] = matT(&wsT);
+            break;
+        case _NN_FROZEN_COPY:
+            ws = params.data + _nn_arena_take(nn, &params,
+                                              (long long)rows * cols);
+            Matrix copy = matView(ws, rows, cols);
+            matrixCopy(&copy, l->ws);
+            l->views[_NN_VIEW_WS] = copy;
+            break;
+        }
+        mfloat* bs =
+            params.data + _nn_arena_take(nn, &params, l->bs->cols);
+        Matrix bsCopy = matView(bs, 1, l->bs->cols);
+        matrixCopy(&bsCopy, l->bs);
+        l->views[_NN_VIEW_BS] = bsCopy;
+        l->bs = &l->views[_NN_VIEW_BS];
+        if (l->ws) {
+            l->ws = &l->views[_NN_VIEW_WS];
+        }
+    }
+    _nn_arena_free(&nn->params);
+    _nn_arena_free(&nn->grads);
+    _nn_arena_free(&nn->state);
+    nn->params = params;
+
+    // Start the acts arena over so it shrinks to what _nn_acts_plan needs, now
+    // that there are only outputs and im2col buffers left
+    for (int i = 0; i < nn->layerCnt; i++) {
+        for (int v = 0; v < _NN_VIEW_COUNT; v++) {
+            Matrix* m = *_nn_layer_view(&nn->layers[i], v);
+            if (m && _nn_view_arena(nn, v) == &nn->acts) {
+                m->data = NULL;
+            }
+        }
+    }
+    _nn_arena_free(&nn->acts);
+    nn->frozen = 1;
+    nn->checkpointEvery = 0;
+    nnBatchSet(nn, nn->batch);
+}
+
+void nnQuantize(NN* nn, const Matrix* calib) {
+    NN_ASSERT(!nn->frozen);
+    NN_ASSERT(calib->rows > 0 && calib->cols == nn->layers[0].nodeCnt);
+    // Every layer's input has to be there after the forward pass. Freezing
+    // lays the activations out again anyway
+    if (nn->checkpointEvery > 0) {
+        nnCheckpointSet(nn, 0);
+    }
+    // The biggest magnitude the input of every layer reaches
+    mfloat* inMax = NN_MALLOC(sizeof(mfloat) * nn->layerCnt);
+    for (int i = 0; i < nn->layerCnt; i++) {
+        inMax[i] = 0;
+    }
+    for (int r = 0; r < calib->rows; r += nn->batch) {
+        int rows = _MATRIX_MIN(nn->batch, calib->rows - r);
+        Matrix in = matRows(calib, r, rows);
+        _nn_rows_set(nn, rows);
+        matrixCopy(NN_INPUT(nn), &in);
+        nnForward(nn);
+        for (int i = 1; i < nn->layerCnt; i++) {
+            const Matrix* x = nn->layers[i].prev->output;
+            for (int s = 0; s < x->rows; s++) {
+                for (int j = 0; j < x->cols; j++) {
+                    mfloat v = MAT_AT(x, s, j);
+                    v = v < 0 ? -v : v;
+                    inMax[i] = v > inMax[i] ? v : inMax[i];
+                }
+            }
+        }
+    }
+    _nn_rows_set(nn, nn->batch);
+
+    for (int i = 1; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        if (l->ws && !l->wss.vals &&
+            !(l->kind == LAYER_KIND_CONV && l->conv.direct)) {
+            l->inScale = inMax[i] > 0 ? inMax[i] / 127 : 1;
+        }
+    }
+    NN_FREE(inMax);
+    nnFreeze(nn);
 }
@@ -1,6 +1,21 @@
+#pragma once
+
+// Only nn.c defines NN_IMPLEMENTATION, so the matrix and dino code gets built
+// once however many files include this
+#ifdef NN_IMPLEMENTATION
 #define MATRIX_IMPLEMENTATION
-#include "matrix.h"
 #define DINO_IMPLEMENTATION
+// The thread pool needs it for the affinity mask, and nnProfile.h includes
+// system headers before the pool gets to define it
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+// Has to come first, it swaps in the counting allocation hooks
+#ifdef NN_PROFILE
+#include "nnProfile.h"
+#endif
+#include "matrix.h"
 #include "dinoarray.h"
 
 #ifndef NN_MALLOC
@@ -18,14 +33,45 @@
 #define NN_ASSERT assert
 #endif // NN_ASSERT
 
+// NCHW 3x3 stride 1 conv layers with at most this many input * output channels
+// run the direct kernel forward. It skips filling the im2col buffer, which is
+// what dominates when there are this few channels; past that the GEMM wins.
+#ifndef NN_CONV_DIRECT_MAX
+#define NN_CONV_DIRECT_MAX 16
+#endif // NN_CONV_DIRECT_MAX
+
+// nnPrune makes a dense layer sparse once at least this much of its ws is in
+// zero blocks. With blocks of 8 the sparse kernels win from about 0.7 at a
+// batch of 64 and from well under half at a batch of 1; plain CSR (blocks of
+// 1) needs about 0.9 to win at 64.
+#ifndef NN_SPARSE_MIN
+#define NN_SPARSE_MIN 0.75
+#endif // NN_SPARSE_MIN
+
 typedef enum LAYER_TYPE {
     LAYER_TYPE_INPUT,
     LAYER_TYPE_OUTPUT,
     LAYER_TYPE_HIDDEN,
 } LAYER_TYPE;
 
+typedef enum LAYER_KIND {
+    LAYER_KIND_FULL,
+    LAYER_KIND_CONV,
+} LAYER_KIND;
+
+/**
+ * How an image sample is laid out in its row.
+ * NCHW: every channel is a whole plane, (c, y, x) is at (c * h + y) * w + x
+ * NHWC: the channels of a pixel are next to each other, (y * w + x) * d + c
+ */
+typedef enum NN_LAYOUT {
+    NN_LAYOUT_NCHW,
+    NN_LAYOUT_NHWC,
+} NN_LAYOUT;
+
 typedef struct NN_Layer {
     LAYER_TYPE layerType;
+    LAYER_KIND kind;
     struct NN_Layer* prev;
     struct NN_Layer* next;
 
@@ -34,16 +80,42 @@ typedef struct NN_Layer {
     int height;
 
     int nodeCnt;
+    MATRIX_ACT act;
     Matrix* output;
+    Matrix* preact; // output before the activation, only kept when needed
     Matrix* gs; // The gradients
 
     Matrix* ws;
     Matrix* bs;
+    // ws packed for the GEMM once the network is frozen, ws is NULL then
+    MatrixPacked wsp;
+    // ws in int8 instead once nnQuantize froze it. inScale is the step the
+    // layer's input gets quantized with, 0 if the layer stays in mfloats
+    MatrixInt8 wsq;
+    mfloat inScale;
+    // ws without its zero blocks, once nnPrune made it sparse enough. Forward
+    // and backward use it, ws stays the dense copy learning steps. Frozen
+    // networks only keep this one
+    MatrixSparse wss;
 
     // The updates to weights/bias
     Matrix* wsu;
     Matrix* bsu;
 
+    // Scratch for the im2col lowering of one sample, conv only
+    Matrix* col;
+
+    // Keep its output when checkpointing even if it isn't every k-th, set it
+    // before nnCheckpointSet
+    char checkpoint;
+    // Its output shares memory with other layers' because of checkpointing,
+    // so backprop computes it again before it's needed
+    char recompute;
+
+    // All of the matrix headers above live here, their data lives in the NN's
+    // arenas
+    Matrix* views;
+
     union {
         struct {
 
@@ -53,28 +125,331 @@ typedef struct NN_Layer {
             int kernelSize;
             int paddingSize;
             int stride;
+            NN_LAYOUT layout;
+            char direct; // Forward uses the direct 3x3 kernel instead of GEMM
         } conv;
     };
+
+#ifdef NN_PROFILE
+    NN_LayerProfile prof;
+#endif
 } NN_Layer;
 
+/**
+ * One contiguous, cache line aligned slab of mfloats. The layers' matrices are
+ * views into it, each one starting on its own cache line.
+ */
+typedef struct NN_Arena {
+    mfloat* data;
+    long long len; // mfloats handed out
+    long long cap;
+    void* mem; // What was actually allocated, data is aligned inside it
+    long long mapLen; // If not 0 mem is a read only mmap of this many bytes
+} NN_Arena;
+
 typedef struct NN {
     NN_Layer* layers;
     int layerCnt;
+    // Layout of image data, set it before adding conv layers. NCHW by default
+    NN_LAYOUT layout;
+    int batch; // Samples the activations have room for, look at nnBatchSet
+    // What nnCost measures and training minimizes, MSE by default. Pair
+    // cross-entropy with a softmax output layer
+    MATRIX_LOSS loss;
+    char frozen; // Only runs forward from now on, look at nnFreeze
+    // Draws the initial weights and the order nnTrainEpoch goes in. Its own
+    // stream of the shared seed, set it before adding layers to pick another
+    MatrixRng rng;
+    // What nnLearn steps with, plain SGD if it's never set. Look at
+    // nnOptimizerSet
+    MatrixOptimizer opt;
+    // A double copy of the params that nnLearn steps instead, NULL unless
+    // nnMasterWeightsSet turned it on
+    double* master;
+    long long masterLen;
+
+    // Only every k-th layer's output is kept for backprop, 0 keeps them all.
+    // Look at nnCheckpointSet
+    int checkpointEvery;
+
+    // Copies sharing params that each train on a slice of every batch,
+    // look at nnReplicasSet
+    struct NN* replicas;
+    int replicaCnt;
+
+    NN_Arena params; // Every ws and bs
+    NN_Arena grads;  // Every wsu and bsu, at the same offsets as in params
+    NN_Arena acts;   // Every output, preact and gs
+    // The optimizer's arrays of state, each at the same offsets as in params
+    NN_Arena state;
+    // Every wss, replicas borrow nn's. Holds ints too, it's just bytes
+    NN_Arena sparse;
+
+    // The layers lowered into a flat list of ops, look at nnCompile. The
+    // forward pass is ops[0, forwardCnt), backward the rest of them
+    struct _NN_Op* ops;
+    int forwardCnt;
+    int opCnt;
+    char compiled; // Cleared by anything that moves a view, runs recompile
 } NN;
 
+/**
+ * Creates an empty network, add layers with the layerCreate functions.
+ * MUST be freed (look at nnFree)
+ */
+NN nnCreate(void);
+
+/**
+ * Frees the network and everything its layers own
+ */
+void nnFree(NN* nn);
+
+/**
+ * Zeroes every wsu and bsu in one sweep
+ */
+void nnZeroGrads(NN* nn);
+
+/**
+ * All the weights and biases of the network as a single 1 x n row.
+ * Handy for optimizer steps, checkpointing or syncing between processes.
+ * The padding between matrices is part of it and always stays 0.
+ */
+Matrix nnParamsView(NN* nn);
+
+/**
+ * All the weight/bias updates as a single 1 x n row, lined up with
+ * nnParamsView element for element
+ */
+Matrix nnGradsView(NN* nn);
+
+/**
+ * Adds the input layer. Has to be the first layer of the network
+ * @param nn The network to add to
+ */
 void layerCreateInput(NN* nn, int width, int height, int depth);
-void layerCreateFull(NN* nn, int nodeCnt, char fillWithRand);
 
-/*#define NN_INPUT(nn) (nn).as[0]*/
-/*#define NN_OUTPUT(nn) (nn).as[(nn).count]*/
-/**/
+/**
+ * Adds a fully connected layer after the current last layer
+ * @param nn The network to add to
+ * @param nodeCnt Amount of nodes in the layer
+ * @param act The activation applied to the outputs
+ * @param fillWithRand Randomize the weights instead of zeroing them. He init
+ * for the ReLU family, Glorot for the rest, both uniform. Biases start at 0
+ */
+void layerCreateFull(NN* nn, int nodeCnt, MATRIX_ACT act, char fillWithRand);
+
+/**
+ * Adds a convolution layer after the current last layer. The prev layer's
+ * width/height/depth give the image shape, its row holds one sample in the
+ * network's layout. NCHW 3x3 stride 1 layers with few channels run a direct
+ * kernel forward (look at NN_CONV_DIRECT_MAX), everything else is lowered
+ * onto the GEMM with im2col.
+ * @param nn The network to add to
+ * @param filters Amount of output channels
+ * @param kernelSize Width and height of the filters
+ * @param stride Step between two filter positions
+ * @param paddingSize Zeros added on every side of the input
+ * @param act The activation applied to the outputs, anything but softmax
+ * @param fillWithRand Randomize the weights instead of zeroing them. He init
+ * for the ReLU family, Glorot for the rest, both uniform. Biases start at 0
+ */
+void layerCreateConv(NN* nn, int filters, int kernelSize, int stride,
+                     int paddingSize, MATRIX_ACT act, char fillWithRand);
+
+/**
+ * Runs one layer forward from its prev layer's output, bias and activation
+ * included, as a single fused kernel
+ */
+void layerForward(NN_Layer* l);
+
+/**
+ * Runs one layer backward. `gs` has to hold the gradient of the cost w.r.t.
+ * the layer's output. Adds to `wsu`/`bsu` and fills the prev layer's `gs`.
+ */
+void layerBackward(NN_Layer* l);
+
+#define NN_INPUT(nn) (nn)->layers[0].output
+#define NN_OUTPUT(nn) (nn)->layers[(nn)->layerCnt - 1].output
+
+/**
+ * Lowers the layers into a flat list of ops for nnForward and backprop to run
+ * in a loop. Every op has its kernel picked, its operands resolved to views
+ * and its shapes checked here, so running one only sets how many rows the
+ * batch has. Dense layers become a fused GEMM forward and an activation
+ * backward plus two GEMMs backward, conv layers an op each way.
+ *  Adding layers, nnBatchSet, nnReplicasSet, nnPrune, nnFreeze and nnLoad
+ * throw the ops out and the next run compiles again, so this never has to be
+ * called. Call it again after changing a layer by hand, e.g. its act.
+ */
+void nnCompile(NN* nn);
+
+/**
+ * Runs the whole network forward from what's in NN_INPUT
+ */
+void nnForward(NN* nn);
+
+/**
+ * nnForward for only the first `rows` samples in NN_INPUT, when there's less
+ * than a whole batch. Just that many rows of each output mean anything after.
+ */
+void nnForwardRows(NN* nn, int rows);
+
+/**
+ * Sets how many samples go through the network at once. Every output, preact
+ * and gs gets a row per sample, so a whole batch runs as GEMMs. 1 by default.
+ * Can be called any time, the activations' contents are lost.
+ */
+void nnBatchSet(NN* nn, int batch);
+
+/**
+ * Splits every batch nnBackprop/nnTrainEpoch run across `replicas` pool
+ * threads. Each replica has its own activations and gradients but reads the
+ * same ws/bs, and their gradients get summed into nn's before the learning
+ * step. Beats parallelizing each GEMM when the layers are narrow. Call it after
+ * all the layers are added, nnBatchSet keeps it.
+ * @param replicas How many, 0 for one per pool thread and 1 turns it off
+ */
+void nnReplicasSet(NN* nn, int replicas);
+
+/**
+ * Gradient checkpointing: cuts the memory training takes for activations by
+ * keeping only some layers' outputs and computing the rest again, a segment
+ * of layers at a time, when backprop gets to them. The kept layers are
+ * every `every`-th one, the ones with l->checkpoint set, the input and the
+ * output. Everything between two kept layers shares memory with the other
+ * segments, and the gradients (gs) alternate between two buffers, so with n
+ * layers of the same width it takes about n/k + k + 2 outputs worth of
+ * memory instead of 2n. Backprop costs up to one more forward pass, about a
+ * third more. Every layer's output is still right after nnForward except the
+ * ones between kept layers, only the last of those segments is left.
+ *  Call it after all the layers are added. nnBatchSet and nnReplicasSet keep
+ * it, nnFreeze drops it. Turning it on before nnBatchSet means the whole
+ * batch's worth of activations never gets allocated.
+ * @param every 0 turns it off. 1 only saves the gradients' memory, and with
+ * nn->layerCnt or more only the marked layers are kept.
+ */
+void nnCheckpointSet(NN* nn, int every);
+
+/**
+ * nnBatchSet(nn, batch) and nnCheckpointSet with the smallest `every` whose
+ * activations fit in `bytes`, which is the one that recomputes the fewest
+ * layers. Replicas take about as much again between them.
+ * @return The `every` it picked, 0 if none fits, the one that takes the
+ * least memory gets used then
+ */
+int nnCheckpointBudget(NN* nn, int batch, long long bytes);
+
+/**
+ * The mean over all samples of nn->loss. Runs forward a batch at a time.
+ * @param ti The inputs, one sample per row
+ * @param to The expected outputs, one sample per row
+ */
+mfloat nnCost(NN* nn, const Matrix* ti, const Matrix* to);
+
+/**
+ * Runs a batch forward and backward, adding the gradients of its mean cost
+ * to every wsu/bsu
+ * @param ti The inputs, at most nn->batch rows
+ * @param to The expected outputs, one row per input
+ */
+void nnBackprop(NN* nn, const Matrix* ti, const Matrix* to);
+
+/**
+ * Picks the optimizer nnLearn steps with and starts its state over, e.g.
+ * nnOptimizerSet(nn, matrixOptimizerCreate(MATRIX_OPTIMIZER_ADAMW)).
+ * The state lives in its own arena, allocated on the next nnLearn.
+ */
+void nnOptimizerSet(NN* nn, MatrixOptimizer opt);
+
+/**
+ * Mixed precision training: keeps a master copy of every ws and bs in doubles
+ * that nnLearn takes its steps on, rounding the result into the params that
+ * forward and backward use. With MATRIX_FLOAT the math stays in floats but
+ * updates too small to move a float still add up. Doesn't change anything in
+ * a double build but takes memory.
+ *  Turning it on copies the params, so call it again after changing them by
+ * hand. nnPrune keeps it in step, nnFreeze drops it.
+ * @param on 1 to keep the master copy, 0 to free it
+ */
+void nnMasterWeightsSet(NN* nn, char on);
+
+/**
+ * Takes a step of nn->opt with the accumulated wsu/bsu and zeroes them. Every
+ * ws and bs gets updated in a single fused pass, on the master copy if
+ * nnMasterWeightsSet turned it on. The weight decay applies to the biases as
+ * well.
+ * @param rate The learning rate
+ */
+void nnLearn(NN* nn, mfloat rate);
+
+/**
+ * One pass over the training set in shuffled mini-batches, taking a learning
+ * step after each one
+ * @param ti The inputs, one sample per row
+ * @param to The expected outputs, one sample per row
+ * @param rate The learning rate
+ */
+void nnTrainEpoch(NN* nn, const Matrix* ti, const Matrix* to, mfloat rate);
+
+/**
+ * Magnitude pruning for dense layers: zeroes the blocks of every ws with the
+ * smallest L2 norms, `sparsity` of them. A block is `blockCols` weights of a
+ * row next to each other, whole blocks are what the sparse kernels can skip
+ * a vector at a time. 8 or 16 is a good start; 1 prunes single weights.
+ *  Layers that end up with at least NN_SPARSE_MIN of their blocks zero get a
+ * sparse copy of ws, wss, and run forward and backward with the sparse
+ * kernels from then on. The pruned weights stay 0 while training goes on,
+ * their gradients are never computed. The optimizer's state starts over.
+ *  Call it a few times with growing sparsity and train in between, the
+ * network recovers better than from pruning all at once. With sparsity 0 it
+ * only picks up layers that already are sparse, e.g. after nnLoad. Conv
+ * layers are left alone.
+ * @param nn The network, can't be frozen. If nnLoad mapped it sparsity has
+ * to be 0
+ * @param sparsity The fraction of blocks to zero, in [0, 1)
+ */
+void nnPrune(NN* nn, mfloat sparsity, int blockCols);
+
+/**
+ * Turns a network into one that only runs forward, for serving predictions.
+ * Every gradient, wsu, bsu and preact is dropped, and the params get copied
+ * into the layout forward reads them in: the weights of dense and NHWC conv
+ * layers packed into the GEMM's panels, NCHW conv weights transposed so they
+ * are read row by row. Nothing gets packed on the first forward pass anymore.
+ * Layers nnPrune made sparse keep only their sparse weights.
+ * Works on networks loaded mapped by nnLoad as well, the mapping gets let go.
+ *  The bias and activation already run inside the GEMM, there are no other
+ * constant ops to fold into the weights.
+ *  The activations get planned by lifetime: layers whose outputs are never
+ * needed at the same time share memory, so a chain of layers only needs
+ * about two outputs worth of it. That means after nnForward only NN_OUTPUT
+ * is valid, NN_INPUT and every other output may have been overwritten.
+ *  After this it can't train, be saved or get layers added. nnForward,
+ * nnCost and nnBatchSet work as before. Freeze after picking the instruction
+ * set, the packed panels are only good for that one.
+ */
+void nnFreeze(NN* nn);
+
+/**
+ * nnFreeze, with the weights of dense and GEMM conv layers stored in int8 and
+ * multiplied in int8 with int32 sums. Weights get one scale per output (per
+ * node, or per filter). The inputs of every layer get one scale, from the
+ * biggest magnitude that layer sees over `calib`, and get quantized on the
+ * fly. The products are scaled back to mfloats before the bias and
+ * activation, so that is what the next layer gets. Biases, direct 3x3 conv
+ * weights and the layers nnPrune made sparse stay in mfloats.
+ *  Costs about 1/8 the weight memory of doubles and 1/4 of floats. Outputs
+ * drift from the float network by about a percent of their range, compare
+ * nnCost before and after on held out data.
+ * @param nn The network, can't be frozen already
+ * @param calib Inputs that look like the real ones, one sample per row. A few
+ * hundred are usually enough
+ */
+void nnQuantize(NN* nn, const Matrix* calib);
+
 /*NN nnAlloc(size_t* arch, size_t archCount);*/
 /*void nnFill(NN nn, size_t val);*/
 /*void nnPrint(NN nn, const char* name);*/
 /*#define NN_PRINT(nn) nnPrint(nn, #nn);*/
 /*void nnRand(NN nn, float low, float high);*/
-/*void nnForward(NN nn);*/
-/*float nnCost(NN nn, Matrix ti, Matrix to);*/
 /*void nnFiniteDiff(NN nn, NN g, float eps, Matrix ti, Matrix to);*/
-/*void nnBackprop(NN nn, NN g, Matrix ti, Matrix to);*/
-/*void nnLearn(NN nn, NN g, float rate);*/
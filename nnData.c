@@ -0,0 +1,398 @@
+#include "nnData.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define _NN_DATA_MAGIC "NNDS"
+#define _NN_DATA_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t inCols;
+    uint32_t outCols;
+    uint32_t pad;
+    uint64_t rows;
+    char reserved[32];
+} _NN_DataHeader;
+
+static int _nn_data_little_endian(void) {
+    uint16_t v = 1;
+    return *(unsigned char*)&v == 1;
+}
+
+//====================== Shards ======================
+
+int nnDataShardWrite(const char* path, const Matrix* ti, const Matrix* to) {
+    NN_ASSERT(ti->rows == to->rows);
+    // The rows get used straight out of the mapping, so they're native
+    if (!_nn_data_little_endian()) {
+        return -1;
+    }
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+    _NN_DataHeader h = {.version = _NN_DATA_VERSION,
+                        .size = sizeof(mfloat),
+                        .inCols = ti->cols,
+                        .outCols = to->cols,
+                        .rows = ti->rows};
+    memcpy(h.magic, _NN_DATA_MAGIC, 4);
+    int ok = fwrite(&h, sizeof(h), 1, file) == 1;
+
+    int cols = ti->cols + to->cols;
+    mfloat* row = NN_MALLOC(sizeof(mfloat) * (cols ? cols : 1));
+    for (int i = 0; ok && i < ti->rows; i++) {
+        for (int j = 0; j < ti->cols; j++) {
+            row[j] = MAT_AT(ti, i, j);
+        }
+        for (int j = 0; j < to->cols; j++) {
+            row[ti->cols + j] = MAT_AT(to, i, j);
+        }
+        ok = fwrite(row, sizeof(mfloat), cols, file) == (size_t)cols;
+    }
+    NN_FREE(row);
+    ok = (fclose(file) == 0) && ok;
+    return ok ? 0 : -1;
+}
+
+// Maps one shard, 0 if it isn't a valid one
+static int _nn_data_shard_open(NN_DataShard* s, const char* path,
+                               int* inCols, int* outCols) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(_NN_DataHeader)) {
+        close(fd);
+        return 0;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    _NN_DataHeader h;
+    memcpy(&h, map, sizeof(h));
+    long long cols = (long long)h.inCols + h.outCols;
+    long long dataLen = st.st_size - (long long)sizeof(h);
+    int valid = memcmp(h.magic, _NN_DATA_MAGIC, 4) == 0 &&
+                h.version == _NN_DATA_VERSION && h.size == sizeof(mfloat) &&
+                _nn_data_little_endian() && cols > 0 &&
+                h.rows <= (uint64_t)(dataLen / (cols * sizeof(mfloat)));
+    // The first shard decides the columns, the rest have to agree
+    if (valid && *inCols < 0) {
+        *inCols = h.inCols;
+        *outCols = h.outCols;
+    }
+    if (!valid || *inCols != (int)h.inCols || *outCols != (int)h.outCols) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    *s = (NN_DataShard){.rows = (const mfloat*)((char*)map + sizeof(h)),
+                        .rowCnt = (long long)h.rows,
+                        .map = map,
+                        .mapLen = st.st_size};
+    return 1;
+}
+
+static void _nn_data_shards_close(NN_Dataset* ds) {
+    for (int i = 0; i < ds->shardCnt; i++) {
+        munmap(ds->shards[i].map, ds->shards[i].mapLen);
+    }
+    if (ds->shards) {
+        NN_FREE(ds->shards);
+    }
+}
+
+int nnDataOpen(NN_Dataset* ds, const char** paths, int count,
+               long long shuffleWindow) {
+    NN_Dataset out = {.inCols = -1, .outCols = -1, .held = -1};
+    out.shards = NN_MALLOC(sizeof(NN_DataShard) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        NN_DataShard* s = &out.shards[i];
+        if (!_nn_data_shard_open(s, paths[i], &out.inCols, &out.outCols)) {
+            _nn_data_shards_close(&out);
+            return -1;
+        }
+        s->first = out.rowCnt;
+        out.rowCnt += s->rowCnt;
+        out.shardCnt++;
+    }
+    if (out.rowCnt == 0) {
+        _nn_data_shards_close(&out);
+        return -1;
+    }
+    // A window reads each shard nearly front to back, so let the kernel read
+    // ahead. A full shuffle jumps all over and read ahead would be wasted.
+    char windowed = shuffleWindow > 0 && shuffleWindow < out.rowCnt;
+    for (int i = 0; i < out.shardCnt; i++) {
+        madvise(out.shards[i].map, out.shards[i].mapLen,
+                windowed ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+    out.shuffleWindow = shuffleWindow;
+    out.seed = 1;
+    // pthread objects can't be copied, they get set up where they stay
+    *ds = out;
+    pthread_mutex_init(&ds->lock, NULL);
+    pthread_cond_init(&ds->changed, NULL);
+    return 0;
+}
+
+//====================== Background gathering ======================
+
+// Where the data set's row `idx` is
+static const mfloat* _nn_data_row(const NN_Dataset* ds, long long idx) {
+    int lo = 0;
+    int hi = ds->shardCnt - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (ds->shards[mid].first <= idx) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    const NN_DataShard* s = &ds->shards[lo];
+    return s->rows + (idx - s->first) * (ds->inCols + ds->outCols);
+}
+
+// Produces the row order of an epoch one index at a time
+typedef struct {
+    const NN_Dataset* ds;
+    MatrixRng rng;
+    long long* perm; // The whole permutation, when there's no window
+    int* shardOrder;
+    int shard;       // Position in shardOrder being streamed
+    long long next;  // Next row of that shard to go in the window
+    long long* window;
+    long long windowLen;
+    long long emitted;
+} _NN_DataOrder;
+
+static int _nn_data_stream(_NN_DataOrder* o, long long* idx) {
+    while (o->shard < o->ds->shardCnt) {
+        const NN_DataShard* s = &o->ds->shards[o->shardOrder[o->shard]];
+        if (o->next < s->rowCnt) {
+            *idx = s->first + o->next++;
+            return 1;
+        }
+        o->shard++;
+        o->next = 0;
+    }
+    return 0;
+}
+
+static void _nn_data_order_init(_NN_DataOrder* o, const NN_Dataset* ds,
+                                unsigned long long epoch) {
+    *o = (_NN_DataOrder){.ds = ds, .rng = matrixRngCreate(ds->seed, epoch)};
+    long long n = ds->rowCnt;
+    if (ds->shuffleWindow <= 0 || ds->shuffleWindow >= n) {
+        // Fisher-Yates over every index, the swaps get drawn up front so
+        // that part runs in parallel
+        long long* swaps = NN_MALLOC(sizeof(long long) * n);
+        matrixRngSwaps(&o->rng, swaps, n);
+        o->perm = NN_MALLOC(sizeof(long long) * n);
+        for (long long i = 0; i < n; i++) {
+            o->perm[i] = i;
+        }
+        for (long long i = n - 1; i > 0; i--) {
+            long long j = swaps[i];
+            long long save = o->perm[i];
+            o->perm[i] = o->perm[j];
+            o->perm[j] = save;
+        }
+        NN_FREE(swaps);
+        return;
+    }
+    // Shards go in a random order, each one streamed front to back through a
+    // window that samples get drawn from at random
+    o->shardOrder = NN_MALLOC(sizeof(int) * ds->shardCnt);
+    for (int i = 0; i < ds->shardCnt; i++) {
+        o->shardOrder[i] = i;
+    }
+    for (int i = ds->shardCnt - 1; i > 0; i--) {
+        int j = (int)matrixRngBelow(&o->rng, i + 1);
+        int save = o->shardOrder[i];
+        o->shardOrder[i] = o->shardOrder[j];
+        o->shardOrder[j] = save;
+    }
+    o->window = NN_MALLOC(sizeof(long long) * ds->shuffleWindow);
+    while (o->windowLen < ds->shuffleWindow &&
+           _nn_data_stream(o, &o->window[o->windowLen])) {
+        o->windowLen++;
+    }
+}
+
+// The next row index of the epoch, 0 once every row was handed out
+static int _nn_data_order_next(_NN_DataOrder* o, long long* idx) {
+    if (o->perm) {
+        if (o->emitted == o->ds->rowCnt) {
+            return 0;
+        }
+        *idx = o->perm[o->emitted++];
+        return 1;
+    }
+    if (o->windowLen == 0) {
+        return 0;
+    }
+    long long pick = matrixRngBelow(&o->rng, o->windowLen);
+    *idx = o->window[pick];
+    // Refill the slot from the stream, or close the gap once it's dry
+    if (!_nn_data_stream(o, &o->window[pick])) {
+        o->window[pick] = o->window[--o->windowLen];
+    }
+    o->emitted++;
+    return 1;
+}
+
+static void _nn_data_order_free(_NN_DataOrder* o) {
+    if (o->perm) {
+        NN_FREE(o->perm);
+    }
+    if (o->shardOrder) {
+        NN_FREE(o->shardOrder);
+        NN_FREE(o->window);
+    }
+}
+
+// Gathers one batch into slot, returns how many rows it got
+static int _nn_data_gather(NN_Dataset* ds, _NN_DataOrder* o, int slot) {
+    int rows = 0;
+    long long idx;
+    while (rows < ds->batch && _nn_data_order_next(o, &idx)) {
+        const mfloat* src = _nn_data_row(ds, idx);
+        memcpy(&MAT_AT(ds->ti[slot], rows, 0), src,
+               sizeof(mfloat) * ds->inCols);
+        memcpy(&MAT_AT(ds->to[slot], rows, 0), src + ds->inCols,
+               sizeof(mfloat) * ds->outCols);
+        rows++;
+    }
+    return rows;
+}
+
+static void* _nn_data_worker(void* arg) {
+    NN_Dataset* ds = arg;
+    _NN_DataOrder o;
+    _nn_data_order_init(&o, ds, ds->epoch);
+    for (int slot = 0;; slot ^= 1) {
+        pthread_mutex_lock(&ds->lock);
+        while (!ds->stop && ds->filled[slot] != -1) {
+            pthread_cond_wait(&ds->changed, &ds->lock);
+        }
+        char stop = ds->stop;
+        pthread_mutex_unlock(&ds->lock);
+        if (stop) {
+            break;
+        }
+
+        // The slot is ours until it's marked filled
+        int rows = _nn_data_gather(ds, &o, slot);
+
+        pthread_mutex_lock(&ds->lock);
+        ds->filled[slot] = rows;
+        pthread_cond_broadcast(&ds->changed);
+        pthread_mutex_unlock(&ds->lock);
+        if (rows == 0) {
+            break;
+        }
+    }
+    _nn_data_order_free(&o);
+    return NULL;
+}
+
+static void _nn_data_stop(NN_Dataset* ds) {
+    if (!ds->running) {
+        return;
+    }
+    pthread_mutex_lock(&ds->lock);
+    ds->stop = 1;
+    pthread_cond_broadcast(&ds->changed);
+    pthread_mutex_unlock(&ds->lock);
+    pthread_join(ds->worker, NULL);
+    ds->running = 0;
+    ds->stop = 0;
+}
+
+void nnDataEpochStart(NN_Dataset* ds, int batch) {
+    NN_ASSERT(batch > 0);
+    _nn_data_stop(ds);
+    if (batch != ds->batch) {
+        for (int i = 0; i < 2; i++) {
+            if (ds->ti[i]) {
+                matrixFree(ds->ti[i]);
+                matrixFree(ds->to[i]);
+            }
+            ds->ti[i] = matrixCreate(batch, ds->inCols);
+            ds->to[i] = matrixCreate(batch, ds->outCols);
+        }
+        ds->batch = batch;
+    }
+    ds->filled[0] = ds->filled[1] = -1;
+    ds->held = -1;
+    ds->next = 0;
+    ds->epoch++;
+    ds->running = pthread_create(&ds->worker, NULL, _nn_data_worker, ds) == 0;
+    NN_ASSERT(ds->running);
+}
+
+int nnDataNext(NN_Dataset* ds, Matrix* ti, Matrix* to) {
+    NN_ASSERT(ds->running);
+    pthread_mutex_lock(&ds->lock);
+    // Give the last batch back so the worker can gather into it
+    if (ds->held >= 0) {
+        ds->filled[ds->held] = -1;
+        ds->held = -1;
+        pthread_cond_broadcast(&ds->changed);
+    }
+    int slot = ds->next;
+    while (ds->filled[slot] == -1) {
+        pthread_cond_wait(&ds->changed, &ds->lock);
+    }
+    int rows = ds->filled[slot];
+    // The end of the epoch stays put for any later calls
+    if (rows) {
+        ds->held = slot;
+        ds->next = slot ^ 1;
+    }
+    pthread_mutex_unlock(&ds->lock);
+
+    *ti = matView(ds->ti[slot]->data, rows, ds->inCols);
+    *to = matView(ds->to[slot]->data, rows, ds->outCols);
+    return rows;
+}
+
+void nnDataClose(NN_Dataset* ds) {
+    _nn_data_stop(ds);
+    _nn_data_shards_close(ds);
+    for (int i = 0; i < 2; i++) {
+        if (ds->ti[i]) {
+            matrixFree(ds->ti[i]);
+            matrixFree(ds->to[i]);
+        }
+    }
+    pthread_mutex_destroy(&ds->lock);
+    pthread_cond_destroy(&ds->changed);
+    *ds = (NN_Dataset){0};
+}
+
+//====================== Training ======================
+
+void nnTrainData(NN* nn, NN_Dataset* ds, mfloat rate) {
+    NN_ASSERT(ds->inCols == nn->layers[0].nodeCnt);
+    nnDataEpochStart(ds, nn->batch);
+    Matrix ti;
+    Matrix to;
+    while (nnDataNext(ds, &ti, &to) > 0) {
+        nnBackprop(nn, &ti, &to);
+        nnLearn(nn, rate);
+    }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "nn.h"
+#include <pthread.h>
+
+/**
+ *  Training data that streams from disk instead of living in one Matrix.
+ *  A data set is one or more shard files, each holding samples as rows of
+ * inCols inputs followed by outCols expected outputs. Shards are mmapped, so
+ * the page cache decides what is in memory and the data can be far bigger
+ * than RAM. Nothing ever gets moved to shuffle it, the order is an index
+ * stream. A background thread gathers the next mini-batch while the current
+ * one trains.
+ *
+ *  A shard file is a 64 byte header (magic "NNDS", version, bytes per value,
+ * inCols, outCols as 4 byte values, 4 bytes of padding, then the row count as
+ * 8 bytes, then zeros) followed by the rows. Little endian, native mfloats.
+ */
+
+typedef struct NN_DataShard {
+    const mfloat* rows; // Inside the mapping
+    long long rowCnt;
+    long long first; // Index of the first row in the whole data set
+    void* map;
+    long long mapLen;
+} NN_DataShard;
+
+typedef struct NN_Dataset {
+    NN_DataShard* shards;
+    int shardCnt;
+    long long rowCnt;
+    int inCols;
+    int outCols;
+
+    // How many upcoming rows a sample gets picked from at random. Rows are
+    // read close to in order, so only about this many have to be in memory.
+    // 0 shuffles the whole data set, which reads all over it
+    long long shuffleWindow;
+    // Every epoch shuffles with its own stream of the seed, 1 by default
+    unsigned long long seed;
+    unsigned long long epoch; // Bumped by nnDataEpochStart
+
+    // The batch being trained on and the one being gathered
+    Matrix* ti[2];
+    Matrix* to[2];
+    int filled[2]; // Rows in the slot, -1 while it's free, 0 ends the epoch
+    int held;      // The slot handed out by nnDataNext, -1 if none
+    int next;      // The slot nnDataNext hands out next
+    int batch;
+    pthread_t worker;
+    char running;
+    char stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} NN_Dataset;
+
+/**
+ * Writes samples out as a shard file
+ * @param path Where to write it, gets overwritten
+ * @param ti The inputs, one sample per row
+ * @param to The expected outputs, one row per input
+ * @return 0 on success, -1 if the file couldn't be written
+ */
+int nnDataShardWrite(const char* path, const Matrix* ti, const Matrix* to);
+
+/**
+ * Maps the shard files of a data set. All of them need the same columns and
+ * the same value size as mfloat.
+ * @param ds Gets the data set, close it with nnDataClose. Untouched on failure
+ * @param paths The shard files
+ * @param count How many there are
+ * @param shuffleWindow Look at NN_Dataset.shuffleWindow
+ * @return 0 on success, -1 if a shard can't be read or doesn't match
+ */
+int nnDataOpen(NN_Dataset* ds, const char** paths, int count,
+               long long shuffleWindow);
+
+/**
+ * Stops the background thread and unmaps everything
+ */
+void nnDataClose(NN_Dataset* ds);
+
+/**
+ * Starts a new epoch in a new random order, and starts gathering its first
+ * batches in the background. Any epoch still running is abandoned.
+ * @param batch Samples per batch
+ */
+void nnDataEpochStart(NN_Dataset* ds, int batch);
+
+/**
+ * Hands out the next batch of the epoch, waiting for it if it isn't gathered
+ * yet. The views stay valid until the next call.
+ * @param ti Gets the inputs
+ * @param to Gets the expected outputs
+ * @return How many samples are in the batch, 0 once the epoch is done
+ */
+int nnDataNext(NN_Dataset* ds, Matrix* ti, Matrix* to);
+
+/**
+ * One pass over a data set in mini-batches of nn->batch, taking a learning
+ * step after each one
+ * @param rate The learning rate
+ */
+void nnTrainData(NN* nn, NN_Dataset* ds, mfloat rate);
@@ -0,0 +1,399 @@
+#include "nnFile.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define _NN_FILE_MAGIC "NNMF"
+#define _NN_FILE_HEADER 32
+#define _NN_FILE_RECORD 64
+#define _NN_FILE_NONE UINT64_MAX
+
+//====================== Encoding ======================
+// The header goes through these byte by byte so it's little endian whatever
+// the machine is
+
+static void _nn_file_put32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void _nn_file_put64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint32_t _nn_file_get32(const unsigned char* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        v |= (uint32_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+static uint64_t _nn_file_get64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+static int _nn_file_little_endian(void) {
+    uint16_t v = 1;
+    return *(unsigned char*)&v == 1;
+}
+
+// Reverses the bytes of every `size` byte element, for big endian machines
+static void _nn_file_swap(void* data, long long count, int size) {
+    unsigned char* p = data;
+    for (long long i = 0; i < count; i++, p += size) {
+        for (int j = 0; j < size / 2; j++) {
+            unsigned char save = p[j];
+            p[j] = p[size - 1 - j];
+            p[size - 1 - j] = save;
+        }
+    }
+}
+
+// Where a view is in the params block in bytes
+static uint64_t _nn_file_offset(const NN* nn, const Matrix* m) {
+    return m ? (uint64_t)(m->data - nn->params.data) * sizeof(mfloat)
+             : _NN_FILE_NONE;
+}
+
+//====================== Saving ======================
+
+int nnSave(NN* nn, const char* path) {
+    // A frozen network's params aren't in the layout layers are built with
+    NN_ASSERT(!nn->frozen);
+    long long headerLen =
+        _NN_FILE_HEADER + (long long)_NN_FILE_RECORD * nn->layerCnt;
+    headerLen = (headerLen + 63) / 64 * 64;
+    unsigned char* header = NN_MALLOC(headerLen);
+    memset(header, 0, headerLen);
+
+    memcpy(header, _NN_FILE_MAGIC, 4);
+    _nn_file_put32(header + 4, NN_FILE_VERSION);
+    _nn_file_put32(header + 8, (uint32_t)headerLen);
+    _nn_file_put32(header + 12, sizeof(mfloat));
+    _nn_file_put32(header + 16, (uint32_t)nn->layerCnt);
+    _nn_file_put32(header + 20, nn->layout);
+    _nn_file_put64(header + 24, (uint64_t)nn->params.len * sizeof(mfloat));
+
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        unsigned char* rec = header + _NN_FILE_HEADER + _NN_FILE_RECORD * i;
+        uint32_t fields[10] = {l->layerType, l->kind,  l->width,
+                               l->height,    l->depth, l->nodeCnt,
+                               l->act};
+        if (l->kind == LAYER_KIND_CONV) {
+            fields[7] = l->conv.kernelSize;
+            fields[8] = l->conv.paddingSize;
+            fields[9] = l->conv.stride;
+        }
+        for (int f = 0; f < 10; f++) {
+            _nn_file_put32(rec + 4 * f, fields[f]);
+        }
+        _nn_file_put64(rec + 40, _nn_file_offset(nn, l->ws));
+        _nn_file_put64(rec + 48, _nn_file_offset(nn, l->bs));
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        NN_FREE(header);
+        return -1;
+    }
+    int ok = fwrite(header, 1, headerLen, file) == (size_t)headerLen;
+    NN_FREE(header);
+
+    long long len = nn->params.len;
+    if (_nn_file_little_endian()) {
+        ok = ok && fwrite(nn->params.data, sizeof(mfloat), len, file) ==
+                       (size_t)len;
+    } else {
+        mfloat* swapped = NN_MALLOC(sizeof(mfloat) * (len ? len : 1));
+        memcpy(swapped, nn->params.data, sizeof(mfloat) * len);
+        _nn_file_swap(swapped, len, sizeof(mfloat));
+        ok = ok && fwrite(swapped, sizeof(mfloat), len, file) == (size_t)len;
+        NN_FREE(swapped);
+    }
+    ok = (fclose(file) == 0) && ok;
+    return ok ? 0 : -1;
+}
+
+//====================== Loading ======================
+
+// A layer record, decoded and checked before anything gets allocated
+typedef struct _NN_FileLayer {
+    LAYER_TYPE type;
+    LAYER_KIND kind;
+    MATRIX_ACT act;
+    int width;
+    int height;
+    int depth;
+    int nodeCnt;
+    int kernelSize;
+    int paddingSize;
+    int stride;
+    // Where ws and bs are in the params block in bytes, and how many params
+    long long wsOff;
+    long long bsOff;
+    long long wsLen;
+    long long bsLen;
+} _NN_FileLayer;
+
+// a * b, or -1 if either is or it's past NN_FILE_MAX_NODES. Both are at most
+// INT_MAX, so it can't overflow
+static long long _nn_file_mul(long long a, long long b) {
+    return (a < 0 || b < 0 || a * b > NN_FILE_MAX_NODES) ? -1 : a * b;
+}
+
+// Where a param of `len` params is, or -1 if it runs past the block or into
+// the params before it. Version 1 files counted offsets in params
+static long long _nn_file_span(const unsigned char* p, long long len,
+                               int size, int version, long long blockLen,
+                               long long* next) {
+    uint64_t off = _nn_file_get64(p);
+    if (version == 1) {
+        off = off <= (uint64_t)blockLen ? off * size : UINT64_MAX;
+    }
+    if (off % size || off < (uint64_t)*next || off > (uint64_t)blockLen ||
+        len * size > blockLen - (long long)off) {
+        return -1;
+    }
+    *next = (long long)off + len * size;
+    return (long long)off;
+}
+
+// Decodes the record of the layer after `prev` (NULL for the first one) into
+// `l`. 0 if it makes no sense or it's bigger than the file can back
+static int _nn_file_layer_check(const unsigned char* rec,
+                                const _NN_FileLayer* prev, int size,
+                                int version, long long blockLen,
+                                long long* next, _NN_FileLayer* l) {
+    uint32_t f[10];
+    for (int i = 0; i < 10; i++) {
+        f[i] = _nn_file_get32(rec + 4 * i);
+    }
+    for (int i = 2; i < 10; i++) {
+        if (f[i] > INT_MAX) {
+            return 0;
+        }
+    }
+    *l = (_NN_FileLayer){.type = f[0], .kind = f[1], .act = f[6]};
+    // The input layer comes first and only there
+    if (f[6] > MATRIX_ACT_SOFTMAX || (f[0] == LAYER_TYPE_INPUT) != !prev ||
+        f[0] > LAYER_TYPE_HIDDEN) {
+        return 0;
+    }
+    long long nodes;
+    long long wsRows;
+    if (l->type == LAYER_TYPE_INPUT) {
+        l->width = f[2];
+        l->height = f[3];
+        l->depth = f[4];
+        nodes = _nn_file_mul(_nn_file_mul(f[2], f[3]), f[4]);
+        l->nodeCnt = nodes;
+        return nodes > 0 && _nn_file_get64(rec + 40) == _NN_FILE_NONE &&
+               _nn_file_get64(rec + 48) == _NN_FILE_NONE;
+    } else if (l->kind == LAYER_KIND_FULL) {
+        l->width = f[5];
+        l->height = 1;
+        l->depth = 1;
+        nodes = f[5];
+        wsRows = prev->nodeCnt;
+    } else if (l->kind == LAYER_KIND_CONV) {
+        long long k = f[7];
+        long long pad = f[8];
+        long long stride = f[9];
+        long long w = prev->width + 2 * pad - k;
+        long long h = prev->height + 2 * pad - k;
+        if (!k || !stride || l->act == MATRIX_ACT_SOFTMAX || w < 0 || h < 0) {
+            return 0;
+        }
+        l->kernelSize = k;
+        l->paddingSize = pad;
+        l->stride = stride;
+        l->width = w / stride + 1;
+        l->height = h / stride + 1;
+        l->depth = f[4];
+        long long pixels = _nn_file_mul(l->width, l->height);
+        nodes = _nn_file_mul(pixels, f[4]);
+        wsRows = _nn_file_mul(_nn_file_mul(k, k), prev->depth);
+        // The im2col scratch
+        if (_nn_file_mul(wsRows, pixels) < 0) {
+            return 0;
+        }
+    } else {
+        return 0;
+    }
+    // ws is wsRows x bsLen
+    l->nodeCnt = nodes;
+    l->bsLen = l->kind == LAYER_KIND_FULL ? nodes : l->depth;
+    l->wsLen = wsRows * l->bsLen;
+    if (nodes <= 0 || nodes > NN_FILE_MAX_NODES || wsRows <= 0 ||
+        f[2] != (uint32_t)l->width || f[3] != (uint32_t)l->height ||
+        f[4] != (uint32_t)l->depth || f[5] != (uint32_t)nodes) {
+        return 0;
+    }
+    l->wsOff = _nn_file_span(rec + 40, l->wsLen, size, version, blockLen, next);
+    l->bsOff = _nn_file_span(rec + 48, l->bsLen, size, version, blockLen, next);
+    return l->wsOff >= 0 && l->bsOff >= 0;
+}
+
+// Adds a layer that passed _nn_file_layer_check
+static void _nn_file_layer(NN* nn, const _NN_FileLayer* l) {
+    if (l->type == LAYER_TYPE_INPUT) {
+        layerCreateInput(nn, l->width, l->height, l->depth);
+    } else if (l->kind == LAYER_KIND_FULL) {
+        layerCreateFull(nn, l->nodeCnt, l->act, 0);
+    } else {
+        layerCreateConv(nn, l->depth, l->kernelSize, l->stride,
+                        l->paddingSize, l->act, 0);
+    }
+}
+
+// Copies `len` params of `size` bytes out of the file, converting and
+// swapping as needed
+static void _nn_file_copy(mfloat* dst, const unsigned char* src, long long len,
+                          int size) {
+    for (long long i = 0; i < len; i++) {
+        unsigned char bytes[8];
+        memcpy(bytes, src + i * size, size);
+        if (!_nn_file_little_endian()) {
+            _nn_file_swap(bytes, 1, size);
+        }
+        if (size == 4) {
+            float v;
+            memcpy(&v, bytes, 4);
+            dst[i] = (mfloat)v;
+        } else {
+            double v;
+            memcpy(&v, bytes, 8);
+            dst[i] = (mfloat)v;
+        }
+    }
+}
+
+// Swaps the params arena for the mapping and drops the gradients
+static void _nn_file_use_mapping(NN* nn, void* map, long long mapLen,
+                                 mfloat* params) {
+    for (int i = 0; i < nn->layerCnt; i++) {
+        NN_Layer* l = &nn->layers[i];
+        if (l->ws) {
+            l->ws->data = params + (l->ws->data - nn->params.data);
+            l->bs->data = params + (l->bs->data - nn->params.data);
+        }
+        l->wsu = NULL;
+        l->bsu = NULL;
+    }
+    NN_FREE(nn->params.mem);
+    NN_FREE(nn->grads.mem);
+    nn->params = (NN_Arena){.data = params,
+                            .len = nn->params.len,
+                            .cap = nn->params.len,
+                            .mem = map,
+                            .mapLen = mapLen};
+    nn->grads = (NN_Arena){0};
+    nn->compiled = 0;
+}
+
+int nnLoad(NN* nn, const char* path, char mapped) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < _NN_FILE_HEADER) {
+        close(fd);
+        return -1;
+    }
+    long long mapLen = st.st_size;
+    unsigned char* map = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    int version = (int)_nn_file_get32(map + 4);
+    long long headerLen = _nn_file_get32(map + 8);
+    int size = (int)_nn_file_get32(map + 12);
+    long long layerCnt = _nn_file_get32(map + 16);
+    uint32_t layout = _nn_file_get32(map + 20);
+    uint64_t blockLen = _nn_file_get64(map + 24);
+    int valid = memcmp(map, _NN_FILE_MAGIC, 4) == 0 &&
+                (version == 1 || version == NN_FILE_VERSION) &&
+                (size == 4 || size == 8) && layout <= NN_LAYOUT_NHWC &&
+                layerCnt > 0 && headerLen % 64 == 0 && headerLen <= mapLen &&
+                headerLen >= _NN_FILE_HEADER + _NN_FILE_RECORD * layerCnt;
+    if (valid && version == 1) {
+        blockLen = blockLen <= (uint64_t)mapLen ? blockLen * size : UINT64_MAX;
+    }
+    valid = valid && blockLen <= (uint64_t)(mapLen - headerLen);
+    if (mapped) {
+        valid = valid && size == sizeof(mfloat) && _nn_file_little_endian();
+    }
+
+    // Every record gets checked before any layer gets built. The header fits
+    // in the file, so there are only as many records as the file has room for
+    _NN_FileLayer* ls = NULL;
+    if (valid) {
+        ls = NN_MALLOC(sizeof(_NN_FileLayer) * layerCnt);
+    }
+    long long next = 0;
+    for (int i = 0; valid && i < layerCnt; i++) {
+        const unsigned char* rec =
+            map + _NN_FILE_HEADER + _NN_FILE_RECORD * i;
+        valid = _nn_file_layer_check(rec, i ? &ls[i - 1] : NULL, size,
+                                     version, (long long)blockLen, &next,
+                                     &ls[i]);
+    }
+    if (!valid) {
+        NN_FREE(ls);
+        munmap(map, mapLen);
+        return -1;
+    }
+
+    NN out = nnCreate();
+    out.layout = layout;
+    for (int i = 0; i < layerCnt; i++) {
+        _nn_file_layer(&out, &ls[i]);
+    }
+
+    // Mapped, the file's layout has to be the one this build lays the params
+    // out in. Otherwise they get copied into it one layer at a time
+    const unsigned char* block = map + headerLen;
+    for (int i = 0; i < layerCnt; i++) {
+        NN_Layer* l = &out.layers[i];
+        if (!l->ws) {
+            continue;
+        }
+        if (!mapped) {
+            _nn_file_copy(l->ws->data, block + ls[i].wsOff, ls[i].wsLen, size);
+            _nn_file_copy(l->bs->data, block + ls[i].bsOff, ls[i].bsLen, size);
+        } else if (ls[i].wsOff != (l->ws->data - out.params.data) * size ||
+                   ls[i].bsOff != (l->bs->data - out.params.data) * size) {
+            valid = 0;
+        }
+    }
+    NN_FREE(ls);
+    if (mapped && valid && out.params.len * size <= (long long)blockLen) {
+        _nn_file_use_mapping(&out, map, mapLen, (mfloat*)block);
+        *nn = out;
+        return 0;
+    }
+    munmap(map, mapLen);
+    if (mapped) {
+        nnFree(&out);
+        return -1;
+    }
+    *nn = out;
+    return 0;
+}
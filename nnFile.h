@@ -0,0 +1,63 @@
+#pragma once
+
+#include "nn.h"
+
+/**
+ *  Saving and loading networks. A model file is:
+ *
+ *  offset  size
+ *       0     4  magic "NNMF"
+ *       4     4  format version (NN_FILE_VERSION)
+ *       8     4  where the params block starts, a multiple of 64
+ *      12     4  bytes per param (4 or 8)
+ *      16     4  layer count
+ *      20     4  NN_LAYOUT
+ *      24     8  bytes in the params block
+ *      32        a 64 byte record per layer:
+ *                  LAYER_TYPE, LAYER_KIND, width, height, depth, nodeCnt,
+ *                  MATRIX_ACT, kernelSize, paddingSize, stride (4 bytes each),
+ *                  offset of ws and of bs in the params block in bytes
+ *                  (8 bytes each, all ones if the layer has none), then 8
+ *                  bytes of padding
+ *
+ *  then zeros up to the params block, which is the network's params arena
+ * byte for byte. Everything is little endian. Since the block and every ws/bs
+ * in it start on a 64 byte boundary, a mapped file can be used in place.
+ *  How much padding there is depends on the param size, so a build with the
+ * other mfloat lays the params out again as it copies them. Version 1 files
+ * counted the offsets and the block in params instead of bytes, they still
+ * load.
+ */
+
+#define NN_FILE_VERSION 2
+
+// Files with a layer more than this many nodes wide, or whose conv layers
+// need an im2col buffer bigger than this, don't load. A broken file can't
+// make nnLoad allocate more than a few GB for a sample's activations then
+#ifndef NN_FILE_MAX_NODES
+#define NN_FILE_MAX_NODES (1 << 28)
+#endif // NN_FILE_MAX_NODES
+
+/**
+ * Writes the network's layers and params to a file
+ * @param nn The network to save, can't be frozen
+ * @param path Where to write it, gets overwritten
+ * @return 0 on success, -1 if the file couldn't be written
+ */
+int nnSave(NN* nn, const char* path);
+
+/**
+ * Builds a network from a file written by nnSave.
+ *  With `mapped` the file gets mmapped and every ws/bs is a view straight into
+ * the mapping: nothing is parsed or copied, and processes loading the same
+ * file share one copy of it in the page cache. The mapping is read only and
+ * there are no wsu/bsu, so such a network can only run forward. It needs the
+ * file to have the same param size as mfloat and a little endian machine.
+ *  Without `mapped` the params get copied (and converted between float and
+ * double if needed) into a normal network that can keep training.
+ * @param nn Gets the network, free it with nnFree. Untouched on failure
+ * @param path The file to read
+ * @param mapped Use the file in place instead of copying it
+ * @return 0 on success, -1 if the file can't be read or isn't a valid model
+ */
+int nnLoad(NN* nn, const char* path, char mapped);
@@ -0,0 +1,340 @@
+#include "nn.h"
+
+#ifdef NN_PROFILE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Room in front of every counted allocation for its size. Keeps the pointer
+// handed out as aligned as malloc's.
+#define _NN_PROFILE_HEADER 16
+
+// One traced layer call
+typedef struct {
+    long long start;
+    long long ns;
+    double flops;
+    double bytes;
+    int tid;
+    int layer;
+    char kind;
+    char backward;
+} _NN_ProfileEvent;
+
+static _NN_ProfileEvent* _nn_profile_events;
+static pthread_once_t _nn_profile_once = PTHREAD_ONCE_INIT;
+static atomic_llong _nn_profile_eventCnt;
+static atomic_int _nn_profile_threadCnt;
+static _Thread_local int _nn_profile_tid = -1;
+
+enum {
+    _NN_PROFILE_MALLOCS,
+    _NN_PROFILE_REALLOCS,
+    _NN_PROFILE_FREES,
+    _NN_PROFILE_BYTES,
+    _NN_PROFILE_LIVE,
+    _NN_PROFILE_PEAK,
+    _NN_PROFILE_COUNTERS,
+};
+static atomic_llong _nn_profile_allocs[NN_PROFILE_HOOK_COUNT]
+                                      [_NN_PROFILE_COUNTERS];
+
+static const char* _nn_profile_hook_names[] = {"NN_MALLOC", "MATRIX_MALLOC",
+                                               "DINO_MALLOC"};
+
+//====================== Allocations ======================
+
+// Moves the live count by `delta` and keeps the peak up with it
+static void _nn_profile_live_add(atomic_llong* c, long long delta) {
+    long long live = atomic_fetch_add(&c[_NN_PROFILE_LIVE], delta) + delta;
+    long long peak = atomic_load(&c[_NN_PROFILE_PEAK]);
+    while (live > peak &&
+           !atomic_compare_exchange_weak(&c[_NN_PROFILE_PEAK], &peak, live)) {
+    }
+}
+
+void* nnProfileMalloc(NN_PROFILE_HOOK hook, size_t size) {
+    unsigned char* mem = malloc(size + _NN_PROFILE_HEADER);
+    if (!mem) {
+        return NULL;
+    }
+    memcpy(mem, &size, sizeof(size));
+    atomic_llong* c = _nn_profile_allocs[hook];
+    atomic_fetch_add(&c[_NN_PROFILE_MALLOCS], 1);
+    atomic_fetch_add(&c[_NN_PROFILE_BYTES], (long long)size);
+    _nn_profile_live_add(c, (long long)size);
+    return mem + _NN_PROFILE_HEADER;
+}
+
+void* nnProfileRealloc(NN_PROFILE_HOOK hook, void* ptr, size_t size) {
+    if (!ptr) {
+        return nnProfileMalloc(hook, size);
+    }
+    unsigned char* mem = (unsigned char*)ptr - _NN_PROFILE_HEADER;
+    size_t old;
+    memcpy(&old, mem, sizeof(old));
+    mem = realloc(mem, size + _NN_PROFILE_HEADER);
+    if (!mem) {
+        return NULL;
+    }
+    memcpy(mem, &size, sizeof(size));
+    atomic_llong* c = _nn_profile_allocs[hook];
+    atomic_fetch_add(&c[_NN_PROFILE_REALLOCS], 1);
+    // Only growth is new memory
+    if (size > old) {
+        atomic_fetch_add(&c[_NN_PROFILE_BYTES], (long long)(size - old));
+    }
+    _nn_profile_live_add(c, (long long)size - (long long)old);
+    return mem + _NN_PROFILE_HEADER;
+}
+
+void nnProfileFree(NN_PROFILE_HOOK hook, void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    unsigned char* mem = (unsigned char*)ptr - _NN_PROFILE_HEADER;
+    size_t size;
+    memcpy(&size, mem, sizeof(size));
+    atomic_fetch_add(&_nn_profile_allocs[hook][_NN_PROFILE_FREES], 1);
+    atomic_fetch_sub(&_nn_profile_allocs[hook][_NN_PROFILE_LIVE],
+                     (long long)size);
+    free(mem);
+}
+
+//====================== Layers ======================
+
+long long _nn_profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void _nn_profile_init(void) {
+    _nn_profile_events = malloc(sizeof(_NN_ProfileEvent) * NN_PROFILE_EVENTS);
+}
+
+static int _nn_profile_layer_idx(const NN_Layer* l) {
+    int idx = 0;
+    for (; l->prev; l = l->prev) {
+        idx++;
+    }
+    return idx;
+}
+
+// Rough FLOPs and bytes of one call. Every matrix the call reads or writes
+// counts once, as if nothing had to be fetched twice.
+static void _nn_profile_cost(const NN_Layer* l, char backward, double* flops,
+                             double* bytes) {
+    double rows = l->output->rows;
+    double in = l->prev->nodeCnt;
+    double out = l->nodeCnt;
+    double acts = l->preact ? 2 : 1; // output, and preact if it's kept
+    char prevGs = l->prev->gs != NULL;
+
+    // Multiply-adds for one pass of the weights over the batch, the weights
+    // and the im2col buffer
+    double madds;
+    double ws;
+    double col = 0;
+    if (l->kind == LAYER_KIND_CONV) {
+        double pixels = (double)l->width * l->height;
+        double kkc = (double)l->conv.kernelSize * l->conv.kernelSize *
+                     l->prev->depth;
+        madds = rows * pixels * kkc * l->depth;
+        ws = kkc * l->depth;
+        if (backward || !l->conv.direct) {
+            col = 2 * rows * pixels * kkc; // Filled then read
+        }
+    } else {
+        ws = in * out;
+        if (l->wss.vals) {
+            // Only the blocks nnPrune kept get multiplied
+            ws = (double)l->wss.blocks * l->wss.blockCols;
+        }
+        madds = rows * ws;
+    }
+
+    if (!backward) {
+        *flops = 2 * madds + rows * out;
+        *bytes = rows * in + ws + out + rows * out * acts + col;
+    } else {
+        // wsu from the input and gs, and the gradient of the input from ws
+        *flops = 2 * madds * (prevGs ? 2 : 1) + rows * out;
+        *bytes = rows * out * (acts + 1) + rows * in + 2 * ws + out + col;
+        if (prevGs) {
+            *bytes += ws + rows * in + (l->kind == LAYER_KIND_CONV ? col : 0);
+        }
+    }
+    *bytes *= sizeof(mfloat);
+}
+
+void _nn_profile_layer(NN_Layer* l, char backward, long long start) {
+    long long ns = _nn_profile_now() - start;
+    double flops;
+    double bytes;
+    _nn_profile_cost(l, backward, &flops, &bytes);
+    NN_ProfileStats* s = backward ? &l->prof.backward : &l->prof.forward;
+    s->calls++;
+    s->ns += ns;
+    s->flops += flops;
+    s->bytes += bytes;
+
+    pthread_once(&_nn_profile_once, _nn_profile_init);
+    long long idx = atomic_fetch_add(&_nn_profile_eventCnt, 1);
+    if (idx >= NN_PROFILE_EVENTS || !_nn_profile_events) {
+        return;
+    }
+    if (_nn_profile_tid < 0) {
+        _nn_profile_tid = atomic_fetch_add(&_nn_profile_threadCnt, 1);
+    }
+    _nn_profile_events[idx] = (_NN_ProfileEvent){
+        .start = start,
+        .ns = ns,
+        .flops = flops,
+        .bytes = bytes,
+        .tid = _nn_profile_tid,
+        .layer = _nn_profile_layer_idx(l),
+        .kind = l->kind,
+        .backward = backward,
+    };
+}
+
+static void _nn_profile_stats_add(NN_ProfileStats* to,
+                                  const NN_ProfileStats* from) {
+    to->calls += from->calls;
+    to->ns += from->ns;
+    to->flops += from->flops;
+    to->bytes += from->bytes;
+}
+
+void _nn_profile_add(NN_LayerProfile* to, const NN_LayerProfile* from) {
+    _nn_profile_stats_add(&to->forward, &from->forward);
+    _nn_profile_stats_add(&to->backward, &from->backward);
+}
+
+//====================== Reports ======================
+
+NN_ProfileReport nnProfileReport(NN* nn) {
+    NN_ProfileReport r = {.layerCnt = nn->layerCnt};
+    r.layers = calloc(nn->layerCnt ? nn->layerCnt : 1, sizeof(NN_LayerProfile));
+    for (int i = 0; i < nn->layerCnt; i++) {
+        r.layers[i] = nn->layers[i].prof;
+        for (int rep = 0; rep < nn->replicaCnt; rep++) {
+            _nn_profile_add(&r.layers[i], &nn->replicas[rep].layers[i].prof);
+        }
+    }
+    for (int h = 0; h < NN_PROFILE_HOOK_COUNT; h++) {
+        atomic_llong* c = _nn_profile_allocs[h];
+        r.allocs[h] = (NN_AllocProfile){
+            .mallocs = atomic_load(&c[_NN_PROFILE_MALLOCS]),
+            .reallocs = atomic_load(&c[_NN_PROFILE_REALLOCS]),
+            .frees = atomic_load(&c[_NN_PROFILE_FREES]),
+            .bytes = atomic_load(&c[_NN_PROFILE_BYTES]),
+            .live = atomic_load(&c[_NN_PROFILE_LIVE]),
+            .peak = atomic_load(&c[_NN_PROFILE_PEAK]),
+        };
+    }
+    long long events = atomic_load(&_nn_profile_eventCnt);
+    r.dropped = events > NN_PROFILE_EVENTS ? events - NN_PROFILE_EVENTS : 0;
+    return r;
+}
+
+void nnProfileReportFree(NN_ProfileReport* report) {
+    free(report->layers);
+    *report = (NN_ProfileReport){0};
+}
+
+static void _nn_profile_print_stats(FILE* f, int layer, const char* name,
+                                    const NN_ProfileStats* s) {
+    if (!s->calls) {
+        return;
+    }
+    double ns = s->ns ? (double)s->ns : 1;
+    fprintf(f, "l%-4d %-14s %10lld %12.3f %12.2f %10.2f %10.2f\n", layer,
+            name, s->calls, s->ns / 1e6, s->ns / 1e3 / s->calls,
+            s->flops / ns, s->bytes / ns);
+}
+
+void nnProfilePrint(const NN_ProfileReport* report, FILE* file) {
+    fprintf(file, "%-20s %10s %12s %12s %10s %10s\n", "layer", "calls",
+            "total ms", "us/call", "GFLOP/s", "GB/s");
+    for (int i = 0; i < report->layerCnt; i++) {
+        const NN_LayerProfile* p = &report->layers[i];
+        _nn_profile_print_stats(file, i, "forward", &p->forward);
+        _nn_profile_print_stats(file, i, "backward", &p->backward);
+    }
+    fprintf(file, "\n%-20s %10s %10s %10s %14s %14s %14s\n", "allocator",
+            "mallocs", "reallocs", "frees", "bytes", "live", "peak");
+    for (int h = 0; h < NN_PROFILE_HOOK_COUNT; h++) {
+        const NN_AllocProfile* a = &report->allocs[h];
+        fprintf(file, "%-20s %10lld %10lld %10lld %14lld %14lld %14lld\n",
+                _nn_profile_hook_names[h], a->mallocs, a->reallocs, a->frees,
+                a->bytes, a->live, a->peak);
+    }
+    if (report->dropped) {
+        fprintf(file, "\n%lld layer calls didn't fit in the trace\n",
+                report->dropped);
+    }
+}
+
+int nnProfileTraceWrite(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+    long long cnt = atomic_load(&_nn_profile_eventCnt);
+    if (cnt > NN_PROFILE_EVENTS) {
+        cnt = NN_PROFILE_EVENTS;
+    }
+    if (!_nn_profile_events) {
+        cnt = 0;
+    }
+    // Times are in microseconds from the first call traced
+    long long base = cnt ? _nn_profile_events[0].start : 0;
+    for (long long i = 1; i < cnt; i++) {
+        if (_nn_profile_events[i].start < base) {
+            base = _nn_profile_events[i].start;
+        }
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (long long i = 0; i < cnt; i++) {
+        const _NN_ProfileEvent* e = &_nn_profile_events[i];
+        const char* kind = e->kind == LAYER_KIND_CONV ? "conv" : "full";
+        const char* dir = e->backward ? "backward" : "forward";
+        fprintf(f,
+                "{\"name\": \"l%d %s %s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, \"tid\": %d, "
+                "\"args\": {\"flops\": %.0f, \"bytes\": %.0f}},\n",
+                e->layer, kind, dir, dir, (e->start - base) / 1e3,
+                e->ns / 1e3, e->tid, e->flops, e->bytes);
+    }
+    // Trailing commas aren't allowed, so the array ends on the process name
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, "
+               "\"args\": {\"name\": \"nn\"}}\n]}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+void nnProfileReset(NN* nn) {
+    for (int i = 0; i < nn->layerCnt; i++) {
+        nn->layers[i].prof = (NN_LayerProfile){0};
+    }
+    for (int rep = 0; rep < nn->replicaCnt; rep++) {
+        for (int i = 0; i < nn->replicas[rep].layerCnt; i++) {
+            nn->replicas[rep].layers[i].prof = (NN_LayerProfile){0};
+        }
+    }
+    for (int h = 0; h < NN_PROFILE_HOOK_COUNT; h++) {
+        atomic_llong* c = _nn_profile_allocs[h];
+        atomic_store(&c[_NN_PROFILE_MALLOCS], 0);
+        atomic_store(&c[_NN_PROFILE_REALLOCS], 0);
+        atomic_store(&c[_NN_PROFILE_FREES], 0);
+        atomic_store(&c[_NN_PROFILE_BYTES], 0);
+        atomic_store(&c[_NN_PROFILE_PEAK], atomic_load(&c[_NN_PROFILE_LIVE]));
+    }
+    atomic_store(&_nn_profile_eventCnt, 0);
+}
+
+#endif // NN_PROFILE
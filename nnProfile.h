@@ -0,0 +1,120 @@
+#pragma once
+
+/**
+ *  A profiler built in behind the NN_PROFILE flag. Define it for every file
+ * (-DNN_PROFILE) and link nnProfile.c. Without the flag none of this exists
+ * and the hooks in nn.c compile to nothing.
+ *
+ *  With it every layerForward/layerBackward call gets timed and charged an
+ * estimate of the FLOPs it did and the bytes it had to touch (weights, inputs,
+ * outputs, gradients and the im2col buffer, each counted once). Every call also
+ * goes into a trace that nnProfileTraceWrite saves for chrome://tracing or
+ * Perfetto.
+ *  NN_MALLOC/NN_FREE, MATRIX_MALLOC/MATRIX_FREE and
+ * DINO_MALLOC/DINO_REALLOC/DINO_FREE get routed through counting wrappers,
+ * unless one of a set was already defined by the user, in which case that set
+ * isn't counted. The profiler's own memory isn't counted either.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+// How many layer calls the trace keeps, later ones are only counted
+#ifndef NN_PROFILE_EVENTS
+#define NN_PROFILE_EVENTS (1 << 18)
+#endif // NN_PROFILE_EVENTS
+
+typedef enum NN_PROFILE_HOOK {
+    NN_PROFILE_HOOK_NN,
+    NN_PROFILE_HOOK_MATRIX,
+    NN_PROFILE_HOOK_DINO,
+    NN_PROFILE_HOOK_COUNT,
+} NN_PROFILE_HOOK;
+
+typedef struct NN_ProfileStats {
+    long long calls;
+    long long ns;
+    double flops;
+    double bytes;
+} NN_ProfileStats;
+
+typedef struct NN_LayerProfile {
+    NN_ProfileStats forward;
+    NN_ProfileStats backward;
+} NN_LayerProfile;
+
+typedef struct NN_AllocProfile {
+    long long mallocs;
+    long long reallocs; // Resized, in place or not
+    long long frees;
+    long long bytes; // Allocated in total
+    long long live;  // Allocated and not freed yet
+    long long peak;  // Highest live has been
+} NN_AllocProfile;
+
+typedef struct NN_ProfileReport {
+    NN_LayerProfile* layers; // One per layer, replicas summed in
+    int layerCnt;
+    NN_AllocProfile allocs[NN_PROFILE_HOOK_COUNT];
+    long long dropped; // Layer calls that didn't fit in the trace
+} NN_ProfileReport;
+
+struct NN;
+struct NN_Layer;
+
+/**
+ * Collects what has been measured so far
+ * @param nn The network to report on, its replicas get added in
+ * @return The report, free it with nnProfileReportFree
+ */
+NN_ProfileReport nnProfileReport(struct NN* nn);
+
+void nnProfileReportFree(NN_ProfileReport* report);
+
+/**
+ * Prints a report as a table: per layer calls, time, GFLOP/s and GB/s, then
+ * the allocations per hook
+ * @param file Where to print it, stdout for example
+ */
+void nnProfilePrint(const NN_ProfileReport* report, FILE* file);
+
+/**
+ * Writes every traced layer call as Chrome trace event JSON
+ * @param path Where to write it, gets overwritten
+ * @return 0 on success, -1 if the file couldn't be written
+ */
+int nnProfileTraceWrite(const char* path);
+
+/**
+ * Zeroes the layer stats of nn and its replicas, the allocation counts and
+ * the trace. Live bytes are kept, that memory is still there.
+ */
+void nnProfileReset(struct NN* nn);
+
+/**
+ * The counting allocation wrappers the hooks below go through
+ */
+void* nnProfileMalloc(NN_PROFILE_HOOK hook, size_t size);
+void* nnProfileRealloc(NN_PROFILE_HOOK hook, void* ptr, size_t size);
+void nnProfileFree(NN_PROFILE_HOOK hook, void* ptr);
+
+// Used by nn.c around every layer call, and to keep the stats of replicas
+long long _nn_profile_now(void);
+void _nn_profile_layer(struct NN_Layer* l, char backward, long long start);
+void _nn_profile_add(NN_LayerProfile* to, const NN_LayerProfile* from);
+
+#if !defined(NN_MALLOC) && !defined(NN_FREE)
+#define NN_MALLOC(size) nnProfileMalloc(NN_PROFILE_HOOK_NN, size)
+#define NN_FREE(ptr) nnProfileFree(NN_PROFILE_HOOK_NN, ptr)
+#endif
+
+#if !defined(MATRIX_MALLOC) && !defined(MATRIX_FREE)
+#define MATRIX_MALLOC(size) nnProfileMalloc(NN_PROFILE_HOOK_MATRIX, size)
+#define MATRIX_FREE(ptr) nnProfileFree(NN_PROFILE_HOOK_MATRIX, ptr)
+#endif
+
+#if !defined(DINO_MALLOC) && !defined(DINO_FREE) && !defined(DINO_REALLOC)
+#define DINO_MALLOC(size) nnProfileMalloc(NN_PROFILE_HOOK_DINO, size)
+#define DINO_REALLOC(ptr, size) nnProfileRealloc(NN_PROFILE_HOOK_DINO, ptr, size)
+#define DINO_FREE(ptr) nnProfileFree(NN_PROFILE_HOOK_DINO, ptr)
+#endif
@@ -0,0 +1,654 @@
+#include "nn.h"
+#include "nnFile.h"
+#include "threadpool.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ *  A local inference server. It loads a model written by nnSave and answers
+ * requests from stdin or from clients of a Unix domain socket. Requests that
+ * come in close together, from any clients, get run as one batched forward
+ * pass on the thread pool: the batch goes once it has --max-batch requests or
+ * once the oldest one has waited --max-wait microseconds. A longer wait makes
+ * bigger batches and more throughput at the cost of latency when it's quiet,
+ * 0 runs whatever is there right away.
+ *
+ *  serve MODEL [--socket PATH] [--max-batch N] [--max-wait US] [--threads N]
+ *  serve --load PATH [--clients N] [--requests N]
+ *
+ *  --socket     listen on PATH instead of reading stdin and writing stdout
+ *  --max-batch  most requests in one forward pass, 32 by default
+ *  --max-wait   how long the oldest request waits for more, 1000 by default
+ *  --threads    pool threads, the default is what threadpool.h picks
+ *  --load       instead of serving, be --clients clients (4 by default) of
+ *               the server at PATH that each send --requests requests (1000
+ *               by default) one after the other, then print the throughput
+ *               and latency percentiles
+ *
+ *  Everything on the wire is 4 byte little endian words, values are floats:
+ *
+ *    on connecting   "NNSV", inputs, outputs
+ *    request         id, n, then n values
+ *    response        id, n, then n values
+ *
+ *  A request's n has to be the model's input count. Responses carry the
+ * output count, or n = 0 if the request's n was wrong. Replies get written
+ * by a thread of the client's own, a client that leaves more than
+ * SERVE_OUTBOX_MAX bytes of them unread gets disconnected (on stdin the
+ * server stops reading) so it can't hold the others up. Responses to one
+ * client's requests can come back in any order, the id is there to match
+ * them up. On stdin the server stops once stdin is closed and every request
+ * has been answered.
+ */
+
+// Requests waiting for a batch, readers block while it's full
+#ifndef SERVE_QUEUE_MAX
+#define SERVE_QUEUE_MAX 4096
+#endif // SERVE_QUEUE_MAX
+
+// Bytes of replies a client can leave unread before it gets dropped
+#ifndef SERVE_OUTBOX_MAX
+#define SERVE_OUTBOX_MAX (1 << 24)
+#endif // SERVE_OUTBOX_MAX
+
+typedef struct ServeOpts {
+    const char* socketPath;
+    int maxBatch;
+    long long maxWaitNs;
+} ServeOpts;
+
+// One client, or stdin/stdout. It has a reader thread and a writer thread,
+// the writer frees it once the reader is done with it and every request of it
+// got its reply out
+typedef struct ServeConn {
+    int in;
+    int out;
+    pthread_mutex_t lock; // Guards everything below
+    pthread_cond_t queued; // Signalled when there's more to write, or refs
+                           // dropped to 0
+    int refs; // The reader, plus every request waiting for a batch
+    // Replies the writer hasn't gotten to, the batcher only ever appends here
+    // so a client that doesn't read can't hold it up
+    unsigned char* outbox;
+    size_t outLen;
+    size_t outCap;
+    char broken; // Writing failed or it fell behind, its replies get dropped
+} ServeConn;
+
+typedef struct ServeReq {
+    ServeConn* conn;
+    uint32_t id;
+    long long arrivedNs;
+    float* in;
+} ServeReq;
+
+typedef struct ServeQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // Signalled when a request comes in
+    pthread_cond_t space; // Signalled when requests get taken out
+    ServeReq reqs[SERVE_QUEUE_MAX];
+    int head;
+    int len;
+    char done; // No more requests are coming
+} ServeQueue;
+
+static ServeQueue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+};
+static int inputs;
+static int outputs;
+static const char* socketPath;
+
+static long long _serve_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//====================== Wire ======================
+
+static void _serve_u32_put(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t _serve_u32_get(const unsigned char* p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static void _serve_f32_put(unsigned char* p, float v) {
+    uint32_t u;
+    memcpy(&u, &v, 4);
+    _serve_u32_put(p, u);
+}
+
+static float _serve_f32_get(const unsigned char* p) {
+    uint32_t u = _serve_u32_get(p);
+    float v;
+    memcpy(&v, &u, 4);
+    return v;
+}
+
+// 0 on EOF or an error
+static int _serve_read(int fd, void* buf, size_t len) {
+    unsigned char* p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int _serve_write(int fd, const void* buf, size_t len) {
+    const unsigned char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+//====================== Connections ======================
+
+// Stops the connection, the lock has to be held. Shutting the socket down
+// wakes the reader up
+static void _serve_conn_break(ServeConn* c) {
+    c->broken = 1;
+    c->outLen = 0;
+    shutdown(c->in, SHUT_RDWR);
+}
+
+// Writes the outbox out until there are no refs left, then frees the
+// connection
+static void* _serve_writer(void* arg) {
+    ServeConn* c = arg;
+    unsigned char* buf = NULL;
+    size_t cap = 0;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (c->outLen == 0 && c->refs > 0) {
+            pthread_cond_wait(&c->queued, &c->lock);
+        }
+        if (c->outLen == 0) {
+            break;
+        }
+        // Take the whole outbox, replies go into the other buffer meanwhile
+        unsigned char* out = c->outbox;
+        size_t outCap = c->outCap;
+        size_t len = c->outLen;
+        c->outbox = buf;
+        c->outCap = cap;
+        c->outLen = 0;
+        buf = out;
+        cap = outCap;
+        pthread_mutex_unlock(&c->lock);
+        int ok = _serve_write(c->out, buf, len);
+        pthread_mutex_lock(&c->lock);
+        if (!ok && !c->broken) {
+            _serve_conn_break(c);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    // stdin/stdout stay open
+    if (c->in != 0) {
+        close(c->in);
+    }
+    free(buf);
+    free(c->outbox);
+    pthread_cond_destroy(&c->queued);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+    return NULL;
+}
+
+// With `writer` the writer thread is left for the caller to join
+static ServeConn* _serve_conn_create(int in, int out, pthread_t* writer) {
+    ServeConn* c = malloc(sizeof(ServeConn));
+    *c = (ServeConn){.in = in, .out = out, .refs = 1};
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->queued, NULL);
+    pthread_t t;
+    if (pthread_create(&t, NULL, _serve_writer, c) != 0) {
+        perror("serve: writer thread");
+        exit(1);
+    }
+    if (writer) {
+        *writer = t;
+    } else {
+        pthread_detach(t);
+    }
+    return c;
+}
+
+static void _serve_conn_release(ServeConn* c) {
+    pthread_mutex_lock(&c->lock);
+    if (--c->refs == 0) {
+        pthread_cond_signal(&c->queued);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Queues one whole message, so replies from the batcher and the reader never
+// interleave. Never waits on the client
+static void _serve_conn_send(ServeConn* c, const void* buf, size_t len) {
+    pthread_mutex_lock(&c->lock);
+    if (!c->broken && c->outLen + len > SERVE_OUTBOX_MAX) {
+        _serve_conn_break(c);
+    }
+    if (!c->broken) {
+        if (c->outLen + len > c->outCap) {
+            c->outCap = (c->outLen + len) * 2;
+            c->outbox = realloc(c->outbox, c->outCap);
+        }
+        memcpy(c->outbox + c->outLen, buf, len);
+        c->outLen += len;
+        pthread_cond_signal(&c->queued);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+static int _serve_conn_broken(ServeConn* c) {
+    pthread_mutex_lock(&c->lock);
+    int broken = c->broken;
+    pthread_mutex_unlock(&c->lock);
+    return broken;
+}
+
+// Reads requests until the client goes away
+static void* _serve_reader(void* arg) {
+    ServeConn* c = arg;
+    unsigned char* buf = malloc((size_t)inputs * 4);
+    unsigned char head[8];
+    while (!_serve_conn_broken(c) && _serve_read(c->in, head, 8)) {
+        uint32_t id = _serve_u32_get(head);
+        uint32_t n = _serve_u32_get(head + 4);
+        if (n != (uint32_t)inputs) {
+            // Skip its values and say so
+            unsigned char skip[256];
+            long long left = (long long)n * 4;
+            while (left > 0) {
+                size_t len = left < 256 ? left : 256;
+                if (!_serve_read(c->in, skip, len)) {
+                    break;
+                }
+                left -= len;
+            }
+            if (left > 0) {
+                break;
+            }
+            _serve_u32_put(head + 4, 0);
+            _serve_conn_send(c, head, 8);
+            continue;
+        }
+        if (!_serve_read(c->in, buf, (size_t)n * 4)) {
+            break;
+        }
+        ServeReq r = {.conn = c, .id = id, .in = malloc(sizeof(float) * n)};
+        for (uint32_t i = 0; i < n; i++) {
+            r.in[i] = _serve_f32_get(buf + i * 4);
+        }
+        pthread_mutex_lock(&c->lock);
+        c->refs++;
+        pthread_mutex_unlock(&c->lock);
+
+        pthread_mutex_lock(&queue.lock);
+        while (queue.len == SERVE_QUEUE_MAX) {
+            pthread_cond_wait(&queue.space, &queue.lock);
+        }
+        r.arrivedNs = _serve_now();
+        queue.reqs[(queue.head + queue.len) % SERVE_QUEUE_MAX] = r;
+        queue.len++;
+        pthread_cond_signal(&queue.ready);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    free(buf);
+    // On stdin this was the only client
+    if (c->in == 0) {
+        pthread_mutex_lock(&queue.lock);
+        queue.done = 1;
+        pthread_cond_signal(&queue.ready);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    _serve_conn_release(c);
+    return NULL;
+}
+
+static void _serve_hello(ServeConn* c) {
+    unsigned char hello[12] = {'N', 'N', 'S', 'V'};
+    _serve_u32_put(hello + 4, inputs);
+    _serve_u32_put(hello + 8, outputs);
+    _serve_conn_send(c, hello, 12);
+}
+
+static void* _serve_acceptor(void* arg) {
+    int fd = *(int*)arg;
+    for (;;) {
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("serve: accept");
+            exit(1);
+        }
+        ServeConn* c = _serve_conn_create(cfd, cfd, NULL);
+        _serve_hello(c);
+        pthread_t t;
+        if (pthread_create(&t, NULL, _serve_reader, c) != 0) {
+            _serve_conn_release(c);
+            continue;
+        }
+        pthread_detach(t);
+    }
+    return NULL;
+}
+
+static void _serve_on_signal(int sig) {
+    (void)sig;
+    unlink(socketPath);
+    _exit(0);
+}
+
+//====================== Batching ======================
+
+// Waits for the next batch and takes it out of the queue, 0 once the queue
+// is done and empty
+static int _serve_batch_take(const ServeOpts* opts, ServeReq* batch) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.len == 0 && !queue.done) {
+        pthread_cond_wait(&queue.ready, &queue.lock);
+    }
+    // The deadline is the oldest request's, waiting doesn't start over with
+    // every batch that goes
+    if (queue.len > 0 && queue.len < opts->maxBatch && !queue.done) {
+        long long deadline = queue.reqs[queue.head].arrivedNs + opts->maxWaitNs;
+        struct timespec ts = {.tv_sec = deadline / 1000000000LL,
+                              .tv_nsec = deadline % 1000000000LL};
+        while (queue.len < opts->maxBatch && !queue.done &&
+               _serve_now() < deadline) {
+            pthread_cond_timedwait(&queue.ready, &queue.lock, &ts);
+        }
+    }
+    int n = queue.len < opts->maxBatch ? queue.len : opts->maxBatch;
+    for (int i = 0; i < n; i++) {
+        batch[i] = queue.reqs[queue.head];
+        queue.head = (queue.head + 1) % SERVE_QUEUE_MAX;
+    }
+    queue.len -= n;
+    pthread_cond_broadcast(&queue.space);
+    pthread_mutex_unlock(&queue.lock);
+    return n;
+}
+
+static void _serve_batches(NN* nn, const ServeOpts* opts) {
+    ServeReq* batch = malloc(sizeof(ServeReq) * opts->maxBatch);
+    size_t msgLen = 8 + (size_t)outputs * 4;
+    unsigned char* msg = malloc(msgLen);
+    long long served = 0;
+    long long batches = 0;
+    int n;
+    while ((n = _serve_batch_take(opts, batch)) > 0) {
+        Matrix* in = NN_INPUT(nn);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < inputs; j++) {
+                MAT_AT(in, i, j) = batch[i].in[j];
+            }
+            free(batch[i].in);
+        }
+        nnForwardRows(nn, n);
+
+        Matrix* out = NN_OUTPUT(nn);
+        for (int i = 0; i < n; i++) {
+            _serve_u32_put(msg, batch[i].id);
+            _serve_u32_put(msg + 4, outputs);
+            for (int j = 0; j < outputs; j++) {
+                _serve_f32_put(msg + 8 + j * 4, MAT_AT(out, i, j));
+            }
+            _serve_conn_send(batch[i].conn, msg, msgLen);
+            _serve_conn_release(batch[i].conn);
+        }
+        served += n;
+        batches++;
+    }
+    if (batches > 0) {
+        fprintf(stderr, "serve: %lld requests in %lld batches, %.1f each\n",
+                served, batches, (double)served / batches);
+    }
+    free(msg);
+    free(batch);
+}
+
+static int _serve(const char* modelPath, const ServeOpts* opts) {
+    NN nn;
+    if (nnLoad(&nn, modelPath, 0) != 0) {
+        fprintf(stderr, "serve: can't load %s\n", modelPath);
+        return 1;
+    }
+    nnFreeze(&nn);
+    nnBatchSet(&nn, opts->maxBatch);
+    inputs = nn.layers[0].nodeCnt;
+    outputs = nn.layers[nn.layerCnt - 1].nodeCnt;
+
+    // The deadline is on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue.ready, &attr);
+    pthread_condattr_destroy(&attr);
+    // Clients that leave get noticed by the failed write instead
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t t;
+    if (!opts->socketPath) {
+        pthread_t writer;
+        ServeConn* c = _serve_conn_create(0, 1, &writer);
+        _serve_hello(c);
+        pthread_create(&t, NULL, _serve_reader, c);
+        _serve_batches(&nn, opts);
+        pthread_join(t, NULL);
+        // Until the last replies are out
+        pthread_join(writer, NULL);
+    } else {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(opts->socketPath) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "serve: socket path too long\n");
+            nnFree(&nn);
+            return 1;
+        }
+        strcpy(addr.sun_path, opts->socketPath);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(opts->socketPath);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(fd, 64) != 0) {
+            perror("serve: socket");
+            nnFree(&nn);
+            return 1;
+        }
+        socketPath = opts->socketPath;
+        signal(SIGINT, _serve_on_signal);
+        signal(SIGTERM, _serve_on_signal);
+        fprintf(stderr, "serve: %s on %s, %d in, %d out\n", modelPath,
+                opts->socketPath, inputs, outputs);
+        pthread_create(&t, NULL, _serve_acceptor, &fd);
+        // Runs until it gets a signal
+        _serve_batches(&nn, opts);
+    }
+    nnFree(&nn);
+    return 0;
+}
+
+//====================== Load ======================
+
+typedef struct ServeClient {
+    const char* path;
+    int requests;
+    long long* latencies; // ns, one per request
+    int seed;
+    int failed;
+} ServeClient;
+
+static void* _serve_client(void* arg) {
+    ServeClient* cl = arg;
+    cl->failed = 1;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, cl->path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("serve: connect");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    unsigned char hello[12];
+    if (!_serve_read(fd, hello, 12) || memcmp(hello, "NNSV", 4) != 0) {
+        fprintf(stderr, "serve: %s isn't a server\n", cl->path);
+        close(fd);
+        return NULL;
+    }
+    uint32_t in = _serve_u32_get(hello + 4);
+    uint32_t out = _serve_u32_get(hello + 8);
+    size_t reqLen = 8 + (size_t)in * 4;
+    size_t respLen = 8 + (size_t)out * 4;
+    unsigned char* req = malloc(reqLen);
+    unsigned char* resp = malloc(respLen);
+    unsigned int state = cl->seed;
+    int i = 0;
+    for (; i < cl->requests; i++) {
+        _serve_u32_put(req, i);
+        _serve_u32_put(req + 4, in);
+        for (uint32_t j = 0; j < in; j++) {
+            state = state * 1664525u + 1013904223u;
+            _serve_f32_put(req + 8 + j * 4, (float)(state >> 8) / (1 << 24));
+        }
+        long long start = _serve_now();
+        if (!_serve_write(fd, req, reqLen) || !_serve_read(fd, resp, 8) ||
+            _serve_u32_get(resp) != (uint32_t)i ||
+            _serve_u32_get(resp + 4) != out ||
+            !_serve_read(fd, resp + 8, respLen - 8)) {
+            fprintf(stderr, "serve: bad response\n");
+            break;
+        }
+        cl->latencies[i] = _serve_now() - start;
+    }
+    cl->failed = i < cl->requests;
+    free(resp);
+    free(req);
+    close(fd);
+    return NULL;
+}
+
+static int _serve_ll_cmp(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static int _serve_load(const char* path, int clients, int requests) {
+    long long* latencies = malloc(sizeof(long long) * clients * requests);
+    ServeClient* cls = malloc(sizeof(ServeClient) * clients);
+    pthread_t* ts = malloc(sizeof(pthread_t) * clients);
+    long long start = _serve_now();
+    for (int i = 0; i < clients; i++) {
+        cls[i] = (ServeClient){.path = path,
+                               .requests = requests,
+                               .latencies = latencies + (long long)i * requests,
+                               .seed = i + 1};
+        pthread_create(&ts[i], NULL, _serve_client, &cls[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(ts[i], NULL);
+        failed |= cls[i].failed;
+    }
+    double secs = (_serve_now() - start) / 1e9;
+    if (!failed) {
+        long long n = (long long)clients * requests;
+        qsort(latencies, n, sizeof(long long), _serve_ll_cmp);
+        printf("%d clients, %lld requests in %.3f s, %.0f requests/s\n",
+               clients, n, secs, n / secs);
+        printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+               latencies[n / 2] / 1e3, latencies[n * 90 / 100] / 1e3,
+               latencies[n * 99 / 100] / 1e3, latencies[n - 1] / 1e3);
+    }
+    free(ts);
+    free(cls);
+    free(latencies);
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    ServeOpts opts = {.maxBatch = 32, .maxWaitNs = 1000000};
+    const char* modelPath = NULL;
+    const char* loadPath = NULL;
+    int clients = 4;
+    int requests = 1000;
+    int ok = 1;
+    for (int i = 1; i < argc && ok; i++) {
+        const char* arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--socket") == 0 && val) {
+            opts.socketPath = argv[++i];
+        } else if (strcmp(arg, "--max-batch") == 0 && val) {
+            opts.maxBatch = atoi(argv[++i]);
+            ok = opts.maxBatch > 0;
+        } else if (strcmp(arg, "--max-wait") == 0 && val) {
+            opts.maxWaitNs = atoll(argv[++i]) * 1000;
+            ok = opts.maxWaitNs >= 0;
+        } else if (strcmp(arg, "--threads") == 0 && val) {
+            tpoolThreadsSet(atoi(argv[++i]));
+        } else if (strcmp(arg, "--load") == 0 && val) {
+            loadPath = argv[++i];
+        } else if (strcmp(arg, "--clients") == 0 && val) {
+            clients = atoi(argv[++i]);
+            ok = clients > 0;
+        } else if (strcmp(arg, "--requests") == 0 && val) {
+            requests = atoi(argv[++i]);
+            ok = requests > 0;
+        } else if (arg[0] != '-' && !modelPath) {
+            modelPath = arg;
+        } else {
+            ok = 0;
+        }
+    }
+    if (!ok || !(modelPath || loadPath)) {
+        fprintf(stderr,
+                "usage: %s MODEL [--socket PATH] [--max-batch N] "
+                "[--max-wait US] [--threads N]\n"
+                "       %s --load PATH [--clients N] [--requests N]\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    int ret = loadPath ? _serve_load(loadPath, clients, requests)
+                       : _serve(modelPath, &opts);
+    tpoolShutdown();
+    return ret;
+}
@@ -0,0 +1,1041 @@
+// For sched_setaffinity
+#define _GNU_SOURCE
+#include "nn.h"
+#include "nnData.h"
+#include "nnFile.h"
+#include "threadpool.h"
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Regression checks for the library, `make test` runs them. Every check
+ * prints a line when it fails and the exit code is 1 if any did.
+ *
+ *  test [--save DIR] [DIR]
+ *
+ *  --save  only write this build's model files to DIR and exit
+ *  DIR     load the files both precisions' builds wrote there with --save
+ *          and check them against what the saving build computed
+ *
+ *  The MATRIX_ISA environment variable picks the SIMD kernels as usual.
+ */
+
+static int checks;
+static int failures;
+
+#define TEST_CHECK(cond, ...)                                                  \
+    do {                                                                       \
+        checks++;                                                              \
+        if (!(cond)) {                                                         \
+            failures++;                                                        \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                        \
+            printf(__VA_ARGS__);                                               \
+            printf("\n");                                                      \
+        }                                                                      \
+    } while (0)
+
+// What results may be off by, a lot more for floats
+#ifdef MATRIX_FLOAT
+#define TEST_TOL 1e-4
+#else
+#define TEST_TOL 1e-10
+#endif
+
+static const char* _test_precision(void) {
+    return sizeof(mfloat) == 4 ? "f32" : "f64";
+}
+
+// The biggest difference between two matrices of the same shape, relative to
+// the biggest magnitude in `want`
+static double _test_diff(const Matrix* got, const Matrix* want) {
+    double diff = 0;
+    double scale = 1;
+    for (int i = 0; i < want->rows; i++) {
+        for (int j = 0; j < want->cols; j++) {
+            double d = fabs((double)MAT_AT(got, i, j) - MAT_AT(want, i, j));
+            diff = d > diff ? d : diff;
+            double a = fabs((double)MAT_AT(want, i, j));
+            scale = a > scale ? a : scale;
+        }
+    }
+    return diff / scale;
+}
+
+// Anything but zeros, so every weight matters
+static void _test_fill(Matrix* m, int seed) {
+    for (int i = 0; i < m->rows; i++) {
+        for (int j = 0; j < m->cols; j++) {
+            MAT_AT(m, i, j) = sin(seed * 7919 + i * 31 + j * 0.7);
+        }
+    }
+}
+
+//====================== Thread pool ======================
+
+// Pinned to `cpus` of the CPUs it may run on, the pool has to size itself to
+// just those
+static void _test_pool_pinned(const cpu_set_t* all, int cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int picked = 0;
+    for (int c = 0; c < CPU_SETSIZE && picked < cpus; c++) {
+        if (CPU_ISSET(c, all)) {
+            CPU_SET(c, &set);
+            picked++;
+        }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        printf("test: can't pin to %d cpus, skipping\n", cpus);
+        return;
+    }
+    tpoolThreadsSet(0);
+    int threads = tpoolThreadsGet();
+    TEST_CHECK(threads == picked, "pool: pinned to %d cpus, %d threads",
+               picked, threads);
+}
+
+static void _test_pool(void) {
+    cpu_set_t all;
+    // TPOOL_THREADS wins over the affinity mask
+    if (getenv("TPOOL_THREADS") || sched_getaffinity(0, sizeof(all), &all)) {
+        return;
+    }
+    _test_pool_pinned(&all, 1);
+    if (CPU_COUNT(&all) > 1) {
+        _test_pool_pinned(&all, 2);
+    }
+    sched_setaffinity(0, sizeof(all), &all);
+    tpoolThreadsSet(0);
+    int threads = tpoolThreadsGet();
+    int want = CPU_COUNT(&all);
+    TEST_CHECK(threads == want, "pool: %d cpus, %d threads", want, threads);
+}
+
+//====================== GEMM ======================
+
+// The activations the plain way, in doubles
+static double _test_act1(double x, MATRIX_ACT act) {
+    switch (act) {
+    case MATRIX_ACT_SIGMOID:
+        return 1 / (1 + exp(-x));
+    case MATRIX_ACT_TANH:
+        return tanh(x);
+    case MATRIX_ACT_RELU:
+        return x > 0 ? x : 0;
+    case MATRIX_ACT_GELU:
+        return 0.5 * x *
+               (1 + tanh(0.7978845608028654 * (x + 0.044715 * x * x * x)));
+    case MATRIX_ACT_LEAKY_RELU:
+        return x > 0 ? x : MATRIX_LEAKY_SLOPE * x;
+    default:
+        return x;
+    }
+}
+
+// want = act(a * b + bias) with three loops, summed in doubles
+static void _test_gemm_ref(Matrix* want, const Matrix* a, const Matrix* b,
+                           const Matrix* bias, MATRIX_ACT act) {
+    for (int i = 0; i < want->rows; i++) {
+        double max = -HUGE_VAL;
+        for (int j = 0; j < want->cols; j++) {
+            double sum = bias ? MAT_AT(bias, 0, j) : 0;
+            for (int k = 0; k < a->cols; k++) {
+                sum += (double)MAT_AT(a, i, k) * MAT_AT(b, k, j);
+            }
+            MAT_AT(want, i, j) = _test_act1(sum, act);
+            max = sum > max ? sum : max;
+        }
+        if (act != MATRIX_ACT_SOFTMAX) {
+            continue;
+        }
+        double total = 0;
+        for (int j = 0; j < want->cols; j++) {
+            total += exp(MAT_AT(want, i, j) - max);
+        }
+        for (int j = 0; j < want->cols; j++) {
+            MAT_AT(want, i, j) = exp(MAT_AT(want, i, j) - max) / total;
+        }
+    }
+}
+
+// What matrixQuantize and matrixGemmInt8 round a value to, in steps
+static double _test_q8(mfloat x, mfloat step) {
+    mfloat q = x * (1 / step);
+    q = q < -127 ? -127 : q;
+    q = q > 127 ? 127 : q;
+    return nearbyint(q);
+}
+
+// matrixGemmInt8's product from the rounded values, the int8 sums are exact
+// so it can only be off by the scaling at the end
+static void _test_gemm_int8_ref(Matrix* want, const Matrix* a, mfloat aScale,
+                                const Matrix* b, const Matrix* bias) {
+    for (int j = 0; j < want->cols; j++) {
+        mfloat max = 0;
+        for (int k = 0; k < b->rows; k++) {
+            mfloat v = fabs(MAT_AT(b, k, j));
+            max = v > max ? v : max;
+        }
+        mfloat scale = max > 0 ? max / 127 : 1;
+        for (int i = 0; i < want->rows; i++) {
+            double sum = 0;
+            for (int k = 0; k < a->cols; k++) {
+                sum += _test_q8(MAT_AT(a, i, k), aScale) *
+                       _test_q8(MAT_AT(b, k, j), scale);
+            }
+            MAT_AT(want, i, j) = sum * aScale * scale;
+            MAT_AT(want, i, j) += bias ? MAT_AT(bias, 0, j) : 0;
+        }
+    }
+}
+
+// Zeros whole blocks of `b` in a pattern that leaves some rows empty
+static void _test_gemm_prune(Matrix* b, int blockCols) {
+    for (int i = 0; i < b->rows; i++) {
+        for (int j = 0; j < b->cols; j++) {
+            int blk = j / blockCols;
+            if (i % 5 == 3 || (i * 7 + blk * 3) % 4 != 0) {
+                MAT_AT(b, i, j) = 0;
+            }
+        }
+    }
+}
+
+// The sparse kernels against their dense equivalents
+static void _test_gemm_sparse(const char* isa, int m, int k, int n,
+                              int blockCols) {
+    Matrix* a = matrixCreate(m, k);
+    Matrix* b = matrixCreate(k, n);
+    Matrix* bias = matrixCreate(1, n);
+    Matrix* got = matrixCreate(m, n);
+    Matrix* want = matrixCreate(m, n);
+    _test_fill(a, 3);
+    _test_fill(b, 4);
+    _test_fill(bias, 5);
+    _test_gemm_prune(b, blockCols);
+    // ReLU'd inputs have zeros, which the sparse kernels skip
+    for (int i = 0; i < m; i++) {
+        MAT_AT(a, i, i % k) = 0;
+    }
+    long long blocks = matrixSparseBlocks(b, blockCols);
+    void* buf = NN_MALLOC(matrixSparseBytes(k, blocks, blockCols));
+    MatrixSparse s = matrixSparsify(buf, b, blockCols);
+
+    matrixGemmSparse(got, a, &s, bias, MATRIX_ACT_TANH, NULL);
+    _test_gemm_ref(want, a, b, bias, MATRIX_ACT_TANH);
+    double diff = _test_diff(got, want);
+    TEST_CHECK(diff <= TEST_TOL, "gemm %s: sparse %dx%dx%d/%d off by %g", isa,
+               m, k, n, blockCols, diff);
+
+    // a * b^T goes from m x n back to m x k
+    Matrix* gs = matrixCreate(m, n);
+    Matrix* gotT = matrixCreate(m, k);
+    Matrix* wantT = matrixCreate(m, k);
+    _test_fill(gs, 6);
+    Matrix bT = matT(b);
+    matrixGemmSparseT(gotT, gs, &s);
+    _test_gemm_ref(wantT, gs, &bT, NULL, MATRIX_ACT_NONE);
+    diff = _test_diff(gotT, wantT);
+    TEST_CHECK(diff <= TEST_TOL, "gemm %s: sparse T %dx%dx%d/%d off by %g",
+               isa, m, k, n, blockCols, diff);
+
+    // dest += a^T * gs where the pattern has blocks, the rest stays put
+    Matrix* gotG = matrixCreate(k, n);
+    Matrix* wantG = matrixCreate(k, n);
+    _test_fill(gotG, 7);
+    Matrix aT = matT(a);
+    _test_gemm_ref(wantG, &aT, gs, NULL, MATRIX_ACT_NONE);
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < n; j++) {
+            int kept = 0;
+            int j0 = j / blockCols * blockCols;
+            for (int c = j0; c < j0 + blockCols && c < n; c++) {
+                kept |= MAT_AT(b, i, c) != 0;
+            }
+            MAT_AT(wantG, i, j) =
+                MAT_AT(gotG, i, j) + (kept ? MAT_AT(wantG, i, j) : 0);
+        }
+    }
+    matrixGemmSparseGrad(gotG, a, gs, &s);
+    diff = _test_diff(gotG, wantG);
+    TEST_CHECK(diff <= TEST_TOL, "gemm %s: sparse grad %dx%dx%d/%d off by %g",
+               isa, m, k, n, blockCols, diff);
+
+    NN_FREE(buf);
+    matrixFree(a);
+    matrixFree(b);
+    matrixFree(bias);
+    matrixFree(got);
+    matrixFree(want);
+    matrixFree(gs);
+    matrixFree(gotT);
+    matrixFree(wantT);
+    matrixFree(gotG);
+    matrixFree(wantG);
+}
+
+// Every way into the GEMM for one m x k x n product. The operands are views
+// into bigger matrices so strides other than the width get used, and `a` is
+// transposed half the time
+static void _test_gemm_shape(const char* isa, int m, int k, int n) {
+    Matrix* aBuf = matrixCreate(k + 2, m + 3);
+    Matrix* bBuf = matrixCreate(k + 1, n + 5);
+    Matrix* bias = matrixCreate(1, n);
+    Matrix* destBuf = matrixCreate(m + 1, n + 2);
+    Matrix* got = matrixCreate(m, n);
+    Matrix* want = matrixCreate(m, n);
+    Matrix* pre = matrixCreate(m, n);
+    _test_fill(aBuf, 8);
+    _test_fill(bBuf, 9);
+    _test_fill(bias, 10);
+    Matrix aT = matSlice(aBuf, 1, 2, k, m);
+    Matrix as[2] = {matT(&aT), matView(aBuf->data, m, k)};
+    Matrix b = matSlice(bBuf, 1, 3, k, n);
+    Matrix dest = matSlice(destBuf, 1, 1, m, n);
+
+    for (int t = 0; t < 2; t++) {
+        Matrix* a = &as[t];
+        // alpha and beta, on top of what's in dest
+        _test_fill(destBuf, 11);
+        _test_gemm_ref(want, a, &b, NULL, MATRIX_ACT_NONE);
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                MAT_AT(want, i, j) =
+                    0.5 * MAT_AT(want, i, j) - 2 * MAT_AT(&dest, i, j);
+            }
+        }
+        matrixGemm(&dest, a, &b, 0.5, -2);
+        double diff = _test_diff(&dest, want);
+        TEST_CHECK(diff <= TEST_TOL, "gemm %s: %dx%dx%d%s off by %g", isa, m,
+                   k, n, t ? "" : " a^T", diff);
+
+        for (int act = MATRIX_ACT_NONE; act <= MATRIX_ACT_SOFTMAX; act++) {
+            _test_gemm_ref(want, a, &b, bias, act);
+            matrixGemmFused(got, a, &b, bias, act, pre);
+            diff = _test_diff(got, want);
+            TEST_CHECK(diff <= TEST_TOL, "gemm %s: fused %dx%dx%d%s act %d "
+                       "off by %g", isa, m, k, n, t ? "" : " a^T", act, diff);
+        }
+    }
+
+    Matrix* a = &as[0];
+    mfloat* packBuf = NN_MALLOC(sizeof(mfloat) * matrixPackedLen(k, n));
+    MatrixPacked packed = matrixPack(packBuf, &b);
+    _test_gemm_ref(want, a, &b, bias, MATRIX_ACT_GELU);
+    matrixGemmPacked(got, a, &packed, bias, MATRIX_ACT_GELU, pre);
+    double diff = _test_diff(got, want);
+    TEST_CHECK(diff <= TEST_TOL, "gemm %s: packed %dx%dx%d off by %g", isa, m,
+               k, n, diff);
+    NN_FREE(packBuf);
+
+    // Steps that clamp the biggest values of `a` to check that too
+    mfloat aScale = 0.9 / 127;
+    void* qBuf = NN_MALLOC(matrixInt8Bytes(k, n));
+    MatrixInt8 q = matrixQuantize(qBuf, &b);
+    _test_gemm_int8_ref(want, a, aScale, &b, bias);
+    matrixGemmInt8(got, a, aScale, &q, bias, MATRIX_ACT_NONE);
+    diff = _test_diff(got, want);
+    TEST_CHECK(diff <= TEST_TOL, "gemm %s: int8 %dx%dx%d off by %g", isa, m,
+               k, n, diff);
+    NN_FREE(qBuf);
+
+    matrixFree(aBuf);
+    matrixFree(bBuf);
+    matrixFree(bias);
+    matrixFree(destBuf);
+    matrixFree(got);
+    matrixFree(want);
+    matrixFree(pre);
+}
+
+// Every instruction set the CPU has, with shapes around the block sizes and
+// ones big enough to go on the pool
+static void _test_gemm(void) {
+    int shapes[][3] = {{1, 1, 1},     {3, 5, 7},      {17, 33, 9},
+                       {40, 40, 40},  {97, 257, 35},  {130, 300, 70},
+                       {1, 600, 129}, {257, 64, 3}};
+    int shapeCnt = sizeof(shapes) / sizeof(shapes[0]);
+    MATRIX_ISA start = matrixIsaGet();
+    for (int isa = MATRIX_ISA_SCALAR; isa <= MATRIX_ISA_AVX512; isa++) {
+        if (matrixIsaSelect(isa) != (MATRIX_ISA)isa) {
+            continue;
+        }
+        const char* name = matrixIsaName(isa);
+        for (int s = 0; s < shapeCnt; s++) {
+            _test_gemm_shape(name, shapes[s][0], shapes[s][1], shapes[s][2]);
+        }
+        int blockCols[] = {1, 4, 8, 16};
+        for (int c = 0; c < 4; c++) {
+            _test_gemm_sparse(name, 37, 45, 61, blockCols[c]);
+            _test_gemm_sparse(name, 64, 200, 300, blockCols[c]);
+        }
+    }
+    matrixIsaSelect(start);
+}
+
+//====================== Networks ======================
+
+// A conv net and a dense one between them cover every kind of layer
+static NN _test_net(int conv, NN_LAYOUT layout) {
+    NN nn = nnCreate();
+    nn.layout = layout;
+    if (conv) {
+        layerCreateInput(&nn, 8, 8, 2);
+        layerCreateConv(&nn, 4, 3, 1, 1, MATRIX_ACT_RELU, 1);
+        layerCreateConv(&nn, 6, 3, 2, 0, MATRIX_ACT_TANH, 1);
+    } else {
+        layerCreateInput(&nn, 24, 1, 1);
+    }
+    layerCreateFull(&nn, 17, MATRIX_ACT_GELU, 1);
+    layerCreateFull(&nn, 30, MATRIX_ACT_SIGMOID, 1);
+    layerCreateFull(&nn, 5, MATRIX_ACT_SOFTMAX, 1);
+    return nn;
+}
+
+// Runs forward on `rows` made up samples and returns a copy of the output
+static Matrix* _test_forward(NN* nn, int rows) {
+    nnBatchSet(nn, rows);
+    _test_fill(NN_INPUT(nn), 1);
+    nnForward(nn);
+    Matrix* out = matrixCreate(rows, NN_OUTPUT(nn)->cols);
+    matrixCopy(out, NN_OUTPUT(nn));
+    return out;
+}
+
+//====================== Gradients ======================
+
+// The step the central differences take and how far off they may be from
+// backprop, relative to the biggest gradient. Floats can't take small steps
+#ifdef MATRIX_FLOAT
+#define TEST_FD_EPS 1e-3
+#define TEST_FD_TOL 1e-2
+#else
+#define TEST_FD_EPS 1e-6
+#define TEST_FD_TOL 1e-6
+#endif
+
+#define TEST_GRAD_ROWS 6
+
+// Ways backprop can run that have to come out the same
+typedef struct {
+    const char* name;
+    int replicas;
+    int checkpoint;
+} _TestGradMode;
+
+// The gradient of the mean cost w.r.t. every param, by central differences
+static Matrix* _test_grad_fd(NN* nn, const Matrix* ti, const Matrix* to) {
+    Matrix params = nnParamsView(nn);
+    Matrix* fd = matrixCreate(1, params.cols);
+    for (int j = 0; j < params.cols; j++) {
+        mfloat p = params.data[j];
+        params.data[j] = p + TEST_FD_EPS;
+        double up = nnCost(nn, ti, to);
+        params.data[j] = p - TEST_FD_EPS;
+        double down = nnCost(nn, ti, to);
+        params.data[j] = p;
+        MAT_AT(fd, 0, j) = (up - down) / (2 * TEST_FD_EPS);
+    }
+    return fd;
+}
+
+// _test_diff relative to the biggest gradient, which is well below 1
+static double _test_grad_diff(const Matrix* got, const Matrix* want) {
+    double scale = 0;
+    for (int j = 0; j < want->cols; j++) {
+        double a = fabs((double)MAT_AT(want, 0, j));
+        scale = a > scale ? a : scale;
+    }
+    return _test_diff(got, want) / (scale > 0 ? scale : 1);
+}
+
+// Backprop's gradients with `mode` on, in a twin of `nn`
+static Matrix* _test_grad_mode(NN* nn, int conv, NN_LAYOUT layout,
+                               const _TestGradMode* mode, const Matrix* ti,
+                               const Matrix* to) {
+    NN twin = _test_net(conv, layout);
+    twin.loss = nn->loss;
+    Matrix params = nnParamsView(nn);
+    Matrix twinParams = nnParamsView(&twin);
+    matrixCopy(&twinParams, &params);
+    if (mode->replicas) {
+        nnReplicasSet(&twin, mode->replicas);
+    }
+    if (mode->checkpoint) {
+        nnCheckpointSet(&twin, mode->checkpoint);
+    }
+    nnBatchSet(&twin, TEST_GRAD_ROWS);
+    // Backprop adds to what's there
+    Matrix grads = nnGradsView(&twin);
+    matrixFill(&grads, 1);
+    nnZeroGrads(&twin);
+    nnBackprop(&twin, ti, to);
+    Matrix* out = matrixCreate(1, grads.cols);
+    matrixCopy(out, &grads);
+    nnFree(&twin);
+    return out;
+}
+
+static void _test_grad(int conv, NN_LAYOUT layout, MATRIX_LOSS loss) {
+    NN nn = _test_net(conv, layout);
+    nn.loss = loss;
+    nnBatchSet(&nn, TEST_GRAD_ROWS);
+    int outs = NN_OUTPUT(&nn)->cols;
+    Matrix* ti = matrixCreate(TEST_GRAD_ROWS, nn.layers[0].nodeCnt);
+    Matrix* to = matrixCreate(TEST_GRAD_ROWS, outs);
+    _test_fill(ti, 12);
+    // One hot, so it's a distribution for cross-entropy
+    matrixFill(to, 0);
+    for (int i = 0; i < TEST_GRAD_ROWS; i++) {
+        MAT_AT(to, i, i * 3 % outs) = 1;
+    }
+    Matrix* fd = _test_grad_fd(&nn, ti, to);
+
+    // The batch doesn't split evenly over 4 replicas, and every 1 and every
+    // layerCnt are the corner cases of checkpointing
+    _TestGradMode modes[] = {
+        {"plain", 0, 0},        {"replicas", 4, 0},
+        {"checkpoint 1", 0, 1}, {"checkpoint 2", 0, 2},
+        {"checkpoint all", 0, nn.layerCnt},
+        {"replicas + checkpoint", 3, 2},
+    };
+    int modeCnt = sizeof(modes) / sizeof(modes[0]);
+    Matrix* plain = NULL;
+    for (int m = 0; m < modeCnt; m++) {
+        Matrix* got = _test_grad_mode(&nn, conv, layout, &modes[m], ti, to);
+        double diff = _test_grad_diff(got, fd);
+        TEST_CHECK(diff <= TEST_FD_TOL, "gradients: %s %s %s %s off from "
+                   "finite differences by %g", conv ? "conv" : "dense",
+                   layout == NN_LAYOUT_NHWC ? "nhwc" : "nchw",
+                   loss == MATRIX_LOSS_MSE ? "mse" : "xent", modes[m].name,
+                   diff);
+        if (!plain) {
+            plain = got;
+            continue;
+        }
+        diff = _test_grad_diff(got, plain);
+        TEST_CHECK(diff <= TEST_TOL, "gradients: %s %s %s %s off from plain "
+                   "backprop by %g", conv ? "conv" : "dense",
+                   layout == NN_LAYOUT_NHWC ? "nhwc" : "nchw",
+                   loss == MATRIX_LOSS_MSE ? "mse" : "xent", modes[m].name,
+                   diff);
+        matrixFree(got);
+    }
+    matrixFree(plain);
+    matrixFree(fd);
+    matrixFree(ti);
+    matrixFree(to);
+    nnFree(&nn);
+}
+
+static void _test_grads(void) {
+    _test_grad(0, NN_LAYOUT_NCHW, MATRIX_LOSS_MSE);
+    _test_grad(0, NN_LAYOUT_NCHW, MATRIX_LOSS_CROSS_ENTROPY);
+    _test_grad(1, NN_LAYOUT_NCHW, MATRIX_LOSS_MSE);
+    _test_grad(1, NN_LAYOUT_NCHW, MATRIX_LOSS_CROSS_ENTROPY);
+    _test_grad(1, NN_LAYOUT_NHWC, MATRIX_LOSS_CROSS_ENTROPY);
+}
+
+//====================== Training ======================
+
+// Steps far too small to move a float have to add up in the master weights
+static void _test_master_small_steps(void) {
+    NN nn = _test_net(0, NN_LAYOUT_NCHW);
+    nnMasterWeightsSet(&nn, 1);
+    Matrix params = nnParamsView(&nn);
+    Matrix* start = matrixCreate(params.rows, params.cols);
+    matrixCopy(start, &params);
+    // The weights are around 1, a float moves in steps of about 1e-7 there
+    int steps = 1000;
+    double rate = 1e-9;
+    for (int s = 0; s < steps; s++) {
+        Matrix grads = nnGradsView(&nn);
+        matrixFill(&grads, 1);
+        nnLearn(&nn, rate);
+    }
+    int off = 0;
+    for (int j = 0; j < params.cols; j++) {
+        double want = MAT_AT(start, 0, j) - steps * rate;
+        // The nearest mfloat to it, plus what the doubles rounded off
+        double ulp = fabs(want) * (sizeof(mfloat) == 4 ? 1.2e-7 : 2.3e-16);
+        off += fabs(MAT_AT(&params, 0, j) - want) > ulp + 1e-3 * steps * rate;
+    }
+    TEST_CHECK(off == 0, "master weights: %d of %d params off after tiny steps",
+               off, params.cols);
+    matrixFree(start);
+    nnFree(&nn);
+}
+
+// Real steps have to come out as they do without the master copy, exactly in
+// a double build
+static void _test_master_matches(MATRIX_OPTIMIZER kind) {
+    NN a = _test_net(0, NN_LAYOUT_NCHW);
+    NN b = _test_net(0, NN_LAYOUT_NCHW);
+    Matrix pa = nnParamsView(&a);
+    Matrix pb = nnParamsView(&b);
+    matrixCopy(&pb, &pa);
+    nnOptimizerSet(&a, matrixOptimizerCreate(kind));
+    nnOptimizerSet(&b, matrixOptimizerCreate(kind));
+    nnMasterWeightsSet(&b, 1);
+    nnBatchSet(&a, 8);
+    nnBatchSet(&b, 8);
+    Matrix* ti = matrixCreate(8, 24);
+    Matrix* to = matrixCreate(8, 5);
+    _test_fill(ti, 2);
+    matrixFill(to, 0.2);
+    for (int s = 0; s < 20; s++) {
+        nnBackprop(&a, ti, to);
+        nnLearn(&a, 0.01);
+        nnBackprop(&b, ti, to);
+        nnLearn(&b, 0.01);
+    }
+    double diff = _test_diff(&pb, &pa);
+    TEST_CHECK(diff <= TEST_TOL, "master weights: optimizer %d off by %g",
+               kind, diff);
+    matrixFree(ti);
+    matrixFree(to);
+    nnFree(&a);
+    nnFree(&b);
+}
+
+static void _test_training(void) {
+    _test_master_small_steps();
+    MATRIX_OPTIMIZER kinds[] = {MATRIX_OPTIMIZER_SGD, MATRIX_OPTIMIZER_MOMENTUM,
+                                MATRIX_OPTIMIZER_ADAM, MATRIX_OPTIMIZER_ADAMW};
+    for (int k = 0; k < 4; k++) {
+        _test_master_matches(kinds[k]);
+    }
+}
+
+//====================== Inference ======================
+
+#define TEST_INF_ROWS 9
+
+// How far int8 outputs may drift, about a percent of the softmax's [0, 1]
+#define TEST_INT8_TOL 1e-2
+
+// A twin of `nn` with the same params
+static NN _test_twin(NN* nn, int conv, NN_LAYOUT layout) {
+    NN twin = _test_net(conv, layout);
+    Matrix params = nnParamsView(nn);
+    Matrix twinParams = nnParamsView(&twin);
+    matrixCopy(&twinParams, &params);
+    return twin;
+}
+
+static void _test_inference_net(int conv, NN_LAYOUT layout) {
+    const char* name = !conv                      ? "dense"
+                       : layout == NN_LAYOUT_NHWC ? "conv nhwc"
+                                                  : "conv nchw";
+    NN nn = _test_net(conv, layout);
+    Matrix* want = _test_forward(&nn, TEST_INF_ROWS);
+
+    NN frozen = _test_twin(&nn, conv, layout);
+    nnFreeze(&frozen);
+    Matrix* got = _test_forward(&frozen, TEST_INF_ROWS);
+    double diff = _test_diff(got, want);
+    TEST_CHECK(diff <= TEST_TOL, "inference: frozen %s off by %g", name, diff);
+    // Fewer rows than the batch, the rest of the outputs mean nothing
+    Matrix in = matRows(NN_INPUT(&frozen), 0, TEST_INF_ROWS);
+    _test_fill(&in, 1);
+    nnForwardRows(&frozen, 4);
+    Matrix part = matRows(NN_OUTPUT(&frozen), 0, 4);
+    Matrix wantPart = matRows(want, 0, 4);
+    diff = _test_diff(&part, &wantPart);
+    TEST_CHECK(diff <= TEST_TOL, "inference: frozen %s on 4 rows off by %g",
+               name, diff);
+    matrixFree(got);
+    nnFree(&frozen);
+
+    NN quant = _test_twin(&nn, conv, layout);
+    Matrix* calib = matrixCreate(TEST_INF_ROWS, nn.layers[0].nodeCnt);
+    _test_fill(calib, 1);
+    nnQuantize(&quant, calib);
+    got = _test_forward(&quant, TEST_INF_ROWS);
+    diff = _test_diff(got, want);
+    TEST_CHECK(diff <= TEST_INT8_TOL, "inference: int8 %s off by %g", name,
+               diff);
+    matrixFree(got);
+    matrixFree(calib);
+    nnFree(&quant);
+    matrixFree(want);
+
+    // Pruned it has to run like the dense net with the same zeros in it,
+    // trained and frozen
+    NN pruned = _test_twin(&nn, conv, layout);
+    nnPrune(&pruned, 0.8, 8);
+    int sparse = 0;
+    for (int i = 0; i < pruned.layerCnt; i++) {
+        sparse += pruned.layers[i].wss.vals != NULL;
+    }
+    TEST_CHECK(sparse > 0, "inference: pruning %s made no layer sparse", name);
+    NN dense = _test_twin(&pruned, conv, layout);
+    want = _test_forward(&dense, TEST_INF_ROWS);
+    got = _test_forward(&pruned, TEST_INF_ROWS);
+    diff = _test_diff(got, want);
+    TEST_CHECK(diff <= TEST_TOL, "inference: pruned %s off by %g", name, diff);
+    matrixFree(got);
+    nnFreeze(&pruned);
+    got = _test_forward(&pruned, TEST_INF_ROWS);
+    diff = _test_diff(got, want);
+    TEST_CHECK(diff <= TEST_TOL, "inference: pruned frozen %s off by %g", name,
+               diff);
+    matrixFree(got);
+    matrixFree(want);
+    nnFree(&dense);
+    nnFree(&pruned);
+    nnFree(&nn);
+}
+
+static void _test_inference(void) {
+    _test_inference_net(0, NN_LAYOUT_NCHW);
+    _test_inference_net(1, NN_LAYOUT_NCHW);
+    _test_inference_net(1, NN_LAYOUT_NHWC);
+}
+
+//====================== Files ======================
+
+static char* _test_read_file(const char* path, long* len) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = malloc(*len);
+    if (fread(data, 1, *len, f) != (size_t)*len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static int _test_write_file(const char* path, const void* data, long len) {
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        return 0;
+    }
+    int ok = fwrite(data, 1, len, f) == (size_t)len;
+    return (fclose(f) == 0) && ok;
+}
+
+static void _test_put32(char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (char)(v >> (8 * i));
+    }
+}
+
+static void _test_put64(char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (char)(v >> (8 * i));
+    }
+}
+
+static uint64_t _test_get64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    }
+    return v;
+}
+
+// Loads `path` both ways and checks the output is `want`
+static void _test_load(const char* path, const Matrix* want, int mapped,
+                       double tol) {
+    NN nn;
+    if (nnLoad(&nn, path, mapped) != 0) {
+        TEST_CHECK(0, "%s doesn't load%s", path, mapped ? " mapped" : "");
+        return;
+    }
+    Matrix* out = _test_forward(&nn, want->rows);
+    double diff = _test_diff(out, want);
+    TEST_CHECK(diff <= tol, "%s%s: output off by %g", path,
+               mapped ? " mapped" : "", diff);
+    matrixFree(out);
+    nnFree(&nn);
+}
+
+// Saves `nn` to `path` with the file edited by `edit` and checks it doesn't
+// load
+static void _test_corrupt(NN* nn, const char* path, const char* what,
+                          void (*edit)(char* file, long len)) {
+    long len;
+    nnSave(nn, path);
+    char* file = _test_read_file(path, &len);
+    edit(file, len);
+    _test_write_file(path, file, len);
+    free(file);
+    NN out;
+    TEST_CHECK(nnLoad(&out, path, 0) == -1, "a file with %s loads", what);
+    TEST_CHECK(nnLoad(&out, path, 1) == -1, "a file with %s loads mapped",
+               what);
+}
+
+// The records start at 32, the input layer's is first
+static void _test_edit_width(char* file, long len) {
+    (void)len;
+    _test_put32(file + 32 + 8, 0x7fffffff);
+}
+
+// 65536 x 65536 overflows an int
+static void _test_edit_overflow(char* file, long len) {
+    (void)len;
+    _test_put32(file + 32 + 8, 65536);
+    _test_put32(file + 32 + 12, 65536);
+}
+
+// The first dense layer gets more ws than the file has
+static void _test_edit_nodes(char* file, long len) {
+    (void)len;
+    _test_put32(file + 32 + 64 + 8, 65536);
+    _test_put32(file + 32 + 64 + 20, 65536);
+}
+
+static void _test_edit_offset(char* file, long len) {
+    _test_put64(file + 32 + 64 + 40, len);
+}
+
+static void _test_edit_header(char* file, long len) {
+    _test_put32(file + 8, (uint32_t)(len + 64) / 64 * 64);
+}
+
+// Turns the file into a version 1 one, which counted in params
+static void _test_to_v1(char* file, long len) {
+    (void)len;
+    int layers = file[16];
+    _test_put32(file + 4, 1);
+    _test_put64(file + 24, _test_get64(file + 24) / sizeof(mfloat));
+    for (int i = 0; i < layers; i++) {
+        for (int k = 40; k <= 48; k += 8) {
+            char* p = file + 32 + 64 * i + k;
+            uint64_t off = _test_get64(p);
+            if (off != UINT64_MAX) {
+                _test_put64(p, off / sizeof(mfloat));
+            }
+        }
+    }
+}
+
+// The files --save writes, for the other precision's build to load
+static void _test_paths(const char* dir, const char* prec, char* model,
+                        char* out) {
+    sprintf(model, "%s/model-%s.nnm", dir, prec);
+    sprintf(out, "%s/model-%s.out", dir, prec);
+}
+
+static int _test_save(const char* dir) {
+    char model[512];
+    char outPath[512];
+    _test_paths(dir, _test_precision(), model, outPath);
+    NN nn = _test_net(1, NN_LAYOUT_NCHW);
+    Matrix* out = _test_forward(&nn, 3);
+    double vals[15];
+    for (int i = 0; i < 15; i++) {
+        vals[i] = MAT_AT(out, i / 5, i % 5);
+    }
+    int ok = nnSave(&nn, model) == 0 &&
+             _test_write_file(outPath, vals, sizeof(vals));
+    matrixFree(out);
+    nnFree(&nn);
+    if (!ok) {
+        fprintf(stderr, "test: can't write to %s\n", dir);
+    }
+    return ok;
+}
+
+// Loads what both precisions' builds saved to `dir`
+static void _test_files_cross(const char* dir) {
+    const char* precs[] = {"f32", "f64"};
+    for (int p = 0; p < 2; p++) {
+        char model[512];
+        char outPath[512];
+        _test_paths(dir, precs[p], model, outPath);
+        long len;
+        double* vals = (double*)_test_read_file(outPath, &len);
+        if (!vals || len != 15 * sizeof(double)) {
+            TEST_CHECK(0, "%s is missing, run --save first", outPath);
+            free(vals);
+            continue;
+        }
+        Matrix* want = matrixCreate(3, 5);
+        for (int i = 0; i < 15; i++) {
+            MAT_AT(want, i / 5, i % 5) = vals[i];
+        }
+        free(vals);
+        // The float build's copy of the params or output rounds either way
+        int same = strcmp(precs[p], _test_precision()) == 0;
+        _test_load(model, want, 0, same ? TEST_TOL : 1e-4);
+        if (same) {
+            _test_load(model, want, 1, TEST_TOL);
+        } else {
+            NN nn;
+            TEST_CHECK(nnLoad(&nn, model, 1) == -1,
+                       "%s maps with the wrong param size", model);
+        }
+        matrixFree(want);
+    }
+}
+
+static void _test_files(const char* dir) {
+    const char* path = "bin/test-model.nnm";
+    for (int conv = 0; conv < 2; conv++) {
+        for (int layout = 0; layout < 2; layout++) {
+            NN nn = _test_net(conv, layout);
+            Matrix* want = _test_forward(&nn, 3);
+            TEST_CHECK(nnSave(&nn, path) == 0, "can't save %s", path);
+            _test_load(path, want, 0, 0);
+            _test_load(path, want, 1, 0);
+
+            long len;
+            char* file = _test_read_file(path, &len);
+            _test_to_v1(file, len);
+            _test_write_file(path, file, len);
+            free(file);
+            _test_load(path, want, 0, 0);
+            matrixFree(want);
+            nnFree(&nn);
+        }
+    }
+
+    NN nn = _test_net(0, NN_LAYOUT_NCHW);
+    _test_corrupt(&nn, path, "a huge input", _test_edit_width);
+    _test_corrupt(&nn, path, "an input overflowing an int",
+                  _test_edit_overflow);
+    _test_corrupt(&nn, path, "more ws than params", _test_edit_nodes);
+    _test_corrupt(&nn, path, "ws past the end", _test_edit_offset);
+    _test_corrupt(&nn, path, "the header past the end", _test_edit_header);
+    nnSave(&nn, path);
+    long len;
+    char* file = _test_read_file(path, &len);
+    _test_write_file(path, file, len - 8);
+    free(file);
+    NN out;
+    TEST_CHECK(nnLoad(&out, path, 0) == -1, "a truncated file loads");
+    nnFree(&nn);
+    remove(path);
+
+    if (dir) {
+        _test_files_cross(dir);
+    }
+}
+
+//====================== Data ======================
+
+// Every row of the data set has to come out exactly once per epoch, with its
+// own expected output
+static void _test_data_epoch(NN_Dataset* ds, int batch, const char* what,
+                             int shuffled) {
+    long long n = ds->rowCnt;
+    char* seen = calloc(n, 1);
+    long long cnt = 0;
+    long long inOrder = 0;
+    int ok = 1;
+    Matrix ti;
+    Matrix to;
+    int rows;
+    nnDataEpochStart(ds, batch);
+    while ((rows = nnDataNext(ds, &ti, &to)) > 0) {
+        for (int r = 0; r < rows; r++) {
+            long long id = (long long)MAT_AT(&ti, r, 0);
+            if (id < 0 || id >= n || seen[id] ||
+                MAT_AT(&ti, r, 1) != -id || MAT_AT(&to, r, 0) != 2 * id) {
+                ok = 0;
+                continue;
+            }
+            seen[id] = 1;
+            inOrder += id == cnt;
+            cnt++;
+        }
+    }
+    TEST_CHECK(ok && cnt == n, "%s: %lld of %lld rows came out right", what,
+               cnt, n);
+    TEST_CHECK(!shuffled || inOrder < n / 2,
+               "%s: %lld of %lld rows weren't shuffled", what, inOrder, n);
+    free(seen);
+}
+
+static void _test_data(void) {
+    // Shards of different sizes, row i holds i, -i and expects 2i
+    const char* paths[] = {"bin/test-shard0.nnd", "bin/test-shard1.nnd",
+                           "bin/test-shard2.nnd"};
+    int sizes[] = {50, 1, 77};
+    int first = 0;
+    for (int i = 0; i < 3; i++) {
+        Matrix* ti = matrixCreate(sizes[i], 2);
+        Matrix* to = matrixCreate(sizes[i], 1);
+        for (int r = 0; r < sizes[i]; r++) {
+            MAT_AT(ti, r, 0) = first + r;
+            MAT_AT(ti, r, 1) = -(first + r);
+            MAT_AT(to, r, 0) = 2 * (first + r);
+        }
+        TEST_CHECK(nnDataShardWrite(paths[i], ti, to) == 0, "can't write %s",
+                   paths[i]);
+        first += sizes[i];
+        matrixFree(ti);
+        matrixFree(to);
+    }
+
+    long long windows[] = {0, 1, 8, 1000};
+    for (int w = 0; w < 4; w++) {
+        NN_Dataset ds;
+        if (nnDataOpen(&ds, paths, 3, windows[w]) != 0) {
+            TEST_CHECK(0, "can't open the shards");
+            continue;
+        }
+        char what[64];
+        for (int batch = 1; batch <= 64; batch *= 8) {
+            sprintf(what, "window %lld batch %d", windows[w], batch);
+            // A window of 1 only shuffles the order of the shards
+            _test_data_epoch(&ds, batch, what, windows[w] != 1);
+            _test_data_epoch(&ds, batch, what, windows[w] != 1);
+        }
+        nnDataClose(&ds);
+    }
+
+    const char* missing[] = {paths[0], "bin/test-missing.nnd"};
+    NN_Dataset ds;
+    TEST_CHECK(nnDataOpen(&ds, missing, 2, 0) == -1,
+               "a missing shard opens");
+    for (int i = 0; i < 3; i++) {
+        remove(paths[i]);
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* saveDir = NULL;
+    const char* dir = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            saveDir = argv[++i];
+        } else if (argv[i][0] != '-' && !dir) {
+            dir = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [--save DIR] [DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    matrixRngSeed(1);
+    if (saveDir) {
+        return _test_save(saveDir) ? 0 : 1;
+    }
+    printf("test: %s, isa %s, %d threads\n", _test_precision(),
+           matrixIsaName(matrixIsaGet()), tpoolThreadsGet());
+    _test_pool();
+    _test_gemm();
+    _test_grads();
+    _test_training();
+    _test_inference();
+    _test_files(dir);
+    _test_data();
+
+    printf("test: %d of %d checks failed\n", failures, checks);
+    tpoolShutdown();
+    return failures ? 1 : 0;
+}
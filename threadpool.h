@@ -0,0 +1,313 @@
+#pragma once
+
+// sched_getaffinity and CPU_COUNT are GNU extensions. This only helps when
+// nothing got included before, nn.h defines it itself for that reason
+#if defined(TPOOL_IMPLEMENTATION) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+/**
+ *  A small work-stealing thread pool. The pool is sized to the CPUs this
+ * process is allowed to run on (its affinity mask on Linux, so taskset and
+ * cgroup pinning count) and gets started the first time it is needed.
+ *  Work is handed out as a range of indices. The range is cut into chunks,
+ * every thread owns an even share of the chunks and once it runs out it steals
+ * chunks from the other threads. The calling thread always does work too.
+ *  Calls made from inside a pool thread (or while another thread is already
+ * using the pool) just run serially, so nesting parallel code is safe.
+ */
+
+/**
+ * A function the pool runs over part of a range.
+ * @param ctx Whatever was given to tpoolParallelFor
+ * @param begin First index to do
+ * @param end One past the last index to do
+ */
+typedef void (*TpoolFunc)(void* ctx, long long begin, long long end);
+
+/**
+ * Sets how many threads (counting the calling thread) the pool uses.
+ * If never called the `TPOOL_THREADS` environment variable is used, and if
+ * that isn't set either it's the number of CPUs the process can run on.
+ * Restarts the pool if it's already running.
+ * @param threads The thread count. 0 goes back to the default
+ */
+void tpoolThreadsSet(int threads);
+
+/**
+ * @return How many threads (counting the calling thread) the pool uses
+ */
+int tpoolThreadsGet(void);
+
+/**
+ * Runs `func` over [0, count) on the pool and waits for it to finish.
+ * Every chunk handed to `func` is a multiple of `grain` long (except the last)
+ * and starts on a multiple of `grain`.
+ * @param count How many indices there are
+ * @param grain The smallest amount of indices worth handing to a thread
+ * @param func The function to run
+ * @param ctx Passed through to `func`
+ */
+void tpoolParallelFor(long long count, long long grain, TpoolFunc func,
+                      void* ctx);
+
+/**
+ * Stops and joins all the pool threads. The pool starts up again if used.
+ */
+void tpoolShutdown(void);
+
+#ifdef TPOOL_IMPLEMENTATION
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#ifndef TPOOL_MALLOC
+#include <stdlib.h>
+#define TPOOL_MALLOC malloc
+#endif
+
+#ifndef TPOOL_FREE
+#include <stdlib.h>
+#define TPOOL_FREE free
+#endif
+
+// Chunks handed out per thread. More means better balancing but more atomics
+#ifndef TPOOL_CHUNKS_PER_THREAD
+#define TPOOL_CHUNKS_PER_THREAD 8
+#endif
+
+#define TPOOL_MAX_THREADS 512
+
+// One per thread, on its own cache line so claiming chunks doesn't false share
+typedef struct {
+    _Atomic long long next; // Next chunk to claim
+    long long end;          // One past the last chunk this thread owns
+    char pad[64 - 2 * sizeof(long long)];
+} _TpoolSlot;
+
+typedef struct {
+    TpoolFunc func;
+    void* ctx;
+    long long count;
+    long long chunk; // Indices per chunk
+    int slotCnt;
+    _Atomic long long remaining; // Chunks not finished yet
+} _TpoolJob;
+
+static struct {
+    int threads; // Wanted thread count, 0 means not decided yet
+    int started; // Worker threads running (threads - 1 once started)
+    pthread_t* workers;
+    _TpoolSlot* slots;
+    pthread_mutex_t submit; // Held by whoever is using the pool
+    pthread_mutex_t lock;   // Guards everything below
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    _TpoolJob* job;
+    unsigned long long generation;
+    int busy; // Workers inside the current job
+    char stop;
+} _tpool = {
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+// Set while a thread is running pool work so nested calls go serial
+static _Thread_local char _tpoolInside;
+
+static int _tpool_detect_threads(void) {
+    const char* env = getenv("TPOOL_THREADS");
+    if (env && atoi(env) > 0) {
+        return atoi(env);
+    }
+#if defined(__linux__) && !defined(CPU_COUNT)
+#warning "_GNU_SOURCE came too late, the pool ignores the affinity mask"
+#endif
+#if defined(__linux__) && defined(CPU_COUNT)
+    // Respects taskset/cgroup pinning
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return CPU_COUNT(&set);
+    }
+#endif
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// Claims chunks from our own slot first, then steals from everyone else's
+static void _tpool_work(_TpoolJob* job, _TpoolSlot* slots, int first) {
+    for (int v = 0; v < job->slotCnt; v++) {
+        _TpoolSlot* slot = &slots[(first + v) % job->slotCnt];
+        for (;;) {
+            long long c =
+                atomic_fetch_add_explicit(&slot->next, 1, memory_order_relaxed);
+            if (c >= slot->end) {
+                break;
+            }
+            long long begin = c * job->chunk;
+            long long end = begin + job->chunk;
+            if (end > job->count) {
+                end = job->count;
+            }
+            job->func(job->ctx, begin, end);
+            atomic_fetch_sub_explicit(&job->remaining, 1,
+                                      memory_order_acq_rel);
+        }
+    }
+}
+
+static void* _tpool_worker(void* arg) {
+    int id = (int)(long long)arg;
+    unsigned long long seen = 0;
+    _tpoolInside = 1;
+    pthread_mutex_lock(&_tpool.lock);
+    for (;;) {
+        while (!_tpool.stop &&
+               (_tpool.job == NULL || _tpool.generation == seen)) {
+            pthread_cond_wait(&_tpool.wake, &_tpool.lock);
+        }
+        if (_tpool.stop) {
+            break;
+        }
+        seen = _tpool.generation;
+        _TpoolJob* job = _tpool.job;
+        _tpool.busy++;
+        pthread_mutex_unlock(&_tpool.lock);
+
+        _tpool_work(job, _tpool.slots, id % job->slotCnt);
+
+        pthread_mutex_lock(&_tpool.lock);
+        _tpool.busy--;
+        if (_tpool.busy == 0) {
+            pthread_cond_signal(&_tpool.done);
+        }
+    }
+    pthread_mutex_unlock(&_tpool.lock);
+    return NULL;
+}
+
+// Needs _tpool.submit held
+static void _tpool_start(void) {
+    if (_tpool.threads <= 0) {
+        _tpool.threads = _tpool_detect_threads();
+    }
+    if (_tpool.threads > TPOOL_MAX_THREADS) {
+        _tpool.threads = TPOOL_MAX_THREADS;
+    }
+    _tpool.slots = TPOOL_MALLOC(sizeof(_TpoolSlot) * _tpool.threads);
+    _tpool.workers = TPOOL_MALLOC(sizeof(pthread_t) * _tpool.threads);
+    _tpool.stop = 0;
+    _tpool.started = 0;
+    for (int i = 1; i < _tpool.threads; i++) {
+        if (pthread_create(&_tpool.workers[_tpool.started], NULL,
+                           _tpool_worker, (void*)(long long)i) != 0) {
+            break;
+        }
+        _tpool.started++;
+    }
+    _tpool.threads = _tpool.started + 1;
+}
+
+// Needs _tpool.submit held
+static void _tpool_stop(void) {
+    if (!_tpool.workers) {
+        return;
+    }
+    pthread_mutex_lock(&_tpool.lock);
+    _tpool.stop = 1;
+    pthread_cond_broadcast(&_tpool.wake);
+    pthread_mutex_unlock(&_tpool.lock);
+    for (int i = 0; i < _tpool.started; i++) {
+        pthread_join(_tpool.workers[i], NULL);
+    }
+    TPOOL_FREE(_tpool.workers);
+    TPOOL_FREE(_tpool.slots);
+    _tpool.workers = NULL;
+    _tpool.slots = NULL;
+    _tpool.started = 0;
+}
+
+void tpoolThreadsSet(int threads) {
+    pthread_mutex_lock(&_tpool.submit);
+    _tpool_stop();
+    _tpool.threads = threads < 0 ? 0 : threads;
+    pthread_mutex_unlock(&_tpool.submit);
+}
+
+int tpoolThreadsGet(void) {
+    pthread_mutex_lock(&_tpool.submit);
+    if (_tpool.threads <= 0) {
+        _tpool.threads = _tpool_detect_threads();
+    }
+    int threads = _tpool.threads;
+    pthread_mutex_unlock(&_tpool.submit);
+    return threads;
+}
+
+void tpoolShutdown(void) {
+    pthread_mutex_lock(&_tpool.submit);
+    _tpool_stop();
+    pthread_mutex_unlock(&_tpool.submit);
+}
+
+void tpoolParallelFor(long long count, long long grain, TpoolFunc func,
+                      void* ctx) {
+    if (count <= 0) {
+        return;
+    }
+    if (grain < 1) {
+        grain = 1;
+    }
+    // Nested, too small, or someone else has the pool: just do it here
+    if (_tpoolInside || count <= grain ||
+        pthread_mutex_trylock(&_tpool.submit) != 0) {
+        func(ctx, 0, count);
+        return;
+    }
+    if (!_tpool.workers) {
+        _tpool_start();
+    }
+    if (_tpool.threads <= 1) {
+        pthread_mutex_unlock(&_tpool.submit);
+        func(ctx, 0, count);
+        return;
+    }
+
+    // Chunks are whole grains, at most TPOOL_CHUNKS_PER_THREAD per thread
+    long long grains = (count + grain - 1) / grain;
+    long long maxChunks = (long long)_tpool.threads * TPOOL_CHUNKS_PER_THREAD;
+    long long chunk = grain * ((grains + maxChunks - 1) / maxChunks);
+    long long chunks = (count + chunk - 1) / chunk;
+
+    _TpoolJob job = {.func = func, .ctx = ctx, .count = count, .chunk = chunk};
+    job.slotCnt = chunks < _tpool.threads ? (int)chunks : _tpool.threads;
+    atomic_init(&job.remaining, chunks);
+    for (int i = 0; i < job.slotCnt; i++) {
+        atomic_init(&_tpool.slots[i].next, chunks * i / job.slotCnt);
+        _tpool.slots[i].end = chunks * (i + 1) / job.slotCnt;
+    }
+
+    pthread_mutex_lock(&_tpool.lock);
+    _tpool.job = &job;
+    _tpool.generation++;
+    pthread_cond_broadcast(&_tpool.wake);
+    pthread_mutex_unlock(&_tpool.lock);
+
+    _tpoolInside = 1;
+    _tpool_work(&job, _tpool.slots, 0);
+    _tpoolInside = 0;
+
+    // Every chunk is claimed now, wait for the ones still running. Clearing
+    // the job keeps late waking workers from touching it after we return.
+    pthread_mutex_lock(&_tpool.lock);
+    while (atomic_load(&job.remaining) > 0 || _tpool.busy > 0) {
+        pthread_cond_wait(&_tpool.done, &_tpool.lock);
+    }
+    _tpool.job = NULL;
+    pthread_mutex_unlock(&_tpool.lock);
+    pthread_mutex_unlock(&_tpool.submit);
+}
+#endif